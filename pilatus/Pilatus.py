@@ -1,4 +1,5 @@
 import re
+import json
 import time
 import socket
 import select
@@ -122,6 +123,30 @@ class Pilatus:
         else:
             self._started = True
 
+    def arm(self, nimages, exptime, expperiod, filename='', command='exposure', timeout=10):
+        """
+        Sets nimages, exptime and expperiod and starts the exposure in one round
+        trip. The streamer checks the settings, sends them to the camserver back to
+        back and answers once. Returns the status, a dict with the series number,
+        the settings and the camserver time in us. filename can't contain commas.
+        """
+        if self.acquiring():
+            raise Exception('Already running!')
+        request = 'arm nimages=%d,exptime=%f,expperiod=%f,mode=%s' % (
+            nimages, exptime, expperiod, command)
+        if filename:
+            request += ',path=%s' % filename
+        res = self.query(request, timeout=timeout)
+        match = re.compile('15 (OK|ERR) arm ([^\x18]*)\x18').match(res or '')
+        if match is None:
+            raise Exception('No reply to arm')
+        status = json.loads(match.group(2))
+        if match.group(1) != 'OK':
+            raise Exception('Error arming: %s' % status['error'])
+        # a short series may have ended before the reply was read
+        self._started = '7 OK' not in res[match.end():]
+        return status
+
     def acquiring(self):
         if not self._started:
             return False
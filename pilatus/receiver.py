@@ -0,0 +1,291 @@
+"""
+Bindings of the receiver library, src/libreceiver.so built with make libreceiver.so.
+The library pulls from the streamer, splits batches into single images and decodes
+cbf and bslz4 images on a pool of threads. The image data is handed out as numpy
+arrays viewing the zmq message or the decode buffer, nothing is copied in Python.
+
+    with Receiver('tcp://127.0.0.1:9999') as receiver:
+        for message in receiver:
+            if message.htype == 'image':
+                process(message.frame, message.data)
+            elif message.htype == 'series_end':
+                break
+
+A message holds on to its slot in the library until the message and every array
+viewing its data are gone. The slots are reused in order, so copy what you keep
+for longer than the depth of the receiver.
+
+Run as a script it measures the sustained frame rate against a streamer, see --help.
+"""
+import os
+import sys
+import json
+import time
+import ctypes
+import socket
+import weakref
+import argparse
+import numpy as np
+
+MESSAGE_TYPES = ('header', 'image', 'series_end', 'other')
+
+
+class _Message(ctypes.Structure):
+    # the leading members of ReceivedMessage in receiver.h
+    _fields_ = [('type', ctypes.c_int),
+                ('series', ctypes.c_int),
+                ('frame', ctypes.c_int),
+                ('shape', ctypes.c_int * 2),
+                ('error', ctypes.c_int),
+                ('dtype', ctypes.c_char * 8),
+                ('compression', ctypes.c_char * 8),
+                ('header', ctypes.c_void_p),
+                ('header_size', ctypes.c_size_t),
+                ('data', ctypes.c_void_p),
+                ('size', ctypes.c_size_t)]
+
+
+class _Stats(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_uint64) for name in
+                ('messages', 'images', 'bytes', 'decoded', 'errors', 'duplicates')]
+
+
+def _load_library(path=None):
+    if path is None:
+        path = os.environ.get('PILATUS_RECEIVER_LIB', os.path.join(
+            os.path.dirname(os.path.abspath(__file__)), '..', 'src', 'libreceiver.so'))
+    lib = ctypes.CDLL(path)
+    lib.receiver_new.restype = ctypes.c_void_p
+    lib.receiver_new.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+    lib.receiver_next.restype = ctypes.POINTER(_Message)
+    lib.receiver_next.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.receiver_release.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Message)]
+    lib.receiver_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(_Stats)]
+    lib.receiver_shutdown.argtypes = [ctypes.c_void_p]
+    lib.receiver_delete.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+class _Handle:
+    """
+    Owns the receiver of the library, freed once the receiver and all of its
+    messages are gone.
+    """
+    def __init__(self, lib, pointer):
+        self.lib = lib
+        self.pointer = pointer
+
+    def __del__(self):
+        self.lib.receiver_delete(self.pointer)
+
+
+class _Slot:
+    def __init__(self, handle, message):
+        self.handle = handle
+        self.message = message
+
+    def __del__(self):
+        self.handle.lib.receiver_release(self.handle.pointer, self.message)
+
+
+class Message:
+    def __init__(self, handle, pointer):
+        message = pointer.contents
+        self._slot = _Slot(handle, pointer)
+        self.htype = MESSAGE_TYPES[message.type]
+        self.series = message.series
+        self.frame = message.frame
+        self.shape = (message.shape[0], message.shape[1])
+        self.dtype = message.dtype.decode()
+        # empty if the image isn't compressed or was decoded
+        self.compression = message.compression.decode()
+        self.error = bool(message.error)
+        self.header = ctypes.string_at(message.header, message.header_size)
+        self.data = None
+        if message.size:
+            buffer = (ctypes.c_uint8 * message.size).from_address(message.data)
+            # the slot lives as long as any array viewing the buffer
+            weakref.finalize(buffer, lambda slot: None, self._slot)
+            data = np.frombuffer(buffer, dtype=np.uint8)
+            if self.htype == 'image' and not self.compression and self.dtype:
+                data = data.view(self.dtype).reshape(self.shape)
+            self.data = data
+
+    @property
+    def info(self):
+        """
+        The json header as a dict, binary image headers give an empty dict.
+        """
+        if self.header.startswith(b'{'):
+            return json.loads(self.header)
+        return {}
+
+
+class Receiver:
+    def __init__(self, endpoints, threads=4, depth=64, rcvhwm=0, library=None):
+        """
+        endpoints is one endpoint or a list of them, like the --endpoint options of the streamer.
+        threads decode cbf and bslz4 images, with 0 they are handed out as received.
+        depth is the number of messages between the socket and the caller.
+        """
+        if isinstance(endpoints, str):
+            endpoints = [endpoints]
+        lib = _load_library(library)
+        pointer = lib.receiver_new(','.join(endpoints).encode(), depth, threads, rcvhwm)
+        if not pointer:
+            raise Exception('Could not connect to %s' % ', '.join(endpoints))
+        self._handle = _Handle(lib, pointer)
+
+    def next(self, timeout=None):
+        """
+        Next message in the order it was received, None after timeout seconds.
+        """
+        if self._handle is None:
+            return None
+        ms = -1 if timeout is None else int(timeout * 1000)
+        pointer = self._handle.lib.receiver_next(self._handle.pointer, ms)
+        if not pointer:
+            return None
+        return Message(self._handle, pointer)
+
+    def __iter__(self):
+        while True:
+            message = self.next()
+            if message is None:
+                return
+            yield message
+
+    def stats(self):
+        stats = _Stats()
+        self._handle.lib.receiver_stats(self._handle.pointer, ctypes.byref(stats))
+        return {name: getattr(stats, name) for name, _ in _Stats._fields_}
+
+    def close(self):
+        """
+        Stops receiving, the messages still held stay valid.
+        """
+        if self._handle is not None:
+            self._handle.lib.receiver_shutdown(self._handle.pointer)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+def _baseline(endpoints, count, timeout):
+    """
+    What a receiver written in Python typically does: copy every part, parse every
+    json header and build the array from the copy.
+    """
+    import zmq
+    context = zmq.Context()
+    pull = context.socket(zmq.PULL)
+    for endpoint in endpoints:
+        pull.connect(endpoint)
+    pull.setsockopt(zmq.RCVTIMEO, int(timeout * 1000))
+    frames = 0
+    size = 0
+    first = last = None
+    try:
+        while count == 0 or frames < count:
+            parts = pull.recv_multipart()
+            header = json.loads(parts[0])
+            if header['htype'] == 'image':
+                image = np.frombuffer(parts[1], dtype=header['type']).reshape(header['shape'])
+                size += image.nbytes
+                frames += 1
+                last = time.monotonic()
+                first = first or last
+            elif header['htype'] == 'series_end':
+                break
+    except zmq.Again:
+        pass
+    pull.close()
+    context.term()
+    return frames, size, first, last
+
+
+def _measure(receiver, count, timeout):
+    frames = 0
+    size = 0
+    first = last = None
+    while count == 0 or frames < count:
+        message = receiver.next(timeout)
+        if message is None or message.htype == 'series_end':
+            break
+        if message.htype == 'image':
+            size += message.data.nbytes
+            frames += 1
+            last = time.monotonic()
+            first = first or last
+    return frames, size, first, last
+
+
+def _trigger(address, nimages, rate):
+    """
+    Starts an exposure through the control port like the consumer tool. Pilatus.start
+    refuses the short periods of a load test, there is no shutter to protect.
+    """
+    host, port = address.split(':')
+    control = socket.create_connection((host, int(port)))
+    commands = []
+    if nimages:
+        commands.append('nimages %d' % nimages)
+    if rate:
+        commands.append('expperiod %f' % (1.0 / rate))
+    # the streamer replaces the file name
+    commands.append('exposure receiver_bench')
+    for command in commands:
+        control.sendall(command.encode() + b'\0')
+        reply = control.recv(1024).decode(errors='replace')
+        if 'OK' not in reply:
+            raise Exception('%s failed: %s' % (command, reply))
+    return control
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Sustained frame rate of the receiver '
+                                     'against a streamer, one json line per series')
+    parser.add_argument('endpoints', nargs='*', default=['tcp://127.0.0.1:9999'])
+    parser.add_argument('--threads', type=int, default=4, help='decoder threads')
+    parser.add_argument('--depth', type=int, default=64)
+    parser.add_argument('--series', type=int, default=1)
+    parser.add_argument('--frames', type=int, default=0,
+                        help='stop a series after this many frames instead of at series_end')
+    parser.add_argument('--trigger', help='control port of the streamer, host:port, to start an exposure')
+    parser.add_argument('--nimages', type=int, default=0)
+    parser.add_argument('--rate', type=float, default=0.0)
+    parser.add_argument('--baseline', action='store_true',
+                        help='measure a plain pyzmq receiver instead')
+    args = parser.parse_args()
+
+    receiver = None if args.baseline else Receiver(args.endpoints, args.threads, args.depth)
+    for series in range(1, args.series + 1):
+        if args.trigger:
+            # give the PUSH socket time to see the receiver before the first frame
+            time.sleep(0.2)
+            control = _trigger(args.trigger, args.nimages, args.rate)
+        if args.baseline:
+            frames, size, first, last = _baseline(args.endpoints, args.frames, 10.0)
+        else:
+            frames, size, first, last = _measure(receiver, args.frames, 10.0)
+        elapsed = last - first if frames > 1 else 0.0
+        rate = (frames - 1) / elapsed if elapsed > 0 else 0.0
+        result = {'series': series, 'receiver': 'pyzmq' if args.baseline else 'libreceiver',
+                  'frames': frames, 'frames_per_second': round(rate, 1),
+                  'throughput_gb_s': round(size * rate / max(frames, 1) / 1e9, 3)}
+        if receiver:
+            result['stats'] = receiver.stats()
+        print(json.dumps(result))
+        sys.stdout.flush()
+        if args.trigger:
+            control.close()
+    if receiver:
+        receiver.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,1631 @@
+// Benchmarks for the hot paths of the streamer, build and run with make bench.
+// Every result is printed as one json object per line starting with {"bench", other
+// lines are log output. Groups can be selected by prefix, e.g. ./bench queue tif_load
+// or make bench BENCH="queue tif_load".
+// File based benchmarks write synthetic frames to tmpfs in /dev/shm.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zmq.h>
+#include "cbf.h"
+#include "compress.h"
+#include "queue.h"
+#include "tiff.h"
+#include "loader.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "framestats.h"
+#include "correct.h"
+#include "integrate.h"
+#include "receiver.h"
+#include "placement.h"
+#include "reorder.h"
+
+// 1475 x 1679 Pixels
+#define WIDTH 1475
+#define HEIGHT 1679
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* bench, const char* metric, double value, const char* unit)
+{
+    printf("{\"bench\": \"%s\", \"metric\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}\n",
+           bench, metric, value, unit);
+    fflush(stdout);
+}
+
+static int g_argc;
+static char** g_argv;
+
+// Whether a benchmark was selected on the command line by a prefix of its name,
+// all are run without arguments
+static int selected(const char* name)
+{
+    if (g_argc < 2) {
+        return 1;
+    }
+    for (int i=1; i<g_argc; i++) {
+        if (strncmp(name, g_argv[i], strlen(g_argv[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Median of the runs, less sensitive to a single disturbed run than the mean
+static double median(double* values, int n)
+{
+    qsort(values, n, sizeof(double), compare_double);
+    return n % 2 ? values[n/2] : 0.5 * (values[n/2 - 1] + values[n/2]);
+}
+
+// Low counts with a few hot pixels and the module gaps set to -1, similar to a real frame
+static void fill_image(int32_t* image, int width, int height)
+{
+    srand(1);
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            int32_t value = rand() % 20;
+            if (rand() % 1000 == 0) {
+                value = rand() % 1000000;
+            }
+            if (x % 494 >= 487 || y % 212 >= 195) {
+                value = -1;
+            }
+            image[y*width + x] = value;
+        }
+    }
+}
+
+typedef long (*decode_fn)(const uint8_t*, size_t, int32_t*, int);
+
+static void bench_cbf_decode(const char* name, decode_fn decode,
+                             const uint8_t* compressed, long size,
+                             const int32_t* image, int nelements)
+{
+    int32_t* out = malloc(nelements * sizeof(int32_t));
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        decode(compressed, size, out, nelements);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    if (memcmp(out, image, nelements * sizeof(int32_t)) != 0) {
+        printf("%s: decoded image differs from the original\n", name);
+    }
+    report(name, "time_per_frame", elapsed / iterations * 1e6, "us");
+    report(name, "input_per_core", size * (double)iterations / elapsed / 1e6, "MB/s");
+    report(name, "output_per_core", nelements * sizeof(int32_t) * (double)iterations / elapsed / 1e6, "MB/s");
+    free(out);
+}
+
+#ifdef HAVE_LZ4
+static void bench_bslz4(const int32_t* image, int nelements)
+{
+    size_t capacity = bslz4_bound(nelements, sizeof(int32_t));
+    void* compressed = malloc(capacity);
+    int32_t* out = malloc(nelements * sizeof(int32_t));
+    long size = 0;
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        size = bslz4_compress(image, nelements, sizeof(int32_t), compressed, capacity);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    report("bslz4_compress", "compression_ratio", nelements * sizeof(int32_t) / (double)size, "");
+    report("bslz4_compress", "time_per_frame", elapsed / iterations * 1e6, "us");
+    report("bslz4_compress", "input_per_core", nelements * sizeof(int32_t) * (double)iterations / elapsed / 1e6, "MB/s");
+
+    iterations = 0;
+    start = now();
+    do {
+        bslz4_decompress(compressed, size, out, nelements * sizeof(int32_t), sizeof(int32_t));
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    if (memcmp(out, image, nelements * sizeof(int32_t)) != 0) {
+        printf("bslz4_decompress: decompressed image differs from the original\n");
+    }
+    report("bslz4_decompress", "time_per_frame", elapsed / iterations * 1e6, "us");
+    report("bslz4_decompress", "output_per_core", nelements * sizeof(int32_t) * (double)iterations / elapsed / 1e6, "MB/s");
+    free(out);
+    free(compressed);
+}
+#endif
+
+// The queue before the rewrite on stdatomic, compiler barriers around plain indices and
+// a condition variable for empty pops. Kept as the baseline, only valid for one producer
+// and one consumer.
+#define __sync_compiler() __asm__ __volatile__("":::"memory")
+
+typedef struct
+{
+    int64_t write_index;
+    char _pad[64 - sizeof(int64_t)];
+    int64_t read_index;
+    char _pad1[64 - sizeof(int64_t)];
+    void** buffer;
+    int size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} LegacyQueue;
+
+static void legacy_init(LegacyQueue* queue, int size)
+{
+    queue->size = size;
+    queue->buffer = malloc(sizeof(void*) * size);
+    queue->write_index = 0;
+    queue->read_index = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
+
+static int legacy_push(LegacyQueue* queue, void* item)
+{
+    __sync_compiler();
+    const int64_t index = queue->write_index;
+    __sync_compiler();
+    if (index >= queue->read_index + queue->size) {
+        return 0;
+    }
+    queue->buffer[index % queue->size] = item;
+    __sync_compiler();
+    queue->write_index = index + 1;
+    __sync_synchronize();
+    if (index == queue->read_index) {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    return 1;
+}
+
+static int legacy_pop(LegacyQueue* queue, void** item)
+{
+    __sync_compiler();
+    int64_t index = queue->read_index;
+    __sync_compiler();
+    if (index == queue->write_index) {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->read_index == queue->write_index) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    *item = queue->buffer[index % queue->size];
+    __sync_compiler();
+    queue->read_index = index + 1;
+    __sync_synchronize();
+    return 1;
+}
+
+#define QUEUE_SIZE 1024
+#define QUEUE_ITEMS 2000000
+#define STRESS_THREADS 4
+
+// Push and pop in the same thread, the cost of the operations without contention
+static void bench_queue_single(const char* name, int type)
+{
+    Queue queue;
+    queue_init(&queue, QUEUE_SIZE, type);
+    void* item;
+    double start = now();
+    for (int i=0; i<QUEUE_ITEMS; i+=QUEUE_SIZE) {
+        for (int k=0; k<QUEUE_SIZE; k++) {
+            queue_push(&queue, (void*)(intptr_t)k);
+        }
+        for (int k=0; k<QUEUE_SIZE; k++) {
+            queue_try_pop(&queue, &item);
+        }
+    }
+    report(name, "single_thread", QUEUE_ITEMS / (now() - start) / 1e6, "Mops/s");
+    queue_free(&queue);
+}
+
+static void bench_legacy_single()
+{
+    LegacyQueue queue;
+    legacy_init(&queue, QUEUE_SIZE);
+    void* item;
+    double start = now();
+    for (int i=0; i<QUEUE_ITEMS; i+=QUEUE_SIZE) {
+        for (int k=0; k<QUEUE_SIZE; k++) {
+            legacy_push(&queue, (void*)(intptr_t)k);
+        }
+        for (int k=0; k<QUEUE_SIZE; k++) {
+            legacy_pop(&queue, &item);
+        }
+    }
+    report("queue_legacy", "single_thread", QUEUE_ITEMS / (now() - start) / 1e6, "Mops/s");
+    free(queue.buffer);
+}
+
+typedef void (*framestats_fn)(const int32_t*, int, int, const FrameStatsConfig*, FrameStats*);
+
+static void bench_framestats(const char* name, framestats_fn compute, const int32_t* image,
+                             int width, int height, FrameStats* stats)
+{
+    FrameStatsConfig config;
+    config.saturation = 1000000;
+    config.nrois = 4;
+    for (int r=0; r<config.nrois; r++) {
+        snprintf(config.rois[r].name, FRAMESTATS_NAME_SIZE, "roi%d", r);
+        config.rois[r].x = 100 * r;
+        config.rois[r].y = 200 * r;
+        config.rois[r].width = 300;
+        config.rois[r].height = 300;
+    }
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        compute(image, width, height, &config, stats);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    report(name, "time_per_frame", elapsed / iterations * 1e6, "us");
+    report(name, "input_per_core",
+           (double)width * height * sizeof(int32_t) * iterations / elapsed / 1e6, "MB/s");
+}
+
+typedef int (*correction_fn)(Correction*, int32_t*, int, int);
+
+// The correction works in place, so every round starts from a copy of the image. The
+// time of the copy alone is subtracted.
+static void bench_correction(const char* name, correction_fn apply, Correction* correction,
+                             const int32_t* image, int32_t* out, int width, int height)
+{
+    const size_t size = (size_t)width * height * sizeof(int32_t);
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        memcpy(out, image, size);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 0.5);
+    const double copy = elapsed / iterations;
+    iterations = 0;
+    start = now();
+    do {
+        memcpy(out, image, size);
+        apply(correction, out, width, height);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    double per_frame = elapsed / iterations - copy;
+    report(name, "time_per_frame", per_frame * 1e6, "us");
+    report(name, "frames_per_core", 1.0 / per_frame, "Hz");
+    // Pilatus 2M at its full frame rate of 250 Hz
+    report(name, "cores_at_250Hz", per_frame * 250.0, "");
+}
+
+typedef void (*integrate_fn)(const IntegrationLut*, const int32_t*, float*, float*);
+
+static void bench_integrate(const char* name, integrate_fn integrate, const IntegrationLut* lut,
+                            const int32_t* image, float* profile)
+{
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        integrate(lut, image, profile, profile + lut->geometry.bins);
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    report(name, "time_per_frame", elapsed / iterations * 1e6, "us");
+    report(name, "cores_at_250Hz", elapsed / iterations * 250.0, "");
+}
+
+static void* legacy_producer(void* arg)
+{
+    LegacyQueue* queue = arg;
+    for (intptr_t i=0; i<QUEUE_ITEMS; i++) {
+        // the legacy push never blocks
+        while (!legacy_push(queue, (void*)i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void bench_legacy_threads()
+{
+    LegacyQueue queue;
+    legacy_init(&queue, QUEUE_SIZE);
+    pthread_t producer;
+    double start = now();
+    pthread_create(&producer, NULL, legacy_producer, &queue);
+    void* item;
+    for (int i=0; i<QUEUE_ITEMS; i++) {
+        legacy_pop(&queue, &item);
+    }
+    pthread_join(producer, NULL);
+    report("queue_legacy", "spsc_threads", QUEUE_ITEMS / (now() - start) / 1e6, "Mops/s");
+    free(queue.buffer);
+}
+
+typedef struct
+{
+    Queue* queue;
+    int id;
+    int nitems;
+    // consumer side: items seen per producer and order violations
+    int* seen;
+    int64_t* last;
+    int errors;
+} QueueWorker;
+
+// Items carry the producer id in the upper and a sequence number in the lower bits
+static void* queue_producer(void* arg)
+{
+    QueueWorker* worker = arg;
+    for (intptr_t i=0; i<worker->nitems; i++) {
+        queue_push_timeout(worker->queue, (void*)(((intptr_t)worker->id << 32) | i), -1);
+    }
+    return NULL;
+}
+
+static void* queue_consumer(void* arg)
+{
+    QueueWorker* worker = arg;
+    void* item;
+    for (int i=0; i<worker->nitems; i++) {
+        if (!queue_pop_timeout(worker->queue, &item, 10000)) {
+            worker->errors++;
+            break;
+        }
+        int producer = (intptr_t)item >> 32;
+        int64_t seq = (intptr_t)item & 0xffffffff;
+        // every consumer sees the items of one producer in the order they were pushed
+        if (seq <= worker->last[producer]) {
+            worker->errors++;
+        }
+        worker->last[producer] = seq;
+        worker->seen[(int64_t)producer * worker->nitems * STRESS_THREADS + seq]++;
+    }
+    return NULL;
+}
+
+// nthreads producers and consumers with blocking calls, checks that every item arrives
+// exactly once and in order per producer
+static void bench_queue_threads(const char* name, const char* metric, int type,
+                                int size, int nthreads)
+{
+    Queue queue;
+    queue_init(&queue, size, type);
+    const int per_thread = QUEUE_ITEMS / nthreads;
+    int* seen = calloc((size_t)nthreads * per_thread * STRESS_THREADS, sizeof(int));
+    QueueWorker producers[nthreads];
+    QueueWorker consumers[nthreads];
+    pthread_t threads[2 * nthreads];
+    double start = now();
+    for (int i=0; i<nthreads; i++) {
+        producers[i] = (QueueWorker){&queue, i, per_thread, NULL, NULL, 0};
+        consumers[i] = (QueueWorker){&queue, i, per_thread, seen, malloc(nthreads * sizeof(int64_t)), 0};
+        for (int k=0; k<nthreads; k++) {
+            consumers[i].last[k] = -1;
+        }
+        pthread_create(&threads[i], NULL, queue_producer, &producers[i]);
+        pthread_create(&threads[nthreads + i], NULL, queue_consumer, &consumers[i]);
+    }
+    for (int i=0; i<2*nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    int errors = 0;
+    for (int i=0; i<nthreads; i++) {
+        errors += consumers[i].errors;
+        free(consumers[i].last);
+    }
+    // each consumer pops per_thread items, so every producer's items are spread over them
+    for (int p=0; p<nthreads; p++) {
+        for (int i=0; i<per_thread; i++) {
+            if (seen[(int64_t)p * per_thread * STRESS_THREADS + i] != 1) {
+                errors++;
+            }
+        }
+    }
+    report(name, metric, nthreads * per_thread / elapsed / 1e6, "Mops/s");
+    if (errors) {
+        printf("%s: %d items lost, duplicated or out of order\n", name, errors);
+    }
+    report(name, "errors", errors, "");
+    free(seen);
+    queue_free(&queue);
+}
+
+typedef struct
+{
+    const char* name;
+    int width;
+    int height;
+} Detector;
+
+static const Detector detectors[] = {
+    {"100k", 487, 195},
+    {"1M", 981, 1043},
+    {"2M", 1475, 1679}
+};
+
+#define NDETECTORS (int)(sizeof(detectors) / sizeof(detectors[0]))
+#define TIF_HEADER_SIZE 4096
+// synthetic files written per round of the file benchmarks
+#define ROUND_BYTES (200 * 1024 * 1024)
+#define ROUNDS 5
+
+// Pilatus style tif, the tags in a 4096 byte header followed by one strip of int32
+static size_t make_tif(char* out, const int32_t* image, int width, int height)
+{
+    memset(out, 0, TIF_HEADER_SIZE);
+    TiffHeader header = {0x4949, 42, 8};
+    memcpy(out, &header, sizeof(header));
+    const uint32_t image_size = width * height * sizeof(int32_t);
+    TifTag tags[] = {
+        {IMAGE_WIDTH, TIF_LONG, 1, width},
+        {IMAGE_HEIGHT, TIF_LONG, 1, height},
+        {BITS_PER_SAMPLE, TIF_SHORT, 1, 32},
+        {COMPRESSION, TIF_SHORT, 1, 1},
+        {STRIP_OFFSETS, TIF_LONG, 1, TIF_HEADER_SIZE},
+        {STRIP_BYTE_COUNTS, TIF_LONG, 1, image_size},
+        {SAMPLE_FORMAT, TIF_SHORT, 1, 2}
+    };
+    uint16_t count = sizeof(tags) / sizeof(TifTag);
+    memcpy(out + header.ifd_offset, &count, sizeof(count));
+    memcpy(out + header.ifd_offset + sizeof(count), tags, sizeof(tags));
+    memcpy(out + TIF_HEADER_SIZE, image, image_size);
+    return TIF_HEADER_SIZE + image_size;
+}
+
+// cbf with the mime header of the binary section as written by the Pilatus
+static size_t make_cbf(char* out, const int32_t* image, int width, int height)
+{
+    uint8_t* data = malloc((size_t)width * height * 7);
+    long size = cbf_encode(image, width * height, data);
+    int length = sprintf(out,
+                         "###CBF: VERSION 1.5\r\n"
+                         "# Detector: PILATUS 2M\r\n"
+                         "# Exposure_time 0.1000000 s\r\n"
+                         "_array_data.data\r\n"
+                         ";\r\n"
+                         "--CIF-BINARY-FORMAT-SECTION--\r\n"
+                         "Content-Type: application/octet-stream;\r\n"
+                         "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+                         "Content-Transfer-Encoding: BINARY\r\n"
+                         "X-Binary-Size: %ld\r\n"
+                         "X-Binary-ID: 1\r\n"
+                         "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+                         "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n"
+                         "X-Binary-Number-of-Elements: %d\r\n"
+                         "X-Binary-Size-Fastest-Dimension: %d\r\n"
+                         "X-Binary-Size-Second-Dimension: %d\r\n"
+                         "X-Binary-Size-Padding: 4095\r\n"
+                         "\r\n", size, width * height, width, height);
+    const char marker[4] = {0x0c, 0x1a, 0x04, (char)0xd5};
+    memcpy(out + length, marker, 4);
+    memcpy(out + length + 4, data, size);
+    free(data);
+    return length + 4 + size;
+}
+
+static char* make_dir()
+{
+    static char dir[64];
+    strcpy(dir, "/dev/shm/pilatus-bench-XXXXXX");
+    if (!mkdtemp(dir)) {
+        strcpy(dir, "/tmp/pilatus-bench-XXXXXX");
+        mkdtemp(dir);
+    }
+    return dir;
+}
+
+static void write_file(const char* path, const char* data, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, data, size) != (ssize_t)size) {
+        printf("Could not write %s\n", path);
+    }
+    close(fd);
+}
+
+static int files_per_round(size_t file_size)
+{
+    int n = ROUND_BYTES / file_size;
+    return n < 4 ? 4 : n > 128 ? 128 : n;
+}
+
+// Loading the files from tmpfs with the loader and parsing them, the way the readers do
+static void bench_tif_load(const Detector* detector)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "tif_load_%s", detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* file = malloc(TIF_HEADER_SIZE + nelements * sizeof(int32_t));
+    size_t file_size = make_tif(file, image, detector->width, detector->height);
+    const int nfiles = files_per_round(file_size);
+    const size_t capacity = (file_size + POOL_ALIGNMENT - 1) & ~((size_t)POOL_ALIGNMENT - 1);
+    char* buffers;
+    if (posix_memalign((void**)&buffers, POOL_ALIGNMENT, nfiles * capacity) != 0) {
+        printf("%s: could not allocate buffers\n", name);
+        return;
+    }
+    const char* dir = make_dir();
+    Loader loader;
+    loader_init(&loader, nfiles, 0);
+    LoadRequest requests[nfiles];
+
+    double frames_per_second[ROUNDS];
+    double parse_us[ROUNDS];
+    int errors = 0;
+    for (int round=0; round<ROUNDS; round++) {
+        for (int i=0; i<nfiles; i++) {
+            snprintf(requests[i].path, sizeof(requests[i].path), "%s/frame_%05d.tif", dir, i);
+            write_file(requests[i].path, file, file_size);
+            requests[i].buffer = buffers + i*capacity;
+            requests[i].capacity = capacity;
+            requests[i].expected_size = 0;
+            requests[i].offset = 0;
+            requests[i].length = 0;
+        }
+        double start = now();
+        loader_load(&loader, requests, nfiles);
+        double loaded = now();
+        for (int i=0; i<nfiles; i++) {
+            TifInfo info;
+            if (requests[i].error || parse_tif(requests[i].buffer, requests[i].nread, &info) != 0 ||
+                info.strip_byte_counts != nelements * sizeof(int32_t)) {
+                errors++;
+            }
+        }
+        double end = now();
+        frames_per_second[round] = nfiles / (end - start);
+        parse_us[round] = (end - loaded) / nfiles * 1e6;
+    }
+    double fps = median(frames_per_second, ROUNDS);
+    report(name, "frames_per_second", fps, "1/s");
+    report(name, "throughput", fps * file_size / 1e9, "GB/s");
+    report(name, "parse_time", median(parse_us, ROUNDS), "us");
+    report(name, "errors", errors, "");
+    loader_close(&loader);
+    rmdir(dir);
+    free(buffers);
+    free(file);
+    free(image);
+}
+
+static void bench_cbf_header(const Detector* detector)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "cbf_header_%s", detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* file = malloc(4096 + (size_t)nelements * 7);
+    size_t size = make_cbf(file, image, detector->width, detector->height);
+    int iterations = 0;
+    int errors = 0;
+    double start = now();
+    double elapsed;
+    do {
+        CbfInfo info;
+        if (parse_cbf(file, size, &info) != 0 || info.nelements != nelements ||
+            info.width != detector->width || info.height != detector->height) {
+            errors++;
+        }
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < 1.0);
+    report(name, "parse_time", elapsed / iterations * 1e6, "us");
+    report(name, "errors", errors, "");
+    free(file);
+    free(image);
+}
+
+// Time per file in the reorder stage with every pair of frames swapped. Files with a
+// broken frame number or one beyond the series mustn't give up the frames still
+// missing, those are counted as errors.
+static void bench_reorder()
+{
+    ReorderConfig config = {.window = 64, .timeout_ms = 1000};
+    Reorder reorder;
+    reorder_init(&reorder, &config);
+    const int count = 1000000;
+    int errors = 0;
+    char name[64];
+    reorder_start(&reorder, count);
+    double start = now();
+    for (int i=0; i<count; i++) {
+        snprintf(name, sizeof(name), "scan_%05d.tif", i ^ 1);
+        errors += reorder_add(&reorder, reorder_frame_number(name), name, 0) != REORDER_ACCEPTED;
+        reorder_clear_ready(&reorder);
+    }
+    report("reorder", "time_per_file", (now() - start) / count * 1e9, "ns");
+    errors += !reorder_complete(&reorder) || reorder.series_lost != 0;
+
+    // names without a frame number are left to the caller
+    const char* broken[] = {"scan_.tif", "scan_abc.tif", "scan_-3.tif", "scan_99999999999.tif"};
+    for (int i=0; i<4; i++) {
+        errors += reorder_frame_number(broken[i]) != -1;
+    }
+    errors += reorder_frame_number("scan.tif") != 0 || reorder_frame_number("a_b_00012.tif") != 12;
+
+    // a stray number beyond the series, with frame 0 still missing
+    reorder_start(&reorder, 10);
+    for (int i=1; i<10; i++) {
+        snprintf(name, sizeof(name), "scan_%05d.tif", i);
+        reorder_add(&reorder, i, name, 0);
+        if (i == 5) {
+            errors += reorder_add(&reorder, 2000000000, "scan_2000000000.tif", 0) !=
+                      REORDER_OUT_OF_RANGE;
+        }
+    }
+    errors += reorder.held != 9 || reorder.series_lost != 0;
+    reorder_add(&reorder, 0, "scan_00000.tif", 0);
+    errors += !reorder_complete(&reorder) || reorder.series_lost != 0;
+    reorder_clear_ready(&reorder);
+
+    // without the number of frames a huge one gives up everything before its window
+    // at once instead of frame by frame
+    reorder_start(&reorder, -1);
+    reorder_add(&reorder, 1, "scan_00001.tif", 0);
+    start = now();
+    reorder_add(&reorder, 1000000000, "scan_1000000000.tif", 0);
+    report("reorder", "window_skip_time", (now() - start) * 1e6, "us");
+    errors += reorder.series_lost != 1000000000 - config.window;
+    reorder_flush(&reorder);
+    reorder_clear_ready(&reorder);
+
+    report("reorder", "errors", errors, "");
+    reorder_close(&reorder);
+}
+
+// What a consumer spends per frame on the image header: the json one is searched for
+// its keys like the consumer does, the binary one is copied into the struct
+static void bench_header()
+{
+    const char* json = "{\"htype\": \"image\",\"frame\": 123456,\"shape\": [1679,1475],"
+                       "\"type\": \"int32\",\"compression\": \"\",\"timestamps\": {"
+                       "\"event\": 1700000000000000,\"load\": 1700000000000100,"
+                       "\"opened\": 1700000000000200,\"read\": 1700000000000300,"
+                       "\"removed\": 1700000000000400,\"processed\": 1700000000000500,"
+                       "\"sent\": 1700000000000600}}";
+    const int count = 1000000;
+    long long sum = 0;
+    double start = now();
+    for (int i=0; i<count; i++) {
+        int frame = 0;
+        int shape[2] = {0, 0};
+        char type[16] = "";
+        long long sent = 0;
+        const char* p = strstr(json, "\"frame\"");
+        sscanf(p, "\"frame\": %d", &frame);
+        p = strstr(json, "\"shape\"");
+        sscanf(p, "\"shape\": [%d,%d]", &shape[0], &shape[1]);
+        p = strstr(json, "\"type\"");
+        sscanf(p, "\"type\": \"%15[^\"]\"", type);
+        p = strstr(json, "\"sent\"");
+        sscanf(p, "\"sent\": %lld", &sent);
+        sum += frame + shape[0] + shape[1] + type[0] + sent;
+    }
+    report("header_json", "parse_time", (now() - start) / count * 1e9, "ns");
+
+    BinaryHeader binary;
+    memset(&binary, 0, sizeof(binary));
+    memcpy(binary.magic, BINARY_HEADER_MAGIC, sizeof(binary.magic));
+    binary.frame = 123456;
+    char message[sizeof(BinaryHeader)];
+    memcpy(message, &binary, sizeof(binary));
+    start = now();
+    for (int i=0; i<count; i++) {
+        BinaryHeader parsed;
+        // the compiler mustn't see that the message never changes
+        __asm__ volatile("" : : "r"(message) : "memory");
+        memcpy(&parsed, message, sizeof(parsed));
+        if (memcmp(parsed.magic, BINARY_HEADER_MAGIC, 4) == 0) {
+            sum += parsed.frame + parsed.shape[0] + parsed.dtype + parsed.timestamps[6];
+        }
+    }
+    report("header_binary", "parse_time", (now() - start) / count * 1e9, "ns");
+    report("header", "json_size", strlen(json), "bytes");
+    report("header", "binary_size", sizeof(BinaryHeader), "bytes");
+    if (sum == 42) {
+        printf("\n");
+    }
+}
+
+typedef struct
+{
+    Queue* requests;
+    Queue* replies;
+    int count;
+} PingPong;
+
+static void* queue_echo(void* arg)
+{
+    PingPong* ping = arg;
+    void* item;
+    for (int i=0; i<ping->count; i++) {
+        queue_pop(ping->requests, &item);
+        queue_push_timeout(ping->replies, item, -1);
+    }
+    return NULL;
+}
+
+// One item bounces between two threads, the latency of a blocking hand over
+static void bench_queue_roundtrip(const char* name, int type)
+{
+    Queue requests;
+    Queue replies;
+    queue_init(&requests, QUEUE_SIZE, type);
+    queue_init(&replies, QUEUE_SIZE, type);
+    const int count = 100000;
+    PingPong ping = {&requests, &replies, count};
+    pthread_t echo;
+    pthread_create(&echo, NULL, queue_echo, &ping);
+    void* item;
+    double start = now();
+    for (intptr_t i=0; i<count; i++) {
+        queue_push_timeout(&requests, (void*)i, -1);
+        queue_pop(&replies, &item);
+    }
+    double elapsed = now() - start;
+    pthread_join(echo, NULL);
+    report(name, "round_trip", elapsed / count * 1e6, "us");
+    queue_free(&requests);
+    queue_free(&replies);
+}
+
+typedef struct
+{
+    void* socket;
+    int frames;
+    size_t bytes;
+} Sink;
+
+// Receives until the series_end message, or a fixed number of frames if frames is set
+static void* receive_frames(void* arg)
+{
+    Sink* receiver = arg;
+    const int expected = receiver->frames;
+    receiver->frames = 0;
+    receiver->bytes = 0;
+    while (expected == 0 || receiver->frames < expected) {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, receiver->socket, 0) < 0) {
+            zmq_msg_close(&msg);
+            break;
+        }
+        const char* data = zmq_msg_data(&msg);
+        const size_t size = zmq_msg_size(&msg);
+        int end = memmem(data, size, "series_end", 10) != NULL;
+        int image = size > 17 && memcmp(data, "{\"htype\": \"image\"", 17) == 0;
+        if (size == sizeof(BinaryHeader) && memcmp(data, BINARY_HEADER_MAGIC, 4) == 0) {
+            image = 1;
+        }
+        // a batch of images tells how many it carries
+        if (size > 18 && memcmp(data, "{\"htype\": \"images\"", 18) == 0) {
+            const char* count = memmem(data, size, "\"count\": ", 9);
+            image = count ? atoi(count + 9) : 0;
+        }
+        while (zmq_msg_more(&msg)) {
+            zmq_msg_close(&msg);
+            zmq_msg_init(&msg);
+            zmq_msg_recv(&msg, receiver->socket, 0);
+            receiver->bytes += zmq_msg_size(&msg);
+        }
+        zmq_msg_close(&msg);
+        receiver->frames += image;
+        if (end) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void connect_pair(void* context, void** push, void** pull)
+{
+    char endpoint[256];
+    size_t length = sizeof(endpoint);
+    *push = zmq_socket(context, ZMQ_PUSH);
+    zmq_bind(*push, "tcp://127.0.0.1:*");
+    zmq_getsockopt(*push, ZMQ_LAST_ENDPOINT, endpoint, &length);
+    *pull = zmq_socket(context, ZMQ_PULL);
+    zmq_connect(*pull, endpoint);
+}
+
+// Zero copy sends of one frame to a PULL socket on the loopback interface
+static void bench_zmq_send(const Detector* detector)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "zmq_send_%s", detector->name);
+    const size_t size = (size_t)detector->width * detector->height * sizeof(int32_t);
+    int32_t* image = malloc(size);
+    fill_image(image, detector->width, detector->height);
+    void* context = zmq_ctx_new();
+    void* push;
+    void* pull;
+    connect_pair(context, &push, &pull);
+    const int count = files_per_round(size);
+    const char* header = "{\"htype\": \"image\",\"frame\": 0}";
+
+    double frames_per_second[ROUNDS];
+    for (int round=0; round<ROUNDS; round++) {
+        Sink receiver = {pull, count, 0};
+        pthread_t thread;
+        pthread_create(&thread, NULL, receive_frames, &receiver);
+        double start = now();
+        for (int i=0; i<count; i++) {
+            zmq_send(push, header, strlen(header), ZMQ_SNDMORE);
+            zmq_msg_t blob;
+            // the image outlives the sends, nothing to free
+            zmq_msg_init_data(&blob, image, size, NULL, NULL);
+            zmq_msg_send(&blob, push, 0);
+        }
+        pthread_join(thread, NULL);
+        frames_per_second[round] = receiver.frames / (now() - start);
+    }
+    double fps = median(frames_per_second, ROUNDS);
+    report(name, "frames_per_second", fps, "1/s");
+    report(name, "throughput", fps * size / 1e9, "GB/s");
+    zmq_close(push);
+    zmq_close(pull);
+    zmq_ctx_term(context);
+    free(image);
+}
+
+// The whole pipeline from tif files on tmpfs to a PULL socket: readers, pool, sender.
+// With send_batch > 1 the images go out in batches.
+static void bench_end_to_end(const Detector* detector, int send_batch, int header_format)
+{
+    char name[64];
+    snprintf(name, sizeof(name),
+             send_batch > 1 ? "end_to_end_batched_%s" :
+             header_format == HEADER_BINARY ? "end_to_end_binary_%s" : "end_to_end_%s",
+             detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* file = malloc(TIF_HEADER_SIZE + nelements * sizeof(int32_t));
+    size_t file_size = make_tif(file, image, detector->width, detector->height);
+    const int nfiles = files_per_round(file_size);
+    char* dir = make_dir();
+
+    PipelineConfig config;
+    config.folder = dir;
+    config.file_ending = "tif";
+    config.nworkers = 4;
+    config.batch_size = 16;
+    config.direct = 0;
+    config.decode = 0;
+    config.compression = COMPRESSION_NONE;
+    config.timestamps = 0;
+    config.send_batch = send_batch;
+    config.send_batch_ms = 0;
+    config.frame_stats = 0;
+    config.saturation = 1048575;
+    config.header_format = header_format;
+    config.name = NULL;
+    PoolConfig pool_config = {64, 0, 0, -1, POOL_WAIT, 0};
+    Pool pool;
+    pool_init(&pool, &pool_config);
+    pool_allocate(&pool, pipeline_buffer_size(&config, nelements, sizeof(int32_t), file_size));
+    void* context = zmq_ctx_new();
+    OutputConfig output_config = {{"tcp://127.0.0.1:*"}, 1, OUTPUT_ROUND_ROBIN, 1, 0, 0};
+    Output output;
+    output_init(&output, &output_config, context);
+    char endpoint[256];
+    size_t length = sizeof(endpoint);
+    zmq_getsockopt(output.endpoints[0].socket, ZMQ_LAST_ENDPOINT, endpoint, &length);
+    void* pull = zmq_socket(context, ZMQ_PULL);
+    zmq_connect(pull, endpoint);
+    Readers readers;
+    readers_init(&readers, &config);
+    Pipeline pipeline;
+    pipeline_init(&pipeline, pool_config.depth - config.nworkers - 1, &config, &readers, &pool,
+                  &output, NULL, NULL, NULL, NULL);
+
+    char filenames[nfiles][32];
+    const char* names[nfiles];
+    int numbers[nfiles];
+    double frames_per_second[ROUNDS];
+    int errors = 0;
+    for (int round=0; round<ROUNDS; round++) {
+        for (int i=0; i<nfiles; i++) {
+            char path[512];
+            snprintf(filenames[i], sizeof(filenames[i]), "frame_%05d.tif", i);
+            snprintf(path, sizeof(path), "%s/%s", dir, filenames[i]);
+            write_file(path, file, file_size);
+            names[i] = filenames[i];
+            numbers[i] = i;
+        }
+        Sink receiver = {pull, 0, 0};
+        pthread_t thread;
+        pthread_create(&thread, NULL, receive_frames, &receiver);
+        const char* header = "{\"htype\": \"header\"}";
+        const char* end = "{\"htype\": \"series_end\"}";
+        double start = now();
+        pipeline_start_series(&pipeline);
+        pipeline_submit_message(&pipeline, header, strlen(header));
+        pipeline_submit_files(&pipeline, names, numbers, nfiles);
+        pipeline_submit_message(&pipeline, end, strlen(end));
+        pthread_join(thread, NULL);
+        frames_per_second[round] = receiver.frames / (now() - start);
+        errors += nfiles - receiver.frames;
+    }
+    double fps = median(frames_per_second, ROUNDS);
+    report(name, "frames_per_second", fps, "1/s");
+    report(name, "throughput", fps * nelements * sizeof(int32_t) / 1e9, "GB/s");
+    report(name, "errors", errors, "");
+
+    readers_close(&readers);
+    pipeline_close(&pipeline);
+    output_close(&output);
+    zmq_close(pull);
+    zmq_ctx_term(context);
+    pool_close(&pool);
+    rmdir(dir);
+    free(file);
+    free(image);
+}
+
+typedef struct
+{
+    Sink sink;
+    double end;
+} TimedSink;
+
+static void* receive_frames_timed(void* arg)
+{
+    TimedSink* receiver = arg;
+    receive_frames(&receiver->sink);
+    receiver->end = now();
+    return NULL;
+}
+
+// Two pipelines sharing four readers, both get a series at the same time, the first
+// one slightly earlier. With readers taking turns both series finish at about the same
+// time, fairness is the ratio of the two times. Readers serving the pipelines one after
+// the other would give about 0.5.
+static void bench_shared_readers(const Detector* detector)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "shared_readers_%s", detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* file = malloc(TIF_HEADER_SIZE + nelements * sizeof(int32_t));
+    size_t file_size = make_tif(file, image, detector->width, detector->height);
+    const int nfiles = files_per_round(file_size) / 2;
+
+    PipelineConfig config;
+    config.file_ending = "tif";
+    config.nworkers = 4;
+    config.batch_size = 16;
+    config.direct = 0;
+    config.decode = 0;
+    config.compression = COMPRESSION_NONE;
+    config.timestamps = 0;
+    config.send_batch = 1;
+    config.send_batch_ms = 0;
+    config.frame_stats = 0;
+    config.saturation = 1048575;
+    config.header_format = HEADER_JSON;
+    config.name = NULL;
+    Readers readers;
+    readers_init(&readers, &config);
+    void* context = zmq_ctx_new();
+    PoolConfig pool_config = {64, 0, 0, -1, POOL_WAIT, 0};
+    char dirs[2][64];
+    Pool pools[2];
+    Output outputs[2];
+    void* pulls[2];
+    Pipeline pipelines[2];
+    PipelineConfig configs[2];
+    for (int p=0; p<2; p++) {
+        snprintf(dirs[p], sizeof(dirs[p]), "%s", make_dir());
+        configs[p] = config;
+        configs[p].folder = dirs[p];
+        pool_init(&pools[p], &pool_config);
+        pool_allocate(&pools[p], pipeline_buffer_size(&config, nelements, sizeof(int32_t),
+                                                      file_size));
+        OutputConfig output_config = {{"tcp://127.0.0.1:*"}, 1, OUTPUT_ROUND_ROBIN, 1, p, 0};
+        output_init(&outputs[p], &output_config, context);
+        char endpoint[256];
+        size_t length = sizeof(endpoint);
+        zmq_getsockopt(outputs[p].endpoints[0].socket, ZMQ_LAST_ENDPOINT, endpoint, &length);
+        pulls[p] = zmq_socket(context, ZMQ_PULL);
+        zmq_connect(pulls[p], endpoint);
+        pipeline_init(&pipelines[p], pool_config.depth - config.nworkers - 1, &configs[p],
+                      &readers, &pools[p], &outputs[p], NULL, NULL, NULL, NULL);
+    }
+
+    char filenames[nfiles][32];
+    const char* names[nfiles];
+    int numbers[nfiles];
+    double frames_per_second[2][ROUNDS];
+    double fairness[ROUNDS];
+    int errors = 0;
+    for (int round=0; round<ROUNDS; round++) {
+        for (int i=0; i<nfiles; i++) {
+            snprintf(filenames[i], sizeof(filenames[i]), "frame_%05d.tif", i);
+            names[i] = filenames[i];
+            numbers[i] = i;
+            for (int p=0; p<2; p++) {
+                char path[512];
+                snprintf(path, sizeof(path), "%s/%s", dirs[p], filenames[i]);
+                write_file(path, file, file_size);
+            }
+        }
+        TimedSink receivers[2];
+        pthread_t threads[2];
+        for (int p=0; p<2; p++) {
+            receivers[p].sink = (Sink){pulls[p], 0, 0};
+            pthread_create(&threads[p], NULL, receive_frames_timed, &receivers[p]);
+        }
+        const char* header = "{\"htype\": \"header\"}";
+        const char* end = "{\"htype\": \"series_end\"}";
+        double start = now();
+        for (int p=0; p<2; p++) {
+            pipeline_start_series(&pipelines[p]);
+            pipeline_submit_message(&pipelines[p], header, strlen(header));
+            pipeline_submit_files(&pipelines[p], names, numbers, nfiles);
+            pipeline_submit_message(&pipelines[p], end, strlen(end));
+        }
+        double elapsed[2];
+        for (int p=0; p<2; p++) {
+            pthread_join(threads[p], NULL);
+            elapsed[p] = receivers[p].end - start;
+            frames_per_second[p][round] = receivers[p].sink.frames / elapsed[p];
+            errors += nfiles - receivers[p].sink.frames;
+        }
+        fairness[round] = elapsed[0] < elapsed[1] ? elapsed[0] / elapsed[1] : elapsed[1] / elapsed[0];
+    }
+    report(name, "first_frames_per_second", median(frames_per_second[0], ROUNDS), "1/s");
+    report(name, "second_frames_per_second", median(frames_per_second[1], ROUNDS), "1/s");
+    report(name, "fairness", median(fairness, ROUNDS), "");
+    report(name, "errors", errors, "");
+
+    readers_close(&readers);
+    for (int p=0; p<2; p++) {
+        pipeline_close(&pipelines[p]);
+        output_close(&outputs[p]);
+        zmq_close(pulls[p]);
+        pool_close(&pools[p]);
+        rmdir(dirs[p]);
+    }
+    zmq_ctx_term(context);
+    free(file);
+    free(image);
+}
+
+// frames of the placement benchmark go out for about this long per variant
+#define PLACEMENT_SECONDS 2.0
+
+typedef struct
+{
+    void* socket;
+    int nframes;
+    // time every frame was received at, by frame number
+    double* received;
+    int frames;
+} LatencySink;
+
+// Takes the receive times of the images until series_end, at SCHED_FIFO if permitted
+static void* receive_latencies(void* arg)
+{
+    LatencySink* sink = arg;
+    struct sched_param param = {.sched_priority = 60};
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    sink->frames = 0;
+    while (1) {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, sink->socket, 0) < 0) {
+            zmq_msg_close(&msg);
+            break;
+        }
+        const double t = now();
+        const char* data = zmq_msg_data(&msg);
+        const size_t size = zmq_msg_size(&msg);
+        const int end = memmem(data, size, "series_end", 10) != NULL;
+        const char* frame = memmem(data, size, "\"frame\": ", 9);
+        if (frame) {
+            const int n = atoi(frame + 9);
+            if (n >= 0 && n < sink->nframes) {
+                sink->received[n] = t;
+                sink->frames++;
+            }
+        }
+        while (zmq_msg_more(&msg)) {
+            zmq_msg_close(&msg);
+            zmq_msg_init(&msg);
+            zmq_msg_recv(&msg, sink->socket, 0);
+        }
+        zmq_msg_close(&msg);
+        if (end) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    Pipeline* pipeline;
+    const char* dir;
+    const char* file;
+    size_t file_size;
+    int nframes;
+    double period;
+    // time every frame was submitted at
+    double* submitted;
+} Feeder;
+
+// Writes and submits one file per period like the DCU and the control loop would
+static void* feed_frames(void* arg)
+{
+    Feeder* feeder = arg;
+    placement_apply(THREAD_CONTROL, "feeder");
+    const char* header = "{\"htype\": \"header\"}";
+    const char* end = "{\"htype\": \"series_end\"}";
+    pipeline_start_series(feeder->pipeline);
+    pipeline_submit_message(feeder->pipeline, header, strlen(header));
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i=0; i<feeder->nframes; i++) {
+        next.tv_nsec += feeder->period * 1e9;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        char filename[32];
+        char path[512];
+        snprintf(filename, sizeof(filename), "frame_%05d.tif", i);
+        snprintf(path, sizeof(path), "%s/%s", feeder->dir, filename);
+        write_file(path, feeder->file, feeder->file_size);
+        const char* names[1] = {filename};
+        feeder->submitted[i] = now();
+        pipeline_submit_files(feeder->pipeline, names, &i, 1);
+    }
+    pipeline_submit_message(feeder->pipeline, end, strlen(end));
+    return NULL;
+}
+
+static volatile int hogs_running;
+
+static void* hog(void* arg)
+{
+    volatile uint64_t spins = 0;
+    while (hogs_running) {
+        spins++;
+    }
+    return NULL;
+}
+
+// NUMA node of a core, from the nodeN link in its sysfs directory
+static int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    int node = -1;
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return node;
+}
+
+// Latency of paced frames from the submission of the file to the receiver, with one
+// thread spinning per core next to the streamer. Without placement the streamer threads
+// compete with them, with placement they are pinned to the upper half of the cores
+// (all of them on a single core), run with SCHED_FIFO, the process is locked into
+// memory and the pool is bound to the node of the cores and faulted in up front. The
+// receiver runs with SCHED_FIFO in both cases, so only the streamer differs.
+static void bench_placement(const Detector* detector, int placed)
+{
+    char name[64];
+    snprintf(name, sizeof(name), placed ? "placement_%s" : "placement_off_%s", detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* file = malloc(TIF_HEADER_SIZE + nelements * sizeof(int32_t));
+    size_t file_size = make_tif(file, image, detector->width, detector->height);
+    // well below what a core can load and send, at most 250 MB/s and 500 Hz, so the
+    // latency shows the scheduling and not a backlog
+    const double period = file_size / 250e6 > 0.002 ? file_size / 250e6 : 0.002;
+    int nframes = PLACEMENT_SECONDS / period;
+    nframes = nframes < 100 ? 100 : nframes;
+    char* dir = make_dir();
+
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    const int ncpus = CPU_COUNT(&allowed);
+    PlacementConfig placement_config;
+    memset(&placement_config, 0, sizeof(placement_config));
+    int numa_node = -1;
+    if (placed) {
+        cpu_set_t upper;
+        CPU_ZERO(&upper);
+        for (int cpu=CPU_SETSIZE - 1, n=0; cpu>=0 && n<(ncpus + 1) / 2; cpu--) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_SET(cpu, &upper);
+                numa_node = cpu_node(cpu);
+                n++;
+            }
+        }
+        for (int role=0; role<THREAD_ROLES; role++) {
+            placement_config.cpus[role] = upper;
+        }
+        placement_config.realtime_priority = 50;
+        placement_config.lock_all = 1;
+        placement_init(&placement_config);
+    }
+
+    PipelineConfig config;
+    config.folder = dir;
+    config.file_ending = "tif";
+    config.nworkers = 4;
+    config.batch_size = 16;
+    config.direct = 0;
+    config.decode = 0;
+    config.compression = COMPRESSION_NONE;
+    config.timestamps = 0;
+    config.send_batch = 1;
+    config.send_batch_ms = 0;
+    config.frame_stats = 0;
+    config.saturation = 1048575;
+    config.header_format = HEADER_JSON;
+    config.name = NULL;
+    PoolConfig pool_config = {64, 0, 0, numa_node, POOL_WAIT, 0};
+    Pool pool;
+    pool_init(&pool, &pool_config);
+    pool_allocate(&pool, pipeline_buffer_size(&config, nelements, sizeof(int32_t), file_size));
+    void* context = zmq_ctx_new();
+    placement_apply_context(context);
+    OutputConfig output_config = {{"tcp://127.0.0.1:*"}, 1, OUTPUT_ROUND_ROBIN, 1, 0, 0};
+    Output output;
+    output_init(&output, &output_config, context);
+    char endpoint[256];
+    size_t length = sizeof(endpoint);
+    zmq_getsockopt(output.endpoints[0].socket, ZMQ_LAST_ENDPOINT, endpoint, &length);
+    void* pull = zmq_socket(context, ZMQ_PULL);
+    zmq_connect(pull, endpoint);
+    Readers readers;
+    readers_init(&readers, &config);
+    Pipeline pipeline;
+    pipeline_init(&pipeline, pool_config.depth - config.nworkers - 1, &config, &readers, &pool,
+                  &output, NULL, NULL, NULL, NULL);
+
+    pthread_t hogs[ncpus];
+    hogs_running = 1;
+    for (int i=0; i<ncpus; i++) {
+        pthread_create(&hogs[i], NULL, hog, NULL);
+    }
+    double* submitted = calloc(nframes, sizeof(double));
+    double* received = calloc(nframes, sizeof(double));
+    LatencySink sink = {pull, nframes, received, 0};
+    Feeder feeder = {&pipeline, dir, file, file_size, nframes, period, submitted};
+    pthread_t receiver_thread;
+    pthread_t feeder_thread;
+    pthread_create(&receiver_thread, NULL, receive_latencies, &sink);
+    pthread_create(&feeder_thread, NULL, feed_frames, &feeder);
+    pthread_join(feeder_thread, NULL);
+    pthread_join(receiver_thread, NULL);
+    hogs_running = 0;
+    for (int i=0; i<ncpus; i++) {
+        pthread_join(hogs[i], NULL);
+    }
+
+    double* latencies = malloc(nframes * sizeof(double));
+    int n = 0;
+    for (int i=0; i<nframes; i++) {
+        if (received[i] > 0.0) {
+            latencies[n++] = (received[i] - submitted[i]) * 1e6;
+        }
+    }
+    qsort(latencies, n, sizeof(double), compare_double);
+    if (n > 0) {
+        report(name, "latency_p50", latencies[n / 2], "us");
+        report(name, "latency_p99", latencies[(int)(n * 0.99)], "us");
+        report(name, "latency_max", latencies[n - 1], "us");
+    }
+    report(name, "frames", n, "");
+    report(name, "errors", nframes - n, "");
+
+    readers_close(&readers);
+    pipeline_close(&pipeline);
+    output_close(&output);
+    zmq_close(pull);
+    zmq_ctx_term(context);
+    pool_close(&pool);
+    if (placed) {
+        placement_close();
+        munlockall();
+    }
+    rmdir(dir);
+    free(latencies);
+    free(submitted);
+    free(received);
+    free(file);
+    free(image);
+}
+
+// The receiver library against a PUSH socket on the loopback interface, plain images
+// handed out as received or cbf images decoded by nthreads threads
+static void bench_receiver(const Detector* detector, int cbf, int nthreads)
+{
+    char name[64];
+    char metric[64];
+    snprintf(name, sizeof(name), cbf ? "receiver_cbf_%s" : "receiver_%s", detector->name);
+    const int nelements = detector->width * detector->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, detector->width, detector->height);
+    char* blob = malloc(nelements * 7 + 4096);
+    size_t size = cbf ? make_cbf(blob, image, detector->width, detector->height) :
+                  nelements * sizeof(int32_t);
+    if (!cbf) {
+        memcpy(blob, image, size);
+    }
+    void* context = zmq_ctx_new();
+    void* push = zmq_socket(context, ZMQ_PUSH);
+    zmq_bind(push, "tcp://127.0.0.1:*");
+    char endpoint[256];
+    size_t length = sizeof(endpoint);
+    zmq_getsockopt(push, ZMQ_LAST_ENDPOINT, endpoint, &length);
+    ReceiverConfig config = {{endpoint}, 1, 64, nthreads, 0};
+    Receiver receiver;
+    receiver_init(&receiver, &config);
+    // the receiver decodes what it gets, cbf images are as large as they are
+    const int count = files_per_round(nelements * sizeof(int32_t));
+    const char* end = "{\"htype\": \"series_end\"}";
+
+    double frames_per_second[ROUNDS];
+    int errors = 0;
+    for (int round=0; round<ROUNDS; round++) {
+        double start = now();
+        int received = 0;
+        int sent = 0;
+        int done = 0;
+        while (!done) {
+            // keeps the socket busy without waiting for the receiver
+            while (sent < count && sent - received < 32) {
+                char header[256];
+                int header_length = snprintf(header, sizeof(header),
+                                             "{\"htype\": \"image\",\"frame\": %d,"
+                                             "\"shape\": [%d,%d],\"type\": \"int32\","
+                                             "\"compression\": \"%s\"}", sent,
+                                             detector->height, detector->width, cbf ? "cbf" : "");
+                zmq_send(push, header, header_length, ZMQ_SNDMORE);
+                zmq_msg_t msg;
+                zmq_msg_init_data(&msg, blob, size, NULL, NULL);
+                zmq_msg_send(&msg, push, 0);
+                if (++sent == count) {
+                    zmq_send(push, end, strlen(end), 0);
+                }
+            }
+            ReceivedMessage* message = receiver_next(&receiver, 1000);
+            if (!message) {
+                errors++;
+                break;
+            }
+            if (message->type == MESSAGE_IMAGE) {
+                received++;
+                // the first pixels came through
+                errors += message->error || message->size != nelements * sizeof(int32_t) ||
+                          memcmp(message->data, image, sizeof(int32_t)) != 0;
+            }
+            done = message->type == MESSAGE_END;
+            receiver_release(&receiver, message);
+        }
+        frames_per_second[round] = received / (now() - start);
+        errors += count - received;
+    }
+    double fps = median(frames_per_second, ROUNDS);
+    snprintf(metric, sizeof(metric), "frames_per_second_%d_threads", nthreads);
+    report(name, cbf ? metric : "frames_per_second", fps, "1/s");
+    snprintf(metric, sizeof(metric), "throughput_%d_threads", nthreads);
+    report(name, cbf ? metric : "throughput", fps * nelements * sizeof(int32_t) / 1e9, "GB/s");
+    report(name, "errors", errors, "");
+    receiver_close(&receiver);
+    zmq_close(push);
+    zmq_ctx_term(context);
+    free(blob);
+    free(image);
+}
+
+int main(int argc, char* argv[])
+{
+    g_argc = argc;
+    g_argv = argv;
+    const int nelements = WIDTH * HEIGHT;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    uint8_t* compressed = malloc(nelements * 7);
+    fill_image(image, WIDTH, HEIGHT);
+    long size = cbf_encode(image, nelements, compressed);
+
+    if (selected("cbf_decode")) {
+        report("cbf_encode", "compression_ratio", nelements * sizeof(int32_t) / (double)size, "");
+        bench_cbf_decode("cbf_decode_scalar", cbf_decode_scalar, compressed, size, image, nelements);
+        bench_cbf_decode("cbf_decode", cbf_decode, compressed, size, image, nelements);
+    }
+#ifdef HAVE_LZ4
+    if (selected("bslz4")) {
+        bench_bslz4(image, nelements);
+    }
+#endif
+
+    if (selected("frame_stats")) {
+        FrameStats scalar;
+        FrameStats vector;
+        memset(&scalar, 0, sizeof(FrameStats));
+        memset(&vector, 0, sizeof(FrameStats));
+        bench_framestats("frame_stats_scalar", framestats_compute_scalar, image, WIDTH, HEIGHT,
+                         &scalar);
+        bench_framestats("frame_stats", framestats_compute, image, WIDTH, HEIGHT, &vector);
+        if (memcmp(&scalar, &vector, sizeof(FrameStats)) != 0) {
+            printf("frame_stats: vectorized result differs from the scalar one\n");
+        }
+    }
+
+    if (selected("correction")) {
+        int32_t* mask = malloc(nelements * sizeof(int32_t));
+        float* flatfield = malloc(nelements * sizeof(float));
+        srand(42);
+        for (int i=0; i<nelements; i++) {
+            mask[i] = rand() % 1000 == 0;
+            flatfield[i] = 0.95f + 0.1f * rand() / RAND_MAX;
+        }
+        CorrectionConfig correction_config = {NULL, NULL, "bench"};
+        Correction gaps;
+        Correction flat;
+        correction_init(&gaps, &correction_config);
+        correction_build(&gaps, WIDTH, HEIGHT, mask, NULL);
+        correction_init(&flat, &correction_config);
+        correction_build(&flat, WIDTH, HEIGHT, mask, flatfield);
+        int32_t* scalar = malloc(nelements * sizeof(int32_t));
+        int32_t* vector = malloc(nelements * sizeof(int32_t));
+        bench_correction("correction_mask_scalar", correction_apply_scalar, &gaps, image, scalar,
+                         WIDTH, HEIGHT);
+        bench_correction("correction_mask", correction_apply, &gaps, image, vector, WIDTH, HEIGHT);
+        if (memcmp(scalar, vector, nelements * sizeof(int32_t)) != 0) {
+            printf("correction_mask: vectorized result differs from the scalar one\n");
+        }
+        bench_correction("correction_flatfield_scalar", correction_apply_scalar, &flat, image,
+                         scalar, WIDTH, HEIGHT);
+        bench_correction("correction_flatfield", correction_apply, &flat, image, vector, WIDTH,
+                         HEIGHT);
+        if (memcmp(scalar, vector, nelements * sizeof(int32_t)) != 0) {
+            printf("correction_flatfield: vectorized result differs from the scalar one\n");
+        }
+        correction_close(&gaps);
+        correction_close(&flat);
+        free(scalar);
+        free(vector);
+        free(mask);
+        free(flatfield);
+    }
+
+    if (selected("integration")) {
+        // beam in the middle of the detector, 1 Angstrom at 300 mm
+        Geometry geometry = {WIDTH / 2.0, HEIGHT / 2.0, 300.0, 172.0, 1.0, 1000};
+        double start = now();
+        IntegrationLut* lut = integrate_build(&geometry, WIDTH, HEIGHT);
+        report("integration_build", "time", (now() - start) * 1e3, "ms");
+        float* scalar = malloc(2 * geometry.bins * sizeof(float));
+        float* vector = malloc(2 * geometry.bins * sizeof(float));
+        bench_integrate("integration_scalar", integrate_frame_scalar, lut, image, scalar);
+        bench_integrate("integration", integrate_frame, lut, image, vector);
+        if (memcmp(scalar, vector, 2 * geometry.bins * sizeof(float)) != 0) {
+            printf("integration: vectorized result differs from the scalar one\n");
+        }
+        integrate_free(lut);
+        free(scalar);
+        free(vector);
+    }
+
+    if (selected("header")) {
+        bench_header();
+    }
+
+    if (selected("reorder")) {
+        bench_reorder();
+    }
+
+    if (selected("queue")) {
+        bench_legacy_single();
+        bench_queue_single("queue_spsc", QUEUE_SPSC);
+        bench_queue_single("queue_mpmc", QUEUE_MPMC);
+        bench_legacy_threads();
+        bench_queue_threads("queue_spsc", "spsc_threads", QUEUE_SPSC, QUEUE_SIZE, 1);
+        bench_queue_threads("queue_mpmc", "spsc_threads", QUEUE_MPMC, QUEUE_SIZE, 1);
+        // small queue so producers and consumers block a lot
+        bench_queue_threads("queue_mpmc", "mpmc_threads", QUEUE_MPMC, 16, STRESS_THREADS);
+        bench_queue_roundtrip("queue_spsc", QUEUE_SPSC);
+        bench_queue_roundtrip("queue_mpmc", QUEUE_MPMC);
+    }
+
+    for (int i=0; i<NDETECTORS; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "tif_load_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_tif_load(&detectors[i]);
+        }
+        snprintf(name, sizeof(name), "cbf_header_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_cbf_header(&detectors[i]);
+        }
+        snprintf(name, sizeof(name), "zmq_send_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_zmq_send(&detectors[i]);
+        }
+        snprintf(name, sizeof(name), "end_to_end_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_end_to_end(&detectors[i], 1, HEADER_JSON);
+        }
+        snprintf(name, sizeof(name), "end_to_end_binary_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_end_to_end(&detectors[i], 1, HEADER_BINARY);
+        }
+        snprintf(name, sizeof(name), "end_to_end_batched_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_end_to_end(&detectors[i], 16, HEADER_JSON);
+        }
+        snprintf(name, sizeof(name), "shared_readers_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_shared_readers(&detectors[i]);
+        }
+        snprintf(name, sizeof(name), "placement_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_placement(&detectors[i], 0);
+            bench_placement(&detectors[i], 1);
+        }
+        snprintf(name, sizeof(name), "receiver_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_receiver(&detectors[i], 0, 0);
+        }
+        snprintf(name, sizeof(name), "receiver_cbf_%s", detectors[i].name);
+        if (selected(name)) {
+            bench_receiver(&detectors[i], 1, 1);
+            bench_receiver(&detectors[i], 1, 4);
+        }
+    }
+
+    free(compressed);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbf.h"
+#include "logger.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+static const char binary_marker[4] = {0x0c, 0x1a, 0x04, (char)0xd5};
+static const char section_start[] = "--CIF-BINARY-FORMAT-SECTION--";
+
+static int has_key(const char* line, const char* eol, const char* key, const char** value)
+{
+    size_t length = strlen(key);
+    if ((size_t)(eol - line) < length || strncmp(line, key, length) != 0) {
+        return 0;
+    }
+    *value = line + length;
+    return 1;
+}
+
+int parse_cbf(const char* data, size_t size, CbfInfo* info)
+{
+    const char* start = memmem(data, size, section_start, strlen(section_start));
+    if (!start) {
+        log_error("Bad header - cannot find binary section");
+        return -1;
+    }
+    const char* end = memmem(start, size - (start - data), binary_marker, sizeof(binary_marker));
+    if (!end) {
+        log_error("Bad header - cannot find binary data");
+        return -1;
+    }
+
+    memset(info, 0, sizeof(CbfInfo));
+    int byte_offset = 0;
+    const char* line = start;
+    while (line < end) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        const char* value;
+        if (has_key(line, eol, "X-Binary-Size:", &value)) {
+            info->binary_size = strtoul(value, NULL, 10);
+        }
+        else if (has_key(line, eol, "X-Binary-Number-of-Elements:", &value)) {
+            info->nelements = strtol(value, NULL, 10);
+        }
+        else if (has_key(line, eol, "X-Binary-Size-Fastest-Dimension:", &value)) {
+            info->width = strtol(value, NULL, 10);
+        }
+        else if (has_key(line, eol, "X-Binary-Size-Second-Dimension:", &value)) {
+            info->height = strtol(value, NULL, 10);
+        }
+        else if (memmem(line, eol - line, "x-CBF_BYTE_OFFSET", 17)) {
+            byte_offset = 1;
+        }
+        line = eol + 1;
+    }
+    info->data_offset = end + sizeof(binary_marker) - data;
+
+    if (!byte_offset) {
+        log_error("Only byte offset compressed cbf files are supported");
+        return -1;
+    }
+    if (info->width <= 0 || info->height <= 0) {
+        log_error("Bad header - missing image dimensions");
+        return -1;
+    }
+    if (info->nelements == 0) {
+        info->nelements = info->width * info->height;
+    }
+    // the blob is sized by the elements and the shape comes from the dimensions
+    if ((long long)info->width * info->height != info->nelements) {
+        log_error("Number of elements does not match the image dimensions");
+        return -1;
+    }
+    if (info->data_offset + info->binary_size > size) {
+        log_error("Binary data exceeds file size");
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes the values begin to end, deltas are summed up as unsigned to wrap around like the
+// encoder does
+static inline int decode_range(const uint8_t* src, size_t size, size_t* pos,
+                               int32_t* out, int begin, int end, uint32_t* value)
+{
+    size_t p = *pos;
+    uint32_t v = *value;
+    for (int i=begin; i<end; i++) {
+        if (p >= size) {
+            return -1;
+        }
+        int8_t delta8 = src[p++];
+        if (delta8 != -128) {
+            v += delta8;
+        }
+        else {
+            if (p + 2 > size) {
+                return -1;
+            }
+            int16_t delta16;
+            memcpy(&delta16, src + p, 2);
+            p += 2;
+            if (delta16 != -32768) {
+                v += delta16;
+            }
+            else {
+                if (p + 4 > size) {
+                    return -1;
+                }
+                int32_t delta32;
+                memcpy(&delta32, src + p, 4);
+                p += 4;
+                if (delta32 != INT32_MIN) {
+                    v += delta32;
+                }
+                else {
+                    if (p + 8 > size) {
+                        return -1;
+                    }
+                    int64_t delta64;
+                    memcpy(&delta64, src + p, 8);
+                    p += 8;
+                    v += (uint32_t)delta64;
+                }
+            }
+        }
+        out[i] = v;
+    }
+    *pos = p;
+    *value = v;
+    return 0;
+}
+
+long cbf_decode_scalar(const uint8_t* src, size_t size, int32_t* out, int nelements)
+{
+    size_t pos = 0;
+    uint32_t value = 0;
+    if (decode_range(src, size, &pos, out, 0, nelements, &value) != 0) {
+        return -1;
+    }
+    return pos;
+}
+
+// Runs of one byte deltas are sign extended and prefix summed in registers, as soon as a
+// block contains an escape byte the values up to and including the escaped one are decoded
+// with the scalar code.
+long cbf_decode(const uint8_t* src, size_t size, int32_t* out, int nelements)
+{
+    size_t pos = 0;
+    uint32_t value = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i escape = _mm256_set1_epi8((char)0x80);
+    const __m256i last_of_low = _mm256_set1_epi32(3);
+    const __m256i last = _mm256_set1_epi32(7);
+    while (i + 32 <= nelements && pos + 32 <= size) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(src + pos));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, escape));
+        if (mask) {
+            int end = i + __builtin_ctz(mask) + 1;
+            if (decode_range(src, size, &pos, out, i, end, &value) != 0) {
+                return -1;
+            }
+            i = end;
+            continue;
+        }
+        __m256i base = _mm256_set1_epi32(value);
+        for (int k=0; k<4; k++) {
+            __m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(src + pos + 8*k)));
+            // prefix sum inside both 128 bit lanes, then carry the lower lane into the upper one
+            x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+            x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+            __m256i carry = _mm256_permutevar8x32_epi32(x, last_of_low);
+            x = _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), carry, 0xF0));
+            x = _mm256_add_epi32(x, base);
+            _mm256_storeu_si256((__m256i*)(out + i + 8*k), x);
+            base = _mm256_permutevar8x32_epi32(x, last);
+        }
+        value = out[i + 31];
+        pos += 32;
+        i += 32;
+    }
+#elif defined(__SSE4_1__)
+    const __m128i escape = _mm_set1_epi8((char)0x80);
+    while (i + 16 <= nelements && pos + 16 <= size) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + pos));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, escape));
+        if (mask) {
+            int end = i + __builtin_ctz(mask) + 1;
+            if (decode_range(src, size, &pos, out, i, end, &value) != 0) {
+                return -1;
+            }
+            i = end;
+            continue;
+        }
+        __m128i base = _mm_set1_epi32(value);
+        __m128i deltas[4] = {_mm_cvtepi8_epi32(bytes),
+                             _mm_cvtepi8_epi32(_mm_srli_si128(bytes, 4)),
+                             _mm_cvtepi8_epi32(_mm_srli_si128(bytes, 8)),
+                             _mm_cvtepi8_epi32(_mm_srli_si128(bytes, 12))};
+        for (int k=0; k<4; k++) {
+            __m128i x = deltas[k];
+            x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi32(x, base);
+            _mm_storeu_si128((__m128i*)(out + i + 4*k), x);
+            base = _mm_shuffle_epi32(x, 0xFF);
+        }
+        value = out[i + 15];
+        pos += 16;
+        i += 16;
+    }
+#endif
+    if (decode_range(src, size, &pos, out, i, nelements, &value) != 0) {
+        return -1;
+    }
+    return pos;
+}
+
+long cbf_encode(const int32_t* src, int nelements, uint8_t* dst)
+{
+    uint8_t* p = dst;
+    int32_t previous = 0;
+    for (int i=0; i<nelements; i++) {
+        int32_t delta = (int32_t)((uint32_t)src[i] - (uint32_t)previous);
+        previous = src[i];
+        if (delta > -128 && delta < 128) {
+            *p++ = (uint8_t)delta;
+        }
+        else if (delta > -32768 && delta < 32768) {
+            int16_t delta16 = delta;
+            *p++ = 0x80;
+            memcpy(p, &delta16, 2);
+            p += 2;
+        }
+        else {
+            int16_t escape16 = -32768;
+            *p++ = 0x80;
+            memcpy(p, &escape16, 2);
+            memcpy(p + 2, &delta, 4);
+            p += 6;
+        }
+    }
+    return p - dst;
+}
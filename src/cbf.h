@@ -0,0 +1,36 @@
+#ifndef CBF_H
+#define CBF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// https://www.iucr.org/__data/iucr/cifdic_html/2/cif_img.dic/Ccompression.html
+
+typedef struct
+{
+    // X-Binary-Size-Fastest-Dimension
+    int width;
+    // X-Binary-Size-Second-Dimension
+    int height;
+    // X-Binary-Number-of-Elements
+    int nelements;
+    // X-Binary-Size, number of compressed bytes
+    size_t binary_size;
+    // offset of the compressed data, right after the binary section marker
+    size_t data_offset;
+} CbfInfo;
+
+// Parses the mime header of the binary section, the text before it is skipped.
+// Returns -1 if the file is malformed or not byte offset compressed.
+int parse_cbf(const char* data, size_t size, CbfInfo* info);
+
+// Byte offset decompression of nelements values into out.
+// Returns the number of compressed bytes consumed or -1 if src is too short.
+long cbf_decode(const uint8_t* src, size_t size, int32_t* out, int nelements);
+long cbf_decode_scalar(const uint8_t* src, size_t size, int32_t* out, int nelements);
+
+// Byte offset compression, dst needs room for 7 bytes per value in the worst case.
+// Returns the number of compressed bytes.
+long cbf_encode(const int32_t* src, int nelements, uint8_t* dst);
+
+#endif // CBF_H
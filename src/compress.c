@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "compress.h"
+#include "logger.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// block size of the bitshuffle filter
+#define TARGET_BLOCK_SIZE 8192
+#define BLOCKED_MULT 8
+#define HEADER_SIZE 12
+
+// Transposes a 8x8 bit matrix, byte k of the result holds bit k of all input bytes
+#define TRANS_BIT_8X8(x, t) {                                  \
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;            \
+        x = x ^ t ^ (t << 7);                                  \
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;           \
+        x = x ^ t ^ (t << 14);                                 \
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;           \
+        x = x ^ t ^ (t << 28);                                 \
+    }
+
+// Groups byte b of every element into plane b
+static void trans_byte_elem(const uint8_t* in, uint8_t* out, size_t n, size_t elem_size)
+{
+    size_t i = 0;
+#if defined(__SSSE3__)
+    if (elem_size == 4) {
+        const __m128i mask = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        for (; i + 16 <= n; i += 16) {
+            // every register holds bytes 0, 1, 2, 3 of four elements
+            __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 4*i)), mask);
+            __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 4*i + 16)), mask);
+            __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 4*i + 32)), mask);
+            __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 4*i + 48)), mask);
+            __m128i ab0 = _mm_unpacklo_epi32(a, b);
+            __m128i ab1 = _mm_unpackhi_epi32(a, b);
+            __m128i cd0 = _mm_unpacklo_epi32(c, d);
+            __m128i cd1 = _mm_unpackhi_epi32(c, d);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi64(ab0, cd0));
+            _mm_storeu_si128((__m128i*)(out + n + i), _mm_unpackhi_epi64(ab0, cd0));
+            _mm_storeu_si128((__m128i*)(out + 2*n + i), _mm_unpacklo_epi64(ab1, cd1));
+            _mm_storeu_si128((__m128i*)(out + 3*n + i), _mm_unpackhi_epi64(ab1, cd1));
+        }
+    }
+#endif
+    for (; i<n; i++) {
+        for (size_t b=0; b<elem_size; b++) {
+            out[b*n + i] = in[i*elem_size + b];
+        }
+    }
+}
+
+static void trans_elem_byte(const uint8_t* in, uint8_t* out, size_t n, size_t elem_size)
+{
+    for (size_t i=0; i<n; i++) {
+        for (size_t b=0; b<elem_size; b++) {
+            out[i*elem_size + b] = in[b*n + i];
+        }
+    }
+}
+
+// Bit k of byte j in a group of 8 bytes of a plane goes to bit j of row k
+static void trans_bit_byte(const uint8_t* in, uint8_t* out, size_t n, size_t elem_size)
+{
+    const size_t row = n / 8;
+    for (size_t b=0; b<elem_size; b++) {
+        const uint8_t* plane = in + b*n;
+        uint8_t* rows = out + b*8*row;
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 32 <= n; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(plane + i));
+            for (int k=7; k>=0; k--) {
+                uint32_t bits = _mm256_movemask_epi8(x);
+                memcpy(rows + k*row + i/8, &bits, 4);
+                x = _mm256_slli_epi64(x, 1);
+            }
+        }
+#elif defined(__SSE2__)
+        for (; i + 16 <= n; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(plane + i));
+            for (int k=7; k>=0; k--) {
+                uint16_t bits = _mm_movemask_epi8(x);
+                memcpy(rows + k*row + i/8, &bits, 2);
+                x = _mm_slli_epi64(x, 1);
+            }
+        }
+#endif
+        for (; i<n; i+=8) {
+            uint64_t x, t;
+            memcpy(&x, plane + i, 8);
+            TRANS_BIT_8X8(x, t);
+            for (int k=0; k<8; k++) {
+                rows[k*row + i/8] = x >> (8*k);
+            }
+        }
+    }
+}
+
+static void trans_byte_bit(const uint8_t* in, uint8_t* out, size_t n, size_t elem_size)
+{
+    const size_t row = n / 8;
+    for (size_t b=0; b<elem_size; b++) {
+        const uint8_t* rows = in + b*8*row;
+        uint8_t* plane = out + b*n;
+        for (size_t i=0; i<n; i+=8) {
+            uint64_t x = 0;
+            uint64_t t;
+            for (int k=0; k<8; k++) {
+                x |= (uint64_t)rows[k*row + i/8] << (8*k);
+            }
+            TRANS_BIT_8X8(x, t);
+            memcpy(plane + i, &x, 8);
+        }
+    }
+}
+
+void bitshuffle(const void* in, void* out, size_t nelements, size_t elem_size)
+{
+    uint8_t planes[nelements * elem_size];
+    trans_byte_elem(in, planes, nelements, elem_size);
+    trans_bit_byte(planes, out, nelements, elem_size);
+}
+
+void bitunshuffle(const void* in, void* out, size_t nelements, size_t elem_size)
+{
+    uint8_t planes[nelements * elem_size];
+    trans_byte_bit(in, planes, nelements, elem_size);
+    trans_elem_byte(planes, out, nelements, elem_size);
+}
+
+static size_t block_size(size_t elem_size)
+{
+    size_t size = TARGET_BLOCK_SIZE / elem_size;
+    return size - size % BLOCKED_MULT;
+}
+
+size_t bslz4_bound(size_t nelements, size_t elem_size)
+{
+    const size_t block_bytes = block_size(elem_size) * elem_size;
+    // lz4 worst case plus the size of every block
+    size_t nblocks = nelements / block_size(elem_size) + 1;
+    return HEADER_SIZE + nblocks * (4 + block_bytes + block_bytes / 255 + 16);
+}
+
+#ifdef HAVE_LZ4
+
+static void write_uint64_be(uint8_t* dst, uint64_t value)
+{
+    uint32_t high = htonl(value >> 32);
+    uint32_t low = htonl(value & 0xffffffff);
+    memcpy(dst, &high, 4);
+    memcpy(dst + 4, &low, 4);
+}
+
+static uint64_t read_uint64_be(const uint8_t* src)
+{
+    uint32_t high;
+    uint32_t low;
+    memcpy(&high, src, 4);
+    memcpy(&low, src + 4, 4);
+    return ((uint64_t)ntohl(high) << 32) | ntohl(low);
+}
+
+long bslz4_compress(const void* src, size_t nelements, size_t elem_size,
+                    void* dst, size_t capacity)
+{
+    const uint8_t* in = src;
+    uint8_t* out = dst;
+    const size_t block = block_size(elem_size);
+    if (capacity < bslz4_bound(nelements, elem_size)) {
+        log_error("bslz4 output buffer too small");
+        return -1;
+    }
+    write_uint64_be(out, nelements * elem_size);
+    uint32_t be_block = htonl(block * elem_size);
+    memcpy(out + 8, &be_block, 4);
+    size_t pos = HEADER_SIZE;
+
+    uint8_t shuffled[block * elem_size];
+    size_t i = 0;
+    while (i + BLOCKED_MULT <= nelements) {
+        size_t count = nelements - i < block ? nelements - i : block;
+        count -= count % BLOCKED_MULT;
+        bitshuffle(in + i*elem_size, shuffled, count, elem_size);
+        int size = LZ4_compress_default((const char*)shuffled, (char*)out + pos + 4,
+                                        count * elem_size, capacity - pos - 4);
+        if (size <= 0) {
+            log_error("lz4 compression failed");
+            return -1;
+        }
+        uint32_t be_size = htonl(size);
+        memcpy(out + pos, &be_size, 4);
+        pos += 4 + size;
+        i += count;
+    }
+    // leftover elements are not compressed
+    memcpy(out + pos, in + i*elem_size, (nelements - i) * elem_size);
+    pos += (nelements - i) * elem_size;
+    return pos;
+}
+
+long bslz4_decompress(const void* src, size_t size, void* dst, size_t capacity,
+                      size_t elem_size)
+{
+    const uint8_t* in = src;
+    uint8_t* out = dst;
+    if (size < HEADER_SIZE) {
+        return -1;
+    }
+    uint64_t total = read_uint64_be(in);
+    uint32_t be_block;
+    memcpy(&be_block, in + 8, 4);
+    size_t block = ntohl(be_block) / elem_size;
+    if (total > capacity || total % elem_size != 0 || block == 0 || block % BLOCKED_MULT != 0) {
+        return -1;
+    }
+    const size_t nelements = total / elem_size;
+    size_t pos = HEADER_SIZE;
+
+    uint8_t shuffled[block * elem_size];
+    size_t i = 0;
+    while (i + BLOCKED_MULT <= nelements) {
+        size_t count = nelements - i < block ? nelements - i : block;
+        count -= count % BLOCKED_MULT;
+        uint32_t be_size;
+        if (pos + 4 > size) {
+            return -1;
+        }
+        memcpy(&be_size, in + pos, 4);
+        uint32_t compressed = ntohl(be_size);
+        if (pos + 4 + compressed > size) {
+            return -1;
+        }
+        int rc = LZ4_decompress_safe((const char*)in + pos + 4, (char*)shuffled,
+                                     compressed, count * elem_size);
+        if (rc != (int)(count * elem_size)) {
+            return -1;
+        }
+        bitunshuffle(shuffled, out + i*elem_size, count, elem_size);
+        pos += 4 + compressed;
+        i += count;
+    }
+    size_t leftover = (nelements - i) * elem_size;
+    if (pos + leftover > size) {
+        return -1;
+    }
+    memcpy(out + i*elem_size, in + pos, leftover);
+    return total;
+}
+
+#endif
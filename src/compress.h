@@ -0,0 +1,29 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bitshuffle/LZ4 in the layout of the bitshuffle hdf5 filter, which is what the
+// Dectris detectors stream as "bslz4":
+// 8 byte big endian uncompressed size, 4 byte big endian block size in bytes,
+// then for every block a 4 byte big endian compressed size and the lz4 data of the
+// bitshuffled block. Elements that don't fill a multiple of 8 are copied as is.
+// https://github.com/kiyo-masui/bitshuffle
+
+// Transposes the bits of nelements, which has to be a multiple of 8. Meant for single
+// blocks, the intermediate result lives on the stack.
+void bitshuffle(const void* in, void* out, size_t nelements, size_t elem_size);
+void bitunshuffle(const void* in, void* out, size_t nelements, size_t elem_size);
+
+size_t bslz4_bound(size_t nelements, size_t elem_size);
+
+#ifdef HAVE_LZ4
+// Return the number of bytes written or -1 on error
+long bslz4_compress(const void* src, size_t nelements, size_t elem_size,
+                    void* dst, size_t capacity);
+long bslz4_decompress(const void* src, size_t size, void* dst, size_t capacity,
+                      size_t elem_size);
+#endif
+
+#endif // COMPRESS_H
@@ -0,0 +1,441 @@
+// PULL client for load tests with the simulator. Measures per series the delivered
+// frame rate, missing and out of order frames and the latency from the simulator
+// writing a frame to receiving it, taken from the timestamp in the first pixels.
+// Every series is summarised in one json line starting with {"series".
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <zmq.h>
+#include "cbf.h"
+#include "frameheader.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_ENDPOINTS 16
+
+typedef struct
+{
+    int number;
+    int frames;
+    size_t bytes;
+    // next frame number if the frames arrive in order
+    int expected;
+    int missing;
+    int out_of_order;
+    // frames the send policy of the streamer dropped according to series_end, -1 if unknown
+    int dropped;
+    double first;
+    double last;
+    // latency of every frame with a timestamp in microseconds
+    double* latencies;
+    int nlatencies;
+    int capacity;
+} Series;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void series_start(Series* series)
+{
+    series->number++;
+    series->frames = 0;
+    series->bytes = 0;
+    series->expected = 0;
+    series->missing = 0;
+    series->out_of_order = 0;
+    series->dropped = -1;
+    series->first = 0.0;
+    series->last = 0.0;
+    series->nlatencies = 0;
+}
+
+static void add_latency(Series* series, double latency)
+{
+    if (series->nlatencies == series->capacity) {
+        series->capacity = series->capacity ? 2 * series->capacity : 1024;
+        series->latencies = realloc(series->latencies, series->capacity * sizeof(double));
+    }
+    series->latencies[series->nlatencies++] = latency;
+}
+
+// Value of a json key like "frame": 12 or "compression": "cbf" in the image header
+static int header_int(const char* header, const char* key, int* value)
+{
+    const char* p = strstr(header, key);
+    return p && sscanf(p + strlen(key), " : %d", value) == 1;
+}
+
+static int header_string(const char* header, const char* key, char* value, int size)
+{
+    const char* p = strstr(header, key);
+    char format[32];
+    snprintf(format, sizeof(format), " : \"%%%d[^\"]\"", size - 1);
+    value[0] = '\0';
+    // an empty string doesn't match the format
+    return p && (sscanf(p + strlen(key), format, value) == 1 ||
+                 strstr(p + strlen(key), "\"\"") != NULL);
+}
+
+// Time the simulator wrote the frame, from the pixels of plain int32 or cbf images
+static int frame_timestamp(const char* header, const char* blob, size_t size, double* stamp)
+{
+    char compression[32];
+    char type[32];
+    int32_t pixels[3];
+    if (!header_string(header, "\"compression\"", compression, sizeof(compression))) {
+        return 0;
+    }
+    if (compression[0] == '\0') {
+        if (!header_string(header, "\"type\"", type, sizeof(type)) ||
+            strstr(type, "int32") == NULL || size < sizeof(pixels)) {
+            return 0;
+        }
+        memcpy(pixels, blob, sizeof(pixels));
+    }
+    else if (strcmp(compression, "cbf") == 0) {
+        CbfInfo info;
+        if (parse_cbf(blob, size, &info) != 0 ||
+            cbf_decode((const uint8_t*)blob + info.data_offset, info.binary_size, pixels, 3) < 0) {
+            return 0;
+        }
+    }
+    else {
+        return 0;
+    }
+    *stamp = pixels[0] + pixels[1] * 1e-6;
+    return 1;
+}
+
+static void add_frame(Series* series, const char* header, const char* blob, size_t size)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double t = now();
+    if (series->frames == 0) {
+        series->first = t;
+    }
+    series->last = t;
+    series->frames++;
+    series->bytes += size;
+
+    int frame;
+    if (header_int(header, "\"frame\"", &frame)) {
+        if (frame == series->expected) {
+            series->expected++;
+        }
+        else if (frame > series->expected) {
+            series->missing += frame - series->expected;
+            series->expected = frame + 1;
+        }
+        else {
+            // counted as missing when the later frames arrived
+            series->out_of_order++;
+            series->missing--;
+        }
+    }
+
+    double stamp;
+    if (frame_timestamp(header, blob, size, &stamp)) {
+        double received = (ts.tv_sec & 0x7fffffff) + ts.tv_nsec * 1e-9;
+        add_latency(series, (received - stamp) * 1e6);
+    }
+}
+
+static void series_report(Series* series, int nimages)
+{
+    // frames missing at the end are only known if the number of images is
+    if (nimages > series->expected) {
+        series->missing += nimages - series->expected;
+    }
+    double elapsed = series->last - series->first;
+    double rate = series->frames > 1 && elapsed > 0 ? (series->frames - 1) / elapsed : 0.0;
+    double throughput = series->frames > 1 && elapsed > 0 ?
+                        series->bytes * (series->frames - 1.0) / series->frames / elapsed / 1e9 : 0.0;
+    printf("{\"series\": %d, \"frames\": %d, \"missing\": %d, \"out_of_order\": %d, "
+           "\"frames_per_second\": %.1f, \"throughput_gb_s\": %.3f",
+           series->number, series->frames, series->missing, series->out_of_order,
+           rate, throughput);
+    if (series->dropped >= 0) {
+        printf(", \"dropped\": %d", series->dropped);
+    }
+    if (series->nlatencies > 0) {
+        double* l = series->latencies;
+        int n = series->nlatencies;
+        qsort(l, n, sizeof(double), compare_double);
+        printf(", \"latency_us\": {\"min\": %.0f, \"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f}",
+               l[0], l[n/2], l[(int)(n * 0.99)], l[n-1]);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+// Sends one command to the control port of the streamer and waits for the reply
+static int send_command(int sock, const char* command)
+{
+    char buffer[BUFFER_SIZE];
+    if (write(sock, command, strlen(command) + 1) == -1) {
+        printf("Could not send %s: %s\n", command, strerror(errno));
+        return -1;
+    }
+    int nb = read(sock, buffer, BUFFER_SIZE - 1);
+    if (nb <= 0) {
+        printf("No reply to %s\n", command);
+        return -1;
+    }
+    buffer[nb] = '\0';
+    printf("%s: %s\n", command, buffer);
+    return strstr(buffer, "OK") != NULL ? 0 : -1;
+}
+
+// Starts an exposure through the streamer like a beamline client would
+static int trigger(const char* address, int nimages, double rate)
+{
+    char host[64];
+    int port;
+    if (sscanf(address, "%63[^:]:%d", host, &port) != 2) {
+        printf("Address has to be host:port\n");
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(host);
+    server.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        printf("Error connecting to the streamer at %s\n", address);
+        return -1;
+    }
+    char command[64];
+    if (nimages > 0) {
+        snprintf(command, sizeof(command), "nimages %d", nimages);
+        if (send_command(sock, command) != 0) {
+            return -1;
+        }
+    }
+    if (rate > 0) {
+        snprintf(command, sizeof(command), "expperiod %f", 1.0 / rate);
+        if (send_command(sock, command) != 0) {
+            return -1;
+        }
+    }
+    // the streamer replaces the file name
+    if (send_command(sock, "exposure load_test") != 0) {
+        return -1;
+    }
+    return sock;
+}
+
+static void show_usage(const char* p)
+{
+  printf("\npilatus-consumer\n"
+         "\n"
+         "Usage: %s [-h]\n"
+         "    -e, --endpoint       Endpoint of the streamer (default tcp://127.0.0.1:9999), can be\n"
+         "                         given several times to receive from all outputs of the streamer\n"
+         "    -s, --series         Exit after this many series, 0 runs forever (default 0)\n"
+         "    -t, --trigger        Start an exposure through the control port of the streamer,\n"
+         "                         host:port, e.g. 127.0.0.1:8888. Measures one series unless\n"
+         "                         --series is given\n"
+         "    -n, --nimages        Number of images to set before triggering, also used to\n"
+         "                         count frames missing at the end of a series\n"
+         "    -r, --rate           Frames per second to set before triggering\n"
+         "    -w, --work           Microseconds spent on every frame, to act as a slow writer\n"
+         "    -q, --rcvhwm         Frames queued by the receiving socket, so backpressure reaches\n"
+         "                         the streamer sooner (default 1000)\n"
+         "    -h, --help           print this message and exit\n", p);
+}
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"endpoint", required_argument, NULL, 'e'},
+    {"series", required_argument, NULL, 's'},
+    {"trigger", required_argument, NULL, 't'},
+    {"nimages", required_argument, NULL, 'n'},
+    {"rate", required_argument, NULL, 'r'},
+    {"work", required_argument, NULL, 'w'},
+    {"rcvhwm", required_argument, NULL, 'q'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char* argv[])
+{
+    const char* endpoints[MAX_ENDPOINTS] = {"tcp://127.0.0.1:9999"};
+    int nendpoints = 0;
+    const char* trigger_address = NULL;
+    int nseries = -1;
+    int nimages = 0;
+    double rate = 0.0;
+    int work_us = 0;
+    int rcvhwm = 0;
+
+    int c;
+    while((c = getopt_long(argc, argv, ":he:s:t:n:r:w:q:", long_options, NULL)) != EOF) {
+        switch(c) {
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            case 'e':
+                if (nendpoints == MAX_ENDPOINTS) {
+                    printf("At most %d endpoints\n", MAX_ENDPOINTS);
+                    return -1;
+                }
+                endpoints[nendpoints++] = optarg;
+                break;
+            case 's':
+                nseries = atoi(optarg);
+                break;
+            case 't':
+                trigger_address = optarg;
+                break;
+            case 'n':
+                nimages = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'w':
+                work_us = atoi(optarg);
+                break;
+            case 'q':
+                rcvhwm = atoi(optarg);
+                break;
+        }
+    }
+    if (nendpoints == 0) {
+        nendpoints = 1;
+    }
+    if (nseries < 0) {
+        nseries = trigger_address ? 1 : 0;
+    }
+
+    void* context = zmq_ctx_new();
+    void* pull = zmq_socket(context, ZMQ_PULL);
+    if (rcvhwm > 0) {
+        zmq_setsockopt(pull, ZMQ_RCVHWM, &rcvhwm, sizeof(rcvhwm));
+    }
+    for (int i=0; i<nendpoints; i++) {
+        if (zmq_connect(pull, endpoints[i]) != 0) {
+            printf("Could not connect to %s: %s\n", endpoints[i], zmq_strerror(errno));
+            return -1;
+        }
+    }
+    int control_sock = -1;
+    if (trigger_address) {
+        // give the PUSH socket time to see this PULL socket before the first frame
+        usleep(200000);
+        control_sock = trigger(trigger_address, nimages, rate);
+        if (control_sock == -1) {
+            return -1;
+        }
+    }
+
+    Series series;
+    memset(&series, 0, sizeof(series));
+    int done = 0;
+    // every output sends the series header and end, a series spans all of them
+    int headers = 0;
+    int ends = 0;
+    while (nseries == 0 || done < nseries) {
+        zmq_msg_t header;
+        zmq_msg_init(&header);
+        if (zmq_msg_recv(&header, pull, 0) < 0) {
+            zmq_msg_close(&header);
+            break;
+        }
+        // batches carry the headers of all their images
+        size_t length = zmq_msg_size(&header);
+        char* text = malloc(length + 1 > BUFFER_SIZE ? length + 1 : BUFFER_SIZE);
+        memcpy(text, zmq_msg_data(&header), length);
+        text[length] = '\0';
+        // binary image headers are turned into the json keys the rest looks for
+        if (length == sizeof(BinaryHeader) && memcmp(text, BINARY_HEADER_MAGIC, 4) == 0) {
+            BinaryHeader binary;
+            memcpy(&binary, text, sizeof(binary));
+            const int ndtypes = sizeof(binary_dtypes) / sizeof(binary_dtypes[0]);
+            const int ncodecs = sizeof(binary_codecs) / sizeof(binary_codecs[0]);
+            snprintf(text, BUFFER_SIZE,
+                     "{\"htype\": \"image\",\"frame\": %d,\"type\": \"%s\",\"compression\": \"%s\"}",
+                     binary.frame, binary.dtype < ndtypes ? binary_dtypes[binary.dtype] : "",
+                     binary.codec < ncodecs ? binary_codecs[binary.codec] : "?");
+        }
+
+        if (strstr(text, "\"images\"")) {
+            // one part per image, in the order of the headers
+            const char* image = text;
+            int more = zmq_msg_more(&header);
+            while (more) {
+                zmq_msg_t blob;
+                zmq_msg_init(&blob);
+                zmq_msg_recv(&blob, pull, 0);
+                more = zmq_msg_more(&blob);
+                image = image ? strstr(image + 1, "\"htype\": \"image\"") : NULL;
+                if (image) {
+                    add_frame(&series, image, zmq_msg_data(&blob), zmq_msg_size(&blob));
+                }
+                zmq_msg_close(&blob);
+                if (work_us > 0) {
+                    usleep(work_us);
+                }
+            }
+        }
+        else if (strstr(text, "\"image\"")) {
+            zmq_msg_t blob;
+            zmq_msg_init(&blob);
+            if (zmq_msg_more(&header)) {
+                zmq_msg_recv(&blob, pull, 0);
+                // drop any further parts
+                while (zmq_msg_more(&blob)) {
+                    zmq_msg_t part;
+                    zmq_msg_init(&part);
+                    zmq_msg_recv(&part, pull, 0);
+                    zmq_msg_close(&part);
+                }
+            }
+            add_frame(&series, text, zmq_msg_data(&blob), zmq_msg_size(&blob));
+            zmq_msg_close(&blob);
+            if (work_us > 0) {
+                usleep(work_us);
+            }
+        }
+        else if (strstr(text, "\"series_end\"")) {
+            header_int(text, "\"send\"", &series.dropped);
+            if (++ends % nendpoints == 0) {
+                series_report(&series, nimages);
+                done++;
+            }
+        }
+        else if (strstr(text, "\"header\"")) {
+            if (headers++ % nendpoints == 0) {
+                series_start(&series);
+            }
+        }
+        free(text);
+        zmq_msg_close(&header);
+    }
+
+    if (control_sock != -1) {
+        close(control_sock);
+    }
+    free(series.latencies);
+    zmq_close(pull);
+    zmq_ctx_term(context);
+    return 0;
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "correct.h"
+#include "tiff.h"
+#include "logger.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+// Pilatus modules are 487 x 195 pixels with gaps of 7 and 17 pixels between them
+#define MODULE_WIDTH 487
+#define MODULE_HEIGHT 195
+#define MODULE_PITCH_X 494
+#define MODULE_PITCH_Y 212
+
+// Reads the image of a tif file, returns NULL if the file can't be read or parsed
+static char* load_tif(const char* path, TifInfo* info)
+{
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        log_error("Could not open %s", path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* data = size > 0 ? malloc(size) : NULL;
+    if (!data || fread(data, 1, size, fp) != (size_t)size || parse_tif(data, size, info) != 0) {
+        log_error("Could not read %s", path);
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    char* image = malloc(info->strip_byte_counts);
+    tif_gather_strips(data, info, image);
+    free(data);
+    return image;
+}
+
+// Mask of any integer type as int32
+static int32_t* load_mask(const char* path, int* width, int* height)
+{
+    TifInfo info;
+    char* image = load_tif(path, &info);
+    if (!image) {
+        return NULL;
+    }
+    const size_t n = (size_t)info.width * info.height;
+    int32_t* mask = malloc(n * sizeof(int32_t));
+    for (size_t i=0; i<n; i++) {
+        switch (info.bits_per_sample) {
+            case 8:
+                mask[i] = ((uint8_t*)image)[i];
+                break;
+            case 16:
+                mask[i] = ((uint16_t*)image)[i];
+                break;
+            default:
+                mask[i] = ((int32_t*)image)[i];
+        }
+    }
+    free(image);
+    *width = info.width;
+    *height = info.height;
+    return mask;
+}
+
+static float* load_flatfield(const char* path, int* width, int* height)
+{
+    TifInfo info;
+    char* image = load_tif(path, &info);
+    if (!image) {
+        return NULL;
+    }
+    // sample format 3 is IEEE floating point
+    if (info.bits_per_sample != 32 || info.sample_format != 3) {
+        log_error("Flatfield %s has to be a 32 bit float tif", path);
+        free(image);
+        return NULL;
+    }
+    *width = info.width;
+    *height = info.height;
+    return (float*)image;
+}
+
+int correction_init(Correction* correction, const CorrectionConfig* config)
+{
+    memset(correction, 0, sizeof(Correction));
+    correction->config = *config;
+    pthread_mutex_init(&correction->mutex, NULL);
+    atomic_init(&correction->ready, 0);
+    atomic_init(&correction->corrected, 0);
+    atomic_init(&correction->mismatched, 0);
+    int32_t* mask = NULL;
+    float* flatfield = NULL;
+    int width = 0;
+    int height = 0;
+    if (config->mask_path) {
+        mask = load_mask(config->mask_path, &width, &height);
+        if (!mask) {
+            return -1;
+        }
+    }
+    if (config->flatfield_path) {
+        int flat_width;
+        int flat_height;
+        flatfield = load_flatfield(config->flatfield_path, &flat_width, &flat_height);
+        if (!flatfield) {
+            free(mask);
+            return -1;
+        }
+        if (mask && (flat_width != width || flat_height != height)) {
+            log_error("Mask of %dx%d and flatfield of %dx%d pixels don't match", width, height,
+                      flat_width, flat_height);
+            free(mask);
+            free(flatfield);
+            return -1;
+        }
+        width = flat_width;
+        height = flat_height;
+    }
+    if (mask || flatfield) {
+        correction_build(correction, width, height, mask, flatfield);
+        log_info("Correction tables of %dx%d pixels, version %s", width, height, config->version);
+    }
+    free(mask);
+    free(flatfield);
+    return 0;
+}
+
+void correction_close(Correction* correction)
+{
+    free(correction->sentinels);
+    free(correction->factors);
+    pthread_mutex_destroy(&correction->mutex);
+}
+
+// FNV-1a, so consumers can tell whether two streams used the same tables
+static uint64_t checksum(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    for (size_t i=0; i<size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void correction_build(Correction* correction, int width, int height, const int32_t* mask,
+                      const float* flatfield)
+{
+    const size_t n = (size_t)width * height;
+    int8_t* sentinels = malloc(n);
+    float* factors = flatfield ? malloc(n * sizeof(float)) : NULL;
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            const size_t i = (size_t)y * width + x;
+            int8_t sentinel = 0;
+            if (mask && mask[i] != 0) {
+                sentinel = CORRECTION_MASKED;
+            }
+            if (factors) {
+                factors[i] = flatfield[i];
+                // a pixel without a usable factor has no usable counts either
+                if (!isfinite(flatfield[i]) || flatfield[i] <= 0.0f) {
+                    sentinel = CORRECTION_MASKED;
+                    factors[i] = 0.0f;
+                }
+            }
+            if (x % MODULE_PITCH_X >= MODULE_WIDTH || y % MODULE_PITCH_Y >= MODULE_HEIGHT) {
+                sentinel = CORRECTION_GAP;
+            }
+            sentinels[i] = sentinel;
+        }
+    }
+    uint64_t hash = checksum(0xcbf29ce484222325ULL, sentinels, n);
+    if (factors) {
+        hash = checksum(hash, factors, n * sizeof(float));
+    }
+    correction->width = width;
+    correction->height = height;
+    correction->sentinels = sentinels;
+    correction->factors = factors;
+    correction->checksum = hash;
+    correction->header_length = snprintf(correction->header, sizeof(correction->header),
+                                         "\"correction\": {\"version\": \"%s\","
+                                         "\"checksum\": \"%016llx\",\"flatfield\": %s}",
+                                         correction->config.version, (unsigned long long)hash,
+                                         factors ? "true" : "false");
+    atomic_store_explicit(&correction->ready, 1, memory_order_release);
+}
+
+// Tables are built for the first image if there were no files
+static int prepare(Correction* correction, int width, int height)
+{
+    if (!atomic_load_explicit(&correction->ready, memory_order_acquire)) {
+        pthread_mutex_lock(&correction->mutex);
+        if (!atomic_load_explicit(&correction->ready, memory_order_acquire)) {
+            correction_build(correction, width, height, NULL, NULL);
+        }
+        pthread_mutex_unlock(&correction->mutex);
+    }
+    if (width != correction->width || height != correction->height) {
+        atomic_fetch_add_explicit(&correction->mismatched, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&correction->corrected, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void apply_scalar(const Correction* correction, int32_t* image, size_t start, size_t n)
+{
+    const int8_t* sentinels = correction->sentinels;
+    const float* factors = correction->factors;
+    for (size_t i=start; i<n; i++) {
+        if (sentinels[i] != 0) {
+            image[i] = sentinels[i];
+        }
+        // negative values are the detector's own markers
+        else if (factors && image[i] >= 0) {
+            image[i] = lrintf((float)image[i] * factors[i]);
+        }
+    }
+}
+
+int correction_apply_scalar(Correction* correction, int32_t* image, int width, int height)
+{
+    if (prepare(correction, width, height) != 0) {
+        return -1;
+    }
+    apply_scalar(correction, image, 0, (size_t)width * height);
+    return 0;
+}
+
+int correction_apply(Correction* correction, int32_t* image, int width, int height)
+{
+    if (prepare(correction, width, height) != 0) {
+        return -1;
+    }
+    const size_t n = (size_t)width * height;
+    const int8_t* sentinels = correction->sentinels;
+    const float* factors = correction->factors;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    if (factors) {
+        for (; i + 8 <= n; i += 8) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(image + i));
+            __m128i bytes = _mm_loadl_epi64((const __m128i*)(sentinels + i));
+            __m256i sentinel = _mm256_cvtepi8_epi32(bytes);
+            __m256 factor = _mm256_loadu_ps(factors + i);
+            // rounds to nearest like lrintf
+            __m256i scaled = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(x), factor));
+            scaled = _mm256_blendv_epi8(scaled, x, _mm256_cmpgt_epi32(zero, x));
+            x = _mm256_blendv_epi8(sentinel, scaled, _mm256_cmpeq_epi32(sentinel, zero));
+            _mm256_storeu_si256((__m256i*)(image + i), x);
+        }
+    }
+    else {
+        for (; i + 8 <= n; i += 8) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(image + i));
+            __m128i bytes = _mm_loadl_epi64((const __m128i*)(sentinels + i));
+            __m256i sentinel = _mm256_cvtepi8_epi32(bytes);
+            x = _mm256_blendv_epi8(sentinel, x, _mm256_cmpeq_epi32(sentinel, zero));
+            _mm256_storeu_si256((__m256i*)(image + i), x);
+        }
+    }
+#elif defined(__SSE4_1__)
+    const __m128i zero = _mm_setzero_si128();
+    if (factors) {
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(image + i));
+            __m128i sentinel = _mm_cvtepi8_epi32(_mm_loadu_si32(sentinels + i));
+            __m128 factor = _mm_loadu_ps(factors + i);
+            __m128i scaled = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(x), factor));
+            scaled = _mm_blendv_epi8(scaled, x, _mm_cmpgt_epi32(zero, x));
+            x = _mm_blendv_epi8(sentinel, scaled, _mm_cmpeq_epi32(sentinel, zero));
+            _mm_storeu_si128((__m128i*)(image + i), x);
+        }
+    }
+    else {
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(image + i));
+            __m128i sentinel = _mm_cvtepi8_epi32(_mm_loadu_si32(sentinels + i));
+            x = _mm_blendv_epi8(sentinel, x, _mm_cmpeq_epi32(sentinel, zero));
+            _mm_storeu_si128((__m128i*)(image + i), x);
+        }
+    }
+#endif
+    apply_scalar(correction, image, i, n);
+    return 0;
+}
+
+int correction_format_stats(Correction* correction, char* buffer, size_t size)
+{
+    return snprintf(buffer, size,
+                    "\"correction\": {\"version\": \"%s\",\"checksum\": \"%016llx\","
+                    "\"corrected\": %llu,\"mismatched\": %llu}",
+                    correction->config.version, (unsigned long long)correction->checksum,
+                    (unsigned long long)atomic_load(&correction->corrected),
+                    (unsigned long long)atomic_load(&correction->mismatched));
+}
@@ -0,0 +1,61 @@
+#ifndef CORRECT_H
+#define CORRECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// values of the pixels that don't carry counts after the correction
+#define CORRECTION_GAP -1
+#define CORRECTION_MASKED -2
+
+typedef struct
+{
+    // tif with the dead and hot pixels as non-zero values, NULL if there is none
+    const char* mask_path;
+    // 32 bit float tif with the factors the counts are multiplied with, NULL if there is none
+    const char* flatfield_path;
+    // put into the image headers together with a checksum of the tables
+    const char* version;
+} CorrectionConfig;
+
+// Mask, module gap and flatfield correction of int32 images in place. The tables are
+// loaded once and only read afterwards, so any number of readers can apply them.
+typedef struct
+{
+    CorrectionConfig config;
+    // 0 until the tables are built, from the files or from the first image
+    atomic_int ready;
+    pthread_mutex_t mutex;
+    int width;
+    int height;
+    // 0 for pixels with counts, CORRECTION_GAP or CORRECTION_MASKED otherwise. Bytes keep
+    // the memory traffic down, the pass is bound by it.
+    int8_t* sentinels;
+    // NULL without a flatfield
+    float* factors;
+    uint64_t checksum;
+    // "correction" json member for the image headers
+    char header[256];
+    int header_length;
+
+    atomic_uint_fast64_t corrected;
+    // images that didn't have the size of the tables and were sent as they are
+    atomic_uint_fast64_t mismatched;
+} Correction;
+
+// Loads the mask and the flatfield, returns -1 if a file can't be read or the sizes
+// don't match. Without files only the module gaps are marked, for the size of the first image.
+int correction_init(Correction* correction, const CorrectionConfig* config);
+void correction_close(Correction* correction);
+// Builds the tables from a mask (non-zero is bad, may be NULL) and a flatfield (may be NULL)
+void correction_build(Correction* correction, int width, int height, const int32_t* mask,
+                      const float* flatfield);
+// Returns -1 if the image doesn't have the size of the tables, it is left as it is then
+int correction_apply(Correction* correction, int32_t* image, int width, int height);
+int correction_apply_scalar(Correction* correction, int32_t* image, int width, int height);
+// "correction" json member with the counters, returns the length like snprintf
+int correction_format_stats(Correction* correction, char* buffer, size_t size);
+
+#endif // CORRECT_H
@@ -0,0 +1,57 @@
+#ifndef FRAMEHEADER_H
+#define FRAMEHEADER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Fixed layout image header sent instead of the json one with --header-format binary.
+// Little endian like the pixels, the series header and series_end stay json.
+#define BINARY_HEADER_MAGIC "PSH1"
+
+enum HeaderFormat
+{
+    HEADER_JSON,
+    HEADER_BINARY
+};
+
+typedef struct
+{
+    char magic[4];
+    // sizeof(BinaryHeader), fields are only ever appended
+    uint16_t size;
+    // index into binary_dtypes and binary_codecs
+    uint8_t dtype;
+    uint8_t codec;
+    int32_t frame;
+    int32_t series;
+    // height, width
+    uint32_t shape[2];
+    // uncompressed size if the streamer compressed the image, otherwise 0
+    uint32_t raw_size;
+    uint32_t data_size;
+    // wall clock microseconds of event, load, opened, read, removed, processed and sent
+    // like the json timestamps, 0 without them
+    int64_t timestamps[7];
+} BinaryHeader;
+
+_Static_assert(sizeof(BinaryHeader) == 88, "binary header layout changed");
+
+static const char* const binary_dtypes[] = {
+    "uint8", "int8", "uint16", "int16", "uint32", "int32"
+};
+static const char* const binary_codecs[] = {
+    "", "cbf", "bslz4"
+};
+
+// Index of name in a table like binary_dtypes, 255 if it isn't there
+static inline uint8_t binary_code(const char* const* table, int count, const char* name)
+{
+    for (int i=0; i<count; i++) {
+        if (strcmp(table[i], name) == 0) {
+            return i;
+        }
+    }
+    return 255;
+}
+
+#endif // FRAMEHEADER_H
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include "framestats.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+typedef struct
+{
+    int64_t total;
+    int32_t max;
+    int saturated;
+    int invalid;
+} RowSums;
+
+typedef void (*row_fn)(const int32_t*, int, int32_t, RowSums*);
+
+static void reduce_row_scalar(const int32_t* row, int n, int32_t saturation, RowSums* sums)
+{
+    for (int i=0; i<n; i++) {
+        const int32_t value = row[i];
+        if (value >= 0) {
+            sums->total += value;
+        }
+        else {
+            sums->invalid++;
+        }
+        if (value > sums->max) {
+            sums->max = value;
+        }
+        sums->saturated += value >= saturation;
+    }
+}
+
+static void reduce_row(const int32_t* row, int n, int32_t saturation, RowSums* sums)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+    const __m256i threshold = _mm256_set1_epi32(saturation - 1);
+    __m256i total = zero;
+    __m256i max = _mm256_set1_epi32(sums->max);
+    __m256i saturated = zero;
+    __m256i invalid = zero;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        // the valid pixels are non-negative, so both halves of a 64 bit lane can be
+        // added as 64 bit values without sign extension
+        __m256i valid = _mm256_max_epi32(x, zero);
+        total = _mm256_add_epi64(total, _mm256_and_si256(valid, low));
+        total = _mm256_add_epi64(total, _mm256_srli_epi64(valid, 32));
+        max = _mm256_max_epi32(max, x);
+        // comparisons are -1 where true
+        saturated = _mm256_sub_epi32(saturated, _mm256_cmpgt_epi32(x, threshold));
+        invalid = _mm256_sub_epi32(invalid, _mm256_cmpgt_epi32(zero, x));
+    }
+    int64_t totals[4];
+    int32_t maxima[8];
+    int32_t saturated_counts[8];
+    int32_t invalid_counts[8];
+    _mm256_storeu_si256((__m256i*)totals, total);
+    _mm256_storeu_si256((__m256i*)maxima, max);
+    _mm256_storeu_si256((__m256i*)saturated_counts, saturated);
+    _mm256_storeu_si256((__m256i*)invalid_counts, invalid);
+    for (int k=0; k<4; k++) {
+        sums->total += totals[k];
+    }
+    for (int k=0; k<8; k++) {
+        sums->max = maxima[k] > sums->max ? maxima[k] : sums->max;
+        sums->saturated += saturated_counts[k];
+        sums->invalid += invalid_counts[k];
+    }
+#elif defined(__SSE4_1__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi64x(0xFFFFFFFF);
+    const __m128i threshold = _mm_set1_epi32(saturation - 1);
+    __m128i total = zero;
+    __m128i max = _mm_set1_epi32(sums->max);
+    __m128i saturated = zero;
+    __m128i invalid = zero;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i valid = _mm_max_epi32(x, zero);
+        total = _mm_add_epi64(total, _mm_and_si128(valid, low));
+        total = _mm_add_epi64(total, _mm_srli_epi64(valid, 32));
+        max = _mm_max_epi32(max, x);
+        saturated = _mm_sub_epi32(saturated, _mm_cmpgt_epi32(x, threshold));
+        invalid = _mm_sub_epi32(invalid, _mm_cmpgt_epi32(zero, x));
+    }
+    int64_t totals[2];
+    int32_t maxima[4];
+    int32_t saturated_counts[4];
+    int32_t invalid_counts[4];
+    _mm_storeu_si128((__m128i*)totals, total);
+    _mm_storeu_si128((__m128i*)maxima, max);
+    _mm_storeu_si128((__m128i*)saturated_counts, saturated);
+    _mm_storeu_si128((__m128i*)invalid_counts, invalid);
+    sums->total += totals[0] + totals[1];
+    for (int k=0; k<4; k++) {
+        sums->max = maxima[k] > sums->max ? maxima[k] : sums->max;
+        sums->saturated += saturated_counts[k];
+        sums->invalid += invalid_counts[k];
+    }
+#endif
+    reduce_row_scalar(row + i, n - i, saturation, sums);
+}
+
+static void compute(const int32_t* image, int width, int height, const FrameStatsConfig* config,
+                    FrameStats* stats, row_fn reduce)
+{
+    // rois clipped to the image once, a row is then only checked against y
+    Roi rois[FRAMESTATS_MAX_ROIS];
+    for (int r=0; r<config->nrois; r++) {
+        Roi roi = config->rois[r];
+        if (roi.x + roi.width > width) {
+            roi.width = width - roi.x;
+        }
+        if (roi.y + roi.height > height) {
+            roi.height = height - roi.y;
+        }
+        rois[r] = roi;
+        stats->roi_sums[r] = 0;
+    }
+    RowSums sums = {0, INT32_MIN, 0, 0};
+    for (int y=0; y<height; y++) {
+        const int32_t* row = image + (size_t)y * width;
+        reduce(row, width, config->saturation, &sums);
+        for (int r=0; r<config->nrois; r++) {
+            const Roi* roi = &rois[r];
+            if (y >= roi->y && y < roi->y + roi->height && roi->width > 0) {
+                RowSums roi_sums = {0, INT32_MIN, 0, 0};
+                reduce(row + roi->x, roi->width, config->saturation, &roi_sums);
+                stats->roi_sums[r] += roi_sums.total;
+            }
+        }
+    }
+    stats->total = sums.total;
+    stats->max = sums.max;
+    stats->saturated = sums.saturated;
+    stats->invalid = sums.invalid;
+}
+
+void framestats_compute(const int32_t* image, int width, int height,
+                        const FrameStatsConfig* config, FrameStats* stats)
+{
+    compute(image, width, height, config, stats, reduce_row);
+}
+
+void framestats_compute_scalar(const int32_t* image, int width, int height,
+                               const FrameStatsConfig* config, FrameStats* stats)
+{
+    compute(image, width, height, config, stats, reduce_row_scalar);
+}
+
+int framestats_format(const FrameStats* stats, const FrameStatsConfig* config,
+                      char* buffer, size_t size)
+{
+    int length = snprintf(buffer, size,
+                          "\"stats\": {\"total\": %lld,\"max\": %d,\"saturated\": %d,"
+                          "\"invalid\": %d,\"rois\": {",
+                          (long long)stats->total, stats->max, stats->saturated, stats->invalid);
+    for (int r=0; r<config->nrois && length < (int)size; r++) {
+        length += snprintf(buffer + length, size - length, "%s\"%s\": %lld", r ? "," : "",
+                           config->rois[r].name, (long long)stats->roi_sums[r]);
+    }
+    if (length < (int)size) {
+        length += snprintf(buffer + length, size - length, "}}");
+    }
+    return length;
+}
+
+int framestats_parse_roi(const char* text, Roi* roi)
+{
+    // names end up as json keys
+    if (sscanf(text, "%15[A-Za-z0-9_-]=%d,%d,%d,%d", roi->name, &roi->x, &roi->y,
+               &roi->width, &roi->height) != 5) {
+        return -1;
+    }
+    if (roi->x < 0 || roi->y < 0 || roi->width < 1 || roi->height < 1) {
+        return -1;
+    }
+    return 0;
+}
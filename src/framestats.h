@@ -0,0 +1,52 @@
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAMESTATS_MAX_ROIS 8
+#define FRAMESTATS_NAME_SIZE 16
+
+// Rectangle in pixels, clipped to the image
+typedef struct
+{
+    char name[FRAMESTATS_NAME_SIZE];
+    int x;
+    int y;
+    int width;
+    int height;
+} Roi;
+
+typedef struct
+{
+    Roi rois[FRAMESTATS_MAX_ROIS];
+    int nrois;
+    // pixels at or above this count are saturated
+    int32_t saturation;
+} FrameStatsConfig;
+
+// Reduction of an int32 image for feedback loops that don't need the pixels
+typedef struct
+{
+    // sum of the pixels >= 0
+    int64_t total;
+    int32_t max;
+    int saturated;
+    // negative pixels, -1 in the module gaps and -2 for bad pixels
+    int invalid;
+    // sum of the pixels >= 0 inside every roi
+    int64_t roi_sums[FRAMESTATS_MAX_ROIS];
+} FrameStats;
+
+// One pass over the image row by row, the rois are summed while the row is in cache
+void framestats_compute(const int32_t* image, int width, int height,
+                        const FrameStatsConfig* config, FrameStats* stats);
+void framestats_compute_scalar(const int32_t* image, int width, int height,
+                               const FrameStatsConfig* config, FrameStats* stats);
+// "stats" json member for the image header, returns the length like snprintf
+int framestats_format(const FrameStats* stats, const FrameStatsConfig* config,
+                      char* buffer, size_t size);
+// Parses "name=x,y,width,height", returns -1 if malformed
+int framestats_parse_roi(const char* text, Roi* roi);
+
+#endif // FRAMESTATS_H
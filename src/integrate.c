@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "integrate.h"
+#include "logger.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+void integrator_init(Integrator* integrator)
+{
+    pthread_mutex_init(&integrator->mutex, NULL);
+    integrator->lut = NULL;
+    integrator->frames = 0;
+    integrator->builds = 0;
+}
+
+void integrator_close(Integrator* integrator)
+{
+    if (integrator->lut) {
+        integrate_free(integrator->lut);
+    }
+    pthread_mutex_destroy(&integrator->mutex);
+}
+
+static int same_geometry(const Geometry* a, const Geometry* b)
+{
+    return a->center_x == b->center_x && a->center_y == b->center_y &&
+           a->distance == b->distance && a->pixel_size == b->pixel_size &&
+           a->wavelength == b->wavelength && a->bins == b->bins;
+}
+
+IntegrationLut* integrator_acquire(Integrator* integrator, const Geometry* geometry,
+                                   int width, int height)
+{
+    pthread_mutex_lock(&integrator->mutex);
+    IntegrationLut* lut = integrator->lut;
+    if (!lut || lut->width != width || lut->height != height ||
+        !same_geometry(&lut->geometry, geometry)) {
+        // the other readers wait for the new table, it is only built once per geometry
+        IntegrationLut* built = integrate_build(geometry, width, height);
+        if (lut && lut->refs == 0) {
+            integrate_free(lut);
+        }
+        lut = built;
+        integrator->lut = lut;
+        integrator->builds++;
+        log_info("Integration table for %dx%d pixels and %d bins up to q = %.3f/nm", width,
+                 height, geometry->bins, lut->q_step * geometry->bins);
+    }
+    lut->refs++;
+    integrator->frames++;
+    pthread_mutex_unlock(&integrator->mutex);
+    return lut;
+}
+
+void integrator_release(Integrator* integrator, IntegrationLut* lut)
+{
+    pthread_mutex_lock(&integrator->mutex);
+    lut->refs--;
+    // replaced while it was used
+    if (lut->refs == 0 && lut != integrator->lut) {
+        integrate_free(lut);
+    }
+    pthread_mutex_unlock(&integrator->mutex);
+}
+
+int integrator_format_stats(Integrator* integrator, char* buffer, size_t size)
+{
+    pthread_mutex_lock(&integrator->mutex);
+    int length = snprintf(buffer, size, "\"integration\": {\"frames\": %llu,\"builds\": %llu}",
+                          (unsigned long long)integrator->frames,
+                          (unsigned long long)integrator->builds);
+    pthread_mutex_unlock(&integrator->mutex);
+    return length;
+}
+
+IntegrationLut* integrate_build(const Geometry* geometry, int width, int height)
+{
+    const size_t n = (size_t)width * height;
+    const int nbins = geometry->bins;
+    // pixel size in mm and wavelength in nm
+    const double pixel = geometry->pixel_size * 1e-3;
+    const double wavelength = geometry->wavelength * 0.1;
+    float* q = malloc(n * sizeof(float));
+    double q_max = 0.0;
+    for (int y=0; y<height; y++) {
+        const double dy = (y - geometry->center_y) * pixel;
+        for (int x=0; x<width; x++) {
+            const double dx = (x - geometry->center_x) * pixel;
+            const double two_theta = atan2(sqrt(dx * dx + dy * dy), geometry->distance);
+            const double value = 4.0 * M_PI * sin(two_theta / 2.0) / wavelength;
+            q[(size_t)y * width + x] = value;
+            q_max = value > q_max ? value : q_max;
+        }
+    }
+    IntegrationLut* lut = malloc(sizeof(IntegrationLut));
+    lut->geometry = *geometry;
+    lut->width = width;
+    lut->height = height;
+    lut->q_step = q_max > 0.0 ? q_max / nbins : 1.0;
+    lut->refs = 0;
+    lut->nblocks = (height + INTEGRATE_BLOCK_ROWS - 1) / INTEGRATE_BLOCK_ROWS;
+    const int nrows = lut->nblocks * nbins;
+    lut->offsets = calloc(nrows + 1, sizeof(int32_t));
+    lut->pixels = malloc(n * sizeof(int32_t));
+    // count, prefix sum, fill. The pixels of a table row stay in image order.
+    int32_t* rows = malloc(n * sizeof(int32_t));
+    for (size_t i=0; i<n; i++) {
+        int bin = q[i] / lut->q_step;
+        bin = bin < nbins ? bin : nbins - 1;
+        rows[i] = (i / width / INTEGRATE_BLOCK_ROWS) * nbins + bin;
+        // counted one ahead, so the prefix sum gives the start of every row
+        lut->offsets[rows[i] + 1]++;
+    }
+    free(q);
+    for (int r=0; r<nrows; r++) {
+        lut->offsets[r + 1] += lut->offsets[r];
+    }
+    int32_t* next = malloc(nrows * sizeof(int32_t));
+    memcpy(next, lut->offsets, nrows * sizeof(int32_t));
+    for (size_t i=0; i<n; i++) {
+        lut->pixels[next[rows[i]]++] = i;
+    }
+    free(next);
+    free(rows);
+    return lut;
+}
+
+void integrate_free(IntegrationLut* lut)
+{
+    free(lut->offsets);
+    free(lut->pixels);
+    free(lut);
+}
+
+typedef void (*sum_fn)(const int32_t*, const int32_t*, int, int, int64_t*, int*);
+
+static void sum_scalar(const int32_t* image, const int32_t* pixels, int start, int end,
+                       int64_t* total, int* count)
+{
+    for (int k=start; k<end; k++) {
+        const int32_t value = image[pixels[k]];
+        if (value >= 0) {
+            *total += value;
+            (*count)++;
+        }
+    }
+}
+
+static void sum_pixels(const int32_t* image, const int32_t* pixels, int start, int end,
+                       int64_t* total, int* count)
+{
+    int k = start;
+#if defined(__AVX2__)
+    if (end - start >= 8) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+        const __m256i minus_one = _mm256_set1_epi32(-1);
+        __m256i sums = zero;
+        __m256i counts = zero;
+        for (; k + 8 <= end; k += 8) {
+            __m256i index = _mm256_loadu_si256((const __m256i*)(pixels + k));
+            __m256i x = _mm256_i32gather_epi32((const int*)image, index, 4);
+            // as in the frame stats the valid pixels are added as 64 bit halves
+            __m256i valid = _mm256_max_epi32(x, zero);
+            sums = _mm256_add_epi64(sums, _mm256_and_si256(valid, low));
+            sums = _mm256_add_epi64(sums, _mm256_srli_epi64(valid, 32));
+            counts = _mm256_sub_epi32(counts, _mm256_cmpgt_epi32(x, minus_one));
+        }
+        int64_t totals[4];
+        int32_t valid_counts[8];
+        _mm256_storeu_si256((__m256i*)totals, sums);
+        _mm256_storeu_si256((__m256i*)valid_counts, counts);
+        *total += totals[0] + totals[1] + totals[2] + totals[3];
+        for (int j=0; j<8; j++) {
+            *count += valid_counts[j];
+        }
+    }
+#endif
+    sum_scalar(image, pixels, k, end, total, count);
+}
+
+static void integrate(const IntegrationLut* lut, const int32_t* image, float* intensity,
+                      float* sigma, sum_fn sum)
+{
+    const int nbins = lut->geometry.bins;
+    int64_t totals[INTEGRATE_MAX_BINS];
+    int counts[INTEGRATE_MAX_BINS];
+    memset(totals, 0, nbins * sizeof(int64_t));
+    memset(counts, 0, nbins * sizeof(int));
+    for (int k=0; k<lut->nblocks; k++) {
+        const int32_t* offsets = lut->offsets + k * nbins;
+        for (int b=0; b<nbins; b++) {
+            sum(image, lut->pixels, offsets[b], offsets[b + 1], &totals[b], &counts[b]);
+        }
+    }
+    for (int b=0; b<nbins; b++) {
+        if (counts[b] == 0) {
+            intensity[b] = NAN;
+            sigma[b] = NAN;
+            continue;
+        }
+        intensity[b] = (double)totals[b] / counts[b];
+        sigma[b] = sqrt((double)totals[b]) / counts[b];
+    }
+}
+
+void integrate_frame(const IntegrationLut* lut, const int32_t* image, float* intensity,
+                     float* sigma)
+{
+    integrate(lut, image, intensity, sigma, sum_pixels);
+}
+
+void integrate_frame_scalar(const IntegrationLut* lut, const int32_t* image, float* intensity,
+                            float* sigma)
+{
+    integrate(lut, image, intensity, sigma, sum_scalar);
+}
+
+int integrate_parse_geometry(const char* text, Geometry* geometry)
+{
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    geometry->pixel_size = 172.0;
+    geometry->bins = 1000;
+    int found = 0;
+    char* rest = NULL;
+    for (char* token = strtok_r(copy, ",", &rest); token; token = strtok_r(NULL, ",", &rest)) {
+        char key[16];
+        double value;
+        if (sscanf(token, "%15[a-z]=%lf", key, &value) != 2) {
+            return -1;
+        }
+        if (strcmp(key, "cx") == 0) {
+            geometry->center_x = value;
+            found |= 1;
+        }
+        else if (strcmp(key, "cy") == 0) {
+            geometry->center_y = value;
+            found |= 2;
+        }
+        else if (strcmp(key, "distance") == 0) {
+            geometry->distance = value;
+            found |= 4;
+        }
+        else if (strcmp(key, "wavelength") == 0) {
+            geometry->wavelength = value;
+            found |= 8;
+        }
+        else if (strcmp(key, "pixel") == 0) {
+            geometry->pixel_size = value;
+        }
+        else if (strcmp(key, "bins") == 0) {
+            geometry->bins = value;
+        }
+        else {
+            return -1;
+        }
+    }
+    if (found != 15 || !(geometry->distance > 0.0) || !(geometry->wavelength > 0.0) ||
+        !(geometry->pixel_size > 0.0) || geometry->bins < 1 ||
+        geometry->bins > INTEGRATE_MAX_BINS) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef INTEGRATE_H
+#define INTEGRATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define INTEGRATE_MAX_BINS 4096
+// rows of the image per block of the lookup table, so a block of a 2M image fits into L2
+#define INTEGRATE_BLOCK_ROWS 32
+
+// Detector geometry of a series, bins == 0 if the images aren't integrated
+typedef struct
+{
+    // beam center in pixels from the first pixel of the image
+    double center_x;
+    double center_y;
+    // sample to detector distance in mm
+    double distance;
+    // in um, 172 for Pilatus
+    double pixel_size;
+    // in Angstrom
+    double wavelength;
+    int bins;
+} Geometry;
+
+// Pixel to q bin lookup table in CSR form. The image is split into blocks of rows and
+// every block has a row of the table per bin: the pixels of bin b in block k are
+// pixels[offsets[r]] to pixels[offsets[r + 1] - 1] with r = k * bins + b. A frame is
+// read block by block, so the scattered pixels of a ring are mostly found in cache.
+// Built once per geometry and image size and shared by the readers.
+typedef struct
+{
+    Geometry geometry;
+    int width;
+    int height;
+    // bin b covers q from b * q_step to (b + 1) * q_step in 1/nm
+    double q_step;
+    int nblocks;
+    int32_t* offsets;
+    int32_t* pixels;
+    // readers using the table, guarded by the mutex of the integrator
+    int refs;
+} IntegrationLut;
+
+// Hands out the lookup table for the geometry of a frame, a new one is built when
+// the geometry or the image size changes and the old one is freed once it is released.
+typedef struct
+{
+    pthread_mutex_t mutex;
+    IntegrationLut* lut;
+    uint64_t frames;
+    uint64_t builds;
+} Integrator;
+
+void integrator_init(Integrator* integrator);
+void integrator_close(Integrator* integrator);
+// Returns the table for geometry and the image size, building it if needed, it has to
+// be given back with integrator_release
+IntegrationLut* integrator_acquire(Integrator* integrator, const Geometry* geometry,
+                                   int width, int height);
+void integrator_release(Integrator* integrator, IntegrationLut* lut);
+// "integration" json member with the counters, returns the length like snprintf
+int integrator_format_stats(Integrator* integrator, char* buffer, size_t size);
+
+IntegrationLut* integrate_build(const Geometry* geometry, int width, int height);
+void integrate_free(IntegrationLut* lut);
+// Mean counts of the pixels >= 0 of every bin and their Poisson error, NaN for bins
+// without such pixels. intensity and sigma need room for the bins of the geometry.
+void integrate_frame(const IntegrationLut* lut, const int32_t* image, float* intensity,
+                     float* sigma);
+void integrate_frame_scalar(const IntegrationLut* lut, const int32_t* image, float* intensity,
+                            float* sigma);
+// Parses "cx=..,cy=..,distance=..,wavelength=..[,pixel=..][,bins=..]", pixel defaults
+// to 172 and bins to 1000. Returns -1 if malformed.
+int integrate_parse_geometry(const char* text, Geometry* geometry);
+
+#endif // INTEGRATE_H
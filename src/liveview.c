@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#include "liveview.h"
+#include "cbf.h"
+#include "compress.h"
+#include "stats.h"
+#include "logger.h"
+
+static int reserve(void** buffer, size_t* capacity, size_t size)
+{
+    if (size <= *capacity) {
+        return 0;
+    }
+    void* tmp = realloc(*buffer, size);
+    if (!tmp) {
+        log_error("Could not allocate %zu bytes for the live view", size);
+        return -1;
+    }
+    *buffer = tmp;
+    *capacity = size;
+    return 0;
+}
+
+// Pixels of the offered frame as int32, decompressed if needed.
+// Returns NULL if the format is not supported.
+static const int32_t* frame_pixels(Liveview* liveview, size_t nelements)
+{
+    const char* data = zmq_msg_data(&liveview->blob);
+    const size_t size = zmq_msg_size(&liveview->blob);
+    const int element_size = liveview->element_size;
+    if (reserve((void**)&liveview->image, &liveview->image_capacity,
+                nelements * sizeof(int32_t)) != 0) {
+        return NULL;
+    }
+    if (strcmp(liveview->compression, "cbf") == 0) {
+        CbfInfo info;
+        if (parse_cbf(data, size, &info) != 0 || (size_t)info.nelements != nelements ||
+            cbf_decode((const uint8_t*)data + info.data_offset, info.binary_size,
+                       liveview->image, nelements) < 0) {
+            return NULL;
+        }
+        return liveview->image;
+    }
+    if (strcmp(liveview->compression, "bslz4") == 0) {
+#ifdef HAVE_LZ4
+        // decompressed into the upper part, so the conversion below can run in place
+        char* raw = (char*)liveview->image + nelements * (sizeof(int32_t) - element_size);
+        if (bslz4_decompress(data, size, raw, nelements * element_size, element_size) < 0) {
+            return NULL;
+        }
+        data = raw;
+#else
+        return NULL;
+#endif
+    }
+    else if (liveview->compression[0] != '\0' || size < nelements * element_size) {
+        return NULL;
+    }
+
+    // 32 bit pixels are binned right in the pool buffer
+    if (element_size == 4 && data != (const char*)liveview->image) {
+        return (const int32_t*)data;
+    }
+    const int is_signed = liveview->dtype[0] == 'i';
+    int32_t* out = liveview->image;
+    // decompressed 32 bit pixels are already in place, uint32 above INT32_MAX turn
+    // negative and are left out like the gaps
+    if (element_size == 1) {
+        for (size_t i=0; i<nelements; i++) {
+            out[i] = is_signed ? ((const int8_t*)data)[i] : ((const uint8_t*)data)[i];
+        }
+    }
+    else if (element_size == 2) {
+        for (size_t i=0; i<nelements; i++) {
+            out[i] = is_signed ? ((const int16_t*)data)[i] : ((const uint16_t*)data)[i];
+        }
+    }
+    return out;
+}
+
+// Sums of binning x binning pixels, negative pixels like the gaps are left out.
+// A sum without any valid pixel is -1, or 0 when clipped to uint16.
+static void bin_image(const Liveview* liveview, const int32_t* image, int width,
+                      int out_width, int out_height)
+{
+    const int b = liveview->config.binning;
+    int64_t sums[out_width];
+    int valid[out_width];
+    for (int oy=0; oy<out_height; oy++) {
+        memset(sums, 0, sizeof(sums));
+        memset(valid, 0, sizeof(valid));
+        for (int y=oy*b; y<(oy+1)*b; y++) {
+            const int32_t* row = image + (size_t)y * width;
+            for (int ox=0; ox<out_width; ox++) {
+                for (int x=ox*b; x<(ox+1)*b; x++) {
+                    if (row[x] >= 0) {
+                        sums[ox] += row[x];
+                        valid[ox] = 1;
+                    }
+                }
+            }
+        }
+        if (liveview->config.uint16) {
+            uint16_t* out = (uint16_t*)liveview->preview + (size_t)oy * out_width;
+            for (int ox=0; ox<out_width; ox++) {
+                out[ox] = sums[ox] > UINT16_MAX ? UINT16_MAX : sums[ox];
+            }
+        }
+        else {
+            int32_t* out = (int32_t*)liveview->preview + (size_t)oy * out_width;
+            for (int ox=0; ox<out_width; ox++) {
+                out[ox] = !valid[ox] ? -1 : sums[ox] > INT32_MAX ? INT32_MAX : sums[ox];
+            }
+        }
+    }
+}
+
+static void publish(Liveview* liveview)
+{
+    const int width = liveview->shape[1];
+    const int height = liveview->shape[0];
+    const int b = liveview->config.binning;
+    const int out_width = width / b;
+    const int out_height = height / b;
+    const int out_element_size = liveview->config.uint16 ? 2 : 4;
+    const size_t out_size = (size_t)out_width * out_height * out_element_size;
+
+    const int32_t* image = frame_pixels(liveview, (size_t)width * height);
+    if (!image || out_size == 0) {
+        return;
+    }
+    if (reserve(&liveview->preview, &liveview->preview_capacity, out_size) != 0) {
+        return;
+    }
+    bin_image(liveview, image, width, out_width, out_height);
+
+    const void* data = liveview->preview;
+    size_t size = out_size;
+    const char* compression = "";
+#ifdef HAVE_LZ4
+    if (liveview->config.lz4) {
+        if (reserve((void**)&liveview->compressed, &liveview->compressed_capacity,
+                    LZ4_compressBound(out_size)) != 0) {
+            return;
+        }
+        int rc = LZ4_compress_default(liveview->preview, liveview->compressed, out_size,
+                                      liveview->compressed_capacity);
+        if (rc <= 0) {
+            return;
+        }
+        data = liveview->compressed;
+        size = rc;
+        compression = "lz4";
+    }
+#endif
+
+    char header[512];
+    int length = snprintf(header, sizeof(header),
+                          "{\"htype\": \"preview\","
+                          "\"frame\": %d,"
+                          "\"shape\": [%d,%d],"
+                          "\"type\": \"%s\","
+                          "\"binning\": %d,"
+                          "\"compression\": \"%s\","
+                          "\"raw_size\": %zu}",
+                          liveview->frame_number, out_height, out_width,
+                          liveview->config.uint16 ? "uint16" : "int32", b, compression, out_size);
+    // one copy for all subscribers, pub drops it for the ones that are too slow
+    zmq_send(liveview->socket, header, length, ZMQ_SNDMORE);
+    zmq_send(liveview->socket, data, size, 0);
+    atomic_fetch_add_explicit(&liveview->published, 1, memory_order_relaxed);
+}
+
+static void* liveview_thread(void* arg)
+{
+    Liveview* liveview = arg;
+    pthread_mutex_lock(&liveview->mutex);
+    while (1) {
+        while (!liveview->pending && !liveview->terminate) {
+            pthread_cond_wait(&liveview->cond, &liveview->mutex);
+        }
+        if (liveview->terminate) {
+            break;
+        }
+        pthread_mutex_unlock(&liveview->mutex);
+
+        publish(liveview);
+        // gives the pool buffer back unless the frame is still being sent
+        zmq_msg_close(&liveview->blob);
+
+        pthread_mutex_lock(&liveview->mutex);
+        liveview->pending = 0;
+    }
+    if (liveview->pending) {
+        zmq_msg_close(&liveview->blob);
+        liveview->pending = 0;
+    }
+    pthread_mutex_unlock(&liveview->mutex);
+    return NULL;
+}
+
+int liveview_init(Liveview* liveview, const LiveviewConfig* config, void* context)
+{
+    memset(liveview, 0, sizeof(Liveview));
+    liveview->config = *config;
+    liveview->socket = zmq_socket(context, ZMQ_PUB);
+    if (zmq_bind(liveview->socket, config->endpoint) != 0) {
+        log_error("zmq_bind for live view socket %s failed: %s", config->endpoint,
+                  zmq_strerror(errno));
+        zmq_close(liveview->socket);
+        return -1;
+    }
+    pthread_mutex_init(&liveview->mutex, NULL);
+    pthread_cond_init(&liveview->cond, NULL);
+    atomic_init(&liveview->next_due, 0);
+    pthread_create(&liveview->thread, NULL, liveview_thread, liveview);
+    return 0;
+}
+
+void liveview_close(Liveview* liveview)
+{
+    pthread_mutex_lock(&liveview->mutex);
+    liveview->terminate = 1;
+    pthread_cond_signal(&liveview->cond);
+    pthread_mutex_unlock(&liveview->mutex);
+    pthread_join(liveview->thread, NULL);
+    zmq_close(liveview->socket);
+    free(liveview->image);
+    free(liveview->preview);
+    free(liveview->compressed);
+}
+
+void liveview_offer(Liveview* liveview, int frame_number, const int shape[2], const char* dtype,
+                    int element_size, const char* compression, zmq_msg_t* blob)
+{
+    const int64_t now = stats_now();
+    if (now < atomic_load_explicit(&liveview->next_due, memory_order_relaxed)) {
+        return;
+    }
+    pthread_mutex_lock(&liveview->mutex);
+    if (liveview->pending) {
+        atomic_fetch_add_explicit(&liveview->busy, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&liveview->mutex);
+        return;
+    }
+    // only a reference, the pixels stay in the pool buffer
+    zmq_msg_init(&liveview->blob);
+    zmq_msg_copy(&liveview->blob, blob);
+    liveview->frame_number = frame_number;
+    liveview->shape[0] = shape[0];
+    liveview->shape[1] = shape[1];
+    liveview->dtype = dtype;
+    liveview->element_size = element_size;
+    liveview->compression = compression;
+    liveview->pending = 1;
+    atomic_store_explicit(&liveview->next_due, now + (int64_t)(1e9 / liveview->config.rate),
+                          memory_order_relaxed);
+    pthread_cond_signal(&liveview->cond);
+    pthread_mutex_unlock(&liveview->mutex);
+}
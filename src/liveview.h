@@ -0,0 +1,66 @@
+#ifndef LIVEVIEW_H
+#define LIVEVIEW_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <zmq.h>
+
+typedef struct
+{
+    const char* endpoint;
+    // maximum number of previews per second, 0 disables the live view
+    double rate;
+    // 1, 2 or 4, sums of binning x binning pixels
+    int binning;
+    // clip the sums to uint16, negative values like the gaps become 0
+    int uint16;
+    // lz4 compress the previews, needs HAVE_LZ4
+    int lz4;
+} LiveviewConfig;
+
+// Reduced previews of the frames, published on a PUB socket by a thread of its own.
+// The sender offers every frame, at most rate frames per second are taken, and only if
+// the previous preview is done. The frame stays in its pool buffer until the preview
+// is computed, nothing is copied on the hot path.
+typedef struct
+{
+    LiveviewConfig config;
+    void* socket;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;
+    int terminate;
+    // earliest time for the next preview, CLOCK_MONOTONIC in ns
+    atomic_int_fast64_t next_due;
+
+    // frame offered to the thread, the message holds a reference to the pool buffer
+    zmq_msg_t blob;
+    int frame_number;
+    int shape[2];
+    const char* dtype;
+    int element_size;
+    const char* compression;
+
+    // images converted to int32, the binned preview and its lz4 compression
+    int32_t* image;
+    void* preview;
+    char* compressed;
+    size_t image_capacity;
+    size_t preview_capacity;
+    size_t compressed_capacity;
+
+    atomic_uint_fast64_t published;
+    // frames that were due but came while the previous preview was still computed
+    atomic_uint_fast64_t busy;
+} Liveview;
+
+// Returns -1 if the socket can't be bound
+int liveview_init(Liveview* liveview, const LiveviewConfig* config, void* context);
+void liveview_close(Liveview* liveview);
+// Called by the sender for every frame before blob is sent, cheap if no preview is due
+void liveview_offer(Liveview* liveview, int frame_number, const int shape[2], const char* dtype,
+                    int element_size, const char* compression, zmq_msg_t* blob);
+
+#endif // LIVEVIEW_H
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "loader.h"
+#include "stats.h"
+#include "logger.h"
+
+static size_t read_size(const Loader* loader, size_t size)
+{
+    if (loader->direct) {
+        return (size + LOADER_ALIGNMENT - 1) & ~((size_t)LOADER_ALIGNMENT - 1);
+    }
+    return size;
+}
+
+// Picks the part of the file to read once its size is known and returns the number of
+// bytes to request, or -1 if they don't fit into the buffer
+static long plan_read(const Loader* loader, LoadRequest* request)
+{
+    request->start = 0;
+    request->nread = request->size;
+    if (request->length && request->size == request->expected_size) {
+        request->start = request->offset;
+        if (loader->direct) {
+            request->start &= ~((size_t)LOADER_ALIGNMENT - 1);
+        }
+        request->nread = request->offset + request->length - request->start;
+    }
+    size_t length = read_size(loader, request->nread);
+    if (length > request->capacity) {
+        log_error("File %s does not fit into buffer", request->path);
+        request->error = EFBIG;
+        return -1;
+    }
+    return length;
+}
+
+static int open_file(Loader* loader, const char* path)
+{
+    int flags = O_RDONLY;
+    if (loader->direct) {
+        flags |= O_DIRECT;
+    }
+    int fd = open(path, flags);
+    // filesystem does not support O_DIRECT, e.g. tmpfs
+    if (fd == -1 && errno == EINVAL && loader->direct) {
+        log_warning("O_DIRECT not supported for %s, using buffered reads", path);
+        loader->direct = 0;
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+// A file that couldn't be loaded is dropped all the same, it would otherwise stay in
+// the watch folder for good
+static void discard_file(const char* path)
+{
+    if (unlink(path) == -1 && errno != ENOENT) {
+        log_error("Error could not delete file %s", path);
+    }
+}
+
+static void load_file(Loader* loader, LoadRequest* request)
+{
+    int fd = open_file(loader, request->path);
+    if (fd == -1) {
+        request->error = errno;
+        log_error("Could not open file %s", request->path);
+        discard_file(request->path);
+        return;
+    }
+    request->opened = stats_now();
+    struct stat st;
+    fstat(fd, &st);
+    request->size = st.st_size;
+    long length = plan_read(loader, request);
+    if (length < 0) {
+        close(fd);
+        discard_file(request->path);
+        return;
+    }
+    size_t done = 0;
+    while (done < request->nread) {
+        ssize_t nb = pread(fd, (char*)request->buffer + done, length - done,
+                           request->start + done);
+        if (nb <= 0) {
+            break;
+        }
+        done += nb;
+    }
+    request->read = stats_now();
+    close(fd);
+    if (done < request->nread) {
+        log_error("Problem reading %s", request->path);
+        request->error = EIO;
+        discard_file(request->path);
+        return;
+    }
+    if (unlink(request->path) == -1) {
+        log_error("Error could not delete file %s", request->path);
+    }
+    request->removed = stats_now();
+}
+
+#ifdef HAVE_LIBURING
+
+enum LoadOp
+{
+    OP_OPEN,
+    OP_STATX,
+    OP_READ,
+    OP_CLOSE,
+    OP_UNLINK
+};
+
+#define USER_DATA(index, op) (((uint64_t)(index) << 3) | (op))
+
+static void submit_and_reap(Loader* loader, int count, int* results)
+{
+    io_uring_submit_and_wait(&loader->ring, count);
+    for (int i=0; i<count; i++) {
+        struct io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&loader->ring, &cqe) < 0) {
+            break;
+        }
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        results[(data >> 3) * 5 + (data & 7)] = cqe->res;
+        io_uring_cqe_seen(&loader->ring, cqe);
+    }
+}
+
+static void load_uring(Loader* loader, LoadRequest* requests, int n)
+{
+    int results[n][5];
+    int fds[n];
+    struct statx stx[n];
+    memset(results, 0, sizeof(results));
+    int flags = O_RDONLY;
+    if (loader->direct) {
+        flags |= O_DIRECT;
+    }
+
+    // 1. open and stat all files
+    for (int i=0; i<n; i++) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&loader->ring);
+        io_uring_prep_openat(sqe, AT_FDCWD, requests[i].path, flags, 0);
+        io_uring_sqe_set_data64(sqe, USER_DATA(i, OP_OPEN));
+        sqe = io_uring_get_sqe(&loader->ring);
+        io_uring_prep_statx(sqe, AT_FDCWD, requests[i].path, 0, STATX_SIZE, &stx[i]);
+        io_uring_sqe_set_data64(sqe, USER_DATA(i, OP_STATX));
+    }
+    submit_and_reap(loader, 2*n, &results[0][0]);
+    int64_t opened = stats_now();
+
+    // 2. read every file straight into its buffer
+    int count = 0;
+    for (int i=0; i<n; i++) {
+        LoadRequest* request = &requests[i];
+        fds[i] = results[i][OP_OPEN];
+        // O_DIRECT or the opcode itself is not supported
+        if (fds[i] == -EINVAL) {
+            fds[i] = open_file(loader, request->path);
+            if (fds[i] == -1) {
+                fds[i] = -errno;
+            }
+        }
+        if (fds[i] < 0) {
+            request->error = -fds[i];
+            log_error("Could not open file %s", request->path);
+            discard_file(request->path);
+            continue;
+        }
+        if (results[i][OP_STATX] < 0) {
+            struct stat st;
+            fstat(fds[i], &st);
+            stx[i].stx_size = st.st_size;
+        }
+        request->opened = opened;
+        request->size = stx[i].stx_size;
+        long length = plan_read(loader, request);
+        if (length < 0) {
+            continue;
+        }
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&loader->ring);
+        io_uring_prep_read(sqe, fds[i], request->buffer, length, request->start);
+        io_uring_sqe_set_data64(sqe, USER_DATA(i, OP_READ));
+        count++;
+    }
+    submit_and_reap(loader, count, &results[0][0]);
+    int64_t read = stats_now();
+
+    // 3. close and remove all files, the ones that failed are dropped
+    count = 0;
+    for (int i=0; i<n; i++) {
+        LoadRequest* request = &requests[i];
+        if (fds[i] < 0) {
+            continue;
+        }
+        request->read = read;
+        if (!request->error && results[i][OP_READ] < (int)request->nread) {
+            log_error("Problem reading %s", request->path);
+            request->error = EIO;
+        }
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&loader->ring);
+        io_uring_prep_close(sqe, fds[i]);
+        io_uring_sqe_set_data64(sqe, USER_DATA(i, OP_CLOSE));
+        sqe = io_uring_get_sqe(&loader->ring);
+        io_uring_prep_unlinkat(sqe, AT_FDCWD, request->path, 0);
+        io_uring_sqe_set_data64(sqe, USER_DATA(i, OP_UNLINK));
+        count += 2;
+    }
+    submit_and_reap(loader, count, &results[0][0]);
+    int64_t removed = stats_now();
+    for (int i=0; i<n; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        if (!requests[i].error) {
+            requests[i].removed = removed;
+        }
+        int rc = results[i][OP_UNLINK];
+        // kernel without IORING_OP_UNLINKAT
+        if (rc == -EINVAL) {
+            rc = unlink(requests[i].path);
+        }
+        if (rc < 0) {
+            log_error("Error could not delete file %s", requests[i].path);
+        }
+    }
+}
+
+#endif
+
+void loader_init(Loader* loader, int max_batch, int direct)
+{
+    loader->max_batch = max_batch;
+    loader->direct = direct;
+    loader->use_uring = 0;
+#ifdef HAVE_LIBURING
+    // open/statx/close/unlink for every file of a batch
+    int rc = io_uring_queue_init(3 * max_batch, &loader->ring, 0);
+    if (rc == 0) {
+        loader->use_uring = 1;
+    }
+    else {
+        log_warning("io_uring not available (%s), using pread", strerror(-rc));
+    }
+#endif
+}
+
+void loader_close(Loader* loader)
+{
+#ifdef HAVE_LIBURING
+    if (loader->use_uring) {
+        io_uring_queue_exit(&loader->ring);
+    }
+#endif
+}
+
+void loader_load(Loader* loader, LoadRequest* requests, int n)
+{
+    for (int i=0; i<n; i++) {
+        requests[i].size = 0;
+        requests[i].start = 0;
+        requests[i].nread = 0;
+        requests[i].error = 0;
+        requests[i].opened = 0;
+        requests[i].read = 0;
+        requests[i].removed = 0;
+    }
+#ifdef HAVE_LIBURING
+    if (loader->use_uring) {
+        for (int i=0; i<n; i+=loader->max_batch) {
+            int count = n - i < loader->max_batch ? n - i : loader->max_batch;
+            load_uring(loader, &requests[i], count);
+        }
+        return;
+    }
+#endif
+    for (int i=0; i<n; i++) {
+        load_file(loader, &requests[i]);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// O_DIRECT needs block aligned buffers and read sizes
+#define LOADER_ALIGNMENT 4096
+
+typedef struct
+{
+    char path[512];
+    void* buffer;
+    size_t capacity;
+    // If set, only length bytes at offset are read, as long as the file has exactly
+    // expected_size bytes. Otherwise the whole file is read.
+    size_t expected_size;
+    size_t offset;
+    size_t length;
+    // filled in by loader_load: size of the file, file offset of the first byte in
+    // the buffer and the number of valid bytes in the buffer
+    size_t size;
+    size_t start;
+    size_t nread;
+    int error;
+    // when the file was opened, read and removed, CLOCK_MONOTONIC in ns. With io_uring
+    // these are the times the whole batch finished the step.
+    int64_t opened;
+    int64_t read;
+    int64_t removed;
+} LoadRequest;
+
+// Reads a batch of files into their buffers and removes the files afterwards.
+// With io_uring all opens, reads, closes and unlinks of a batch are submitted
+// together, otherwise every file is loaded with a single pread.
+typedef struct
+{
+    int max_batch;
+    int direct;
+    int use_uring;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+} Loader;
+
+void loader_init(Loader* loader, int max_batch, int direct);
+void loader_close(Loader* loader);
+void loader_load(Loader* loader, LoadRequest* requests, int n);
+
+#endif // LOADER_H
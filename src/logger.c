@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+#include "queue.h"
+
+typedef struct
+{
+    int length;
+    char text[LOGGER_LINE_SIZE];
+} LogEntry;
+
+typedef struct
+{
+    LoggerConfig config;
+    LogEntry* entries;
+    // entries ready to be written and the ones queued for the logger thread
+    Queue free;
+    Queue pending;
+    pthread_t thread;
+    atomic_int running;
+    atomic_int level;
+    // second of the current rate window and the lines written in it
+    atomic_int_fast64_t window;
+    atomic_int window_count;
+    atomic_uint_fast64_t suppressed;
+    atomic_uint_fast64_t dropped;
+} Logger;
+
+static Logger logger = { .level = LOG_INFO };
+static __thread const char* thread_prefix = NULL;
+
+static int64_t now_seconds()
+{
+    // the coarse clock is read without a syscall and good enough for a rate
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+    return time.tv_sec;
+}
+
+// Only called by the logger thread, prints how many lines were lost since the last call
+static void report_lost()
+{
+    static uint64_t reported_suppressed = 0;
+    static uint64_t reported_dropped = 0;
+    uint64_t suppressed = atomic_load_explicit(&logger.suppressed, memory_order_relaxed);
+    uint64_t dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+    if (suppressed > reported_suppressed) {
+        printf("%llu log lines suppressed\n",
+               (unsigned long long)(suppressed - reported_suppressed));
+        reported_suppressed = suppressed;
+    }
+    if (dropped > reported_dropped) {
+        printf("%llu log lines dropped, the log ring was full\n",
+               (unsigned long long)(dropped - reported_dropped));
+        reported_dropped = dropped;
+    }
+}
+
+static void* logger_thread(void* arg)
+{
+    while (1) {
+        void* item;
+        if (queue_pop_timeout(&logger.pending, &item, 1000)) {
+            LogEntry* entry = item;
+            fwrite(entry->text, 1, entry->length, stdout);
+            queue_push(&logger.free, entry);
+            if (!queue_empty(&logger.pending)) {
+                continue;
+            }
+        }
+        // only returns 0 after the shutdown once everything is written
+        else if (!atomic_load(&logger.running)) {
+            break;
+        }
+        report_lost();
+        fflush(stdout);
+    }
+    report_lost();
+    fflush(stdout);
+    return NULL;
+}
+
+void logger_init(const LoggerConfig* config)
+{
+    logger.config = *config;
+    atomic_store(&logger.level, config->level);
+    logger.entries = malloc(config->capacity * sizeof(LogEntry));
+    queue_init(&logger.free, config->capacity, QUEUE_MPMC);
+    queue_init(&logger.pending, config->capacity, QUEUE_MPMC);
+    for (int i=0; i<config->capacity; i++) {
+        queue_push(&logger.free, &logger.entries[i]);
+    }
+    atomic_store(&logger.window, now_seconds());
+    atomic_store(&logger.window_count, 0);
+    atomic_store(&logger.running, 1);
+    pthread_create(&logger.thread, NULL, logger_thread, NULL);
+}
+
+void logger_close()
+{
+    if (!atomic_load(&logger.running)) {
+        return;
+    }
+    atomic_store(&logger.running, 0);
+    queue_shutdown(&logger.pending);
+    pthread_join(logger.thread, NULL);
+    queue_free(&logger.pending);
+    queue_free(&logger.free);
+    free(logger.entries);
+}
+
+// Returns 0 if the line exceeds the rate of the current second
+static int within_rate()
+{
+    const int64_t second = now_seconds();
+    int_fast64_t window = atomic_load_explicit(&logger.window, memory_order_relaxed);
+    if (second != window &&
+        atomic_compare_exchange_strong(&logger.window, &window, second)) {
+        atomic_store_explicit(&logger.window_count, 0, memory_order_relaxed);
+    }
+    return atomic_fetch_add_explicit(&logger.window_count, 1, memory_order_relaxed) <
+           logger.config.rate;
+}
+
+void logger_write(int level, const char* format, ...)
+{
+    if (level < atomic_load_explicit(&logger.level, memory_order_relaxed)) {
+        return;
+    }
+    va_list args;
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        if (thread_prefix) {
+            printf("[%s] ", thread_prefix);
+        }
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        putchar('\n');
+        return;
+    }
+    if (level < LOG_ERROR && logger.config.rate > 0 && !within_rate()) {
+        atomic_fetch_add_explicit(&logger.suppressed, 1, memory_order_relaxed);
+        return;
+    }
+    void* item;
+    if (!queue_try_pop(&logger.free, &item)) {
+        atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    LogEntry* entry = item;
+    int length = 0;
+    if (thread_prefix) {
+        length = snprintf(entry->text, LOGGER_LINE_SIZE - 1, "[%s] ", thread_prefix);
+    }
+    va_start(args, format);
+    const int text = vsnprintf(entry->text + length, LOGGER_LINE_SIZE - 1 - length, format, args);
+    va_end(args);
+    length = text < 0 ? -1 : length + text;
+    // truncated lines keep their newline
+    if (length < 0) {
+        length = 0;
+    }
+    else if (length > LOGGER_LINE_SIZE - 2) {
+        length = LOGGER_LINE_SIZE - 2;
+    }
+    entry->text[length++] = '\n';
+    entry->length = length;
+    queue_push(&logger.pending, entry);
+}
+
+void logger_set_prefix(const char* prefix)
+{
+    thread_prefix = prefix;
+}
+
+uint64_t logger_dropped()
+{
+    return atomic_load(&logger.dropped) + atomic_load(&logger.suppressed);
+}
+
+int logger_level(const char* name)
+{
+    const char* names[] = {"debug", "info", "warning", "error"};
+    for (int i=0; i<4; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
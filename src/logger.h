@@ -0,0 +1,49 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+enum LogLevel
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+};
+
+#define LOGGER_LINE_SIZE 256
+
+typedef struct
+{
+    // lines below this level are discarded right away
+    int level;
+    // lines per second, the rest is counted and reported as suppressed, 0 is unlimited
+    int rate;
+    // lines queued for the logger thread before new ones are dropped
+    int capacity;
+} LoggerConfig;
+
+// Lines are formatted by the caller into a preallocated entry and printed to
+// stdout by a thread of their own, so no thread of the pipeline ever blocks on
+// a slow terminal or journald. Entries come from a lock-free free list, if it
+// is empty the line is dropped and counted. Before logger_init and after
+// logger_close lines are printed directly, e.g. in the tools and the benchmark.
+// Errors are never rate limited.
+void logger_init(const LoggerConfig* config);
+// Prints the lines still queued and stops the thread
+void logger_close(void);
+void logger_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+// Lines of the calling thread start with "[prefix] " from now on, e.g. the detector it
+// works for. NULL removes it.
+void logger_set_prefix(const char* prefix);
+// lines dropped because the ring was full or the rate was exceeded
+uint64_t logger_dropped(void);
+// Returns the level for a name like info or -1
+int logger_level(const char* name);
+
+#define log_debug(...) logger_write(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) logger_write(LOG_INFO, __VA_ARGS__)
+#define log_warning(...) logger_write(LOG_WARNING, __VA_ARGS__)
+#define log_error(...) logger_write(LOG_ERROR, __VA_ARGS__)
+
+#endif // LOGGER_H
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metadata.h"
+
+void metadata_init(SeriesMetadata* metadata)
+{
+    metadata->exposure_time = -1.0;
+    metadata->exposure_period = -1.0;
+    metadata->nimages = -1;
+    metadata->energy = -1.0;
+    metadata->threshold = -1.0;
+    metadata->width = 0;
+    metadata->height = 0;
+    metadata->pixel_size = 172.0;
+}
+
+int metadata_parse_reply(SeriesMetadata* metadata, const char* reply)
+{
+    // e.g. "15 OK Exposure time set to: 0.1000000 sec."
+    if (sscanf(reply, "15 OK Exposure time set to: %lf", &metadata->exposure_time) == 1 ||
+        sscanf(reply, "15 OK Exposure period set to: %lf", &metadata->exposure_period) == 1 ||
+        sscanf(reply, "15 OK N images set to: %d", &metadata->nimages) == 1 ||
+        sscanf(reply, "15 OK Energy setting: %lf", &metadata->energy) == 1) {
+        return 1;
+    }
+    // setthr answers "15 OK Settings: mid gain; threshold: 6330 eV; vcmp: ..."
+    const char* threshold = strncmp(reply, "15 OK", 5) == 0 ? strcasestr(reply, "threshold") : NULL;
+    if (threshold && sscanf(threshold, "%*[A-Za-z_ ]: %lf", &metadata->threshold) == 1) {
+        return 1;
+    }
+    return 0;
+}
+
+int metadata_format(const SeriesMetadata* metadata, char* buffer, size_t size)
+{
+    int length = snprintf(buffer, size, "\"nimages\": %d", metadata->nimages);
+    const double values[] = {metadata->exposure_time, metadata->exposure_period,
+                             metadata->energy, metadata->threshold};
+    const char* names[] = {"exposure_time", "exposure_period", "energy", "threshold"};
+    for (int i=0; i<4 && length < (int)size; i++) {
+        if (values[i] >= 0.0) {
+            length += snprintf(buffer + length, size - length, ",\"%s\": %g", names[i], values[i]);
+        }
+    }
+    if (metadata->width > 0 && length < (int)size) {
+        length += snprintf(buffer + length, size - length,
+                           ",\"detector\": {\"width\": %d,\"height\": %d,\"pixel_size\": %g}",
+                           metadata->width, metadata->height, metadata->pixel_size);
+    }
+    return length;
+}
+
+const char* metadata_parse_arm(const char* text, ArmSettings* arm)
+{
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", text);
+    arm->nimages = 0;
+    arm->exposure_time = -1.0;
+    arm->exposure_period = -1.0;
+    arm->path[0] = '\0';
+    snprintf(arm->mode, sizeof(arm->mode), "exposure");
+    char* rest = NULL;
+    for (char* token = strtok_r(copy, ",", &rest); token; token = strtok_r(NULL, ",", &rest)) {
+        char* value = strchr(token, '=');
+        if (!value) {
+            return "settings have to be key=value";
+        }
+        *value++ = '\0';
+        if (strcmp(token, "nimages") == 0) {
+            arm->nimages = atoi(value);
+        }
+        else if (strcmp(token, "exptime") == 0) {
+            arm->exposure_time = atof(value);
+        }
+        else if (strcmp(token, "expperiod") == 0) {
+            arm->exposure_period = atof(value);
+        }
+        else if (strcmp(token, "path") == 0) {
+            snprintf(arm->path, sizeof(arm->path), "%s", value);
+        }
+        else if (strcmp(token, "mode") == 0) {
+            snprintf(arm->mode, sizeof(arm->mode), "%s", value);
+        }
+        else {
+            return "unknown setting";
+        }
+    }
+    if (arm->nimages < 1) {
+        return "nimages has to be at least 1";
+    }
+    if (!(arm->exposure_time > 0.0) || !(arm->exposure_period > 0.0)) {
+        return "exptime and expperiod are needed";
+    }
+    if (arm->exposure_time > arm->exposure_period - METADATA_READOUT_TIME + 1e-6) {
+        return "exposure time too long for the period";
+    }
+    if (strcasecmp(arm->mode, "exposure") != 0 && strcasecmp(arm->mode, "extmtrigger") != 0 &&
+        strcasecmp(arm->mode, "extenable") != 0 && strcasecmp(arm->mode, "exttrigger") != 0) {
+        return "mode has to be exposure, extmtrigger, extenable or exttrigger";
+    }
+    return NULL;
+}
+
+void metadata_apply_arm(SeriesMetadata* metadata, const ArmSettings* arm)
+{
+    metadata->nimages = arm->nimages;
+    metadata->exposure_time = arm->exposure_time;
+    metadata->exposure_period = arm->exposure_period;
+}
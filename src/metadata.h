@@ -0,0 +1,53 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stddef.h>
+
+// Settings of the next series as the camserver confirmed them. They are collected from
+// its replies and serialized once when the series starts, instead of per frame.
+typedef struct
+{
+    // seconds, negative while unknown
+    double exposure_time;
+    double exposure_period;
+    // -1 while unknown
+    int nimages;
+    // eV, negative while unknown
+    double energy;
+    double threshold;
+    // detector size in pixels, 0 if the buffers are sized from the first frame
+    int width;
+    int height;
+    // um
+    double pixel_size;
+} SeriesMetadata;
+
+// shortest gap between the end of an exposure and the next one, as in Pilatus.start
+#define METADATA_READOUT_TIME 0.003
+
+// Settings of "arm nimages=..,exptime=..,expperiod=..[,path=..][,mode=..]", which sets
+// up and starts a series in one request
+typedef struct
+{
+    int nimages;
+    double exposure_time;
+    double exposure_period;
+    // file name for the series header, the camserver writes into the watched folder
+    char path[256];
+    // exposure, extmtrigger, extenable or exttrigger
+    char mode[16];
+} ArmSettings;
+
+void metadata_init(SeriesMetadata* metadata);
+// Takes a setting from a camserver reply, returns 1 if the reply confirmed one
+int metadata_parse_reply(SeriesMetadata* metadata, const char* reply);
+// json members of the known settings, without braces, returns the length like snprintf
+int metadata_format(const SeriesMetadata* metadata, char* buffer, size_t size);
+
+// Returns NULL if the settings are complete and the exposure fits into the period,
+// otherwise the reason to reject them
+const char* metadata_parse_arm(const char* text, ArmSettings* arm);
+// Takes the settings of an arm request before the camserver confirmed them
+void metadata_apply_arm(SeriesMetadata* metadata, const ArmSettings* arm);
+
+#endif // METADATA_H
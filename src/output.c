@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <zmq.h>
+#include "output.h"
+#include "logger.h"
+
+static int64_t output_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int output_init(Output* output, const OutputConfig* config, void* context)
+{
+    memset(output, 0, sizeof(Output));
+    output->config = *config;
+    for (int i=0; i<config->count; i++) {
+        Endpoint* endpoint = &output->endpoints[i];
+        endpoint->endpoint = config->endpoints[i];
+        endpoint->socket = zmq_socket(context, ZMQ_PUSH);
+        // one io thread per socket as long as there are enough of them
+        uint64_t affinity = 1ULL << ((config->first_io_thread + i) % config->io_threads);
+        zmq_setsockopt(endpoint->socket, ZMQ_AFFINITY, &affinity, sizeof(affinity));
+        if (config->sndhwm > 0) {
+            zmq_setsockopt(endpoint->socket, ZMQ_SNDHWM, &config->sndhwm, sizeof(config->sndhwm));
+        }
+        if (config->sndbuf > 0) {
+            zmq_setsockopt(endpoint->socket, ZMQ_SNDBUF, &config->sndbuf, sizeof(config->sndbuf));
+        }
+        if (zmq_bind(endpoint->socket, endpoint->endpoint) != 0) {
+            log_error("zmq_bind for push socket %s failed: %s", endpoint->endpoint,
+                      zmq_strerror(errno));
+            zmq_close(endpoint->socket);
+            output->count = i;
+            output_close(output);
+            return -1;
+        }
+        atomic_init(&endpoint->frames, 0);
+        atomic_init(&endpoint->in_flight, 0);
+    }
+    output->count = config->count;
+    if (config->stats_endpoint) {
+        output->stats_socket = zmq_socket(context, ZMQ_PUB);
+        if (zmq_bind(output->stats_socket, config->stats_endpoint) != 0) {
+            log_error("zmq_bind for stats socket %s failed: %s", config->stats_endpoint,
+                      zmq_strerror(errno));
+            zmq_close(output->stats_socket);
+            output->stats_socket = NULL;
+            output_close(output);
+            return -1;
+        }
+    }
+    if (config->profile_endpoint) {
+        output->profile_socket = zmq_socket(context, ZMQ_PUB);
+        if (zmq_bind(output->profile_socket, config->profile_endpoint) != 0) {
+            log_error("zmq_bind for profile socket %s failed: %s", config->profile_endpoint,
+                      zmq_strerror(errno));
+            zmq_close(output->profile_socket);
+            output->profile_socket = NULL;
+            output_close(output);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void output_close(Output* output)
+{
+    for (int i=0; i<output->count; i++) {
+        zmq_close(output->endpoints[i].socket);
+    }
+    output->count = 0;
+    if (output->stats_socket) {
+        zmq_close(output->stats_socket);
+        output->stats_socket = NULL;
+    }
+    if (output->profile_socket) {
+        zmq_close(output->profile_socket);
+        output->profile_socket = NULL;
+    }
+}
+
+int output_select(Output* output, int frame_number)
+{
+    if (output->count == 1) {
+        return 0;
+    }
+    switch (output->config.policy) {
+        case OUTPUT_MODULO:
+            return (unsigned)frame_number % output->count;
+        case OUTPUT_LEAST_LOADED: {
+            // ties go round robin, so idle writers share the frames
+            int best = output->next;
+            int best_load = atomic_load_explicit(&output->endpoints[best].in_flight,
+                                                 memory_order_relaxed);
+            for (int i=1; i<output->count; i++) {
+                int index = (output->next + i) % output->count;
+                int load = atomic_load_explicit(&output->endpoints[index].in_flight,
+                                                memory_order_relaxed);
+                if (load < best_load) {
+                    best = index;
+                    best_load = load;
+                }
+            }
+            output->next = (best + 1) % output->count;
+            return best;
+        }
+        default: {
+            int index = output->next;
+            output->next = (index + 1) % output->count;
+            return index;
+        }
+    }
+}
+
+void output_sent(Output* output, int endpoint)
+{
+    atomic_fetch_add_explicit(&output->endpoints[endpoint].frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&output->endpoints[endpoint].in_flight, 1, memory_order_relaxed);
+}
+
+void output_released(Output* output, int endpoint)
+{
+    atomic_fetch_sub_explicit(&output->endpoints[endpoint].in_flight, 1, memory_order_relaxed);
+}
+
+int output_broadcast(Output* output, const void* data, size_t size, int timeout_ms)
+{
+    int rc = 0;
+    const int64_t deadline = output_now_ms() + timeout_ms;
+    for (int i=0; i<output->count; i++) {
+        void* socket = output->endpoints[i].socket;
+        if (timeout_ms == 0) {
+            zmq_send(socket, data, size, 0);
+            continue;
+        }
+        zmq_pollitem_t item = {socket, 0, ZMQ_POLLOUT, 0};
+        while (zmq_send(socket, data, size, ZMQ_DONTWAIT) < 0) {
+            const int64_t remaining = deadline - output_now_ms();
+            if (errno != EAGAIN || remaining <= 0) {
+                log_warning("%s didn't take a message within %d ms", output->endpoints[i].endpoint,
+                            timeout_ms);
+                rc = -1;
+                break;
+            }
+            zmq_poll(&item, 1, remaining);
+        }
+    }
+    output_publish(output, data, size);
+    return rc;
+}
+
+void output_publish(Output* output, const void* header, size_t size)
+{
+    if (output->stats_socket) {
+        zmq_send(output->stats_socket, header, size, ZMQ_DONTWAIT);
+    }
+}
+
+void output_publish_profile(Output* output, const void* header, size_t header_size,
+                            const void* data, size_t data_size)
+{
+    if (output->profile_socket) {
+        zmq_send(output->profile_socket, header, header_size, ZMQ_SNDMORE | ZMQ_DONTWAIT);
+        zmq_send(output->profile_socket, data, data_size, ZMQ_DONTWAIT);
+    }
+}
+
+int output_writable(Output* output)
+{
+    zmq_pollitem_t items[OUTPUT_MAX_ENDPOINTS];
+    for (int i=0; i<output->count; i++) {
+        items[i].socket = output->endpoints[i].socket;
+        items[i].fd = 0;
+        items[i].events = ZMQ_POLLOUT;
+        items[i].revents = 0;
+    }
+    return zmq_poll(items, output->count, 0) == output->count;
+}
+
+static const char* policy_names[] = {"block", "drop-newest", "drop-oldest", "live-only"};
+
+const char* output_policy_name(int send_policy)
+{
+    return policy_names[send_policy];
+}
+
+int output_parse_policy(const char* name)
+{
+    for (int i=0; i<(int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int output_drained(Output* output)
+{
+    for (int i=0; i<output->count; i++) {
+        if (atomic_load_explicit(&output->endpoints[i].in_flight, memory_order_relaxed) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int output_format_stats(Output* output, char* buffer, size_t size)
+{
+    int length = snprintf(buffer, size, "\"outputs\": [");
+    for (int i=0; i<output->count && length < (int)size; i++) {
+        const Endpoint* endpoint = &output->endpoints[i];
+        length += snprintf(buffer + length, size - length,
+                           "%s{\"endpoint\": \"%s\",\"frames\": %llu,\"in_flight\": %d}",
+                           i ? "," : "", endpoint->endpoint,
+                           (unsigned long long)atomic_load(&endpoint->frames),
+                           atomic_load(&endpoint->in_flight));
+    }
+    if (length < (int)size) {
+        length += snprintf(buffer + length, size - length, "]");
+    }
+    return length;
+}
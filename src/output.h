@@ -0,0 +1,110 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define OUTPUT_MAX_ENDPOINTS 16
+
+// Which endpoint a frame is sent to, messages go to all of them
+enum OutputPolicy
+{
+    OUTPUT_ROUND_ROBIN,
+    // frame number modulo the number of endpoints, a writer always gets the same frames
+    OUTPUT_MODULO,
+    // endpoint with the fewest frames zmq hasn't released yet
+    OUTPUT_LEAST_LOADED
+};
+
+// What the sender does with a frame an endpoint doesn't take
+enum SendPolicy
+{
+    // wait for the endpoint, with a send timeout the frame is dropped after it
+    SEND_BLOCK,
+    // drop the frame right away, the ones zmq already queued go out
+    SEND_DROP_NEWEST,
+    // wait, but drop the frame as soon as a newer one is ready or the timeout passed
+    SEND_DROP_OLDEST,
+    // stop sending frames until the output caught up, they only go to the live view
+    SEND_LIVE_ONLY
+};
+
+typedef struct
+{
+    const char* endpoints[OUTPUT_MAX_ENDPOINTS];
+    int count;
+    int policy;
+    // zmq io threads of the context, the sockets are spread over them
+    int io_threads;
+    // io thread of the first endpoint, the detectors sharing a context start at
+    // different ones
+    int first_io_thread;
+    // frames queued per connection before a send blocks, 0 keeps the zmq default
+    int sndhwm;
+    // kernel send buffer of every connection in bytes, 0 keeps the system default
+    int sndbuf;
+    int send_policy;
+    // milliseconds a message, and with SEND_BLOCK or SEND_DROP_OLDEST a frame, waits
+    // for an endpoint before it is dropped, 0 waits forever
+    int send_timeout_ms;
+    // PUB socket the image headers and messages are published on without the pixels,
+    // NULL disables it
+    const char* stats_endpoint;
+    // PUB socket the radial profiles of the images are published on, NULL disables it
+    const char* profile_endpoint;
+} OutputConfig;
+
+typedef struct
+{
+    void* socket;
+    const char* endpoint;
+    atomic_uint_fast64_t frames;
+    // frames handed to zmq whose buffers are not released yet
+    atomic_int in_flight;
+} Endpoint;
+
+// PUSH sockets the frames are distributed over, each one for a writer of its own.
+// Only used by the sender thread, except for the counters.
+typedef struct
+{
+    OutputConfig config;
+    Endpoint endpoints[OUTPUT_MAX_ENDPOINTS];
+    int count;
+    // next endpoint for round robin
+    int next;
+    // NULL if there is no stats stream
+    void* stats_socket;
+    // NULL if there is no profile stream
+    void* profile_socket;
+} Output;
+
+// The io threads have to be set on the context before any socket is created.
+// Returns -1 if a socket can't be bound.
+int output_init(Output* output, const OutputConfig* config, void* context);
+void output_close(Output* output);
+// Endpoint the next frame is sent to
+int output_select(Output* output, int frame_number);
+void output_sent(Output* output, int endpoint);
+// Called when zmq releases the buffer of a frame sent to endpoint
+void output_released(Output* output, int endpoint);
+// Sends a single part message like the series header to every endpoint and publishes it.
+// Returns -1 if an endpoint didn't take it within timeout_ms, 0 waits forever.
+int output_broadcast(Output* output, const void* data, size_t size, int timeout_ms);
+// Publishes an image header on the stats stream, dropped if a subscriber is too slow
+void output_publish(Output* output, const void* header, size_t size);
+// Publishes a json header and the profile data as two parts, dropped if a subscriber
+// is too slow
+void output_publish_profile(Output* output, const void* header, size_t header_size,
+                            const void* data, size_t data_size);
+// 1 if every endpoint takes a message right now, e.g. for a broadcast that mustn't block
+int output_writable(Output* output);
+// Name of a send policy like drop-newest and back, -1 for an unknown name
+const char* output_policy_name(int send_policy);
+int output_parse_policy(const char* name);
+// 1 once zmq released the buffers of all frames sent so far
+int output_drained(Output* output);
+// "outputs" json member with the counters of every endpoint, returns the length like snprintf
+int output_format_stats(Output* output, char* buffer, size_t size);
+
+#endif // OUTPUT_H
@@ -6,23 +6,37 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/inotify.h>
 #include <getopt.h>
 #include <zmq.h>
-#include "tiff.h"
-#include "queue.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "logger.h"
+#include "reorder.h"
+#include "metadata.h"
+#include "placement.h"
 
 #define BUFFER_SIZE 1024
+// an arm request the camserver didn't answer completely by then fails
+#define ARM_TIMEOUT_MS 5000
 #define EVENT_SIZE sizeof(struct inotify_event)
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
 
 // assume pilatus has int32 data so 4 bytes per pixel
 #define ELEMENT_SIZE 4
 
+// a process serves up to this many detectors, each with a pipeline of its own
+#define MAX_DETECTORS 8
+
+// detector sizes that can be given by name, any other size as WxH
 enum DetectorSize
 {
+    // size the buffers from the first frame
+    DetectorAuto = 0,
     // 487 x 195 Pixels
     Pilatus100k = 94965,
     // 981 x 1043 Pixels
@@ -31,167 +45,580 @@ enum DetectorSize
     Pilatus2M = 2476525
 };
 
+// An arm request waiting for the camserver to answer the commands it was split into
 typedef struct
 {
-    zmq_msg_t header_msg;
-    zmq_msg_t blob_msg;
-} Payload;
+    // replies still owed, 0 if no arm request is waiting
+    int pending;
+    // first error reply of the camserver
+    char error[256];
+    int64_t start;
+    int64_t deadline;
+    ArmSettings settings;
+    int series;
+} ArmState;
 
 typedef struct
 {
-    char last_file[256];
-    char recent_file[256];
+    // of the detector, NULL if the process serves a single one
+    const char* name;
     const char* file_ending;
     void* context;
-    void* push_socket;
+    Output output;
     void* monitor_socket;
     int scan_numer;
-    void* mem_pool;
-    Queue queue;
-    Payload most_recent_img;
+    // settings of the next series as last confirmed by the camserver
+    SeriesMetadata metadata;
+    ArmState arm;
+    Reorder reorder;
+    // rois for the next series, set on the command line or with roi requests
+    Roi rois[FRAMESTATS_MAX_ROIS];
+    int nrois;
+    Pool pool;
+    Pipeline pipeline;
+    Liveview liveview;
+    int liveview_enabled;
+    Spill spill;
+    int spill_enabled;
+    Correction correction;
+    int correction_enabled;
+    // only with a profile endpoint
+    Integrator integrator;
+    int integrator_enabled;
 } Pilatus;
 
-void pilatus_init(Pilatus* pilatus, enum DetectorSize num_pixels, const char* file_ending)
+// Everything that is set per detector
+typedef struct
+{
+    // NULL if the process serves a single detector
+    const char* name;
+    const char* folder;
+    const char* file_ending;
+    size_t num_pixels;
+    int width;
+    int height;
+    char camserver_address[64];
+    int camserver_port;
+    // port the client talks the camserver protocol on
+    int control_port;
+    const char* monitor_endpoint;
+    PipelineConfig config;
+    PoolConfig pool_config;
+    OutputConfig output_config;
+    ReorderConfig reorder_config;
+    // rois and geometry of the first series
+    Roi rois[FRAMESTATS_MAX_ROIS];
+    int nrois;
+    Geometry geometry;
+    CorrectionConfig correction_config;
+    int correction;
+    SpillConfig spill_config;
+    LiveviewConfig live_config;
+} DetectorConfig;
+
+void detector_config_init(DetectorConfig* d)
+{
+    d->name = NULL;
+    d->folder = NULL;
+    d->file_ending = NULL;
+    d->num_pixels = DetectorAuto;
+    d->width = 0;
+    d->height = 0;
+    snprintf(d->camserver_address, sizeof(d->camserver_address), "127.0.0.1");
+    d->camserver_port = 41234;
+    d->control_port = 8888;
+    d->monitor_endpoint = "tcp://*:9998";
+    d->config.nworkers = 4;
+    d->config.batch_size = 16;
+    d->config.direct = 0;
+    d->config.decode = 0;
+    d->config.compression = COMPRESSION_NONE;
+    d->config.timestamps = 0;
+    d->config.header_format = HEADER_JSON;
+    d->config.send_batch = 1;
+    d->config.send_batch_ms = 0;
+    d->config.frame_stats = 0;
+    d->config.saturation = 1048575;
+    d->config.name = NULL;
+    d->pool_config.depth = 100;
+    d->pool_config.hugepages = 0;
+    d->pool_config.lock = 0;
+    d->pool_config.numa_node = -1;
+    d->pool_config.policy = POOL_WAIT;
+    d->pool_config.timeout_ms = 5000;
+    d->output_config.count = 0;
+    d->output_config.policy = OUTPUT_ROUND_ROBIN;
+    d->output_config.io_threads = 1;
+    d->output_config.first_io_thread = 0;
+    d->output_config.sndhwm = 0;
+    d->output_config.sndbuf = 0;
+    d->output_config.send_policy = SEND_BLOCK;
+    d->output_config.send_timeout_ms = 0;
+    d->output_config.stats_endpoint = NULL;
+    d->output_config.profile_endpoint = NULL;
+    d->reorder_config.window = 64;
+    d->reorder_config.timeout_ms = 1000;
+    d->nrois = 0;
+    d->geometry.bins = 0;
+    d->correction_config.mask_path = NULL;
+    d->correction_config.flatfield_path = NULL;
+    d->correction_config.version = "1";
+    d->correction = 0;
+    d->spill_config.path = NULL;
+    d->spill_config.size = 4ULL << 30;
+    d->spill_config.deadline_ms = 100;
+    d->live_config.endpoint = "tcp://*:9997";
+    d->live_config.rate = 0.0;
+    d->live_config.binning = 2;
+    d->live_config.uint16 = 0;
+    d->live_config.lz4 = 0;
+}
+
+// The zmq context and the readers are shared by all detectors of the process
+void pilatus_init(Pilatus* pilatus, const DetectorConfig* d, void* context, Readers* readers)
 {
-    pilatus->last_file[0] = '\0';
+    const PipelineConfig* config = &d->config;
+    const PoolConfig* pool_config = &d->pool_config;
+    pilatus->name = d->name;
     pilatus->scan_numer = 0;
-    pilatus->file_ending = file_ending;
-    pilatus->context = zmq_ctx_new();
-    pilatus->push_socket = zmq_socket(pilatus->context, ZMQ_PUSH);
-    int rc = zmq_bind(pilatus->push_socket, "tcp://*:9999");
-    if (rc != 0) {
-        printf("zmq_bind for push socket failed\n");
+    metadata_init(&pilatus->metadata);
+    pilatus->metadata.width = d->width;
+    pilatus->metadata.height = d->height;
+    pilatus->arm.pending = 0;
+    reorder_init(&pilatus->reorder, &d->reorder_config);
+    pilatus->file_ending = config->file_ending;
+    pilatus->context = context;
+    if (output_init(&pilatus->output, &d->output_config, pilatus->context) != 0) {
+        exit(-1);
     }
     pilatus->monitor_socket = zmq_socket(pilatus->context, ZMQ_REP);
-    rc = zmq_bind(pilatus->monitor_socket, "tcp://*:9998");
+    int rc = zmq_bind(pilatus->monitor_socket, d->monitor_endpoint);
     if (rc != 0) {
-        printf("zmq_bind for monitor socket failed\n");
+        log_error("zmq_bind for monitor socket failed");
+    }
+    pilatus->liveview_enabled = 0;
+    if (d->live_config.rate > 0.0) {
+        if (liveview_init(&pilatus->liveview, &d->live_config, pilatus->context) != 0) {
+            exit(-1);
+        }
+        pilatus->liveview_enabled = 1;
+    }
+    pilatus->spill_enabled = 0;
+    if (d->spill_config.path) {
+        if (spill_init(&pilatus->spill, &d->spill_config) != 0) {
+            exit(-1);
+        }
+        pilatus->spill_enabled = 1;
+    }
+    pilatus->correction_enabled = 0;
+    if (d->correction) {
+        if (correction_init(&pilatus->correction, &d->correction_config) != 0) {
+            exit(-1);
+        }
+        pilatus->correction_enabled = 1;
+    }
+    pilatus->integrator_enabled = d->output_config.profile_endpoint != NULL;
+    if (pilatus->integrator_enabled) {
+        integrator_init(&pilatus->integrator);
     }
     
-    zmq_msg_init(&pilatus->most_recent_img.header_msg);
-    zmq_msg_init(&pilatus->most_recent_img.blob_msg);
+    pool_init(&pilatus->pool, pool_config);
+    if (d->num_pixels != DetectorAuto) {
+        size_t item_size = pipeline_buffer_size(config, d->num_pixels, ELEMENT_SIZE, 0);
+        if (pool_allocate(&pilatus->pool, item_size) != 0) {
+            exit(-1);
+        }
+    }
     
-    const size_t nitems = 100;
-    // overhead for cbf header 128k
-    const size_t overhead = 128000;
-    queue_init(&pilatus->queue, nitems);
-    pilatus->mem_pool = malloc(nitems * (size_t)num_pixels * ELEMENT_SIZE + overhead);
-    size_t item_size = num_pixels * ELEMENT_SIZE;
-    for (size_t i=0; i<nitems; i++) {
-        queue_push(&pilatus->queue, &((char*)pilatus->mem_pool)[i*item_size]);
+    // Fewer slots than buffers, so the oldest frame can always get a buffer once zmq
+    // has released the ones of frames already sent. Every reader may hold one extra
+    // buffer, e.g. for decoding, the most recent image for the monitor holds one and
+    // the frame the live view is working on another one.
+    // The push sockets are only used by the sender thread from here on.
+    pipeline_init(&pilatus->pipeline,
+                  pool_config->depth - config->nworkers - 1 - pilatus->liveview_enabled, config,
+                  readers, &pilatus->pool, &pilatus->output,
+                  pilatus->liveview_enabled ? &pilatus->liveview : NULL,
+                  pilatus->spill_enabled ? &pilatus->spill : NULL,
+                  pilatus->correction_enabled ? &pilatus->correction : NULL,
+                  pilatus->integrator_enabled ? &pilatus->integrator : NULL);
+    // like the roi and geometry requests they apply from the next series on
+    memcpy(pilatus->rois, d->rois, d->nrois * sizeof(Roi));
+    pilatus->nrois = d->nrois;
+    pipeline_set_rois(&pilatus->pipeline, d->rois, d->nrois);
+    if (d->geometry.bins > 0) {
+        pipeline_set_geometry(&pilatus->pipeline, &d->geometry);
+    }
+}
+
+void pilatus_close(Pilatus* pilatus)
+{
+    pipeline_close(&pilatus->pipeline);
+    output_close(&pilatus->output);
+    zmq_close(pilatus->monitor_socket);
+    if (pilatus->spill_enabled) {
+        spill_close(&pilatus->spill);
+    }
+    pool_close(&pilatus->pool);
+    if (pilatus->correction_enabled) {
+        correction_close(&pilatus->correction);
     }
+    if (pilatus->integrator_enabled) {
+        integrator_close(&pilatus->integrator);
+    }
+    reorder_close(&pilatus->reorder);
 }
 
-int connect_camserver()
+int connect_camserver(const char* address, int port)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
-        printf("Could not create camserver socket");
+        log_error("Could not create camserver socket");
         return -1;
     }
     struct sockaddr_in server;
     server.sin_family = AF_INET;
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server.sin_port = htons(41234);
+    server.sin_addr.s_addr = inet_addr(address);
+    server.sin_port = htons(port);
     if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
-        printf("Error connecting to camserver socket\n");
+        log_error("Error connecting to camserver socket at %s:%d", address, port);
         return -1;
     }
+    // the commands of an arm request go out back to back, none of them may wait for
+    // the ack of the one before
+    const int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     return sock;
 }
 
-int start_server()
+int start_server(int port)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
-        printf("Could not create server socket");
+        log_error("Could not create server socket");
         return -1;
     }
     struct sockaddr_in server;
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(8888);
+    server.sin_port = htons(port);
     if( bind(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
-         printf("Error binding to server socket: %s\n", strerror(errno));
+         log_error("Error binding to server socket on port %d: %s", port, strerror(errno));
     }
     listen(sock, 3);
     return sock;
 }
 
-int get_frame_number(const char* filename)
+void end_of_exposure(Pilatus* pilatus)
+{
+    char msg[128];
+    int length = snprintf(msg, sizeof(msg), "{\"htype\": \"series_end\",\"lost\": %d}",
+                          pilatus->reorder.series_lost);
+    pipeline_submit_message(&pilatus->pipeline, msg, length);
+}
+
+// Queues the files the reorder stage released, and ends the series once every frame
+// was queued or declared lost
+void submit_ready(Pilatus* pilatus)
+{
+    Reorder* reorder = &pilatus->reorder;
+    const int complete = reorder_complete(reorder);
+    if (reorder->ready_count > 0) {
+        pipeline_submit_files(&pilatus->pipeline, reorder->ready_names, reorder->ready_numbers,
+                              reorder->ready_count);
+        reorder_clear_ready(reorder);
+    }
+    if (complete) {
+        end_of_exposure(pilatus);
+    }
+}
+
+// Adds or replaces a roi for the next series with "roi name=x,y,width,height" or removes
+// all of them with "roi clear". Answered by the streamer in the camserver format.
+void handle_roi(const char* request, int client_sock, Pilatus* pilatus)
+{
+    char arg[128] = "";
+    sscanf(request, "%*s %127s", arg);
+    char reply[256];
+    Roi roi;
+    if (strcasecmp(arg, "clear") == 0) {
+        pilatus->nrois = 0;
+        snprintf(reply, sizeof(reply), "15 OK rois cleared\x18");
+    }
+    else if (framestats_parse_roi(arg, &roi) != 0) {
+        snprintf(reply, sizeof(reply), "15 ERR roi has to be name=x,y,width,height\x18");
+    }
+    else {
+        int index = 0;
+        while (index < pilatus->nrois && strcmp(pilatus->rois[index].name, roi.name) != 0) {
+            index++;
+        }
+        if (index == FRAMESTATS_MAX_ROIS) {
+            snprintf(reply, sizeof(reply), "15 ERR at most %d rois\x18", FRAMESTATS_MAX_ROIS);
+        }
+        else {
+            pilatus->rois[index] = roi;
+            if (index == pilatus->nrois) {
+                pilatus->nrois++;
+            }
+            snprintf(reply, sizeof(reply), "15 OK roi %s set to: %d %d %d %d\x18", roi.name,
+                     roi.x, roi.y, roi.width, roi.height);
+        }
+    }
+    pipeline_set_rois(&pilatus->pipeline, pilatus->rois, pilatus->nrois);
+    if (client_sock >= 0 && write(client_sock, reply, strlen(reply)) < 0) {
+        log_error("Could not answer the roi request: %s", strerror(errno));
+    }
+}
+
+void handle_geometry(const char* request, int client_sock, Pilatus* pilatus)
 {
-    int frame_number;
-    char* tmp = strrchr(filename, '_');
-    // if nimages=1 no frame number is appended to filename
-    if (tmp == NULL) {
-        frame_number = 0;
+    char arg[200] = "";
+    sscanf(request, "%*s %199s", arg);
+    char reply[256];
+    Geometry geometry;
+    if (!pilatus->integrator_enabled) {
+        snprintf(reply, sizeof(reply), "15 ERR integration needs a profile endpoint\x18");
+    }
+    else if (strcasecmp(arg, "clear") == 0) {
+        pipeline_set_geometry(&pilatus->pipeline, NULL);
+        snprintf(reply, sizeof(reply), "15 OK geometry cleared\x18");
+    }
+    else if (integrate_parse_geometry(arg, &geometry) != 0) {
+        snprintf(reply, sizeof(reply),
+                 "15 ERR geometry has to be cx=..,cy=..,distance=..,wavelength=..\x18");
     }
     else {
-        sscanf(tmp, "_%05d.tif", &frame_number);
+        pipeline_set_geometry(&pilatus->pipeline, &geometry);
+        snprintf(reply, sizeof(reply), "15 OK geometry set to: %g %g %g %g %g %d\x18",
+                 geometry.center_x, geometry.center_y, geometry.distance, geometry.wavelength,
+                 geometry.pixel_size, geometry.bins);
+    }
+    if (client_sock >= 0 && write(client_sock, reply, strlen(reply)) < 0) {
+        log_error("Could not answer the geometry request: %s", strerror(errno));
+    }
+}
+
+// Series header with everything known about the series when it is armed, so the image
+// headers only need to carry what changes per frame
+int format_series_header(Pilatus* pilatus, const char* save_path, char* msg, size_t size)
+{
+    const Pipeline* pipeline = &pilatus->pipeline;
+    int length = snprintf(msg, size, "{\"htype\": \"header\",\"filename\": \"%s\","
+                          "\"header_format\": \"%s\",", save_path,
+                          pipeline->config.header_format == HEADER_BINARY ? "binary" : "json");
+    length += metadata_format(&pilatus->metadata, msg + length, size - length);
+    // the pipeline switched to the geometry of this series already
+    const Geometry* g = &pipeline->geometry;
+    if (g->bins > 0 && length < (int)size) {
+        length += snprintf(msg + length, size - length,
+                           ",\"geometry\": {\"cx\": %g,\"cy\": %g,\"distance\": %g,"
+                           "\"pixel\": %g,\"wavelength\": %g,\"bins\": %d}",
+                           g->center_x, g->center_y, g->distance, g->pixel_size, g->wavelength,
+                           g->bins);
+    }
+    if (pilatus->correction_enabled && length < (int)size &&
+        atomic_load_explicit(&pilatus->correction.ready, memory_order_acquire)) {
+        length += snprintf(msg + length, size - length, ",%s", pilatus->correction.header);
+    }
+    if (length < (int)size) {
+        length += snprintf(msg + length, size - length, "}");
+    }
+    return length < (int)size ? length : (int)size - 1;
+}
+
+// Starts the series of the exposure command cmd. The camserver writes into the watched
+// folder under a name of the streamer, the previous series is ended and the series
+// header queued. Writes the command for the camserver into command and returns its
+// length including the null byte.
+int start_series(Pilatus* pilatus, const char* cmd, const char* save_path, char* command,
+                 size_t size)
+{
+    int nb = snprintf(command, size - 1, "%s scan%d.%s", cmd, pilatus->scan_numer,
+                      pilatus->file_ending);
+    // for null terminator added by snprintf
+    nb += 1;
+    pilatus->scan_numer++;
+
+    // a series that didn't get all its frames ends before the next one starts
+    if (pilatus->reorder.active) {
+        reorder_flush(&pilatus->reorder);
+        submit_ready(pilatus);
+    }
+    pipeline_start_series(&pilatus->pipeline);
+    reorder_start(&pilatus->reorder, pilatus->metadata.nimages);
+    char msg[1024];
+    int length = format_series_header(pilatus, save_path, msg, sizeof(msg));
+    pipeline_submit_message(&pilatus->pipeline, msg, length);
+    return nb;
+}
+
+static void reply_arm_error(int client_sock, const char* error)
+{
+    char reply[512];
+    snprintf(reply, sizeof(reply), "15 ERR arm {\"error\": \"%s\"}\x18", error);
+    if (client_sock >= 0 && write(client_sock, reply, strlen(reply)) < 0) {
+        log_error("Could not answer the arm request: %s", strerror(errno));
     }
-    return frame_number;
 }
 
-void handle_request(char buffer[], int nb, int camserver_sock, Pilatus* pilatus)
+// "arm nimages=..,exptime=..,expperiod=..[,path=..][,mode=..]" sets up and starts a
+// series in one round trip. The settings are checked here and sent to the camserver
+// back to back, handle_respone collects its replies and answers once.
+void handle_arm(const char* request, int camserver_sock, int client_sock, Pilatus* pilatus)
 {
-    printf("Request: %s\n", buffer);
+    char arg[512] = "";
+    sscanf(request, "%*s %511s", arg);
+    ArmSettings settings;
+    const char* error = pilatus->arm.pending ? "the previous arm request is still running" :
+                        metadata_parse_arm(arg, &settings);
+    if (error) {
+        reply_arm_error(client_sock, error);
+        return;
+    }
+    // the series header and the reorder stage go by the settings before they are confirmed
+    metadata_apply_arm(&pilatus->metadata, &settings);
+    char commands[BUFFER_SIZE];
+    int nb = snprintf(commands, sizeof(commands), "nimages %d%cexptime %f%cexpperiod %f%c",
+                      settings.nimages, '\0', settings.exposure_time, '\0',
+                      settings.exposure_period, '\0');
+    nb += start_series(pilatus, settings.mode, settings.path, commands + nb,
+                       sizeof(commands) - nb);
+    ArmState* arm = &pilatus->arm;
+    // nimages, exptime, expperiod and the exposure are answered with a 15
+    arm->pending = 4;
+    arm->error[0] = '\0';
+    arm->start = stats_now();
+    arm->deadline = arm->start + ARM_TIMEOUT_MS * 1000000LL;
+    arm->settings = settings;
+    arm->series = pilatus->pipeline.series;
+    if (write(camserver_sock, commands, nb) != nb) {
+        log_error("Could not send the arm request to the camserver: %s", strerror(errno));
+        arm->pending = 0;
+        reply_arm_error(client_sock, "camserver not reachable");
+    }
+}
+
+// Answers the arm request with an error without waiting for the replies still owed.
+// Replies arriving later go to the client as they are.
+static void arm_fail(Pilatus* pilatus, const char* error, int client_sock)
+{
+    if (!pilatus->arm.pending) {
+        return;
+    }
+    log_error("Arm request failed, %d replies of the camserver missing: %s",
+              pilatus->arm.pending, error);
+    pilatus->arm.pending = 0;
+    reply_arm_error(client_sock, error);
+}
+
+// Answers the arm request once the camserver answered all of its commands
+static void arm_reply(Pilatus* pilatus, const char* token, int client_sock)
+{
+    ArmState* arm = &pilatus->arm;
+    if (strstr(token, "ERR") && arm->error[0] == '\0') {
+        snprintf(arm->error, sizeof(arm->error), "%s", token);
+    }
+    if (--arm->pending > 0) {
+        return;
+    }
+    if (arm->error[0] != '\0') {
+        // the reply of the camserver is text, without the quotes it stays valid json
+        for (char* c = arm->error; *c; c++) {
+            *c = *c == '"' || *c == '\\' ? '\'' : *c;
+        }
+        reply_arm_error(client_sock, arm->error);
+        return;
+    }
+    const ArmSettings* settings = &arm->settings;
+    char reply[512];
+    snprintf(reply, sizeof(reply),
+             "15 OK arm {\"series\": %d,\"nimages\": %d,\"exptime\": %g,\"expperiod\": %g,"
+             "\"path\": \"%s\",\"mode\": \"%s\",\"camserver_us\": %lld}\x18",
+             arm->series, settings->nimages, settings->exposure_time, settings->exposure_period,
+             settings->path, settings->mode, (long long)(stats_now() - arm->start) / 1000);
+    if (client_sock >= 0 && write(client_sock, reply, strlen(reply)) < 0) {
+        log_error("Could not answer the arm request: %s", strerror(errno));
+    }
+}
+
+void handle_request(char buffer[], int nb, int camserver_sock, int client_sock, Pilatus* pilatus)
+{
+    log_debug("Request: %s", buffer);
+    // rois and the geometry are handled by the streamer, the camserver doesn't know them
+    if (strncasecmp(buffer, "roi", 3) == 0 && (buffer[3] == ' ' || buffer[3] == '\0')) {
+        handle_roi(buffer, client_sock, pilatus);
+        return;
+    }
+    if (strncasecmp(buffer, "geometry", 8) == 0 && (buffer[8] == ' ' || buffer[8] == '\0')) {
+        handle_geometry(buffer, client_sock, pilatus);
+        return;
+    }
+    if (strncasecmp(buffer, "arm", 3) == 0 && (buffer[3] == ' ' || buffer[3] == '\0')) {
+        handle_arm(buffer, camserver_sock, client_sock, pilatus);
+        return;
+    }
     if ((strncasecmp(buffer, "Exposure", 8) == 0) ||
         (strncasecmp(buffer, "ExtMtrigger", 11) == 0) ||
         (strncasecmp(buffer, "ExtEnable", 9) == 0) ||
         (strncasecmp(buffer, "Exttrigger", 10) == 0)) {
-        printf("Arm detector request\n");
+        log_debug("Arm detector request");
         char cmd[64];
         char save_path[256];
         if (sscanf(buffer, "%s %s", cmd, save_path) != 2) {
-            printf("Not saving\n");
+            log_debug("Not saving");
             save_path[0] = '\0';
         }
-        nb = snprintf(buffer, BUFFER_SIZE-1, 
-                      "%s scan%d.%s", cmd, pilatus->scan_numer, pilatus->file_ending);
-        // for null terminator added by snprintf
-        nb += 1;
-        pilatus->scan_numer++;
-        
-        char msg[1024];
-        int length = snprintf(msg, 1023, 
-                              "{\"htype\": \"header\","
-                               "\"filename\": \"%s\"}", save_path);
-        printf("Msg:%s\n", msg);
-        zmq_send(pilatus->push_socket, msg, length, 0);
+        nb = start_series(pilatus, cmd, save_path, buffer, BUFFER_SIZE);
     }
     int bw = write(camserver_sock, buffer, nb);
-    printf("req write %d\n", bw);
-}
-
-void end_of_exposure(Pilatus* pilatus)
-{
-    const char* msg = "{\"htype\": \"series_end\"}";
-    printf("Msg:%s\n", msg);
-    zmq_send(pilatus->push_socket, msg, strlen(msg), 0);
-    pilatus->last_file[0] = '\0';
+    log_debug("req write %d", bw);
 }
 
-void handle_respone(char buffer[], int nb, Pilatus* pilatus)
+// While an arm request waits for its replies they are taken out of the stream to the
+// client and the other replies are forwarded one by one. buffer only holds complete
+// replies, the first skip bytes were already forwarded.
+void handle_respone(char buffer[], int skip, int client_sock, Pilatus* pilatus)
 {
+    // on_camserver didn't forward the buffer as a whole
+    const int forward = pilatus->arm.pending && client_sock >= 0;
     char* rest = NULL;
     char* token;
     for (token = strtok_r(buffer, "\x18", &rest);
          token != NULL;
          token = strtok_r(NULL, "\x18", &rest)) {   
-        printf("token:%s\n", token);
-        if (strncmp(token, "7", 1) == 0) {
-            printf("Acquisition finished\n");
+        log_debug("token:%s", token);
+        if (pilatus->arm.pending && strncmp(token, "15 ", 3) == 0) {
+            metadata_parse_reply(&pilatus->metadata, token);
+            arm_reply(pilatus, token, client_sock);
+            continue;
+        }
+        if (forward) {
+            // only the first reply can start with bytes of the last read
+            const size_t length = strlen(token);
+            const size_t sent = token == buffer ? (size_t)skip : 0;
+            if (write(client_sock, token + sent, length - sent) < 0 ||
+                write(client_sock, "\x18", 1) < 0) {
+                log_error("Could not forward the camserver reply: %s", strerror(errno));
+            }
+        }
+        if (metadata_parse_reply(&pilatus->metadata, token)) {
+            log_debug("Series setting: %s", token);
+        }
+        else if (strncmp(token, "7", 1) == 0) {
+            log_info("Acquisition finished");
             char status[16];
             char path[256];
             sscanf(token, "%*d %s %s", status, path);
             
             if (strncmp(status, "OK", 2) == 0) {
                 char* filename = strrchr(path, '/');
-                strcpy(pilatus->last_file, filename+1);
-                printf("status: %s\nlast file: %s\n", status, pilatus->last_file);
-                if (strcmp(pilatus->last_file, pilatus->recent_file) == 0) {
-                    end_of_exposure(pilatus);
-                }
+                filename = filename ? filename + 1 : path;
+                log_info("status: %s, last file: %s", status, filename);
+                // the last file tells how many frames there are, also after an abort
+                const int last = reorder_frame_number(filename);
+                reorder_expect(&pilatus->reorder, last >= 0 ? last + 1 : -1, 1, stats_now());
+                submit_ready(pilatus);
             }
             // Error in aquisition, send end of stream message
             // Pilatus 3 seems to send 7 ERR and 7 OK if you abort aquisition
@@ -203,117 +630,79 @@ void handle_respone(char buffer[], int nb, Pilatus* pilatus)
     }
 }
 
-void free_queue_callback(void* data, void* hint)
-{
-    Queue* queue = (Queue*)hint;
-    queue_push(queue, data);
-}
-
-int get_int(char* data, const char* pattern)
-{
-    char* ptr = strstr(data, pattern);
-    if (!ptr) {
-        printf("Bad header - cannot find %s\n", pattern);
-    }
-    ptr += strlen(pattern);
-    int value;
-    if (sscanf(ptr, "%d", &value) != 1) {
-        printf("Error getting binary size\n");
-        return -1;
-    }
-    return value;
-}
-
-void handle_file(char buffer[], int nb, Pilatus* pilatus, const char* folder)
+void handle_file(char buffer[], int nb, Pilatus* pilatus)
 {
+    const int64_t now = stats_now();
     int i = 0;
     while (i < nb) {
         struct inotify_event* event = (struct inotify_event*) &buffer[i];
-        if (event->len) {
-            printf("New file: %s\n", event->name);
-            strcpy(pilatus->recent_file, event->name);
-            int frame_number = get_frame_number(event->name);
-            //printf("frame number %d\n", frame_number);
-            
-            char full_path[512];
-            snprintf(full_path, 512, "%s/%s", folder, event->name);
-            FILE* fp = fopen(full_path, "rb");
-            if (!fp) {
-                printf("Could not open file %s\n", full_path);
-            }
-            
-            void* blob;
-            queue_pop(&pilatus->queue, &blob);
-            int blob_size = 0;
-            int shape[2] = {0, 0};
-            // Tif image
-            if (strncmp(pilatus->file_ending, "tif", 3) == 0) {
-                TifInfo info;
-                parse_tif(fp, &info);
-                read_tif_image(fp, &info, blob);
-                blob_size = info.strip_byte_counts;
-                shape[0] = info.height;
-                shape[1] = info.width;
-            }
-            // cbf image
-            else if (strncmp(pilatus->file_ending, "cbf", 3) == 0) {
-                fseek(fp, 0, SEEK_END);
-                long file_size = ftell(fp);
-                fseek(fp, 0, SEEK_SET);
-                fread(blob, 1, file_size, fp);
-                blob_size = file_size;
-                shape[0] = get_int(blob, "X-Binary-Size-Second-Dimension:");
-                shape[1] = get_int(blob, "X-Binary-Size-Fastest-Dimension:");
-            }
-            zmq_msg_t blob_msg;
-            zmq_msg_init_data(&blob_msg, blob, blob_size, free_queue_callback, &pilatus->queue);
-            
-            fclose(fp);
-            int rc = remove(full_path);
-            if (rc == -1) {
-                printf("Error could not delete file %s\n", full_path);
-            }
-            /*
-            float exposure_time = 0.0;
-            char* tmp = strstr(info.description, "Exposure_time");
-            if (tmp != NULL) {
-                sscanf(tmp + 13, "%f", &exposure_time);
+        const int frame_number = event->len ? reorder_frame_number(event->name) : -1;
+        if (event->len && frame_number < 0) {
+            // not a file of the detector, it is left alone
+            log_warning("Ignoring %s without a frame number", event->name);
+        }
+        else if (event->len) {
+            log_debug("New file: %s", event->name);
+            if (!pool_ready(&pilatus->pool)) {
+                size_t item_size = pipeline_buffer_size_from_file(&pilatus->pipeline.config,
+                                                                  event->name);
+                // without buffers the frames are dropped until a file can be parsed
+                if (item_size > 0) {
+                    pool_allocate(&pilatus->pool, item_size);
+                }
             }
-            */
-            char header[1024];
-            char compression[8];
-            compression[0] = '\0';
-            if (strncmp(pilatus->file_ending, "cbf", 3) == 0) {
-                strcpy(compression, "cbf");
+            if (reorder_add(&pilatus->reorder, frame_number, event->name, now) != REORDER_ACCEPTED) {
+                // the file isn't used, nobody else removes it
+                char path[512];
+                snprintf(path, sizeof(path), "%s/%s", pilatus->pipeline.config.folder, event->name);
+                unlink(path);
             }
-            int length = snprintf(header, 1024, 
-                                  "{\"htype\": \"image\","
-                                  "\"frame\": %d,"
-                                  "\"shape\": [%d,%d],"
-                                  "\"type\": \"int32\","
-                                  "\"compression\": \"%s\"}",
-                                  frame_number, shape[0], shape[1], compression);
-            
-            zmq_msg_t header_msg;
-            zmq_msg_init_size(&header_msg, length);
-            memcpy(zmq_msg_data(&header_msg), header, length);
-            
-            // Override most recent image
-            zmq_msg_copy(&pilatus->most_recent_img.header_msg, &header_msg);
-            zmq_msg_copy(&pilatus->most_recent_img.blob_msg, &blob_msg);
-            
-            // send json header
-            zmq_sendmsg(pilatus->push_socket, &header_msg, ZMQ_SNDMORE);
-            
-            // send binary blob
-            zmq_sendmsg(pilatus->push_socket, &blob_msg, 0);
-            
-            if (strcmp(event->name, pilatus->last_file) == 0) {
-                end_of_exposure(pilatus);
+            // all files of one inotify read are handed to the readers together, unless
+            // the reorder stage released too many of them
+            if (reorder_ready_full(&pilatus->reorder)) {
+                submit_ready(pilatus);
             }
         }
         i += EVENT_SIZE + event->len;
     }
+    submit_ready(pilatus);
+}
+
+// Reply to a pool request on the monitor socket
+void send_pool_stats(Pilatus* pilatus)
+{
+    PoolStats stats;
+    pool_stats(&pilatus->pool, &stats);
+    char msg[512];
+    int length = snprintf(msg, sizeof(msg),
+                          "{\"htype\": \"pool\","
+                          "\"depth\": %d,"
+                          "\"item_size\": %zu,"
+                          "\"in_use\": %d,"
+                          "\"high_water_mark\": %d,"
+                          "\"waits\": %llu,"
+                          "\"drops\": %llu}",
+                          stats.depth, stats.item_size, stats.in_use, stats.high_water_mark,
+                          (unsigned long long)stats.waits, (unsigned long long)stats.drops);
+    zmq_send(pilatus->monitor_socket, msg, length, 0);
+}
+
+// Reply to a stats request on the monitor socket
+void send_stats(Pilatus* pilatus)
+{
+    char msg[8192];
+    int length = pipeline_format_stats(&pilatus->pipeline, msg, sizeof(msg));
+    // the reorder stage belongs to the control loop, its counters go into the same object
+    if (length > 0 && msg[length - 1] == '}') {
+        length--;
+        length += snprintf(msg + length, sizeof(msg) - length, ",");
+        length += reorder_format_stats(&pilatus->reorder, msg + length, sizeof(msg) - length);
+        length += snprintf(msg + length, sizeof(msg) - length, "}");
+        if (length >= (int)sizeof(msg)) {
+            length = sizeof(msg) - 1;
+        }
+    }
+    zmq_send(pilatus->monitor_socket, msg, length, 0);
 }
 
 typedef struct
@@ -327,11 +716,11 @@ void notify_init(Notify* notify, const char* folder, uint32_t mask)
 {
     notify->fd = inotify_init();
     if (notify->fd < 0) {
-        printf("Error in inotify_init\n");
+        log_error("Error in inotify_init");
     }
     notify->wd = inotify_add_watch(notify->fd, folder, mask);
     if (notify->wd == -1) {
-        printf("Error watching folder %s\n%s\n", folder, strerror(errno));
+        log_error("Error watching folder %s: %s", folder, strerror(errno));
         exit(-1);
     }
 }
@@ -342,178 +731,1224 @@ void notify_close(Notify* notify)
     close(notify->fd);
 }
 
-static void show_usage(const char* p)
+enum HandlerSource
 {
-  printf("\npilatus-streamer\n"
-         "\n"
-         "Usage: %s [-h]\n"
-         "    -f    The folder on the dcu to watch for new files\n"
-         "    -t    The file format of the images the dcu writes. Either cbf or tif\n"
-         "    -s    The detector size. Either Pilatus100k, Pilatus1M or Pilatus2M\n"
-         "    -h     print this message and exit\n", p);
+    HANDLER_NOTIFY,
+    HANDLER_CAMSERVER,
+    HANDLER_SERVER,
+    HANDLER_CLIENT,
+    HANDLER_MONITOR,
+    // ticks while the reorder stage waits for a missing frame
+    HANDLER_TIMER,
+    HANDLER_COUNT
+};
+
+struct Control;
+
+// A source of events of the control loop, the callback is run when fd is readable
+typedef struct
+{
+    int fd;
+    void (*callback)(struct Control* control);
+} Handler;
+
+// State of the control loop, an epoll reactor dispatching to one handler per source
+typedef struct Control
+{
+    Pilatus* pilatus;
+    Notify notify;
+    int epoll_fd;
+    int camserver_sock;
+    int server_sock;
+    // -1 while no client is connected
+    int client_sock;
+    int timer_fd;
+    // period of the timer, 0 while it is stopped
+    long timer_interval_ms;
+    // start of a reply cut off by the end of the last read, and how much of it
+    // already went to the client
+    char partial[BUFFER_SIZE];
+    int partial_length;
+    int partial_forwarded;
+    Handler handlers[HANDLER_COUNT];
+    char buffer[BUFFER_SIZE];
+} Control;
+
+void control_add(Control* control, int source, int fd, void (*callback)(Control*))
+{
+    Handler* handler = &control->handlers[source];
+    handler->fd = fd;
+    handler->callback = callback;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = handler;
+    if (epoll_ctl(control->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        log_error("Could not add fd %d to epoll: %s", fd, strerror(errno));
+    }
+}
+
+void control_remove(Control* control, int source)
+{
+    Handler* handler = &control->handlers[source];
+    epoll_ctl(control->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+    handler->fd = -1;
 }
 
+// new request from client
+void on_client(Control* control)
+{
+    // the buffer isn't cleared, only the bytes read are terminated
+    int nb = recv(control->client_sock, control->buffer, BUFFER_SIZE - 1, MSG_DONTWAIT);
+    if (nb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    // client disconnected
+    if (nb <= 0) {
+        log_info("client disconnected");
+        control_remove(control, HANDLER_CLIENT);
+        close(control->client_sock);
+        control->client_sock = -1;
+        return;
+    }
+    control->buffer[nb] = '\0';
+    handle_request(control->buffer, nb, control->camserver_sock, control->client_sock,
+                   control->pilatus);
+}
 
-int main(int argc, char* argv[])
+// new connection from client
+void on_server(Control* control)
+{
+    int sock = accept(control->server_sock, (struct sockaddr*)NULL, NULL);
+    if (sock == -1) {
+        log_error("Error accepting connection: %s", strerror(errno));
+        return;
+    }
+    // only one client at a time, the new one replaces the old one
+    if (control->client_sock >= 0) {
+        control_remove(control, HANDLER_CLIENT);
+        close(control->client_sock);
+    }
+    log_info("New connection");
+    // a reply must not wait for the client to ack the one before, e.g. the end of an
+    // exposure right after the reply to arm
+    const int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    control->client_sock = sock;
+    control_add(control, HANDLER_CLIENT, sock, on_client);
+}
+
+// new response from camserver
+void on_camserver(Control* control)
+{
+    Pilatus* pilatus = control->pilatus;
+    const int carried = control->partial_length;
+    memcpy(control->buffer, control->partial, carried);
+    int nb = read(control->camserver_sock, control->buffer + carried, BUFFER_SIZE - 1 - carried);
+    if (nb <= 0) {
+        log_error("Connection to camserver lost");
+        control_remove(control, HANDLER_CAMSERVER);
+        // requests from now on fail right away instead of timing out
+        close(control->camserver_sock);
+        control->camserver_sock = -1;
+        control->partial_length = 0;
+        arm_fail(pilatus, "connection to camserver lost", control->client_sock);
+        return;
+    }
+    // The camserver answers the commands of an arm request one by one, and with Nagle
+    // every reply after the first waits for the ack of the one before. Ack right away
+    // instead of delayed, the kernel falls back to delayed acks after every read.
+    const int quickack = 1;
+    setsockopt(control->camserver_sock, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+    // replies to an arm request are answered by the streamer
+    const int forward = control->client_sock >= 0 && !pilatus->arm.pending;
+    if (forward) {
+        write(control->client_sock, control->buffer + carried, nb);
+    }
+    nb += carried;
+    control->buffer[nb] = '\0';
+
+    // a reply is only handled once its terminator arrived, unless it fills the buffer
+    int complete = nb;
+    while (complete > 0 && control->buffer[complete - 1] != '\x18') {
+        complete--;
+    }
+    if (nb - complete >= BUFFER_SIZE / 2) {
+        complete = nb;
+    }
+    const int skip = control->partial_forwarded < complete ? control->partial_forwarded : complete;
+    control->partial_length = nb - complete;
+    memcpy(control->partial, control->buffer + complete, control->partial_length);
+    control->partial_forwarded = forward ? control->partial_length :
+                                 control->partial_forwarded - skip;
+    control->buffer[complete] = '\0';
+    handle_respone(control->buffer, skip, control->client_sock, pilatus);
+}
+
+// new data file
+void on_notify(Control* control)
+{
+    Notify* notify = &control->notify;
+    int nb = read(notify->fd, notify->buffer, EVENT_BUF_LEN);
+    if (nb > 0) {
+        handle_file(notify->buffer, nb, control->pilatus);
+    }
+}
+
+// new request on monitoring socket
+void on_monitor(Control* control)
+{
+    Pilatus* pilatus = control->pilatus;
+    // the zmq fd only signals that the socket state changed, all pending requests
+    // have to be handled before waiting again
+    uint32_t zmq_event;
+    size_t zmq_event_size = sizeof(zmq_event);
+    zmq_getsockopt(pilatus->monitor_socket, ZMQ_EVENTS, &zmq_event, &zmq_event_size);
+    while(zmq_event & ZMQ_POLLIN) {
+        char msg [256];
+        int nb = zmq_recv(pilatus->monitor_socket, msg, 255, 0);
+        
+        if (nb >= 4 && strncmp(msg, "pool", 4) == 0) {
+            send_pool_stats(pilatus);
+        }
+        else if (nb >= 5 && strncmp(msg, "stats", 5) == 0) {
+            send_stats(pilatus);
+        }
+        else {
+            // send json header
+            zmq_msg_t header;
+            zmq_msg_t blob;
+            zmq_msg_init(&header);
+            zmq_msg_init(&blob);
+            pipeline_copy_recent(&pilatus->pipeline, &header, &blob);
+            zmq_sendmsg(pilatus->monitor_socket, &header, ZMQ_SNDMORE);
+            
+            // send binary blob
+            zmq_sendmsg(pilatus->monitor_socket, &blob, 0);
+        }
+        zmq_getsockopt(pilatus->monitor_socket, ZMQ_EVENTS, &zmq_event, &zmq_event_size);
+    }
+}
+
+// gaps in the frame numbers and arm requests time out
+void on_timer(Control* control)
+{
+    Pilatus* pilatus = control->pilatus;
+    uint64_t expirations;
+    if (read(control->timer_fd, &expirations, sizeof(expirations)) > 0) {
+        const int64_t now = stats_now();
+        reorder_poll(&pilatus->reorder, now);
+        submit_ready(pilatus);
+        if (pilatus->arm.pending && now >= pilatus->arm.deadline) {
+            arm_fail(pilatus, "timeout", control->client_sock);
+        }
+    }
+}
+
+// The timer only runs while a frame is missing or an arm request waits for replies
+void control_update_timer(Control* control)
+{
+    const Pilatus* pilatus = control->pilatus;
+    const Reorder* reorder = &pilatus->reorder;
+    // a tenth of the timeout, a gap or an arm request times out at most 10% late
+    long interval_ms = 0;
+    if (reorder_waiting(reorder)) {
+        interval_ms = reorder->config.timeout_ms / 10 + 1;
+    }
+    if (pilatus->arm.pending && (interval_ms == 0 || interval_ms > ARM_TIMEOUT_MS / 10)) {
+        interval_ms = ARM_TIMEOUT_MS / 10;
+    }
+    if (interval_ms == control->timer_interval_ms) {
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(control->timer_fd, 0, &spec, NULL);
+    control->timer_interval_ms = interval_ms;
+}
+
+void control_init(Control* control, Pilatus* pilatus, const DetectorConfig* d)
 {
-    char* folder = NULL;
-    char* file_ending = NULL;
-    enum DetectorSize num_pixels = Pilatus2M;
+    control->pilatus = pilatus;
+    control->epoll_fd = epoll_create1(0);
+    for (int i=0; i<HANDLER_COUNT; i++) {
+        control->handlers[i].fd = -1;
+    }
+    control->server_sock = start_server(d->control_port);
+    control->camserver_sock = connect_camserver(d->camserver_address, d->camserver_port);
+    control->client_sock = -1;
+    notify_init(&control->notify, d->folder, IN_MOVED_TO);
     
-    int c;
-    while((c = getopt(argc, argv, ":hf:t:s:")) != EOF) {
-        switch(c) {
-            case 'h':
-                show_usage(argv[0]);
-                return 0;
-            case 'f':
-                folder = optarg;
-                break;
-                
-            case 't':
-                file_ending = optarg;
-                break;
-                
-            case 's':
-                if (strcmp("Pilatus100k", optarg) == 0) {
-                    num_pixels = Pilatus100k;
-                }
-                else if (strcmp("Pilatus1M", optarg) == 0) {
-                    num_pixels = Pilatus1M;
-                }
-                else if (strcmp("Pilatus2M", optarg) == 0) {
-                    num_pixels = Pilatus2M;
-                }
-                else {
-                    printf("Wrong detector size\n");
-                    return -1;
-                }
-                break;
+    control_add(control, HANDLER_NOTIFY, control->notify.fd, on_notify);
+    control_add(control, HANDLER_CAMSERVER, control->camserver_sock, on_camserver);
+    control_add(control, HANDLER_SERVER, control->server_sock, on_server);
+    // the fd of a zmq socket doesn't change, it is only looked up once
+    int socket_fd;
+    size_t fd_size = sizeof(socket_fd);
+    zmq_getsockopt(pilatus->monitor_socket, ZMQ_FD, &socket_fd, &fd_size);
+    control_add(control, HANDLER_MONITOR, socket_fd, on_monitor);
+    control->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    control->timer_interval_ms = 0;
+    control->partial_length = 0;
+    control->partial_forwarded = 0;
+    control_add(control, HANDLER_TIMER, control->timer_fd, on_timer);
+}
+
+void control_run(Control* control)
+{
+    struct epoll_event events[HANDLER_COUNT];
+    while (1) {
+        int n = epoll_wait(control->epoll_fd, events, HANDLER_COUNT, -1);
+        if (n < 0 && errno != EINTR) {
+            log_error("epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+        for (int i=0; i<n; i++) {
+            Handler* handler = events[i].data.ptr;
+            // a handler of this round may have removed another one
+            if (handler->fd >= 0) {
+                handler->callback(control);
+            }
         }
+        control_update_timer(control);
+    }
+}
+
+// Every detector has a control loop of its own, so a detector whose pipeline is full
+// only blocks its own loop
+void* control_thread(void* arg)
+{
+    Control* control = (Control*)arg;
+    logger_set_prefix(control->pilatus->name);
+    placement_apply(THREAD_CONTROL, "control");
+    control_run(control);
+    return NULL;
+}
+
+void control_close(Control* control)
+{
+    notify_close(&control->notify);
+    if (control->client_sock >= 0) {
+        close(control->client_sock);
+    }
+    if (control->camserver_sock >= 0) {
+        close(control->camserver_sock);
     }
-    printf("Folder %s\n", folder);
-    printf("File ending %s\n", file_ending);
+    close(control->server_sock);
+    close(control->timer_fd);
+    close(control->epoll_fd);
+}
+
+static void show_usage(const char* p)
+{
+  printf("\npilatus-streamer\n"
+         "\n"
+         "Usage: %s [-h] [options] [--detector name options]...\n"
+         "\n"
+         "Options after --detector apply to that detector only, the ones before the first\n"
+         "--detector to all of them. -w, -b, -D, --io-threads, the log options and the\n"
+         "placement of the threads are shared by all detectors.\n"
+         "        --detector       Starts the options of another detector of up to 8 served by\n"
+         "                         this process, named in the stats and the log. Every detector\n"
+         "                         needs its own folder, control port and endpoints\n"
+         "    -f, --folder         The folder on the dcu to watch for new files\n"
+         "    -t, --type           The file format of the images the dcu writes. Either cbf or tif\n"
+         "    -s, --size           The detector size. Either Pilatus100k, Pilatus1M, Pilatus2M,\n"
+         "                         WxH in pixels or auto to size the buffers from the first frame\n"
+         "                         (default auto)\n"
+         "    -w, --workers        Number of reader threads loading the files, shared by the\n"
+         "                         detectors (default 4)\n"
+         "    -b, --batch          Maximum number of files a reader loads in one batch (default 16)\n"
+         "    -D, --direct         Read the files with O_DIRECT\n"
+         "    -d, --decode         Decompress cbf files and send plain int32 images\n"
+         "    -c, --compression    Compress plain images before sending, only bslz4 (bitshuffle + lz4)\n"
+         "    -n, --pool-depth     Number of image buffers (default 100)\n"
+         "    -H, --hugepages      Back the image buffers with huge pages\n"
+         "    -L, --mlock          Lock the image buffers into memory\n"
+         "        --numa-node      Bind the image buffers to this NUMA node, a number or the\n"
+         "                         network interface the frames go out on, e.g. eth0, and fault\n"
+         "                         them in when they are allocated\n"
+         "        --pool-policy    What to do if all buffers are in use, wait or drop (default wait)\n"
+         "        --pool-timeout   Milliseconds to wait for a buffer before dropping the frame,\n"
+         "                         0 waits forever (default 5000)\n"
+         "    -T, --timestamps     Add the times of the pipeline stages to the image headers\n"
+         "        --header-format  json or binary image headers. binary is a fixed layout of\n"
+         "                         88 bytes with frame, series, shape, type, compression and the\n"
+         "                         timestamps, see frameheader.h (default json)\n"
+         "        --camserver      Address of the camserver, e.g. of the simulator\n"
+         "                         (default 127.0.0.1:41234)\n"
+         "        --control-port   Port the client sends the camserver commands to (default 8888)\n"
+         "        --monitor-endpoint Endpoint of the REP socket answering pool, stats and image\n"
+         "                         requests (default tcp://*:9998)\n"
+         "        --reorder-window Frames held back at most while an earlier one is missing, the\n"
+         "                         frames are sent in frame number order (default 64)\n"
+         "        --reorder-timeout Milliseconds a missing frame is waited for before it is\n"
+         "                         declared lost (default 1000)\n"
+         "        --frame-stats    Add total counts, maximum, saturated and invalid pixels of\n"
+         "                         plain int32 images (tif, or cbf with -d) to their headers\n"
+         "        --saturation     Pixels at or above this count are saturated (default 1048575)\n"
+         "        --roi            Sum of a region added to the header stats, name=x,y,width,height\n"
+         "                         in pixels, can be given up to 8 times. Also set per series with\n"
+         "                         roi requests on the control port. Implies --frame-stats\n"
+         "        --mask           Tif with the bad pixels as non-zero values, they are set to -2\n"
+         "                         in plain int32 images (tif, or cbf with -d). Implies\n"
+         "                         --mark-gaps\n"
+         "        --flatfield      32 bit float tif the counts are multiplied with, pixels with\n"
+         "                         a factor <= 0 are set to -2. Implies --mark-gaps\n"
+         "        --mark-gaps      Set the pixels between the modules to -1\n"
+         "        --correction-version Version of the correction tables added to the image\n"
+         "                         headers (default 1)\n"
+         "        --profile-endpoint Endpoint of a PUB socket the radial profiles of plain int32\n"
+         "                         images are published on, e.g. tcp://*:9995. Disabled by default\n"
+         "        --geometry       Integrate the images into radial profiles,\n"
+         "                         cx=..,cy=..,distance=..,wavelength=..[,pixel=..][,bins=..] with\n"
+         "                         the beam center in pixels, the distance in mm, the wavelength in\n"
+         "                         Angstrom, the pixel size in um (default 172) and up to 4096 bins\n"
+         "                         (default 1000). Also set per series with geometry requests on\n"
+         "                         the control port. Needs --profile-endpoint\n"
+         "        --stats-endpoint Endpoint of a PUB socket the image headers and series messages\n"
+         "                         are published on without the pixels, e.g. tcp://*:9996\n"
+         "        --send-batch     Send up to this many images as one multipart message, 1 sends\n"
+         "                         every image on its own (default 1)\n"
+         "        --send-batch-ms  Milliseconds a batch waits for more images, 0 sends what is\n"
+         "                         ready without waiting (default 0)\n"
+         "        --endpoint       Endpoint of a PUSH socket the frames are sent to, can be\n"
+         "                         given several times to feed parallel writers, e.g. one per\n"
+         "                         port or network interface (default tcp://*:9999)\n"
+         "        --output-policy  How frames are distributed over several endpoints, round-robin,\n"
+         "                         modulo (of the frame number) or least-loaded (default round-robin)\n"
+         "        --io-threads     Number of zmq io threads, the endpoints are spread over them\n"
+         "                         (default 1)\n"
+         "        --send-policy    What happens to a frame the endpoint doesn't take: block, waits\n"
+         "                         for it, drop-newest drops it right away, drop-oldest waits but\n"
+         "                         drops it once a newer one is ready, live-only stops sending\n"
+         "                         until the output caught up and only feeds the live view.\n"
+         "                         The drops of a series are reported in its series_end\n"
+         "                         (default block)\n"
+         "        --send-timeout   Milliseconds a message, and with block or drop-oldest a frame,\n"
+         "                         waits for the endpoint before it is dropped. 0 waits forever\n"
+         "                         with block, the other policies use 1000 then (default 0)\n"
+         "        --sndhwm         Frames queued per connection of an endpoint before it doesn't\n"
+         "                         take more (default 1000, with --spill or another policy than\n"
+         "                         block half of the free buffers spread over the endpoints)\n"
+         "        --sndbuf         Kernel send buffer of every connection in bytes (default the\n"
+         "                         system default)\n"
+         "        --spill          File on a local disk frames are spilled to if the output doesn't\n"
+         "                         take them in time, they are sent from there once the consumers\n"
+         "                         caught up. Disabled by default\n"
+         "        --spill-size     Size of the spill file in GB (default 4)\n"
+         "        --spill-deadline Milliseconds a frame waits for the output before it is spilled\n"
+         "                         (default 100)\n"
+         "        --live-rate      Maximum number of binned previews per second published for\n"
+         "                         live viewers, 0 disables the live view (default 0)\n"
+         "        --live-endpoint  Endpoint of the live view PUB socket (default tcp://*:9997)\n"
+         "        --live-binning   Sum 1x1, 2x2 or 4x4 pixels in the previews (default 2)\n"
+         "        --live-uint16    Clip the previews to uint16\n"
+         "        --live-lz4       Compress the previews with lz4\n"
+         "        --cpus-control   Cores the control loops run on, a list like 0-3,8\n"
+         "        --cpus-readers   Cores the reader threads run on\n"
+         "        --cpus-sender    Cores the sender threads run on\n"
+         "        --cpus-io        Cores the zmq io threads run on\n"
+         "        --realtime       Run the control loops, readers, senders and zmq io threads\n"
+         "                         with SCHED_FIFO at this priority, 1 to 99\n"
+         "        --mlockall       Lock all memory of the process, now and later\n"
+         "        --log-level      Lowest level logged, debug, info, warning or error. debug\n"
+         "                         shows every file, request and camserver reply (default info)\n"
+         "        --log-rate       Maximum number of log lines per second, the rest is counted\n"
+         "                         as suppressed, errors always go through. 0 is unlimited\n"
+         "                         (default 100)\n"
+         "    -h, --help           print this message and exit\n", p);
+}
+
+// options without a short form
+enum
+{
+    OPT_POOL_POLICY = 256,
+    OPT_POOL_TIMEOUT,
+    OPT_CAMSERVER,
+    OPT_LIVE_RATE,
+    OPT_LIVE_ENDPOINT,
+    OPT_LIVE_BINNING,
+    OPT_LIVE_UINT16,
+    OPT_LIVE_LZ4,
+    OPT_ENDPOINT,
+    OPT_OUTPUT_POLICY,
+    OPT_IO_THREADS,
+    OPT_SPILL,
+    OPT_SPILL_SIZE,
+    OPT_SPILL_DEADLINE,
+    OPT_SEND_BATCH,
+    OPT_SEND_BATCH_MS,
+    OPT_LOG_LEVEL,
+    OPT_LOG_RATE,
+    OPT_REORDER_WINDOW,
+    OPT_REORDER_TIMEOUT,
+    OPT_FRAME_STATS,
+    OPT_SATURATION,
+    OPT_ROI,
+    OPT_STATS_ENDPOINT,
+    OPT_MASK,
+    OPT_FLATFIELD,
+    OPT_MARK_GAPS,
+    OPT_CORRECTION_VERSION,
+    OPT_PROFILE_ENDPOINT,
+    OPT_GEOMETRY,
+    OPT_HEADER_FORMAT,
+    OPT_DETECTOR,
+    OPT_CONTROL_PORT,
+    OPT_MONITOR_ENDPOINT,
+    OPT_NUMA_NODE,
+    OPT_CPUS_CONTROL,
+    OPT_CPUS_READERS,
+    OPT_CPUS_SENDER,
+    OPT_CPUS_IO,
+    OPT_REALTIME,
+    OPT_MLOCKALL,
+    OPT_SEND_POLICY,
+    OPT_SEND_TIMEOUT,
+    OPT_SNDHWM,
+    OPT_SNDBUF
+};
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"folder", required_argument, NULL, 'f'},
+    {"type", required_argument, NULL, 't'},
+    {"size", required_argument, NULL, 's'},
+    {"workers", required_argument, NULL, 'w'},
+    {"batch", required_argument, NULL, 'b'},
+    {"direct", no_argument, NULL, 'D'},
+    {"decode", no_argument, NULL, 'd'},
+    {"compression", required_argument, NULL, 'c'},
+    {"pool-depth", required_argument, NULL, 'n'},
+    {"hugepages", no_argument, NULL, 'H'},
+    {"mlock", no_argument, NULL, 'L'},
+    {"timestamps", no_argument, NULL, 'T'},
+    {"pool-policy", required_argument, NULL, OPT_POOL_POLICY},
+    {"pool-timeout", required_argument, NULL, OPT_POOL_TIMEOUT},
+    {"camserver", required_argument, NULL, OPT_CAMSERVER},
+    {"live-rate", required_argument, NULL, OPT_LIVE_RATE},
+    {"live-endpoint", required_argument, NULL, OPT_LIVE_ENDPOINT},
+    {"live-binning", required_argument, NULL, OPT_LIVE_BINNING},
+    {"live-uint16", no_argument, NULL, OPT_LIVE_UINT16},
+    {"live-lz4", no_argument, NULL, OPT_LIVE_LZ4},
+    {"endpoint", required_argument, NULL, OPT_ENDPOINT},
+    {"output-policy", required_argument, NULL, OPT_OUTPUT_POLICY},
+    {"io-threads", required_argument, NULL, OPT_IO_THREADS},
+    {"spill", required_argument, NULL, OPT_SPILL},
+    {"spill-size", required_argument, NULL, OPT_SPILL_SIZE},
+    {"spill-deadline", required_argument, NULL, OPT_SPILL_DEADLINE},
+    {"send-batch", required_argument, NULL, OPT_SEND_BATCH},
+    {"send-batch-ms", required_argument, NULL, OPT_SEND_BATCH_MS},
+    {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+    {"log-rate", required_argument, NULL, OPT_LOG_RATE},
+    {"reorder-window", required_argument, NULL, OPT_REORDER_WINDOW},
+    {"reorder-timeout", required_argument, NULL, OPT_REORDER_TIMEOUT},
+    {"frame-stats", no_argument, NULL, OPT_FRAME_STATS},
+    {"saturation", required_argument, NULL, OPT_SATURATION},
+    {"roi", required_argument, NULL, OPT_ROI},
+    {"stats-endpoint", required_argument, NULL, OPT_STATS_ENDPOINT},
+    {"mask", required_argument, NULL, OPT_MASK},
+    {"flatfield", required_argument, NULL, OPT_FLATFIELD},
+    {"mark-gaps", no_argument, NULL, OPT_MARK_GAPS},
+    {"correction-version", required_argument, NULL, OPT_CORRECTION_VERSION},
+    {"profile-endpoint", required_argument, NULL, OPT_PROFILE_ENDPOINT},
+    {"geometry", required_argument, NULL, OPT_GEOMETRY},
+    {"header-format", required_argument, NULL, OPT_HEADER_FORMAT},
+    {"detector", required_argument, NULL, OPT_DETECTOR},
+    {"control-port", required_argument, NULL, OPT_CONTROL_PORT},
+    {"monitor-endpoint", required_argument, NULL, OPT_MONITOR_ENDPOINT},
+    {"numa-node", required_argument, NULL, OPT_NUMA_NODE},
+    {"cpus-control", required_argument, NULL, OPT_CPUS_CONTROL},
+    {"cpus-readers", required_argument, NULL, OPT_CPUS_READERS},
+    {"cpus-sender", required_argument, NULL, OPT_CPUS_SENDER},
+    {"cpus-io", required_argument, NULL, OPT_CPUS_IO},
+    {"realtime", required_argument, NULL, OPT_REALTIME},
+    {"mlockall", no_argument, NULL, OPT_MLOCKALL},
+    {"send-policy", required_argument, NULL, OPT_SEND_POLICY},
+    {"send-timeout", required_argument, NULL, OPT_SEND_TIMEOUT},
+    {"sndhwm", required_argument, NULL, OPT_SNDHWM},
+    {"sndbuf", required_argument, NULL, OPT_SNDBUF},
+    {NULL, 0, NULL, 0}
+};
+
+// Checks the options of one detector, prints what is wrong and returns -1 then
+static int detector_check(DetectorConfig* d)
+{
+    printf("Folder %s\n", d->folder);
+    printf("File ending %s\n", d->file_ending);
     
-    if (folder == NULL) {
+    if (d->folder == NULL) {
         printf("Folder to watch is empty. Abort!\n");
         return -1;
     }
     
-     if (file_ending == NULL) {
+     if (d->file_ending == NULL) {
         printf("File ending is empty. Abort!\n");
         return -1;
     }
     
-    if (strcmp("cbf", file_ending) == 0) {
+    if (strcmp("cbf", d->file_ending) == 0) {
     }
-    else if (strcmp("tif", file_ending) == 0) {
+    else if (strcmp("tif", d->file_ending) == 0) {
     }
     else {
         printf("Wrong file format. Has to be either tif or cbf\n");
         return -1;
     }
+    PipelineConfig* config = &d->config;
+    if (d->correction && strcmp("cbf", d->file_ending) == 0 && !config->decode) {
+        printf("cbf images can only be corrected with -d\n");
+        return -1;
+    }
+    if (d->geometry.bins > 0 && !d->output_config.profile_endpoint) {
+        printf("The geometry needs a --profile-endpoint the profiles are published on\n");
+        return -1;
+    }
+    if (d->output_config.profile_endpoint && strcmp("cbf", d->file_ending) == 0 &&
+        !config->decode) {
+        printf("cbf images can only be integrated with -d\n");
+        return -1;
+    }
     
-    Pilatus pilatus;
-    pilatus_init(&pilatus, num_pixels, file_ending);
-    
-    int server_sock = start_server();
-    int camserver_sock = connect_camserver();
-    int client_sock = 0;
+    // one slot per reader for decoding, one for the monitor image, one for the live view
+    // and at least one frame
+    const int live = d->live_config.rate > 0.0;
+    if (d->pool_config.depth < config->nworkers + 2 + live) {
+        printf("Pool depth has to be at least the number of readers + %d\n", 2 + live);
+        return -1;
+    }
     
-    Notify notify;
-    notify_init(&notify, folder, IN_MOVED_TO);
+    if (d->output_config.count == 0) {
+        d->output_config.endpoints[d->output_config.count++] = "tcp://*:9999";
+    }
     
-    fd_set set;
-    char buffer[BUFFER_SIZE];
-    while (1) {
-        FD_ZERO(&set);
-        
-        FD_SET(notify.fd, &set);
-        int maxfd = notify.fd;
-        
-        FD_SET(camserver_sock, &set);
-        maxfd = fmax(camserver_sock, maxfd);
-        
-        FD_SET(server_sock, &set);
-        maxfd = fmax(server_sock, maxfd);
-        
-        int socket_fd;
-        size_t fd_size = sizeof(socket_fd);
-        zmq_getsockopt(pilatus.monitor_socket, ZMQ_FD, &socket_fd, &fd_size);
-        FD_SET(socket_fd, &set);
-        maxfd = fmax(socket_fd, maxfd);
-        
-        if (client_sock > 0) {
-            FD_SET(client_sock, &set);
-            maxfd = fmax(client_sock, maxfd);
+    // a batch holds on to its slots until it is sent
+    if (config->send_batch > (d->pool_config.depth - config->nworkers - 1 - live) / 2) {
+        printf("Send batch can be at most half of the pool depth minus the number of readers + %d\n",
+               1 + live);
+        return -1;
+    }
+    // batches and frame stats are carried by json headers
+    if (config->header_format == HEADER_BINARY && (config->send_batch > 1 || config->frame_stats)) {
+        printf("Binary headers can't be used with --send-batch or --frame-stats\n");
+        return -1;
+    }
+    if (config->send_batch > 1 && d->spill_config.path) {
+        printf("Batched images can't be spilled, use either --send-batch or --spill\n");
+        return -1;
+    }
+    const int policy = d->output_config.send_policy;
+    if (policy != SEND_BLOCK && d->spill_config.path) {
+        printf("Frames are only spilled with --send-policy block\n");
+        return -1;
+    }
+    // the oldest frame of a batch isn't known once it's in the batch
+    if (policy == SEND_DROP_OLDEST && config->send_batch > 1) {
+        printf("--send-policy drop-oldest can't be combined with --send-batch\n");
+        return -1;
+    }
+    if (policy == SEND_LIVE_ONLY && !live) {
+        printf("--send-policy live-only needs the live view, set --live-rate\n");
+        return -1;
+    }
+    // the sender must not wait forever for a series message either
+    if (policy != SEND_BLOCK && d->output_config.send_timeout_ms == 0) {
+        d->output_config.send_timeout_ms = 1000;
+    }
+    if (d->spill_config.path || policy != SEND_BLOCK) {
+        // zmq holds on to the buffers of queued frames, the send has to block or the
+        // frames have to be spilled or dropped before the pool runs out
+        int free_buffers = d->pool_config.depth - config->nworkers - 1 - live;
+        int sndhwm = free_buffers / 2 / d->output_config.count;
+        if (sndhwm < 1) {
+            sndhwm = 1;
         }
-        
-        select(maxfd + 1, &set, NULL, NULL, NULL);
-        
-        // new request from client
-        if (FD_ISSET(client_sock, &set)) {
-            int nb = read(client_sock, buffer, BUFFER_SIZE);
-            // client disconnected
-            if (nb == 0) {
-                printf("client disconnected\n");
-                close(client_sock);
-                client_sock = 0;
+        if (d->output_config.sndhwm > sndhwm) {
+            printf("With --spill or a policy other than block, --sndhwm can be at most %d, half "
+                   "of the free buffers spread over the endpoints\n", sndhwm);
+            return -1;
+        }
+        if (d->output_config.sndhwm == 0) {
+            d->output_config.sndhwm = sndhwm;
+        }
+    }
+    config->folder = d->folder;
+    config->file_ending = d->file_ending;
+    return 0;
+}
+
+// zmq endpoints the detector binds, returns their number
+static int bound_endpoints(const DetectorConfig* d, const char** endpoints)
+{
+    int n = 0;
+    endpoints[n++] = d->monitor_endpoint;
+    for (int i=0; i<d->output_config.count; i++) {
+        endpoints[n++] = d->output_config.endpoints[i];
+    }
+    if (d->live_config.rate > 0.0) {
+        endpoints[n++] = d->live_config.endpoint;
+    }
+    if (d->output_config.stats_endpoint) {
+        endpoints[n++] = d->output_config.stats_endpoint;
+    }
+    if (d->output_config.profile_endpoint) {
+        endpoints[n++] = d->output_config.profile_endpoint;
+    }
+    return n;
+}
+
+// Two detectors can't watch the same folder or bind the same port
+static int detectors_check(const DetectorConfig* detectors, int ndetectors)
+{
+    for (int i=0; i<ndetectors; i++) {
+        const DetectorConfig* a = &detectors[i];
+        const char* a_endpoints[OUTPUT_MAX_ENDPOINTS + 4];
+        const int na = bound_endpoints(a, a_endpoints);
+        for (int j=0; j<i; j++) {
+            const DetectorConfig* b = &detectors[j];
+            if (strcmp(a->folder, b->folder) == 0) {
+                printf("Detectors %s and %s watch the same folder %s\n", b->name, a->name,
+                       a->folder);
+                return -1;
             }
-            else {
-                handle_request(buffer, nb, camserver_sock, &pilatus);
+            if (a->control_port == b->control_port) {
+                printf("Detectors %s and %s use the same control port %d\n", b->name, a->name,
+                       a->control_port);
+                return -1;
             }
-        }
-        
-        // new connection from client
-        if (FD_ISSET(server_sock, &set)) {
-            client_sock = accept(server_sock, (struct sockaddr*)NULL, NULL);
-            if (client_sock == -1) {
-                printf("Error accepting connection\n");
+            const char* b_endpoints[OUTPUT_MAX_ENDPOINTS + 4];
+            const int nb = bound_endpoints(b, b_endpoints);
+            for (int k=0; k<na; k++) {
+                for (int l=0; l<nb; l++) {
+                    if (strcmp(a_endpoints[k], b_endpoints[l]) == 0) {
+                        printf("Detectors %s and %s both bind %s\n", b->name, a->name,
+                               a_endpoints[k]);
+                        return -1;
+                    }
+                }
             }
-            printf("New connection\n");
         }
-        
-        // new response from camserver
-        if (FD_ISSET(camserver_sock, &set)) {
-            int nb = read(camserver_sock, buffer, BUFFER_SIZE);
-            write(client_sock, buffer, nb);
-            handle_respone(buffer, nb, &pilatus);
-            bzero(buffer, BUFFER_SIZE);
-        }
-        
-        // new data file
-        if (FD_ISSET(notify.fd, &set)) {
-            int nb = read(notify.fd, notify.buffer, EVENT_BUF_LEN);
-            handle_file(notify.buffer, nb, &pilatus, folder);
-        }
-        
-        // new request on monitoring socket
-        if (FD_ISSET(socket_fd, &set)) {
-            uint32_t zmq_event;
-            size_t zmq_event_size = sizeof(zmq_event);
-            zmq_getsockopt(pilatus.monitor_socket, ZMQ_EVENTS, &zmq_event, &zmq_event_size);
-            while(zmq_event & ZMQ_POLLIN) {
-                char msg [256];
-                zmq_recv(pilatus.monitor_socket, msg, 255, 0);
-                //printf("monitor msg: %s\n", msg);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    // options before the first --detector apply to all detectors, the ones after it
+    // only to that detector
+    DetectorConfig defaults;
+    detector_config_init(&defaults);
+    DetectorConfig detectors[MAX_DETECTORS];
+    int ndetectors = 0;
+    DetectorConfig* d = &defaults;
+    // the readers and the zmq io threads are shared by all detectors
+    PipelineConfig readers_config = defaults.config;
+    int io_threads = 1;
+    // all threads are left to the scheduler unless configured
+    PlacementConfig placement_config;
+    memset(&placement_config, 0, sizeof(placement_config));
+    LoggerConfig log_config;
+    log_config.level = LOG_INFO;
+    log_config.rate = 100;
+    log_config.capacity = 1024;
+    
+    int c;
+    while((c = getopt_long(argc, argv, ":hf:t:s:w:b:Ddc:n:HLT", long_options, NULL)) != EOF) {
+        switch(c) {
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            case 'f':
+                d->folder = optarg;
+                break;
                 
-                // send json header
-                zmq_msg_t header;
-                zmq_msg_init(&header);
-                zmq_msg_copy(&header, &pilatus.most_recent_img.header_msg);
-                zmq_sendmsg(pilatus.monitor_socket, &header, ZMQ_SNDMORE);
+            case 't':
+                d->file_ending = optarg;
+                break;
                 
-                // send binary blob
-                zmq_msg_t blob;
-                zmq_msg_init(&blob);
-                zmq_msg_copy(&blob, &pilatus.most_recent_img.blob_msg);
-                zmq_sendmsg(pilatus.monitor_socket, &blob, 0);
+            case 's': {
+                int width;
+                int height;
+                if (strcmp("Pilatus100k", optarg) == 0) {
+                    d->num_pixels = Pilatus100k;
+                    d->width = 487;
+                    d->height = 195;
+                }
+                else if (strcmp("Pilatus1M", optarg) == 0) {
+                    d->num_pixels = Pilatus1M;
+                    d->width = 981;
+                    d->height = 1043;
+                }
+                else if (strcmp("Pilatus2M", optarg) == 0) {
+                    d->num_pixels = Pilatus2M;
+                    d->width = 1475;
+                    d->height = 1679;
+                }
+                else if (strcmp("auto", optarg) == 0) {
+                    d->num_pixels = DetectorAuto;
+                    d->width = 0;
+                    d->height = 0;
+                }
+                else if (sscanf(optarg, "%dx%d", &width, &height) == 2 && width > 0 && height > 0) {
+                    d->num_pixels = (size_t)width * height;
+                    d->width = width;
+                    d->height = height;
+                }
+                else {
+                    printf("Wrong detector size\n");
+                    return -1;
+                }
+                break;
+            }
+                
+            case 'w':
+                readers_config.nworkers = atoi(optarg);
+                if (readers_config.nworkers < 1 || readers_config.nworkers > 32) {
+                    printf("Number of reader threads has to be between 1 and 32\n");
+                    return -1;
+                }
+                break;
+                
+            case 'b':
+                readers_config.batch_size = atoi(optarg);
+                if (readers_config.batch_size < 1) {
+                    printf("Batch size has to be at least 1\n");
+                    return -1;
+                }
+                break;
+                
+            case 'D':
+                readers_config.direct = 1;
+                break;
+                
+            case 'd':
+                d->config.decode = 1;
+                break;
                 
-                zmq_getsockopt(pilatus.monitor_socket, ZMQ_EVENTS, &zmq_event, &zmq_event_size);
-            } 
+            case 'c':
+                if (strcmp("bslz4", optarg) == 0) {
+#ifdef HAVE_LZ4
+                    d->config.compression = COMPRESSION_BSLZ4;
+#else
+                    printf("Built without lz4, rebuild with make LZ4=1\n");
+                    return -1;
+#endif
+                }
+                else {
+                    printf("Unknown compression %s\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'n':
+                d->pool_config.depth = atoi(optarg);
+                break;
+                
+            case 'H':
+                d->pool_config.hugepages = 1;
+                break;
+                
+            case 'L':
+                d->pool_config.lock = 1;
+                break;
+
+            case 'T':
+                d->config.timestamps = 1;
+                break;
+                
+            case OPT_POOL_POLICY:
+                if (strcmp("wait", optarg) == 0) {
+                    d->pool_config.policy = POOL_WAIT;
+                }
+                else if (strcmp("drop", optarg) == 0) {
+                    d->pool_config.policy = POOL_DROP;
+                }
+                else {
+                    printf("Pool policy has to be either wait or drop\n");
+                    return -1;
+                }
+                break;
+                
+            case OPT_POOL_TIMEOUT:
+                d->pool_config.timeout_ms = atoi(optarg);
+                if (d->pool_config.timeout_ms < 0) {
+                    printf("Pool timeout can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_CAMSERVER:
+                if (sscanf(optarg, "%63[^:]:%d", d->camserver_address, &d->camserver_port) != 2) {
+                    printf("Camserver address has to be host:port\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_ENDPOINT:
+                if (d->output_config.count == OUTPUT_MAX_ENDPOINTS) {
+                    printf("At most %d endpoints\n", OUTPUT_MAX_ENDPOINTS);
+                    return -1;
+                }
+                d->output_config.endpoints[d->output_config.count++] = optarg;
+                break;
+
+            case OPT_OUTPUT_POLICY:
+                if (strcmp("round-robin", optarg) == 0) {
+                    d->output_config.policy = OUTPUT_ROUND_ROBIN;
+                }
+                else if (strcmp("modulo", optarg) == 0) {
+                    d->output_config.policy = OUTPUT_MODULO;
+                }
+                else if (strcmp("least-loaded", optarg) == 0) {
+                    d->output_config.policy = OUTPUT_LEAST_LOADED;
+                }
+                else {
+                    printf("Output policy has to be round-robin, modulo or least-loaded\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_IO_THREADS:
+                io_threads = atoi(optarg);
+                if (io_threads < 1 || io_threads > 64) {
+                    printf("Number of io threads has to be between 1 and 64\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SEND_BATCH:
+                d->config.send_batch = atoi(optarg);
+                if (d->config.send_batch < 1) {
+                    printf("Send batch has to be at least 1\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SEND_BATCH_MS:
+                d->config.send_batch_ms = atoi(optarg);
+                if (d->config.send_batch_ms < 0) {
+                    printf("Send batch time can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_FRAME_STATS:
+                d->config.frame_stats = 1;
+                break;
+
+            case OPT_SATURATION:
+                d->config.saturation = atoi(optarg);
+                if (d->config.saturation < 1) {
+                    printf("Saturation has to be at least 1\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_ROI:
+                if (d->nrois == FRAMESTATS_MAX_ROIS) {
+                    printf("At most %d rois\n", FRAMESTATS_MAX_ROIS);
+                    return -1;
+                }
+                if (framestats_parse_roi(optarg, &d->rois[d->nrois]) != 0) {
+                    printf("Roi has to be name=x,y,width,height\n");
+                    return -1;
+                }
+                d->nrois++;
+                d->config.frame_stats = 1;
+                break;
+
+            case OPT_STATS_ENDPOINT:
+                d->output_config.stats_endpoint = optarg;
+                break;
+
+            case OPT_HEADER_FORMAT:
+                if (strcmp(optarg, "json") == 0) {
+                    d->config.header_format = HEADER_JSON;
+                }
+                else if (strcmp(optarg, "binary") == 0) {
+                    d->config.header_format = HEADER_BINARY;
+                }
+                else {
+                    printf("Header format has to be json or binary\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_PROFILE_ENDPOINT:
+                d->output_config.profile_endpoint = optarg;
+                break;
+
+            case OPT_GEOMETRY:
+                if (integrate_parse_geometry(optarg, &d->geometry) != 0) {
+                    printf("Geometry has to be cx=..,cy=..,distance=..,wavelength=..\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_MASK:
+                d->correction_config.mask_path = optarg;
+                d->correction = 1;
+                break;
+
+            case OPT_FLATFIELD:
+                d->correction_config.flatfield_path = optarg;
+                d->correction = 1;
+                break;
+
+            case OPT_MARK_GAPS:
+                d->correction = 1;
+                break;
+
+            case OPT_CORRECTION_VERSION:
+                // ends up in the image headers as a json string
+                if (strlen(optarg) > 64 || strpbrk(optarg, "\"\\") != NULL) {
+                    printf("Correction version has to be at most 64 characters without quotes\n");
+                    return -1;
+                }
+                d->correction_config.version = optarg;
+                break;
+
+            case OPT_REORDER_WINDOW:
+                d->reorder_config.window = atoi(optarg);
+                if (d->reorder_config.window < 1) {
+                    printf("Reorder window has to be at least 1\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_REORDER_TIMEOUT:
+                d->reorder_config.timeout_ms = atoi(optarg);
+                if (d->reorder_config.timeout_ms < 1) {
+                    printf("Reorder timeout has to be at least 1 ms\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_LOG_LEVEL:
+                log_config.level = logger_level(optarg);
+                if (log_config.level < 0) {
+                    printf("Log level has to be debug, info, warning or error\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_LOG_RATE:
+                log_config.rate = atoi(optarg);
+                if (log_config.rate < 0) {
+                    printf("Log rate can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SPILL:
+                d->spill_config.path = optarg;
+                break;
+
+            case OPT_SPILL_SIZE:
+                d->spill_config.size = atof(optarg) * (1ULL << 30);
+                if (d->spill_config.size < (1ULL << 20)) {
+                    printf("Spill file has to be at least 1 MB\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SPILL_DEADLINE:
+                d->spill_config.deadline_ms = atoi(optarg);
+                if (d->spill_config.deadline_ms < 0) {
+                    printf("Spill deadline can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_LIVE_RATE:
+                d->live_config.rate = atof(optarg);
+                if (d->live_config.rate < 0.0) {
+                    printf("Live view rate can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_LIVE_ENDPOINT:
+                d->live_config.endpoint = optarg;
+                break;
+
+            case OPT_LIVE_BINNING:
+                d->live_config.binning = atoi(optarg);
+                if (d->live_config.binning != 1 && d->live_config.binning != 2 &&
+                    d->live_config.binning != 4) {
+                    printf("Live view binning has to be 1, 2 or 4\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_LIVE_UINT16:
+                d->live_config.uint16 = 1;
+                break;
+
+            case OPT_LIVE_LZ4:
+#ifdef HAVE_LZ4
+                d->live_config.lz4 = 1;
+#else
+                printf("Built without lz4, rebuild with make LZ4=1\n");
+                return -1;
+#endif
+                break;
+
+            case OPT_DETECTOR:
+                if (ndetectors == MAX_DETECTORS) {
+                    printf("At most %d detectors\n", MAX_DETECTORS);
+                    return -1;
+                }
+                // ends up in the stats as a json string and in every log line
+                if (strlen(optarg) == 0 || strlen(optarg) > 32 || strpbrk(optarg, "\"\\") != NULL) {
+                    printf("Detector name has to be 1 to 32 characters without quotes\n");
+                    return -1;
+                }
+                detectors[ndetectors] = defaults;
+                d = &detectors[ndetectors++];
+                d->name = optarg;
+                d->config.name = optarg;
+                break;
+
+            case OPT_CONTROL_PORT:
+                d->control_port = atoi(optarg);
+                if (d->control_port < 1 || d->control_port > 65535) {
+                    printf("Control port has to be between 1 and 65535\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_MONITOR_ENDPOINT:
+                d->monitor_endpoint = optarg;
+                break;
+
+            case OPT_NUMA_NODE:
+                d->pool_config.numa_node = placement_parse_node(optarg);
+                if (d->pool_config.numa_node == -2) {
+                    printf("NUMA node has to be the number of a node or a network interface\n");
+                    return -1;
+                }
+                if (d->pool_config.numa_node == -1) {
+                    printf("Interface %s has no NUMA node, the buffers aren't bound\n", optarg);
+                }
+                break;
+
+            case OPT_CPUS_CONTROL:
+            case OPT_CPUS_READERS:
+            case OPT_CPUS_SENDER:
+            case OPT_CPUS_IO:
+                // the options are in the order of the roles
+                if (placement_parse_cpus(optarg, &placement_config.cpus[c - OPT_CPUS_CONTROL]) != 0) {
+                    printf("Cores have to be a list like 0-3,8 of cores this process may use\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_REALTIME:
+                placement_config.realtime_priority = atoi(optarg);
+                if (placement_config.realtime_priority < 1 || placement_config.realtime_priority > 99) {
+                    printf("Realtime priority has to be between 1 and 99\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_MLOCKALL:
+                placement_config.lock_all = 1;
+                break;
+
+            case OPT_SEND_POLICY:
+                d->output_config.send_policy = output_parse_policy(optarg);
+                if (d->output_config.send_policy < 0) {
+                    printf("Send policy has to be block, drop-newest, drop-oldest or live-only\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SEND_TIMEOUT:
+                d->output_config.send_timeout_ms = atoi(optarg);
+                if (d->output_config.send_timeout_ms < 0) {
+                    printf("Send timeout can't be negative\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SNDHWM:
+                d->output_config.sndhwm = atoi(optarg);
+                if (d->output_config.sndhwm < 1) {
+                    printf("Send high water mark has to be at least 1\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SNDBUF:
+                d->output_config.sndbuf = atoi(optarg);
+                if (d->output_config.sndbuf < 1) {
+                    printf("Send buffer has to be at least 1 byte\n");
+                    return -1;
+                }
+                break;
+        }
+    }
+    if (ndetectors == 0) {
+        detectors[ndetectors++] = defaults;
+    }
+    int first_io_thread = 0;
+    for (int i=0; i<ndetectors; i++) {
+        d = &detectors[i];
+        d->config.nworkers = readers_config.nworkers;
+        d->config.batch_size = readers_config.batch_size;
+        d->config.direct = readers_config.direct;
+        d->output_config.io_threads = io_threads;
+        if (detector_check(d) != 0) {
+            if (d->name) {
+                printf("in the options of detector %s\n", d->name);
+            }
+            return -1;
         }
+        // the endpoints of the detectors are spread over the io threads
+        d->output_config.first_io_thread = first_io_thread;
+        first_io_thread += d->output_config.count;
+    }
+    if (detectors_check(detectors, ndetectors) != 0) {
+        return -1;
+    }
+    
+    // from here on nothing prints to stdout directly
+    logger_init(&log_config);
+    placement_init(&placement_config);
+    void* context = zmq_ctx_new();
+    zmq_ctx_set(context, ZMQ_IO_THREADS, io_threads);
+    placement_apply_context(context);
+    Readers readers;
+    readers_init(&readers, &readers_config);
+    Pilatus* pilatus = calloc(ndetectors, sizeof(Pilatus));
+    Control* control = calloc(ndetectors, sizeof(Control));
+    pthread_t threads[MAX_DETECTORS];
+    for (int i=0; i<ndetectors; i++) {
+        logger_set_prefix(detectors[i].name);
+        pilatus_init(&pilatus[i], &detectors[i], context, &readers);
+        control_init(&control[i], &pilatus[i], &detectors[i]);
+    }
+    logger_set_prefix(NULL);
+    for (int i=0; i<ndetectors; i++) {
+        pthread_create(&threads[i], NULL, control_thread, &control[i]);
+    }
+    for (int i=0; i<ndetectors; i++) {
+        pthread_join(threads[i], NULL);
     }
     
-    notify_close(&notify);
+    readers_close(&readers);
+    for (int i=0; i<ndetectors; i++) {
+        control_close(&control[i]);
+        pilatus_close(&pilatus[i]);
+    }
+    free(control);
+    free(pilatus);
+    zmq_ctx_term(context);
+    placement_close();
+    logger_close();
     return 0;
 }
@@ -0,0 +1,1315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "loader.h"
+#include "cbf.h"
+#include "compress.h"
+#include "logger.h"
+#include "placement.h"
+
+static void release_buffer(Pipeline* pipeline, void* data)
+{
+    pool_put(pipeline->pool, data);
+}
+
+static void free_buffer_callback(void* data, void* hint)
+{
+    Pipeline* pipeline = (Pipeline*)hint;
+    const int index = pool_index(pipeline->pool, data);
+    histogram_add(&pipeline->stats.stages[STAGE_FREE], stats_now() - pipeline->sent_times[index]);
+    // spilled frames never reached an endpoint
+    if (pipeline->sent_endpoints[index] >= 0) {
+        output_released(pipeline->output, pipeline->sent_endpoints[index]);
+    }
+    release_buffer(pipeline, data);
+}
+
+static void* acquire_buffer(Pipeline* pipeline)
+{
+    void* buffer = NULL;
+    if (pool_get(pipeline->pool, &buffer, 1) != 1) {
+        return NULL;
+    }
+    return buffer;
+}
+
+static int decode_cbf(Pipeline* pipeline, Frame* frame, const CbfInfo* info)
+{
+    if ((size_t)info->nelements * sizeof(int32_t) > pipeline->pool->item_size) {
+        log_error("Decoded image does not fit into buffer");
+        return -1;
+    }
+    void* decoded = acquire_buffer(pipeline);
+    if (!decoded) {
+        return -1;
+    }
+    long rc = cbf_decode((const uint8_t*)frame->blob + info->data_offset, info->binary_size,
+                         decoded, info->nelements);
+    release_buffer(pipeline, frame->blob);
+    frame->blob = decoded;
+    if (rc < 0) {
+        log_error("Error decoding cbf data");
+        return -1;
+    }
+    frame->data = decoded;
+    frame->blob_size = info->nelements * sizeof(int32_t);
+    frame->dtype = "int32";
+    frame->element_size = sizeof(int32_t);
+    frame->compression = "";
+    return 0;
+}
+
+static int compress_frame(Pipeline* pipeline, Frame* frame)
+{
+#ifdef HAVE_LZ4
+    void* compressed = acquire_buffer(pipeline);
+    if (!compressed) {
+        return -1;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long size = bslz4_compress(frame->data, frame->blob_size / frame->element_size,
+                               frame->element_size, compressed, pipeline->pool->item_size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    release_buffer(pipeline, frame->blob);
+    frame->blob = compressed;
+    if (size < 0) {
+        return -1;
+    }
+    frame->raw_size = frame->blob_size;
+    frame->compression_time_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                                 (end.tv_nsec - start.tv_nsec) / 1000;
+    frame->data = compressed;
+    frame->blob_size = size;
+    frame->compression = "bslz4";
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Looks up the layout cached for the series of the frame
+static int cached_layout(Pipeline* pipeline, const Frame* frame, TifLayout* layout)
+{
+    int found = 0;
+    pthread_mutex_lock(&pipeline->layout_mutex);
+    if (pipeline->layout_series == frame->series) {
+        *layout = pipeline->layout;
+        found = 1;
+    }
+    pthread_mutex_unlock(&pipeline->layout_mutex);
+    return found;
+}
+
+static void cache_layout(Pipeline* pipeline, const Frame* frame, const TifLayout* layout)
+{
+    pthread_mutex_lock(&pipeline->layout_mutex);
+    // a reader that is behind must not replace the layout of a newer series
+    if (frame->series >= pipeline->layout_series) {
+        pipeline->layout = *layout;
+        pipeline->layout_series = frame->series;
+    }
+    pthread_mutex_unlock(&pipeline->layout_mutex);
+}
+
+static void set_tif_frame(Frame* frame, const TifLayout* layout)
+{
+    frame->blob_size = layout->data_size;
+    frame->shape[0] = layout->height;
+    frame->shape[1] = layout->width;
+    frame->dtype = tif_dtype(layout->bits_per_sample, layout->sample_format);
+    frame->element_size = layout->bits_per_sample / 8;
+    frame->compression = "";
+}
+
+static int parse_tif_frame(Pipeline* pipeline, Frame* frame, const LoadRequest* request,
+                           const TifLayout* cached)
+{
+    // only the image data was read with the cached layout
+    if (request->length && request->size == request->expected_size) {
+        frame->data = (char*)frame->blob + (cached->data_offset - request->start);
+        set_tif_frame(frame, cached);
+        return 0;
+    }
+    TifInfo info;
+    if (parse_tif(frame->blob, request->nread, &info) != 0) {
+        return -1;
+    }
+    // a float image would go out labelled as an integer type, and corrections and
+    // statistics only handle integers
+    if (info.sample_format > 2) {
+        log_error("Unsupported sample format %d, frames have to be integer images",
+                  info.sample_format);
+        return -1;
+    }
+    TifLayout layout;
+    layout.file_size = request->size;
+    layout.width = info.width;
+    layout.height = info.height;
+    layout.bits_per_sample = info.bits_per_sample;
+    layout.sample_format = info.sample_format;
+    layout.data_offset = info.strip_offsets;
+    layout.data_size = info.strip_byte_counts;
+    set_tif_frame(frame, &layout);
+    if (info.contiguous) {
+        frame->data = (char*)frame->blob + info.strip_offsets;
+        cache_layout(pipeline, frame, &layout);
+        return 0;
+    }
+    // strips are scattered over the file, copy them into one image
+    void* image = acquire_buffer(pipeline);
+    if (!image) {
+        return -1;
+    }
+    tif_gather_strips(frame->blob, &info, image);
+    release_buffer(pipeline, frame->blob);
+    frame->blob = image;
+    frame->data = image;
+    return 0;
+}
+
+static int parse_frame(Pipeline* pipeline, Frame* frame, const LoadRequest* request,
+                       const TifLayout* cached)
+{
+    // Tif image
+    if (strncmp(pipeline->config.file_ending, "tif", 3) == 0) {
+        return parse_tif_frame(pipeline, frame, request, cached);
+    }
+    // cbf image
+    else if (strncmp(pipeline->config.file_ending, "cbf", 3) == 0) {
+        CbfInfo info;
+        if (parse_cbf(frame->blob, request->nread, &info) != 0) {
+            return -1;
+        }
+        frame->shape[0] = info.height;
+        frame->shape[1] = info.width;
+        if (pipeline->config.decode) {
+            return decode_cbf(pipeline, frame, &info);
+        }
+        frame->data = frame->blob;
+        frame->blob_size = request->nread;
+        frame->dtype = "int32";
+        frame->element_size = sizeof(int32_t);
+        frame->compression = "cbf";
+    }
+    return 0;
+}
+
+static int process_frame(Pipeline* pipeline, Frame* frame, const LoadRequest* request,
+                         const TifLayout* cached)
+{
+    if (parse_frame(pipeline, frame, request, cached) != 0) {
+        return -1;
+    }
+    const int plain_int32 = frame->compression[0] == '\0' && strcmp(frame->dtype, "int32") == 0;
+    if (pipeline->correction && plain_int32) {
+        if (correction_apply(pipeline->correction, frame->data, frame->shape[1],
+                             frame->shape[0]) == 0) {
+            frame->corrected = 1;
+        }
+        else {
+            log_warning("Frame %d of %dx%d pixels doesn't match the correction tables",
+                        frame->frame_number, frame->shape[1], frame->shape[0]);
+        }
+    }
+    // while the image is still in cache
+    if (pipeline->config.frame_stats && plain_int32) {
+        framestats_compute(frame->data, frame->shape[1], frame->shape[0], &frame->stats_config,
+                           &frame->frame_stats);
+        frame->has_stats = 1;
+    }
+    if (pipeline->integrator && plain_int32 && frame->geometry.bins > 0) {
+        IntegrationLut* lut = integrator_acquire(pipeline->integrator, &frame->geometry,
+                                                 frame->shape[1], frame->shape[0]);
+        integrate_frame(lut, frame->data, frame->profile, frame->profile + frame->geometry.bins);
+        frame->profile_q_step = lut->q_step;
+        integrator_release(pipeline->integrator, lut);
+        frame->has_profile = 1;
+    }
+    // only plain images are compressed, cbf files are already
+    if (pipeline->config.compression == COMPRESSION_BSLZ4 && frame->compression[0] == '\0') {
+        return compress_frame(pipeline, frame);
+    }
+    return 0;
+}
+
+static void load_frames(Pipeline* pipeline, Loader* loader, Frame** frames, int n)
+{
+    LoadRequest requests[n];
+    TifLayout layouts[n];
+    void* buffers[n];
+    // all buffers of a batch are taken at once, so readers never hold part of a batch
+    // while waiting for the rest
+    int count = pool_get(pipeline->pool, buffers, n);
+    int64_t start = stats_now();
+    for (int i=0; i<n; i++) {
+        frames[i]->blob = i < count ? buffers[i] : NULL;
+        frames[i]->no_buffer = i >= count;
+        frames[i]->times.load = start;
+    }
+    for (int i=count; i<n; i++) {
+        char path[512];
+        log_warning("No free buffer, dropping frame %d", frames[i]->frame_number);
+        snprintf(path, sizeof(path), "%s/%s", pipeline->config.folder, frames[i]->filename);
+        unlink(path);
+    }
+    n = count;
+
+    for (int i=0; i<n; i++) {
+        LoadRequest* request = &requests[i];
+        snprintf(request->path, sizeof(request->path), "%s/%s",
+                 pipeline->config.folder, frames[i]->filename);
+        request->buffer = frames[i]->blob;
+        request->capacity = pipeline->pool->item_size;
+        request->expected_size = 0;
+        request->offset = 0;
+        request->length = 0;
+        if (strncmp(pipeline->config.file_ending, "tif", 3) == 0 &&
+            cached_layout(pipeline, frames[i], &layouts[i])) {
+            request->expected_size = layouts[i].file_size;
+            request->offset = layouts[i].data_offset;
+            request->length = layouts[i].data_size;
+        }
+    }
+    loader_load(loader, requests, n);
+
+    for (int i=0; i<n; i++) {
+        Frame* frame = frames[i];
+        frame->times.opened = requests[i].opened;
+        frame->times.read = requests[i].read;
+        frame->times.removed = requests[i].removed;
+        if (requests[i].error || process_frame(pipeline, frame, &requests[i], &layouts[i]) != 0) {
+            log_warning("Dropping frame %d", frame->frame_number);
+            release_buffer(pipeline, frame->blob);
+            frame->blob = NULL;
+            atomic_fetch_add_explicit(&pipeline->stats.errors, 1, memory_order_relaxed);
+        }
+        frame->times.processed = stats_now();
+    }
+}
+
+// Sends msg unless the socket doesn't take it within timeout_ms, returns -1 then
+static int send_deadline(void* socket, zmq_msg_t* msg, int flags, int timeout_ms)
+{
+    const int64_t deadline = stats_now() + timeout_ms * 1000000LL;
+    zmq_pollitem_t item = {socket, 0, ZMQ_POLLOUT, 0};
+    while (zmq_msg_send(msg, socket, flags | ZMQ_DONTWAIT) < 0) {
+        const int64_t remaining = deadline - stats_now();
+        if (errno != EAGAIN || remaining <= 0) {
+            return -1;
+        }
+        zmq_poll(&item, 1, remaining / 1000000 + 1);
+    }
+    return 0;
+}
+
+// Sends the oldest spilled frame or message. Returns -1 if the spill is empty or,
+// with ZMQ_DONTWAIT, if the output can't take it right now.
+static int replay_record(Pipeline* pipeline, int flags)
+{
+    SpillRecord record;
+    if (!spill_peek(pipeline->spill, &record)) {
+        return -1;
+    }
+    if (record.endpoint < 0) {
+        if ((flags & ZMQ_DONTWAIT) && !output_writable(pipeline->output)) {
+            return -1;
+        }
+        output_broadcast(pipeline->output, record.header, record.header_size, 0);
+        atomic_fetch_add_explicit(&pipeline->stats.messages, 1, memory_order_relaxed);
+    }
+    else {
+        Endpoint* endpoint = &pipeline->output->endpoints[record.endpoint];
+        if (zmq_send(endpoint->socket, record.header, record.header_size, ZMQ_SNDMORE | flags) < 0) {
+            return -1;
+        }
+        // copied, the record is overwritten once it's popped. The second part never
+        // blocks once the first one was taken.
+        zmq_send(endpoint->socket, record.data, record.data_size, 0);
+        atomic_fetch_add_explicit(&endpoint->frames, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pipeline->stats.frames, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pipeline->stats.bytes, record.data_size, memory_order_relaxed);
+    }
+    spill_pop(pipeline->spill);
+    return 0;
+}
+
+// Replays as much as the output takes without blocking
+static void replay_spill(Pipeline* pipeline)
+{
+    while (replay_record(pipeline, ZMQ_DONTWAIT) == 0) {
+    }
+}
+
+// Appends a frame or a message (data NULL) behind the spilled ones. If the file is full
+// this waits for the output to take the oldest records. Returns -1 only if the record
+// is larger than the whole file.
+static int spill_frame(Pipeline* pipeline, int endpoint, const void* header, size_t header_size,
+                       const void* data, size_t data_size)
+{
+    Spill* spill = pipeline->spill;
+    if (spill_append(spill, endpoint, header, header_size, data, data_size) == 0) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&spill->full, 1, memory_order_relaxed);
+    while (spill_append(spill, endpoint, header, header_size, data, data_size) != 0) {
+        if (replay_record(pipeline, 0) != 0) {
+            log_error("Frame of %zu bytes does not fit into the spill file", data_size);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Image header in the fixed layout of frameheader.h, returns its length
+static int format_binary_header(Pipeline* pipeline, const Frame* frame, char* header)
+{
+    BinaryHeader binary;
+    memcpy(binary.magic, BINARY_HEADER_MAGIC, sizeof(binary.magic));
+    binary.size = sizeof(BinaryHeader);
+    binary.dtype = binary_code(binary_dtypes, sizeof(binary_dtypes) / sizeof(binary_dtypes[0]),
+                               frame->dtype);
+    binary.codec = binary_code(binary_codecs, sizeof(binary_codecs) / sizeof(binary_codecs[0]),
+                               frame->compression);
+    binary.frame = frame->frame_number;
+    binary.series = frame->series;
+    binary.shape[0] = frame->shape[0];
+    binary.shape[1] = frame->shape[1];
+    binary.raw_size = frame->raw_size;
+    binary.data_size = frame->blob_size;
+    const FrameTimes* t = &frame->times;
+    const int64_t times[7] = {t->event, t->load, t->opened, t->read, t->removed, t->processed,
+                              t->sent};
+    for (int i=0; i<7; i++) {
+        binary.timestamps[i] = pipeline->config.timestamps ?
+                               (times[i] + pipeline->stats.realtime_offset) / 1000 : 0;
+    }
+    memcpy(header, &binary, sizeof(BinaryHeader));
+    return sizeof(BinaryHeader);
+}
+
+static int format_json_header(Pipeline* pipeline, const Frame* frame, char* header)
+{
+    int length = snprintf(header, FRAME_HEADER_SIZE,
+                          "{\"htype\": \"image\","
+                          "\"frame\": %d,"
+                          "\"shape\": [%d,%d],"
+                          "\"type\": \"%s\","
+                          "\"compression\": \"%s\"",
+                          frame->frame_number, frame->shape[0], frame->shape[1], frame->dtype,
+                          frame->compression);
+    if (frame->raw_size) {
+        length += snprintf(header + length, FRAME_HEADER_SIZE - length,
+                           ",\"raw_size\": %d,"
+                           "\"compression_ratio\": %.3f,"
+                           "\"compression_time_us\": %d",
+                           frame->raw_size, (double)frame->raw_size / frame->blob_size,
+                           frame->compression_time_us);
+    }
+    if (frame->corrected) {
+        length += snprintf(header + length, FRAME_HEADER_SIZE - length, ",%s",
+                           pipeline->correction->header);
+    }
+    if (frame->has_stats) {
+        header[length++] = ',';
+        length += framestats_format(&frame->frame_stats, &frame->stats_config,
+                                    header + length, FRAME_HEADER_SIZE - length);
+    }
+    if (pipeline->config.timestamps) {
+        // wall clock microseconds, so they can be compared with other machines
+        const FrameTimes* t = &frame->times;
+        const int64_t offset = pipeline->stats.realtime_offset;
+        length += snprintf(header + length, FRAME_HEADER_SIZE - length,
+                           ",\"timestamps\": {\"event\": %lld,\"load\": %lld,\"opened\": %lld,"
+                           "\"read\": %lld,\"removed\": %lld,\"processed\": %lld,\"sent\": %lld}",
+                           (long long)(t->event + offset) / 1000, (long long)(t->load + offset) / 1000,
+                           (long long)(t->opened + offset) / 1000, (long long)(t->read + offset) / 1000,
+                           (long long)(t->removed + offset) / 1000,
+                           (long long)(t->processed + offset) / 1000,
+                           (long long)(t->sent + offset) / 1000);
+    }
+    length += snprintf(header + length, FRAME_HEADER_SIZE - length, "}");
+    return length;
+}
+
+// Stamps the send time, books the buffer to endpoint and formats the image header.
+// The frame also becomes the most recent image and is offered to the live view.
+// Returns the length of the header.
+static int prepare_frame(Pipeline* pipeline, Frame* frame, int endpoint, zmq_msg_t* header_msg,
+                         zmq_msg_t* blob_msg, char* header)
+{
+    frame->times.sent = stats_now();
+    const int index = pool_index(pipeline->pool, frame->blob);
+    pipeline->sent_times[index] = frame->times.sent;
+    pipeline->sent_endpoints[index] = endpoint;
+    zmq_msg_init_data(blob_msg, frame->data, frame->blob_size, free_buffer_callback, pipeline);
+
+    const int length = pipeline->config.header_format == HEADER_BINARY ?
+                       format_binary_header(pipeline, frame, header) :
+                       format_json_header(pipeline, frame, header);
+    zmq_msg_init_size(header_msg, length);
+    memcpy(zmq_msg_data(header_msg), header, length);
+    output_publish(pipeline->output, header, length);
+    if (frame->has_profile) {
+        // bin i covers q from i * q_step to (i + 1) * q_step
+        const Geometry* g = &frame->geometry;
+        char profile_header[512];
+        int profile_length = snprintf(profile_header, sizeof(profile_header),
+                                      "{\"htype\": \"profile\",\"frame\": %d,\"series\": %d,"
+                                      "\"shape\": [2,%d],\"type\": \"float32\",\"q_step\": %.9g,"
+                                      "\"unit\": \"1/nm\",\"geometry\": {\"cx\": %g,\"cy\": %g,"
+                                      "\"distance\": %g,\"pixel\": %g,\"wavelength\": %g}}",
+                                      frame->frame_number, frame->series, g->bins,
+                                      frame->profile_q_step, g->center_x, g->center_y,
+                                      g->distance, g->pixel_size, g->wavelength);
+        output_publish_profile(pipeline->output, profile_header, profile_length, frame->profile,
+                               2 * g->bins * sizeof(float));
+    }
+
+    // Override most recent image
+    pthread_mutex_lock(&pipeline->recent_mutex);
+    zmq_msg_copy(&pipeline->most_recent_img.header_msg, header_msg);
+    zmq_msg_copy(&pipeline->most_recent_img.blob_msg, blob_msg);
+    pthread_mutex_unlock(&pipeline->recent_mutex);
+    if (pipeline->liveview) {
+        liveview_offer(pipeline->liveview, frame->frame_number, frame->shape, frame->dtype,
+                       frame->element_size, frame->compression, blob_msg);
+    }
+    return length;
+}
+
+// Drop counters of the series frame belongs to, they start over with every series
+static SeriesDrops* series_drops(Pipeline* pipeline, const Frame* frame)
+{
+    if (frame->series != pipeline->drops.series) {
+        memset(&pipeline->drops, 0, sizeof(SeriesDrops));
+        pipeline->drops.series = frame->series;
+    }
+    return &pipeline->drops;
+}
+
+// Adds what was lost of the series to its series_end message
+static void add_drops(Pipeline* pipeline, Frame* frame)
+{
+    const SeriesDrops* drops = series_drops(pipeline, frame);
+    // the closing brace is replaced
+    const int length = frame->msg_length - 1;
+    if (length < 0 || frame->msg[length] != '}') {
+        return;
+    }
+    const int n = snprintf(frame->msg + length, sizeof(frame->msg) - length,
+                           ",\"dropped\": {\"policy\": \"%s\",\"send\": %d,\"pool\": %d,"
+                           "\"errors\": %d,\"messages\": %d}}",
+                           output_policy_name(pipeline->output->config.send_policy),
+                           drops->send, drops->pool, drops->errors, drops->messages);
+    if (length + n < (int)sizeof(frame->msg)) {
+        frame->msg_length = length + n;
+    }
+    else {
+        frame->msg[length] = '}';
+        frame->msg[length + 1] = '\0';
+    }
+}
+
+static void count_send_drops(Pipeline* pipeline, int n)
+{
+    // once per series, the counts are in series_end
+    if (pipeline->drops.send == 0) {
+        log_warning("The output doesn't take the frames, dropping them (%s)",
+                    output_policy_name(pipeline->output->config.send_policy));
+    }
+    pipeline->drops.send += n;
+    atomic_fetch_add_explicit(&pipeline->stats.send_drops, n, memory_order_relaxed);
+}
+
+// Whether an image queued after the one being sent is loaded already and could take
+// its place
+static int newer_ready(Pipeline* pipeline)
+{
+    int ready = 0;
+    pthread_mutex_lock(&pipeline->mutex);
+    for (int64_t i=pipeline->send_index + 1; i<pipeline->write_index; i++) {
+        const Frame* frame = &pipeline->frames[i % pipeline->size];
+        if (frame->type != FRAME_IMAGE) {
+            continue;
+        }
+        if (frame->state != SLOT_READY) {
+            break;
+        }
+        // files that could not be loaded are stepped over
+        if (frame->blob) {
+            ready = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return ready;
+}
+
+// Hands the first part of a frame or batch to the endpoint according to the send
+// policy, the other parts never block once it was taken. Returns -1 if the frame has
+// to be dropped instead.
+static int send_header(Pipeline* pipeline, void* socket, zmq_msg_t* header_msg)
+{
+    const OutputConfig* config = &pipeline->output->config;
+    switch (config->send_policy) {
+        case SEND_DROP_NEWEST:
+            return zmq_msg_send(header_msg, socket, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0 ? -1 : 0;
+        case SEND_DROP_OLDEST: {
+            const int64_t deadline = stats_now() + config->send_timeout_ms * 1000000LL;
+            zmq_pollitem_t item = {socket, 0, ZMQ_POLLOUT, 0};
+            while (zmq_msg_send(header_msg, socket, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0) {
+                if (errno != EAGAIN || newer_ready(pipeline) ||
+                    (config->send_timeout_ms > 0 && stats_now() > deadline)) {
+                    return -1;
+                }
+                zmq_poll(&item, 1, 1);
+            }
+            return 0;
+        }
+        case SEND_LIVE_ONLY:
+            if (pipeline->live_only) {
+                if (!output_drained(pipeline->output)) {
+                    return -1;
+                }
+                pipeline->live_only = 0;
+                log_debug("The output caught up, sending the frames again");
+            }
+            if (zmq_msg_send(header_msg, socket, ZMQ_SNDMORE | ZMQ_DONTWAIT) < 0) {
+                pipeline->live_only = 1;
+                log_debug("The output doesn't take the frames, only the live view gets them "
+                          "until it caught up");
+                return -1;
+            }
+            return 0;
+        default:
+            if (config->send_timeout_ms > 0) {
+                return send_deadline(socket, header_msg, ZMQ_SNDMORE, config->send_timeout_ms);
+            }
+            return zmq_msg_send(header_msg, socket, ZMQ_SNDMORE) < 0 ? -1 : 0;
+    }
+}
+
+// zmq never got the frame, its buffer goes back once the live view and the most recent
+// image let go of it
+static void unsent_frame(Pipeline* pipeline, const Frame* frame, zmq_msg_t* blob_msg)
+{
+    pipeline->sent_endpoints[pool_index(pipeline->pool, frame->blob)] = -1;
+    zmq_msg_close(blob_msg);
+}
+
+static void send_frame(Pipeline* pipeline, Frame* frame)
+{
+    SeriesDrops* drops = series_drops(pipeline, frame);
+    if (frame->type == FRAME_MESSAGE) {
+        if (strstr(frame->msg, "\"htype\": \"series_end\"") != NULL) {
+            add_drops(pipeline, frame);
+        }
+        log_info("Msg:%s", frame->msg);
+        // queued behind spilled frames, so the series end comes after its frames
+        if (pipeline->spill && !spill_empty(pipeline->spill) &&
+            spill_frame(pipeline, -1, frame->msg, frame->msg_length, NULL, 0) == 0) {
+            replay_spill(pipeline);
+            return;
+        }
+        // every writer gets the series header and end
+        if (output_broadcast(pipeline->output, frame->msg, frame->msg_length,
+                             pipeline->output->config.send_timeout_ms) != 0) {
+            drops->messages++;
+            atomic_fetch_add_explicit(&pipeline->stats.message_drops, 1, memory_order_relaxed);
+            return;
+        }
+        atomic_fetch_add_explicit(&pipeline->stats.messages, 1, memory_order_relaxed);
+        return;
+    }
+    // no free buffer or the file could not be loaded
+    if (!frame->blob) {
+        if (frame->no_buffer) {
+            drops->pool++;
+        }
+        else {
+            drops->errors++;
+        }
+        return;
+    }
+    const int endpoint = output_select(pipeline->output, frame->frame_number);
+    zmq_msg_t header_msg;
+    zmq_msg_t blob_msg;
+    char header[FRAME_HEADER_SIZE];
+    int length = prepare_frame(pipeline, frame, endpoint, &header_msg, &blob_msg, header);
+
+    // send json header
+    void* socket = pipeline->output->endpoints[endpoint].socket;
+    int sent = 0;
+    if (pipeline->spill) {
+        // once a frame is spilled the following ones are too until the spill is replayed
+        if (spill_empty(pipeline->spill) &&
+            send_deadline(socket, &header_msg, ZMQ_SNDMORE, pipeline->spill->config.deadline_ms) == 0) {
+            sent = 1;
+        }
+        else if (spill_frame(pipeline, endpoint, header, length, frame->data, frame->blob_size) == 0) {
+            unsent_frame(pipeline, frame, &blob_msg);
+            zmq_msg_close(&header_msg);
+            replay_spill(pipeline);
+            return;
+        }
+    }
+    if (!sent && send_header(pipeline, socket, &header_msg) != 0) {
+        unsent_frame(pipeline, frame, &blob_msg);
+        zmq_msg_close(&header_msg);
+        count_send_drops(pipeline, 1);
+        return;
+    }
+    output_sent(pipeline->output, endpoint);
+
+    // send binary blob
+    const int size = frame->blob_size;
+    zmq_sendmsg(socket, &blob_msg, 0);
+
+    stats_add_frame(&pipeline->stats, &frame->times, stats_now() - frame->times.sent);
+    atomic_fetch_add_explicit(&pipeline->stats.frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pipeline->stats.bytes, size, memory_order_relaxed);
+}
+
+// Sends the images of count slots from the oldest one on as one multipart message,
+// a header with the array of image headers followed by one part per image. The parts
+// point into the pool buffers like single frames.
+static void send_batch(Pipeline* pipeline, int count)
+{
+    Frame* frames[count];
+    int n = 0;
+    for (int i=0; i<count; i++) {
+        Frame* frame = &pipeline->frames[(pipeline->send_index + i) % pipeline->size];
+        SeriesDrops* drops = series_drops(pipeline, frame);
+        // files that could not be loaded leave a gap
+        if (frame->blob) {
+            frames[n++] = frame;
+        }
+        else if (frame->no_buffer) {
+            drops->pool++;
+        }
+        else {
+            drops->errors++;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    const int endpoint = output_select(pipeline->output, frames[0]->frame_number);
+    char* header = pipeline->batch_header;
+    const size_t capacity = pipeline->config.send_batch * FRAME_HEADER_SIZE + 64;
+    int length = snprintf(header, capacity, "{\"htype\": \"images\",\"count\": %d,\"frames\": [", n);
+    zmq_msg_t blob_msgs[n];
+    for (int i=0; i<n; i++) {
+        zmq_msg_t header_msg;
+        if (i) {
+            header[length++] = ',';
+        }
+        length += prepare_frame(pipeline, frames[i], endpoint, &header_msg, &blob_msgs[i],
+                                header + length);
+        zmq_msg_close(&header_msg);
+    }
+    length += snprintf(header + length, capacity - length, "]}");
+
+    void* socket = pipeline->output->endpoints[endpoint].socket;
+    const int64_t start = stats_now();
+    zmq_msg_t header_msg;
+    zmq_msg_init_size(&header_msg, length);
+    memcpy(zmq_msg_data(&header_msg), header, length);
+    if (send_header(pipeline, socket, &header_msg) != 0) {
+        for (int i=0; i<n; i++) {
+            unsent_frame(pipeline, frames[i], &blob_msgs[i]);
+        }
+        zmq_msg_close(&header_msg);
+        count_send_drops(pipeline, n);
+        return;
+    }
+    for (int i=0; i<n; i++) {
+        output_sent(pipeline->output, endpoint);
+        zmq_sendmsg(socket, &blob_msgs[i], i < n - 1 ? ZMQ_SNDMORE : 0);
+    }
+    const int64_t send_ns = stats_now() - start;
+
+    for (int i=0; i<n; i++) {
+        stats_add_frame(&pipeline->stats, &frames[i]->times, send_ns);
+        atomic_fetch_add_explicit(&pipeline->stats.bytes, frames[i]->blob_size, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&pipeline->stats.frames, n, memory_order_relaxed);
+}
+
+// Absolute CLOCK_REALTIME time ms milliseconds from now, for pthread_cond_timedwait
+static struct timespec deadline_in(int ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Takes the next pending slots of pipeline for a reader, the images among them go into
+// batch. Returns the number of slots taken. With shared readers a pipeline whose pool
+// has no free buffer isn't waited for, blocked is set instead and nothing is taken.
+static int take_batch(Readers* readers, Pipeline* pipeline, Frame** batch, int* n, int* blocked)
+{
+    *n = 0;
+    int free_buffers = -1;
+    if (readers->count > 1 && pipeline->pool->config.policy == POOL_WAIT &&
+        pool_ready(pipeline->pool)) {
+        free_buffers = pool_available(pipeline->pool);
+    }
+    pthread_mutex_lock(&pipeline->mutex);
+    int pending = pipeline->write_index - pipeline->work_index;
+    if (pending == 0 || pipeline->terminate) {
+        pthread_mutex_unlock(&pipeline->mutex);
+        return 0;
+    }
+    // share the pending files between the readers
+    int count = (pending + readers->nthreads - 1) / readers->nthreads;
+    if (count > readers->batch_size) {
+        count = readers->batch_size;
+    }
+    // after the pool timeout the frames are left to the pool policy, so they are
+    // dropped like with a reader of their own
+    if (free_buffers == 0) {
+        const int64_t now = stats_now();
+        if (pipeline->blocked_since == 0) {
+            pipeline->blocked_since = now;
+        }
+        const int timeout_ms = pipeline->pool->config.timeout_ms;
+        if (timeout_ms > 0 && now - pipeline->blocked_since > timeout_ms * 1000000LL) {
+            free_buffers = -1;
+        }
+    }
+    else {
+        pipeline->blocked_since = 0;
+    }
+    if (free_buffers == 0) {
+        // messages in front of the images can still be stepped over
+        Frame* frame = &pipeline->frames[pipeline->work_index % pipeline->size];
+        if (frame->type == FRAME_IMAGE) {
+            pthread_mutex_unlock(&pipeline->mutex);
+            atomic_fetch_add_explicit(&pipeline->reader_skips, 1, memory_order_relaxed);
+            *blocked = 1;
+            return 0;
+        }
+    }
+    else if (free_buffers > 0 && count > free_buffers) {
+        count = free_buffers;
+    }
+    int taken = 0;
+    while (taken < count) {
+        Frame* frame = &pipeline->frames[pipeline->work_index % pipeline->size];
+        // messages are ready as soon as they are queued
+        if (frame->type == FRAME_IMAGE) {
+            if (free_buffers == 0) {
+                break;
+            }
+            batch[(*n)++] = frame;
+        }
+        pipeline->work_index++;
+        taken++;
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return taken;
+}
+
+static void finish_batch(Pipeline* pipeline, Frame** batch, int n)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    Frame* next = &pipeline->frames[pipeline->wait_index % pipeline->size];
+    for (int i=0; i<n; i++) {
+        batch[i]->state = SLOT_READY;
+        // only the sender waits and it only cares about the next slot in order
+        if (batch[i] == next) {
+            pthread_cond_signal(&pipeline->ready_cond);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+static void* reader_thread(void* arg)
+{
+    Readers* readers = (Readers*)arg;
+    Frame* batch[readers->batch_size];
+    Loader loader;
+    loader_init(&loader, readers->batch_size, readers->direct);
+    placement_apply(THREAD_READER, "reader");
+
+    pthread_mutex_lock(&readers->mutex);
+    while (!readers->terminate) {
+        const uint64_t generation = readers->generation;
+        const int count = readers->count;
+        pthread_mutex_unlock(&readers->mutex);
+
+        // one batch of the first pipeline with work, starting at the turn of this reader
+        const unsigned turn = atomic_fetch_add_explicit(&readers->next, 1, memory_order_relaxed);
+        int taken = 0;
+        int blocked = 0;
+        for (int i=0; i<count && taken == 0; i++) {
+            Pipeline* pipeline = readers->pipelines[(turn + i) % count];
+            int n;
+            taken = take_batch(readers, pipeline, batch, &n, &blocked);
+            if (n > 0) {
+                const int64_t start = stats_now();
+                logger_set_prefix(pipeline->config.name);
+                load_frames(pipeline, &loader, batch, n);
+                logger_set_prefix(NULL);
+                finish_batch(pipeline, batch, n);
+                atomic_fetch_add_explicit(&pipeline->reader_ns, stats_now() - start,
+                                          memory_order_relaxed);
+            }
+        }
+
+        pthread_mutex_lock(&readers->mutex);
+        if (taken > 0) {
+            continue;
+        }
+        if (blocked) {
+            // buffers come back without a signal, the blocked pools are checked every ms
+            struct timespec ts = deadline_in(1);
+            pthread_cond_timedwait(&readers->cond, &readers->mutex, &ts);
+            continue;
+        }
+        while (generation == readers->generation && !readers->terminate) {
+            pthread_cond_wait(&readers->cond, &readers->mutex);
+        }
+    }
+    pthread_mutex_unlock(&readers->mutex);
+    loader_close(&loader);
+    return NULL;
+}
+
+// Wakes up the readers after work was queued on a pipeline
+static void readers_notify(Readers* readers)
+{
+    pthread_mutex_lock(&readers->mutex);
+    readers->generation++;
+    pthread_cond_broadcast(&readers->cond);
+    pthread_mutex_unlock(&readers->mutex);
+}
+
+void readers_init(Readers* readers, const PipelineConfig* config)
+{
+    readers->nthreads = config->nworkers;
+    readers->batch_size = config->batch_size;
+    readers->direct = config->direct;
+    readers->count = 0;
+    atomic_init(&readers->next, 0);
+    pthread_mutex_init(&readers->mutex, NULL);
+    pthread_cond_init(&readers->cond, NULL);
+    readers->generation = 0;
+    readers->terminate = 0;
+    readers->threads = malloc(readers->nthreads * sizeof(pthread_t));
+    for (int i=0; i<readers->nthreads; i++) {
+        pthread_create(&readers->threads[i], NULL, reader_thread, readers);
+    }
+}
+
+void readers_close(Readers* readers)
+{
+    pthread_mutex_lock(&readers->mutex);
+    readers->terminate = 1;
+    pthread_cond_broadcast(&readers->cond);
+    pthread_mutex_unlock(&readers->mutex);
+    // readers might wait for a free buffer
+    for (int i=0; i<readers->count; i++) {
+        pool_shutdown(readers->pipelines[i]->pool);
+    }
+    for (int i=0; i<readers->nthreads; i++) {
+        pthread_join(readers->threads[i], NULL);
+    }
+    free(readers->threads);
+}
+
+static void readers_add(Readers* readers, Pipeline* pipeline)
+{
+    pthread_mutex_lock(&readers->mutex);
+    readers->pipelines[readers->count++] = pipeline;
+    pthread_mutex_unlock(&readers->mutex);
+}
+
+static void* sender_thread(void* arg)
+{
+    Pipeline* pipeline = (Pipeline*)arg;
+    logger_set_prefix(pipeline->config.name);
+    placement_apply(THREAD_SENDER, "sender");
+    // slots from send_index on held back for the next batch
+    int batched = 0;
+    struct timespec batch_deadline;
+    pthread_mutex_lock(&pipeline->mutex);
+    while (1) {
+        pipeline->wait_index = pipeline->send_index + batched;
+        Frame* frame = &pipeline->frames[pipeline->wait_index % pipeline->size];
+        int timeout = 0;
+        while (frame->state != SLOT_READY && !pipeline->terminate && !timeout) {
+            if (pipeline->spill && !spill_empty(pipeline->spill)) {
+                // replays while there is nothing new, checks every millisecond
+                pthread_mutex_unlock(&pipeline->mutex);
+                replay_spill(pipeline);
+                pthread_mutex_lock(&pipeline->mutex);
+                if (frame->state != SLOT_READY && !spill_empty(pipeline->spill)) {
+                    struct timespec ts = deadline_in(1);
+                    pthread_cond_timedwait(&pipeline->ready_cond, &pipeline->mutex, &ts);
+                }
+                continue;
+            }
+            if (batched) {
+                timeout = pthread_cond_timedwait(&pipeline->ready_cond, &pipeline->mutex,
+                                                 &batch_deadline) == ETIMEDOUT;
+                continue;
+            }
+            pthread_cond_wait(&pipeline->ready_cond, &pipeline->mutex);
+        }
+        if (frame->state != SLOT_READY && !timeout) {
+            break;
+        }
+
+        // images are held back until the batch is full or its time is up, anything
+        // else goes out on its own after the images batched before it
+        int single = 0;
+        if (frame->state == SLOT_READY) {
+            if (pipeline->config.send_batch > 1 && frame->type == FRAME_IMAGE) {
+                if (batched == 0) {
+                    batch_deadline = deadline_in(pipeline->config.send_batch_ms);
+                }
+                batched++;
+                if (batched < pipeline->config.send_batch) {
+                    continue;
+                }
+            }
+            else {
+                single = 1;
+            }
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        if (batched) {
+            send_batch(pipeline, batched);
+        }
+        if (single) {
+            send_frame(pipeline, frame);
+        }
+
+        pthread_mutex_lock(&pipeline->mutex);
+        for (int i=0; i<batched + single; i++) {
+            pipeline->frames[pipeline->send_index % pipeline->size].state = SLOT_FREE;
+            // a message can be sent before any reader stepped over its slot, the slot
+            // may be reused from now on so the readers must not pick it up anymore
+            if (pipeline->work_index == pipeline->send_index) {
+                pipeline->work_index++;
+            }
+            pipeline->send_index++;
+        }
+        batched = 0;
+        pthread_cond_signal(&pipeline->free_cond);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+void pipeline_init(Pipeline* pipeline, int size, const PipelineConfig* config,
+                   Readers* readers, Pool* pool, Output* output, Liveview* liveview, Spill* spill,
+                   Correction* correction, Integrator* integrator)
+{
+    pipeline->size = size;
+    pipeline->frames = calloc(size, sizeof(Frame));
+    pipeline->write_index = 0;
+    pipeline->work_index = 0;
+    pipeline->send_index = 0;
+    pipeline->wait_index = 0;
+    pipeline->terminate = 0;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->ready_cond, NULL);
+    pthread_cond_init(&pipeline->free_cond, NULL);
+
+    pipeline->config = *config;
+    pipeline->pool = pool;
+    pipeline->output = output;
+    pipeline->spill = spill;
+
+    zmq_msg_init(&pipeline->most_recent_img.header_msg);
+    zmq_msg_init(&pipeline->most_recent_img.blob_msg);
+    pthread_mutex_init(&pipeline->recent_mutex, NULL);
+    pipeline->liveview = liveview;
+    pipeline->correction = correction;
+    pipeline->integrator = integrator;
+    if (integrator) {
+        for (int i=0; i<size; i++) {
+            pipeline->frames[i].profile = malloc(2 * INTEGRATE_MAX_BINS * sizeof(float));
+        }
+    }
+
+    pipeline->series = 0;
+    pipeline->layout_series = -1;
+    pthread_mutex_init(&pipeline->layout_mutex, NULL);
+    memset(&pipeline->stats_config, 0, sizeof(FrameStatsConfig));
+    pipeline->stats_config.saturation = config->saturation;
+    pipeline->next_stats_config = pipeline->stats_config;
+    memset(&pipeline->geometry, 0, sizeof(Geometry));
+    pipeline->next_geometry = pipeline->geometry;
+
+    stats_init(&pipeline->stats);
+    pipeline->sent_times = calloc(pool->config.depth, sizeof(int64_t));
+    pipeline->sent_endpoints = calloc(pool->config.depth, sizeof(int));
+    memset(&pipeline->drops, 0, sizeof(SeriesDrops));
+    pipeline->live_only = 0;
+    pipeline->batch_header = NULL;
+    if (config->send_batch > 1) {
+        pipeline->batch_header = malloc(config->send_batch * FRAME_HEADER_SIZE + 64);
+    }
+
+    atomic_init(&pipeline->reader_ns, 0);
+    atomic_init(&pipeline->reader_skips, 0);
+    pipeline->blocked_since = 0;
+
+    pipeline->readers = readers;
+    readers_add(readers, pipeline);
+    pthread_create(&pipeline->sender, NULL, sender_thread, pipeline);
+}
+
+void pipeline_close(Pipeline* pipeline)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->terminate = 1;
+    pthread_cond_broadcast(&pipeline->ready_cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+    pthread_join(pipeline->sender, NULL);
+    // the live view may still hold a frame whose buffer goes back through the pipeline
+    if (pipeline->liveview) {
+        liveview_close(pipeline->liveview);
+    }
+    zmq_msg_close(&pipeline->most_recent_img.header_msg);
+    zmq_msg_close(&pipeline->most_recent_img.blob_msg);
+    for (int i=0; i<pipeline->size; i++) {
+        free(pipeline->frames[i].profile);
+    }
+    free(pipeline->frames);
+    free(pipeline->sent_times);
+    free(pipeline->sent_endpoints);
+    free(pipeline->batch_header);
+}
+
+// Blocks until a slot is free, has to be called with the mutex held
+static Frame* reserve_slot(Pipeline* pipeline)
+{
+    while (pipeline->write_index - pipeline->send_index >= pipeline->size) {
+        // make sure the slots queued so far are worked on
+        readers_notify(pipeline->readers);
+        pthread_cond_wait(&pipeline->free_cond, &pipeline->mutex);
+    }
+    return &pipeline->frames[pipeline->write_index % pipeline->size];
+}
+
+size_t pipeline_buffer_size(const PipelineConfig* config, size_t nelements, int element_size,
+                            size_t file_size)
+{
+    // headers and files that are a bit larger than the first one
+    const size_t overhead = 128000;
+    size_t size = nelements * element_size;
+    if (file_size > size) {
+        size = file_size;
+    }
+    if (config->compression == COMPRESSION_BSLZ4 &&
+        bslz4_bound(nelements, element_size) > size) {
+        size = bslz4_bound(nelements, element_size);
+    }
+    return size + overhead;
+}
+
+size_t pipeline_buffer_size_from_file(const PipelineConfig* config, const char* filename)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", config->folder, filename);
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        log_error("Could not open %s to size the buffers", path);
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (file_size <= 0) {
+        fclose(fp);
+        return 0;
+    }
+    char* data = malloc(file_size);
+    size_t nb = fread(data, 1, file_size, fp);
+    fclose(fp);
+
+    size_t size = 0;
+    if (strncmp(config->file_ending, "tif", 3) == 0) {
+        TifInfo info;
+        if (parse_tif(data, nb, &info) == 0) {
+            size = pipeline_buffer_size(config, (size_t)info.width * info.height,
+                                        info.bits_per_sample / 8, file_size);
+        }
+    }
+    else if (strncmp(config->file_ending, "cbf", 3) == 0) {
+        CbfInfo info;
+        if (parse_cbf(data, nb, &info) == 0) {
+            size = pipeline_buffer_size(config, info.nelements, sizeof(int32_t), file_size);
+        }
+    }
+    free(data);
+    return size;
+}
+
+void pipeline_start_series(Pipeline* pipeline)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->series++;
+    pipeline->stats_config = pipeline->next_stats_config;
+    pipeline->geometry = pipeline->next_geometry;
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void pipeline_set_rois(Pipeline* pipeline, const Roi* rois, int nrois)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    memcpy(pipeline->next_stats_config.rois, rois, nrois * sizeof(Roi));
+    pipeline->next_stats_config.nrois = nrois;
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void pipeline_set_geometry(Pipeline* pipeline, const Geometry* geometry)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    if (geometry) {
+        pipeline->next_geometry = *geometry;
+    }
+    else {
+        memset(&pipeline->next_geometry, 0, sizeof(Geometry));
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void pipeline_submit_files(Pipeline* pipeline, const char** filenames,
+                           const int* frame_numbers, int n)
+{
+    const int64_t event = stats_now();
+    pthread_mutex_lock(&pipeline->mutex);
+    for (int i=0; i<n; i++) {
+        Frame* frame = reserve_slot(pipeline);
+        frame->type = FRAME_IMAGE;
+        frame->state = SLOT_PENDING;
+        frame->frame_number = frame_numbers[i];
+        frame->series = pipeline->series;
+        snprintf(frame->filename, sizeof(frame->filename), "%s", filenames[i]);
+        frame->blob = NULL;
+        frame->no_buffer = 0;
+        frame->data = NULL;
+        frame->blob_size = 0;
+        frame->shape[0] = 0;
+        frame->shape[1] = 0;
+        frame->raw_size = 0;
+        if (pipeline->config.frame_stats) {
+            frame->stats_config = pipeline->stats_config;
+        }
+        frame->has_stats = 0;
+        frame->corrected = 0;
+        frame->geometry = pipeline->geometry;
+        frame->has_profile = 0;
+        memset(&frame->times, 0, sizeof(FrameTimes));
+        frame->times.event = event;
+        pipeline->write_index++;
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    readers_notify(pipeline->readers);
+}
+
+void pipeline_submit_message(Pipeline* pipeline, const char* msg, int length)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    Frame* frame = reserve_slot(pipeline);
+    frame->type = FRAME_MESSAGE;
+    frame->state = SLOT_READY;
+    frame->series = pipeline->series;
+    frame->msg_length = snprintf(frame->msg, sizeof(frame->msg), "%.*s", length, msg);
+    // the sender waits for the slot after the images it batched, like in finish_batch
+    if (frame == &pipeline->frames[pipeline->wait_index % pipeline->size]) {
+        pthread_cond_signal(&pipeline->ready_cond);
+    }
+    pipeline->write_index++;
+    pthread_mutex_unlock(&pipeline->mutex);
+    // let a reader step over the message slot
+    readers_notify(pipeline->readers);
+}
+
+int pipeline_format_stats(Pipeline* pipeline, char* buffer, size_t size)
+{
+    PoolStats pool;
+    pool_stats(pipeline->pool, &pool);
+    pthread_mutex_lock(&pipeline->mutex);
+    int in_use = pipeline->write_index - pipeline->send_index;
+    int pending = pipeline->write_index - pipeline->work_index;
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    int length = snprintf(buffer, size, "{\"htype\": \"stats\",");
+    if (pipeline->config.name) {
+        length += snprintf(buffer + length, size - length, "\"detector\": \"%s\",",
+                           pipeline->config.name);
+    }
+    length += stats_format(&pipeline->stats, buffer + length, size - length);
+    if (length >= (int)size) {
+        return size - 1;
+    }
+    length += snprintf(buffer + length, size - length,
+                       ",\"pool\": {\"depth\": %d,\"in_use\": %d,\"high_water_mark\": %d,"
+                       "\"waits\": %llu,\"drops\": %llu},"
+                       "\"queue\": {\"size\": %d,\"in_use\": %d,\"pending\": %d},",
+                       pool.depth, pool.in_use, pool.high_water_mark,
+                       (unsigned long long)pool.waits, (unsigned long long)pool.drops,
+                       pipeline->size, in_use, pending);
+    // the readers are shared, busy is the share of them this detector took since start
+    const double elapsed = (stats_now() - pipeline->stats.start) * 1e-9;
+    const double busy = atomic_load(&pipeline->reader_ns) * 1e-9;
+    length += snprintf(buffer + length, size - length,
+                       "\"readers\": {\"threads\": %d,\"detectors\": %d,\"busy\": %.3f,"
+                       "\"skips\": %llu},",
+                       pipeline->readers->nthreads, pipeline->readers->count,
+                       elapsed > 0 ? busy / elapsed / pipeline->readers->nthreads : 0.0,
+                       (unsigned long long)atomic_load(&pipeline->reader_skips));
+    if (length < (int)size) {
+        length += output_format_stats(pipeline->output, buffer + length, size - length);
+    }
+    if (pipeline->spill && length < (int)size) {
+        length += snprintf(buffer + length, size - length, ",");
+        length += spill_format_stats(pipeline->spill, buffer + length, size - length);
+    }
+    if (pipeline->liveview && length < (int)size) {
+        length += snprintf(buffer + length, size - length,
+                           ",\"liveview\": {\"published\": %llu,\"busy\": %llu}",
+                           (unsigned long long)atomic_load(&pipeline->liveview->published),
+                           (unsigned long long)atomic_load(&pipeline->liveview->busy));
+    }
+    if (pipeline->correction && length < (int)size) {
+        length += snprintf(buffer + length, size - length, ",");
+        length += correction_format_stats(pipeline->correction, buffer + length, size - length);
+    }
+    if (pipeline->integrator && length < (int)size) {
+        length += snprintf(buffer + length, size - length, ",");
+        length += integrator_format_stats(pipeline->integrator, buffer + length, size - length);
+    }
+    if (length < (int)size) {
+        length += snprintf(buffer + length, size - length, "}");
+    }
+    return length < (int)size ? length : (int)size - 1;
+}
+
+void pipeline_copy_recent(Pipeline* pipeline, zmq_msg_t* header, zmq_msg_t* blob)
+{
+    pthread_mutex_lock(&pipeline->recent_mutex);
+    zmq_msg_copy(header, &pipeline->most_recent_img.header_msg);
+    zmq_msg_copy(blob, &pipeline->most_recent_img.blob_msg);
+    pthread_mutex_unlock(&pipeline->recent_mutex);
+}
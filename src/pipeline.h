@@ -0,0 +1,267 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <zmq.h>
+#include "pool.h"
+#include "tiff.h"
+#include "stats.h"
+#include "liveview.h"
+#include "output.h"
+#include "spill.h"
+#include "framestats.h"
+#include "correct.h"
+#include "integrate.h"
+#include "frameheader.h"
+
+// maximum length of the json header of an image
+#define FRAME_HEADER_SIZE 1024
+
+enum FrameType
+{
+    // image file that has to be loaded by a reader
+    FRAME_IMAGE,
+    // json message like the series header or series_end, sent as is
+    FRAME_MESSAGE
+};
+
+enum SlotState
+{
+    SLOT_FREE,
+    SLOT_PENDING,
+    SLOT_READY
+};
+
+typedef struct
+{
+    int type;
+    int state;
+    int frame_number;
+    // series the frame belongs to, see pipeline_start_series
+    int series;
+    char filename[256];
+    char msg[1024];
+    int msg_length;
+    // start of the pool buffer the file was read into
+    void* blob;
+    // there was no free buffer, the file was deleted without loading it
+    int no_buffer;
+    // image data inside the buffer that gets sent
+    void* data;
+    int blob_size;
+    int shape[2];
+    // pixel type for the image header and its size in bytes
+    const char* dtype;
+    int element_size;
+    // compression field of the image header
+    const char* compression;
+    // uncompressed size and time spent if the streamer compressed the image
+    int raw_size;
+    int compression_time_us;
+    FrameTimes times;
+    // rois of the series the frame belongs to, copied when it is queued, and the
+    // reduction of the image if it was computed
+    FrameStatsConfig stats_config;
+    FrameStats frame_stats;
+    int has_stats;
+    // mask, gap and flatfield correction was applied
+    int corrected;
+    // geometry of the series, copied when the frame is queued, and the radial profile
+    // as intensity followed by sigma if it was computed
+    Geometry geometry;
+    float* profile;
+    double profile_q_step;
+    int has_profile;
+} Frame;
+
+typedef struct
+{
+    zmq_msg_t header_msg;
+    zmq_msg_t blob_msg;
+} Payload;
+
+enum Compression
+{
+    COMPRESSION_NONE,
+    // bitshuffle + lz4
+    COMPRESSION_BSLZ4
+};
+
+typedef struct
+{
+    const char* folder;
+    const char* file_ending;
+    int nworkers;
+    // maximum number of files a reader loads in one go
+    int batch_size;
+    // read the files with O_DIRECT
+    int direct;
+    // decompress cbf files and send plain int32 images
+    int decode;
+    // compression of plain images before sending
+    int compression;
+    // add the times of the pipeline stages to the image headers
+    int timestamps;
+    // send up to send_batch images as one message, 1 sends every image on its own
+    int send_batch;
+    // milliseconds a batch waits for more images before it goes out incomplete, with 0
+    // a batch takes the images that are ready, so batches only grow under load
+    int send_batch_ms;
+    // reduce plain int32 images to total, maximum, saturated pixels and roi sums for
+    // the image header
+    int frame_stats;
+    // pixels at or above this count are saturated
+    int32_t saturation;
+    // json or fixed layout binary image headers, see frameheader.h
+    int header_format;
+    // detector the pipeline belongs to, for the stats and the log. NULL with a single one
+    const char* name;
+} PipelineConfig;
+
+// Frames and messages of one series that didn't reach the endpoints, by reason
+typedef struct
+{
+    int series;
+    // no free buffer in the pool
+    int pool;
+    // the file could not be loaded or parsed
+    int errors;
+    // the send policy dropped them
+    int send;
+    int messages;
+} SeriesDrops;
+
+struct Readers;
+
+// Ring of frame slots between the control loop, the reader threads and the sender.
+// The control loop fills slots in order, the readers load the files of image slots
+// in parallel and the sender emits the slots in the same order they were queued.
+typedef struct
+{
+    Frame* frames;
+    int size;
+    // next slot handed out by the control loop
+    int64_t write_index;
+    // next slot picked up by a reader
+    int64_t work_index;
+    // next slot to be sent
+    int64_t send_index;
+    // slot the sender waits for, after the ones it holds for the next batch
+    int64_t wait_index;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready_cond;
+    pthread_cond_t free_cond;
+    int terminate;
+
+    PipelineConfig config;
+    // loads the image slots, shared with the pipelines of the other detectors
+    struct Readers* readers;
+    pthread_t sender;
+
+    // image buffers, allocated by the control loop before the first file is queued
+    Pool* pool;
+    Output* output;
+    // NULL if frames are never spilled, otherwise only used by the sender
+    Spill* spill;
+
+    Payload most_recent_img;
+    pthread_mutex_t recent_mutex;
+    // NULL if the live view is disabled
+    Liveview* liveview;
+    // NULL if the images are sent uncorrected, shared by the readers
+    Correction* correction;
+    // NULL if the images are never integrated
+    Integrator* integrator;
+
+    // incremented for every new series by the control loop
+    int series;
+    // tif layout of the first frame that was parsed in the current series, later
+    // frames of the same size only read the image data
+    TifLayout layout;
+    int layout_series;
+    pthread_mutex_t layout_mutex;
+    // rois of the current series and of the next one, guarded by the mutex
+    FrameStatsConfig stats_config;
+    FrameStatsConfig next_stats_config;
+    // same for the integration geometry, bins is 0 while there is none
+    Geometry geometry;
+    Geometry next_geometry;
+
+    Stats stats;
+    // when the frame in each pool buffer was handed to zmq, for the free stage, and
+    // the endpoint it went to
+    int64_t* sent_times;
+    int* sent_endpoints;
+    // header of a batch of images, only used by the sender
+    char* batch_header;
+    // what was lost of the current series so far, only used by the sender and added
+    // to the series_end message
+    SeriesDrops drops;
+    // with SEND_LIVE_ONLY the frames only go to the live view until the output caught up
+    int live_only;
+    // time the readers spent loading frames of this pipeline and the number of times
+    // they passed it over because its pool had no free buffer
+    atomic_uint_fast64_t reader_ns;
+    atomic_uint_fast64_t reader_skips;
+    // since when the readers pass it over, 0 while its pool has free buffers
+    int64_t blocked_since;
+} Pipeline;
+
+#define READERS_MAX_PIPELINES 8
+
+// Reader threads shared by the pipelines of all detectors of the process. A reader
+// takes one batch at a time from the pipelines in turn, so a detector with a long
+// backlog can't starve the others. With several pipelines a reader doesn't wait for
+// the pool of one of them, a pipeline without free buffers is passed over.
+typedef struct Readers
+{
+    int nthreads;
+    int batch_size;
+    int direct;
+    pthread_t* threads;
+    Pipeline* pipelines[READERS_MAX_PIPELINES];
+    int count;
+    // turn of the pipeline a reader looks at first
+    atomic_uint next;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // bumped whenever work was queued, a reader only sleeps if it didn't change while
+    // it looked for work
+    uint64_t generation;
+    int terminate;
+} Readers;
+
+// Starts config->nworkers readers loading up to config->batch_size files at a time
+void readers_init(Readers* readers, const PipelineConfig* config);
+// Stops the readers, has to be called before the pipelines are closed
+void readers_close(Readers* readers);
+
+// The pipeline is added to readers. liveview may be NULL, otherwise it holds on to one
+// more pool buffer and is closed by pipeline_close. spill may be NULL, then the send policy
+// of the output decides what happens while it is full.
+// correction may be NULL, otherwise it is applied to plain int32 images. integrator may
+// be NULL, otherwise the plain int32 images are integrated once a geometry is set.
+void pipeline_init(Pipeline* pipeline, int size, const PipelineConfig* config,
+                   Readers* readers, Pool* pool, Output* output, Liveview* liveview, Spill* spill,
+                   Correction* correction, Integrator* integrator);
+void pipeline_close(Pipeline* pipeline);
+// Size of the pool buffers for frames of nelements pixels stored in files of file_size bytes
+size_t pipeline_buffer_size(const PipelineConfig* config, size_t nelements, int element_size,
+                            size_t file_size);
+// Same for frames like the one in filename, 0 if the file can't be parsed
+size_t pipeline_buffer_size_from_file(const PipelineConfig* config, const char* filename);
+// Frames submitted after this call no longer use the cached layout of the previous series
+// and use the rois and the geometry set since the last series started
+void pipeline_start_series(Pipeline* pipeline);
+void pipeline_set_rois(Pipeline* pipeline, const Roi* rois, int nrois);
+// NULL stops the integration
+void pipeline_set_geometry(Pipeline* pipeline, const Geometry* geometry);
+void pipeline_submit_files(Pipeline* pipeline, const char** filenames,
+                           const int* frame_numbers, int n);
+void pipeline_submit_message(Pipeline* pipeline, const char* msg, int length);
+// Stats of the pipeline, the pool, the frame ring and the outputs as a json object
+int pipeline_format_stats(Pipeline* pipeline, char* buffer, size_t size);
+void pipeline_copy_recent(Pipeline* pipeline, zmq_msg_t* header, zmq_msg_t* blob);
+
+#endif // PIPELINE_H
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <zmq.h>
+#include "placement.h"
+#include "logger.h"
+
+static const char* role_names[THREAD_ROLES] = {"control", "readers", "sender", "io"};
+
+static PlacementConfig placement;
+static int placement_active = 0;
+
+// The zmq io threads abort if they can't get the policy they were told to use,
+// so SCHED_FIFO is tried on the calling thread first
+static int realtime_permitted(int priority)
+{
+    int policy;
+    struct sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    struct sched_param realtime = {.sched_priority = priority};
+    int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &realtime);
+    if (rc != 0) {
+        log_warning("SCHED_FIFO not permitted (%s), the threads keep their policy", strerror(rc));
+        return 0;
+    }
+    pthread_setschedparam(pthread_self(), policy, &param);
+    return 1;
+}
+
+static const char* policy_name(int policy)
+{
+    switch (policy) {
+        case SCHED_FIFO:
+            return "SCHED_FIFO";
+        case SCHED_RR:
+            return "SCHED_RR";
+        case SCHED_BATCH:
+            return "SCHED_BATCH";
+        case SCHED_IDLE:
+            return "SCHED_IDLE";
+        default:
+            return "SCHED_OTHER";
+    }
+}
+
+void placement_init(const PlacementConfig* config)
+{
+    placement = *config;
+    placement_active = 1;
+    if (placement.realtime_priority > 0 && !realtime_permitted(placement.realtime_priority)) {
+        placement.realtime_priority = 0;
+    }
+    if (placement.lock_all && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        log_warning("Could not lock the process into memory: %s", strerror(errno));
+        placement.lock_all = 0;
+    }
+
+    char text[THREAD_ROLES][128];
+    for (int i=0; i<THREAD_ROLES; i++) {
+        placement_format_cpus(&placement.cpus[i], text[i], sizeof(text[i]));
+    }
+    char scheduling[32] = "SCHED_OTHER";
+    if (placement.realtime_priority > 0) {
+        snprintf(scheduling, sizeof(scheduling), "SCHED_FIFO %d", placement.realtime_priority);
+    }
+    log_info("Placement: %s %s, %s %s, %s %s, %s %s, %s%s", role_names[0], text[0],
+             role_names[1], text[1], role_names[2], text[2], role_names[3], text[3],
+             scheduling, placement.lock_all ? ", mlockall" : "");
+}
+
+void placement_close(void)
+{
+    placement_active = 0;
+}
+
+void placement_apply(int role, const char* name)
+{
+    if (!placement_active) {
+        return;
+    }
+    const cpu_set_t* cpus = &placement.cpus[role];
+    if (CPU_COUNT(cpus) > 0) {
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+        if (rc != 0) {
+            log_warning("Could not pin the %s thread: %s", name, strerror(rc));
+        }
+    }
+    if (placement.realtime_priority > 0) {
+        struct sched_param param = {.sched_priority = placement.realtime_priority};
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (rc != 0) {
+            log_warning("Could not run the %s thread with SCHED_FIFO: %s", name, strerror(rc));
+        }
+    }
+
+    // what the thread actually got
+    cpu_set_t effective;
+    CPU_ZERO(&effective);
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &effective);
+    char text[128];
+    placement_format_cpus(&effective, text, sizeof(text));
+    int policy;
+    struct sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    unsigned cpu = 0;
+    unsigned node = 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    log_info("%s thread on cpus %s, now on cpu %u of node %u, %s %d", name, text, cpu, node,
+             policy_name(policy), param.sched_priority);
+}
+
+void placement_apply_context(void* context)
+{
+    if (!placement_active) {
+        return;
+    }
+    const cpu_set_t* cpus = &placement.cpus[THREAD_IO];
+    for (int cpu=0; cpu<CPU_SETSIZE && CPU_COUNT(cpus) > 0; cpu++) {
+        if (CPU_ISSET(cpu, cpus) && zmq_ctx_set(context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0) {
+            log_warning("Could not pin the zmq io threads: %s", zmq_strerror(zmq_errno()));
+            break;
+        }
+    }
+    if (placement.realtime_priority > 0) {
+        if (zmq_ctx_set(context, ZMQ_THREAD_SCHED_POLICY, SCHED_FIFO) != 0 ||
+            zmq_ctx_set(context, ZMQ_THREAD_PRIORITY, placement.realtime_priority) != 0) {
+            log_warning("Could not run the zmq io threads with SCHED_FIFO: %s",
+                        zmq_strerror(zmq_errno()));
+        }
+    }
+}
+
+int placement_parse_cpus(const char* text, cpu_set_t* cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    CPU_ZERO(cpus);
+    const char* p = text;
+    while (1) {
+        char* end;
+        if (!isdigit((unsigned char)*p)) {
+            return -1;
+        }
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            if (!isdigit((unsigned char)*p)) {
+                return -1;
+            }
+            last = strtol(p, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu=first; cpu<=last; cpu++) {
+            // cores outside the affinity of the process can't be used either
+            if (!CPU_ISSET(cpu, &allowed)) {
+                return -1;
+            }
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+void placement_format_cpus(const cpu_set_t* cpus, char* text, size_t size)
+{
+    size_t length = 0;
+    text[0] = '\0';
+    if (CPU_COUNT(cpus) == 0) {
+        snprintf(text, size, "any");
+        return;
+    }
+    for (int cpu=0; cpu<CPU_SETSIZE && length < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        const char* separator = length > 0 ? "," : "";
+        if (last > cpu) {
+            length += snprintf(text + length, size - length, "%s%d-%d", separator, cpu, last);
+        }
+        else {
+            length += snprintf(text + length, size - length, "%s%d", separator, cpu);
+        }
+        cpu = last;
+    }
+}
+
+int placement_parse_node(const char* text)
+{
+    char path[256];
+    char* end;
+    long node = strtol(text, &end, 10);
+    if (end != text && *end == '\0') {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld", node);
+        return node >= 0 && access(path, F_OK) == 0 ? (int)node : -2;
+    }
+    if (strlen(text) > 64 || strchr(text, '/') != NULL) {
+        return -2;
+    }
+    snprintf(path, sizeof(path), "/sys/class/net/%s", text);
+    if (access(path, F_OK) != 0) {
+        return -2;
+    }
+    // virtual interfaces and single node machines have no node
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", text);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    int value = -1;
+    if (fscanf(f, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(f);
+    return value;
+}
+
+int placement_bind_memory(void* mem, size_t size, int node)
+{
+    unsigned long mask[16] = {0};
+    if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+        errno = EINVAL;
+        return -1;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, mem, size, MPOL_BIND, mask, sizeof(mask) * 8, 0) == 0 ? 0 : -1;
+}
+
+int placement_memory_node(void* mem)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, mem, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
@@ -0,0 +1,54 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+#include <sched.h>
+
+enum ThreadRole
+{
+    // control loops, they turn the inotify events into frames for the readers
+    THREAD_CONTROL,
+    THREAD_READER,
+    THREAD_SENDER,
+    // zmq io threads, set on the context
+    THREAD_IO,
+    THREAD_ROLES
+};
+
+typedef struct
+{
+    // cores of the threads of every role, an empty set leaves them to the scheduler
+    cpu_set_t cpus[THREAD_ROLES];
+    // SCHED_FIFO priority of the threads of all roles, 0 keeps SCHED_OTHER
+    int realtime_priority;
+    // mlockall(MCL_CURRENT | MCL_FUTURE), so no page of the process ever faults
+    int lock_all;
+} PlacementConfig;
+
+// Where the threads of the data path run, for the whole process like the logger.
+// placement_init applies mlockall and logs the configuration, every thread then
+// calls placement_apply for its role when it starts and logs where it ended up.
+// Failures are logged as warnings and leave the thread where it was. Without
+// placement_init, e.g. in the tools, placement_apply does nothing.
+void placement_init(const PlacementConfig* config);
+// Forgets the configuration, threads started from now on aren't placed
+void placement_close(void);
+void placement_apply(int role, const char* name);
+// Sets the affinity and scheduling of the io threads the context starts, before
+// its first socket is created
+void placement_apply_context(void* context);
+// Parses a cpu list like 0-3,8 into cpus. Returns -1 if it isn't one or a core
+// doesn't exist.
+int placement_parse_cpus(const char* text, cpu_set_t* cpus);
+// Formats cpus as a list like 0-3,8, "any" if it is empty
+void placement_format_cpus(const cpu_set_t* cpus, char* text, size_t size);
+// Returns the NUMA node of a number or of a network interface like eth0, -1 if
+// the interface has no node, e.g. a virtual one, and -2 if it doesn't exist
+int placement_parse_node(const char* text);
+// Binds the pages of the mapping to a NUMA node before they are first touched.
+// Returns -1 on failure.
+int placement_bind_memory(void* mem, size_t size, int node);
+// NUMA node the page at mem is on, -1 if unknown
+int placement_memory_node(void* mem);
+
+#endif // PLACEMENT_H
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "pool.h"
+#include "logger.h"
+#include "placement.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static char* map_buffers(Pool* pool, size_t size)
+{
+    char* mem;
+    if (pool->config.hugepages) {
+        pool->mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, pool->mapped_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            log_info("Buffer pool uses %zu reserved huge pages", pool->mapped_size / HUGE_PAGE_SIZE);
+            return mem;
+        }
+        log_warning("No reserved huge pages (%s), using transparent huge pages", strerror(errno));
+    }
+    pool->mapped_size = size;
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    if (pool->config.hugepages && madvise(mem, size, MADV_HUGEPAGE) != 0) {
+        log_warning("madvise MADV_HUGEPAGE failed: %s", strerror(errno));
+    }
+    return mem;
+}
+
+void pool_init(Pool* pool, const PoolConfig* config)
+{
+    pool->config = *config;
+    pool->mem = NULL;
+    pool->item_size = 0;
+    pool->mapped_size = 0;
+    queue_init(&pool->free, config->depth, QUEUE_MPMC);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    atomic_init(&pool->waiting, 0);
+    pool->terminate = 0;
+    pool->high_water_mark = 0;
+    pool->waits = 0;
+    pool->drops = 0;
+}
+
+void pool_close(Pool* pool)
+{
+    if (pool->mem) {
+        munmap(pool->mem, pool->mapped_size);
+    }
+    queue_free(&pool->free);
+}
+
+int pool_allocate(Pool* pool, size_t item_size)
+{
+    item_size = (item_size + POOL_ALIGNMENT - 1) & ~((size_t)POOL_ALIGNMENT - 1);
+    size_t size = item_size * pool->config.depth;
+    char* mem = map_buffers(pool, size);
+    if (!mem) {
+        log_error("Could not allocate %zu bytes for the buffer pool: %s", size, strerror(errno));
+        return -1;
+    }
+    if (pool->config.numa_node >= 0) {
+        if (placement_bind_memory(mem, pool->mapped_size, pool->config.numa_node) != 0) {
+            log_warning("Could not bind the buffer pool to NUMA node %d: %s",
+                        pool->config.numa_node, strerror(errno));
+        }
+        // all pages are faulted in now instead of by the first frames
+        for (size_t offset=0; offset<pool->mapped_size; offset+=POOL_ALIGNMENT) {
+            mem[offset] = 0;
+        }
+    }
+    if (pool->config.lock && mlock(mem, pool->mapped_size) != 0) {
+        log_warning("Could not lock the buffer pool into memory: %s", strerror(errno));
+    }
+    if (pool->config.numa_node >= 0) {
+        log_info("Buffer pool of %d x %zu bytes on NUMA node %d", pool->config.depth, item_size,
+                 placement_memory_node(mem));
+    }
+    else {
+        log_info("Buffer pool of %d x %zu bytes", pool->config.depth, item_size);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->mem = mem;
+    pool->item_size = item_size;
+    for (int i=0; i<pool->config.depth; i++) {
+        queue_push(&pool->free, mem + i*item_size);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+int pool_ready(Pool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    int ready = pool->mem != NULL;
+    pthread_mutex_unlock(&pool->mutex);
+    return ready;
+}
+
+int pool_available(Pool* pool)
+{
+    return queue_count(&pool->free);
+}
+
+static int wait_for_buffers(Pool* pool, int n)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += pool->config.timeout_ms / 1000;
+    deadline.tv_nsec += (pool->config.timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pool->waits++;
+    int rc = 0;
+    atomic_fetch_add(&pool->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (queue_count(&pool->free) < n && !pool->terminate) {
+        if (pool->config.timeout_ms == 0) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        else if (pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline) == ETIMEDOUT) {
+            rc = -1;
+            break;
+        }
+    }
+    atomic_fetch_sub(&pool->waiting, 1);
+    return rc;
+}
+
+int pool_get(Pool* pool, void** items, int n)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->mem && queue_count(&pool->free) < n && pool->config.policy == POOL_WAIT) {
+        if (wait_for_buffers(pool, n) != 0) {
+            log_warning("Timeout waiting for %d free buffers", n);
+        }
+    }
+    int count = 0;
+    while (count < n && pool->mem && !pool->terminate &&
+           queue_try_pop(&pool->free, &items[count])) {
+        count++;
+    }
+    // buffers only come back in the meantime, so this is the maximum so far
+    int in_use = pool->config.depth - queue_count(&pool->free);
+    if (pool->mem && in_use > pool->high_water_mark) {
+        pool->high_water_mark = in_use;
+    }
+    pool->drops += n - count;
+    pthread_mutex_unlock(&pool->mutex);
+    return count;
+}
+
+void pool_put(Pool* pool, void* data)
+{
+    // the data does not have to start at the beginning of its buffer
+    size_t item = ((char*)data - pool->mem) / pool->item_size;
+    queue_push(&pool->free, pool->mem + item * pool->item_size);
+    // pairs with the waiter setting the flag before it checks the count
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&pool->mutex);
+        // waiters might need more than one buffer
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+int pool_index(const Pool* pool, const void* data)
+{
+    return ((const char*)data - pool->mem) / pool->item_size;
+}
+
+void pool_stats(Pool* pool, PoolStats* stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    stats->depth = pool->config.depth;
+    stats->item_size = pool->item_size;
+    stats->in_use = pool->mem ? pool->config.depth - queue_count(&pool->free) : 0;
+    stats->high_water_mark = pool->high_water_mark;
+    stats->waits = pool->waits;
+    stats->drops = pool->drops;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_shutdown(Pool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->terminate = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
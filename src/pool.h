@@ -0,0 +1,87 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "queue.h"
+
+// buffers are page aligned and a multiple of this size, as needed for O_DIRECT
+#define POOL_ALIGNMENT 4096
+
+enum PoolPolicy
+{
+    // wait up to timeout_ms for free buffers, then drop the frames
+    POOL_WAIT,
+    // drop the frames right away if there are not enough free buffers
+    POOL_DROP
+};
+
+typedef struct
+{
+    int depth;
+    // back the buffers with huge pages, MAP_HUGETLB if reserved, otherwise THP
+    int hugepages;
+    // lock the buffers into memory so they never fault
+    int lock;
+    // NUMA node the buffers are bound to and touched on when they are mapped, e.g.
+    // the one of the network interface. -1 leaves them where they are first used.
+    int numa_node;
+    int policy;
+    // 0 waits forever
+    int timeout_ms;
+} PoolConfig;
+
+typedef struct
+{
+    int depth;
+    size_t item_size;
+    // buffers handed out and not returned yet, e.g. still held by zmq
+    int in_use;
+    int high_water_mark;
+    // number of times a caller had to wait and the frames dropped for lack of buffers
+    uint64_t waits;
+    uint64_t drops;
+} PoolStats;
+
+// Fixed number of equally sized image buffers in one mapping. The buffers are
+// allocated either right away or once the size of the first frame is known.
+// All functions are thread safe. Returning a buffer is lock-free unless a
+// caller of pool_get is waiting.
+typedef struct
+{
+    PoolConfig config;
+    char* mem;
+    size_t item_size;
+    size_t mapped_size;
+    Queue free;
+    // serializes pool_get, so only one thread pops from the free queue at a time
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // callers blocked in pool_get, more than one can wait while the mutex is released
+    atomic_int waiting;
+    int terminate;
+    int high_water_mark;
+    uint64_t waits;
+    uint64_t drops;
+} Pool;
+
+void pool_init(Pool* pool, const PoolConfig* config);
+void pool_close(Pool* pool);
+// Maps depth buffers of at least item_size bytes. Returns -1 on failure.
+int pool_allocate(Pool* pool, size_t item_size);
+int pool_ready(Pool* pool);
+// Free buffers right now, without waiting for pool_get callers
+int pool_available(Pool* pool);
+// Takes n buffers at once according to the policy. Returns the number of buffers
+// taken, the missing ones are counted as drops.
+int pool_get(Pool* pool, void** items, int n);
+// Returns the buffer that data points into
+void pool_put(Pool* pool, void* data);
+// Index of the buffer data points into, between 0 and depth - 1
+int pool_index(const Pool* pool, const void* data);
+void pool_stats(Pool* pool, PoolStats* stats);
+// Wakes up all waiting callers, pool_get returns 0 from now on
+void pool_shutdown(Pool* pool);
+
+#endif // POOL_H
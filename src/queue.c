@@ -1,87 +1,247 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "queue.h"
 
-#define __sync_compiler() __asm__ __volatile__("":::"memory")
+static void futex_wait(atomic_uint* word, unsigned value, const struct timespec* timeout)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake_all(atomic_uint* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
 
-void queue_init(Queue* queue, int size)
+#define WAITING 1u
+
+void queue_init(Queue* queue, int size, int type)
 {
     queue->size = size;
-    queue->buffer = malloc(sizeof(void*) * queue->size);
-    queue->write_index = 0;
-    queue->read_index = 0;
-    queue->terminate = 0;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
+    queue->type = type;
+    queue->cells = malloc(sizeof(QueueCell) * size);
+    for (int i=0; i<size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].item = NULL;
+    }
+    atomic_init(&queue->write_index, 0);
+    atomic_init(&queue->read_index, 0);
+    queue->read_cache = 0;
+    queue->write_cache = 0;
+    atomic_init(&queue->not_empty, 0);
+    atomic_init(&queue->not_full, 0);
+    atomic_init(&queue->terminate, 0);
 }
 
 void queue_free(Queue* queue)
 {
-    free(queue->buffer);
+    free(queue->cells);
+}
+
+int queue_count(Queue* queue)
+{
+    int64_t read = atomic_load_explicit(&queue->read_index, memory_order_acquire);
+    int64_t write = atomic_load_explicit(&queue->write_index, memory_order_acquire);
+    int64_t count = write - read;
+    // the indices are not read together
+    if (count < 0) {
+        return 0;
+    }
+    return count > queue->size ? queue->size : count;
 }
 
 int queue_empty(Queue* queue)
 {
-    return queue->read_index == queue->write_index;
+    return queue_count(queue) == 0;
 }
 
-int queue_push(Queue* queue, void* item)
+static int spsc_push(Queue* queue, void* item)
 {
-    // atomic load
-    __sync_compiler();
-    const int64_t index = queue->write_index;
-    __sync_compiler() ;
-    
-    int64_t limit = queue->read_index + queue->size;
-    // queue is full
-    if (index >= limit) {
-        return 0;
+    const int64_t index = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+    if (index - queue->read_cache >= queue->size) {
+        queue->read_cache = atomic_load_explicit(&queue->read_index, memory_order_acquire);
+        if (index - queue->read_cache >= queue->size) {
+            return 0;
+        }
     }
-    else {
-        queue->buffer[index % queue->size] = item;
-        int64_t next = index + 1;
-        // atomic store of write_index
-        __sync_compiler();
-        queue->write_index = next;
-        __sync_synchronize();
-        // signal consumer that queue is no longer empty
-        if (index == queue->read_index) {
-            pthread_mutex_lock(&queue->mutex);
-            pthread_cond_signal(&queue->cond); 
-            pthread_mutex_unlock(&queue->mutex);
+    queue->cells[index % queue->size].item = item;
+    atomic_store_explicit(&queue->write_index, index + 1, memory_order_release);
+    return 1;
+}
+
+static int spsc_pop(Queue* queue, void** item)
+{
+    const int64_t index = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    if (index == queue->write_cache) {
+        queue->write_cache = atomic_load_explicit(&queue->write_index, memory_order_acquire);
+        if (index == queue->write_cache) {
+            return 0;
         }
-        return 1;
     }
+    *item = queue->cells[index % queue->size].item;
+    atomic_store_explicit(&queue->read_index, index + 1, memory_order_release);
+    return 1;
 }
 
-int queue_pop(Queue* queue, void** item)
+// A cell at position pos can be written when its sequence is pos and read when it is
+// pos + 1. Reading sets it to pos + size for the next round.
+static int mpmc_push(Queue* queue, void* item)
+{
+    int64_t pos = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+    QueueCell* cell;
+    while (1) {
+        cell = &queue->cells[pos % queue->size];
+        int64_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        int64_t diff = seq - pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->write_index, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        }
+        // the cell still holds an item of the previous round
+        else if (diff < 0) {
+            return 0;
+        }
+        else {
+            pos = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+static int mpmc_pop(Queue* queue, void** item)
 {
-    // atomic load
-    __sync_compiler();
-    int64_t index = queue->read_index;
-    __sync_compiler();
-    // check if queue is empty
-    if (index == queue->write_index) {
-        pthread_mutex_lock(&queue->mutex);
-        while (queue_empty(queue) && !queue->terminate) {
-            pthread_cond_wait(&queue->cond, &queue->mutex);
+    int64_t pos = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    QueueCell* cell;
+    while (1) {
+        cell = &queue->cells[pos % queue->size];
+        int64_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        int64_t diff = seq - (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->read_index, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
         }
-        pthread_mutex_unlock(&queue->mutex);
-        if (queue->terminate && queue_empty(queue)) {
+        else if (diff < 0) {
             return 0;
         }
+        else {
+            pos = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+        }
     }
-    *item = queue->buffer[index % queue->size];
-    int64_t next = index + 1;
-    // atomic store of read_index
-    __sync_compiler();
-    queue->read_index = next;
-    __sync_synchronize();
+    *item = cell->item;
+    atomic_store_explicit(&cell->sequence, pos + queue->size, memory_order_release);
     return 1;
 }
 
+// Wakes the threads sleeping on word by starting a new epoch. The fence orders the
+// preceding index update before the flag check, the waiting side sets the flag before it
+// checks the queue again, so either the waiter sees the update or this sees the flag.
+// All waiters wake up and the ones that still can't proceed set the flag again.
+static void notify(atomic_uint* word)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned value = atomic_load_explicit(word, memory_order_relaxed);
+    while (value & WAITING) {
+        if (atomic_compare_exchange_weak(word, &value, (value + 2) & ~WAITING)) {
+            futex_wake_all(word);
+            break;
+        }
+    }
+}
+
+int queue_push(Queue* queue, void* item)
+{
+    int rc = queue->type == QUEUE_SPSC ? spsc_push(queue, item) : mpmc_push(queue, item);
+    if (rc) {
+        notify(&queue->not_empty);
+    }
+    return rc;
+}
+
+int queue_try_pop(Queue* queue, void** item)
+{
+    int rc = queue->type == QUEUE_SPSC ? spsc_pop(queue, item) : mpmc_pop(queue, item);
+    if (rc) {
+        notify(&queue->not_full);
+    }
+    return rc;
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Retries op until it succeeds, the timeout expires or the queue is shut down
+static int wait_for(Queue* queue, int (*op)(Queue*, void**), void** item,
+                    atomic_uint* word, int timeout_ms)
+{
+    const int64_t deadline = now_ns() + (int64_t)timeout_ms * 1000000;
+    while (1) {
+        if (op(queue, item)) {
+            return 1;
+        }
+        if (atomic_load(&queue->terminate)) {
+            return 0;
+        }
+        struct timespec timeout;
+        if (timeout_ms >= 0) {
+            int64_t left = deadline - now_ns();
+            if (left <= 0) {
+                return 0;
+            }
+            timeout.tv_sec = left / 1000000000;
+            timeout.tv_nsec = left % 1000000000;
+        }
+        unsigned value = atomic_fetch_or(word, WAITING) | WAITING;
+        atomic_thread_fence(memory_order_seq_cst);
+        // check again now that notify will see the flag, leaving it set only costs
+        // one needless wakeup
+        if (op(queue, item)) {
+            return 1;
+        }
+        if (!atomic_load(&queue->terminate)) {
+            futex_wait(word, value, timeout_ms >= 0 ? &timeout : NULL);
+        }
+    }
+}
+
+static int push_op(Queue* queue, void** item)
+{
+    return queue_push(queue, *item);
+}
+
+int queue_push_timeout(Queue* queue, void* item, int timeout_ms)
+{
+    return wait_for(queue, push_op, &item, &queue->not_full, timeout_ms);
+}
+
+int queue_pop_timeout(Queue* queue, void** item, int timeout_ms)
+{
+    return wait_for(queue, queue_try_pop, item, &queue->not_empty, timeout_ms);
+}
+
+int queue_pop(Queue* queue, void** item)
+{
+    return queue_pop_timeout(queue, item, -1);
+}
+
 void queue_shutdown(Queue* queue)
 {
-    pthread_mutex_lock(&queue->mutex);
-    queue->terminate = 1;
-    pthread_cond_signal(&queue->cond); 
-    pthread_mutex_unlock(&queue->mutex);
+    atomic_store(&queue->terminate, 1);
+    atomic_fetch_add(&queue->not_empty, 2);
+    atomic_fetch_add(&queue->not_full, 2);
+    futex_wake_all(&queue->not_empty);
+    futex_wake_all(&queue->not_full);
 }
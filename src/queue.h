@@ -1,29 +1,60 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <pthread.h>
+#include <stdatomic.h>
+
+enum QueueType
+{
+    // one thread pushes and one thread pops
+    QUEUE_SPSC,
+    // any number of threads push and pop
+    QUEUE_MPMC
+};
+
+typedef struct
+{
+    // MPMC only, tells whether the cell is ready to be written or read in a round
+    atomic_int_fast64_t sequence;
+    void* item;
+} QueueCell;
 
+// Bounded lock-free ring of pointers. The SPSC variant is a plain ring with
+// acquire/release indices, the MPMC variant uses a sequence number per cell
+// (Vyukov). Blocking calls sleep on a futex, which is only woken if somebody waits.
 typedef struct
 {
-    int64_t write_index;
-    char _pad[64 - sizeof(int64_t)];
-    int64_t read_index;
-    char _pad1[64 - sizeof(int64_t)];
-    void** buffer;
+    // written by the producers, the consumer side index is cached to avoid
+    // touching the other cache line on every push
+    _Alignas(64) atomic_int_fast64_t write_index;
+    int64_t read_cache;
+    _Alignas(64) atomic_int_fast64_t read_index;
+    int64_t write_cache;
+    // futex words, an epoch in the upper bits and a waiting flag in the lowest bit.
+    // Push and pop only make a syscall if the flag is set.
+    _Alignas(64) atomic_uint not_empty;
+    atomic_uint not_full;
+    atomic_int terminate;
+    QueueCell* cells;
     int size;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int terminate;
+    int type;
 } Queue;
 
-void queue_init(Queue* queue, int size);
+void queue_init(Queue* queue, int size, int type);
 void queue_free(Queue* queue);
 int queue_empty(Queue* queue);
+// number of items, only a snapshot if other threads are active
+int queue_count(Queue* queue);
+// Non-blocking, return 1 on success and 0 if the queue is full or empty
 int queue_push(Queue* queue, void* item);
+int queue_try_pop(Queue* queue, void** item);
+// Wait up to timeout_ms, a negative timeout waits forever.
+// Return 0 on timeout or after queue_shutdown.
+int queue_push_timeout(Queue* queue, void* item, int timeout_ms);
+int queue_pop_timeout(Queue* queue, void** item, int timeout_ms);
+// Blocks until an item is available, returns 0 after queue_shutdown once the queue is empty
 int queue_pop(Queue* queue, void** item);
 void queue_shutdown(Queue* queue);
 
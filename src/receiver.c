@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include "receiver.h"
+#include "frameheader.h"
+#include "cbf.h"
+#include "compress.h"
+#include "logger.h"
+
+// how often the receive thread looks for receiver_shutdown while the stream is idle
+#define RECEIVE_TIMEOUT_MS 100
+
+// Value of a json key like "frame": 12 or "compression": "cbf"
+static int json_int(const char* text, const char* key, int* value)
+{
+    const char* p = strstr(text, key);
+    return p && sscanf(p + strlen(key), " : %d", value) == 1;
+}
+
+static void json_string(const char* text, const char* key, char* value, int size)
+{
+    const char* p = strstr(text, key);
+    char format[32];
+    snprintf(format, sizeof(format), " : \"%%%d[^\"]\"", size - 1);
+    // an empty string doesn't match the format
+    if (!p || sscanf(p + strlen(key), format, value) != 1) {
+        value[0] = '\0';
+    }
+}
+
+static void reserve(void** buffer, size_t* capacity, size_t size)
+{
+    if (size > *capacity) {
+        free(*buffer);
+        *buffer = malloc(size);
+        *capacity = size;
+    }
+}
+
+static void set_text(ReceivedMessage* message, const char* text, size_t length)
+{
+    reserve((void**)&message->text, &message->text_capacity, length + 1);
+    memcpy(message->text, text, length);
+    message->text[length] = '\0';
+    message->header = message->text;
+    message->header_size = length;
+}
+
+static void parse_json_image(ReceivedMessage* message)
+{
+    const char* text = message->text;
+    message->frame = -1;
+    json_int(text, "\"frame\"", &message->frame);
+    const char* shape = strstr(text, "\"shape\"");
+    if (!shape || sscanf(shape + 7, " : [ %d , %d ]", &message->shape[0], &message->shape[1]) != 2) {
+        message->shape[0] = 0;
+        message->shape[1] = 0;
+    }
+    json_string(text, "\"type\"", message->dtype, sizeof(message->dtype));
+    json_string(text, "\"compression\"", message->compression, sizeof(message->compression));
+}
+
+static void parse_binary_image(ReceivedMessage* message)
+{
+    BinaryHeader binary;
+    memcpy(&binary, message->text, sizeof(binary));
+    const int ndtypes = sizeof(binary_dtypes) / sizeof(binary_dtypes[0]);
+    const int ncodecs = sizeof(binary_codecs) / sizeof(binary_codecs[0]);
+    message->frame = binary.frame;
+    message->shape[0] = binary.shape[0];
+    message->shape[1] = binary.shape[1];
+    snprintf(message->dtype, sizeof(message->dtype), "%s",
+             binary.dtype < ndtypes ? binary_dtypes[binary.dtype] : "");
+    snprintf(message->compression, sizeof(message->compression), "%s",
+             binary.codec < ncodecs ? binary_codecs[binary.codec] : "?");
+}
+
+#ifdef HAVE_LZ4
+static int element_size(const char* dtype)
+{
+    if (strstr(dtype, "8")) {
+        return 1;
+    }
+    return strstr(dtype, "16") ? 2 : 4;
+}
+#endif
+
+// Decompresses the image into the decode buffer of the slot, returns -1 on errors
+static int decode_message(ReceivedMessage* message)
+{
+    const char* data = message->data;
+    size_t size;
+    if (strcmp(message->compression, "cbf") == 0) {
+        CbfInfo info;
+        if (parse_cbf(data, message->size, &info) != 0) {
+            return -1;
+        }
+        size = (size_t)info.nelements * sizeof(int32_t);
+        reserve(&message->decoded, &message->decoded_capacity, size);
+        if (cbf_decode((const uint8_t*)data + info.data_offset, info.binary_size, message->decoded,
+                       info.nelements) < 0) {
+            return -1;
+        }
+        message->shape[0] = info.height;
+        message->shape[1] = info.width;
+        snprintf(message->dtype, sizeof(message->dtype), "int32");
+    }
+#ifdef HAVE_LZ4
+    else if (strcmp(message->compression, "bslz4") == 0) {
+        // the stream starts with the uncompressed size
+        uint64_t total;
+        if (message->size < sizeof(total)) {
+            return -1;
+        }
+        memcpy(&total, data, sizeof(total));
+        size = be64toh(total);
+        reserve(&message->decoded, &message->decoded_capacity, size);
+        if (bslz4_decompress(data, message->size, message->decoded, size,
+                             element_size(message->dtype)) != (long)size) {
+            return -1;
+        }
+    }
+#endif
+    else {
+        return -1;
+    }
+    message->data = message->decoded;
+    message->size = size;
+    message->compression[0] = '\0';
+    return 0;
+}
+
+static int decodable(const Receiver* receiver, const ReceivedMessage* message)
+{
+    if (receiver->config.nthreads == 0) {
+        return 0;
+    }
+#ifdef HAVE_LZ4
+    if (strcmp(message->compression, "bslz4") == 0) {
+        return 1;
+    }
+#endif
+    return strcmp(message->compression, "cbf") == 0;
+}
+
+// Waits for the slot at write_index to be released, NULL once shut down
+static ReceivedMessage* next_slot(Receiver* receiver)
+{
+    pthread_mutex_lock(&receiver->mutex);
+    ReceivedMessage* message = &receiver->messages[receiver->write_index % receiver->config.depth];
+    while (message->state != MESSAGE_FREE && !receiver->terminate) {
+        pthread_cond_wait(&receiver->free_cond, &receiver->mutex);
+    }
+    if (receiver->terminate) {
+        message = NULL;
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+    if (message) {
+        message->series = (receiver->headers + receiver->config.nendpoints - 1) /
+                          receiver->config.nendpoints;
+        message->frame = -1;
+        message->shape[0] = 0;
+        message->shape[1] = 0;
+        message->error = 0;
+        message->dtype[0] = '\0';
+        message->compression[0] = '\0';
+        message->data = NULL;
+        message->size = 0;
+        zmq_msg_init(&message->blob_msg);
+    }
+    return message;
+}
+
+// Receives the next part of the multipart message into the slot
+static void receive_blob(Receiver* receiver, ReceivedMessage* message)
+{
+    zmq_msg_recv(&message->blob_msg, receiver->socket, 0);
+    message->data = zmq_msg_data(&message->blob_msg);
+    message->size = zmq_msg_size(&message->blob_msg);
+}
+
+static void publish(Receiver* receiver, ReceivedMessage* message)
+{
+    const int pending = message->type == MESSAGE_IMAGE && decodable(receiver, message);
+    pthread_mutex_lock(&receiver->mutex);
+    message->state = pending ? MESSAGE_PENDING : MESSAGE_READY;
+    receiver->write_index++;
+    receiver->stats.messages++;
+    receiver->stats.bytes += message->header_size + message->size;
+    if (message->type == MESSAGE_IMAGE) {
+        receiver->stats.images++;
+    }
+    if (pending) {
+        pthread_cond_signal(&receiver->work_cond);
+    }
+    else {
+        pthread_cond_signal(&receiver->ready_cond);
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+static void drop_parts(Receiver* receiver, int more)
+{
+    while (more) {
+        zmq_msg_t part;
+        zmq_msg_init(&part);
+        zmq_msg_recv(&part, receiver->socket, 0);
+        more = zmq_msg_more(&part);
+        zmq_msg_close(&part);
+    }
+}
+
+// A batch whose header can't be split into the image headers is dropped as a whole
+static void drop_batch(Receiver* receiver, int more)
+{
+    pthread_mutex_lock(&receiver->mutex);
+    receiver->stats.errors++;
+    pthread_mutex_unlock(&receiver->mutex);
+    drop_parts(receiver, more);
+}
+
+// One part per image after the header with the array of image headers
+static void receive_batch(Receiver* receiver, const char* text, size_t length, int more)
+{
+    if (length <= 2) {
+        drop_batch(receiver, more);
+        return;
+    }
+    const char* marker = "{\"htype\": \"image\"";
+    const char* end = text + length;
+    const char* image = memmem(text + 1, length - 1, marker, strlen(marker));
+    while (more && image) {
+        const char* next = memmem(image + 1, end - image - 1, marker, strlen(marker));
+        // without the comma before the next image or the closing ]} of the batch
+        const char* stop = next ? next - 1 : end - 2;
+        if (stop <= image) {
+            drop_batch(receiver, more);
+            return;
+        }
+        ReceivedMessage* message = next_slot(receiver);
+        if (!message) {
+            return;
+        }
+        message->type = MESSAGE_IMAGE;
+        set_text(message, image, stop - image);
+        parse_json_image(message);
+        receive_blob(receiver, message);
+        more = zmq_msg_more(&message->blob_msg);
+        publish(receiver, message);
+        image = next;
+    }
+    // image parts without an image header
+    if (more) {
+        drop_batch(receiver, more);
+    }
+}
+
+static void receive_message(Receiver* receiver, zmq_msg_t* header)
+{
+    const char* data = zmq_msg_data(header);
+    const size_t length = zmq_msg_size(header);
+    const int more = zmq_msg_more(header);
+    const int binary = length == sizeof(BinaryHeader) &&
+                       memcmp(data, BINARY_HEADER_MAGIC, 4) == 0;
+    char htype[16] = "image";
+    if (!binary) {
+        // only the start of the message, the image headers of a batch follow
+        char start[64];
+        snprintf(start, sizeof(start), "%.*s", (int)(length < 63 ? length : 63), data);
+        json_string(start, "\"htype\"", htype, sizeof(htype));
+    }
+    if (strcmp(htype, "images") == 0) {
+        receive_batch(receiver, data, length, more);
+        return;
+    }
+    int type = MESSAGE_OTHER;
+    if (strcmp(htype, "image") == 0) {
+        type = MESSAGE_IMAGE;
+    }
+    else if (strcmp(htype, "header") == 0 || strcmp(htype, "series_end") == 0) {
+        // every output of the streamer sends them, a series spans all endpoints
+        const int n = receiver->config.nendpoints;
+        const int first = htype[0] == 'h' ? receiver->headers++ % n == 0 : ++receiver->ends % n == 0;
+        if (!first) {
+            pthread_mutex_lock(&receiver->mutex);
+            receiver->stats.duplicates++;
+            pthread_mutex_unlock(&receiver->mutex);
+            drop_parts(receiver, more);
+            return;
+        }
+        type = htype[0] == 'h' ? MESSAGE_HEADER : MESSAGE_END;
+    }
+    ReceivedMessage* message = next_slot(receiver);
+    if (!message) {
+        return;
+    }
+    message->type = type;
+    set_text(message, data, length);
+    if (type == MESSAGE_IMAGE) {
+        if (binary) {
+            parse_binary_image(message);
+        }
+        else {
+            parse_json_image(message);
+        }
+    }
+    if (more) {
+        receive_blob(receiver, message);
+        drop_parts(receiver, zmq_msg_more(&message->blob_msg));
+    }
+    publish(receiver, message);
+}
+
+static int terminated(Receiver* receiver)
+{
+    pthread_mutex_lock(&receiver->mutex);
+    const int terminate = receiver->terminate;
+    pthread_mutex_unlock(&receiver->mutex);
+    return terminate;
+}
+
+static void* receive_thread(void* arg)
+{
+    Receiver* receiver = arg;
+    while (!terminated(receiver)) {
+        zmq_msg_t header;
+        zmq_msg_init(&header);
+        if (zmq_msg_recv(&header, receiver->socket, 0) >= 0) {
+            receive_message(receiver, &header);
+        }
+        zmq_msg_close(&header);
+    }
+    return NULL;
+}
+
+static void* decoder_thread(void* arg)
+{
+    Receiver* receiver = arg;
+    pthread_mutex_lock(&receiver->mutex);
+    while (1) {
+        while (receiver->work_index == receiver->write_index && !receiver->terminate) {
+            pthread_cond_wait(&receiver->work_cond, &receiver->mutex);
+        }
+        if (receiver->terminate) {
+            break;
+        }
+        ReceivedMessage* message = &receiver->messages[receiver->work_index % receiver->config.depth];
+        receiver->work_index++;
+        // messages that need no decoding are ready already, a slot that was reused
+        // before a decoder got to its old index is decoded by whoever sees it first
+        if (message->state != MESSAGE_PENDING) {
+            continue;
+        }
+        message->state = MESSAGE_DECODING;
+        pthread_mutex_unlock(&receiver->mutex);
+
+        const int error = decode_message(message) != 0;
+
+        pthread_mutex_lock(&receiver->mutex);
+        message->error = error;
+        message->state = MESSAGE_READY;
+        if (error) {
+            // handed out as received
+            message->data = zmq_msg_data(&message->blob_msg);
+            message->size = zmq_msg_size(&message->blob_msg);
+            receiver->stats.errors++;
+        }
+        else {
+            receiver->stats.decoded++;
+        }
+        // only the caller waits and it only cares about the next slot in order
+        if (message == &receiver->messages[receiver->read_index % receiver->config.depth]) {
+            pthread_cond_signal(&receiver->ready_cond);
+        }
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+    return NULL;
+}
+
+int receiver_init(Receiver* receiver, const ReceiverConfig* config)
+{
+    memset(receiver, 0, sizeof(Receiver));
+    receiver->config = *config;
+    receiver->context = zmq_ctx_new();
+    receiver->socket = zmq_socket(receiver->context, ZMQ_PULL);
+    const int timeout = RECEIVE_TIMEOUT_MS;
+    const int linger = 0;
+    zmq_setsockopt(receiver->socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    zmq_setsockopt(receiver->socket, ZMQ_LINGER, &linger, sizeof(linger));
+    if (config->rcvhwm > 0) {
+        zmq_setsockopt(receiver->socket, ZMQ_RCVHWM, &config->rcvhwm, sizeof(config->rcvhwm));
+    }
+    for (int i=0; i<config->nendpoints; i++) {
+        if (zmq_connect(receiver->socket, config->endpoints[i]) != 0) {
+            log_error("Could not connect to %s: %s", config->endpoints[i], zmq_strerror(errno));
+            zmq_close(receiver->socket);
+            zmq_ctx_term(receiver->context);
+            return -1;
+        }
+    }
+    receiver->messages = calloc(config->depth, sizeof(ReceivedMessage));
+    pthread_mutex_init(&receiver->mutex, NULL);
+    pthread_cond_init(&receiver->work_cond, NULL);
+    pthread_cond_init(&receiver->ready_cond, NULL);
+    pthread_cond_init(&receiver->free_cond, NULL);
+    receiver->decoders = malloc(config->nthreads * sizeof(pthread_t));
+    for (int i=0; i<config->nthreads; i++) {
+        pthread_create(&receiver->decoders[i], NULL, decoder_thread, receiver);
+    }
+    pthread_create(&receiver->receive_thread, NULL, receive_thread, receiver);
+    return 0;
+}
+
+void receiver_shutdown(Receiver* receiver)
+{
+    pthread_mutex_lock(&receiver->mutex);
+    if (receiver->terminate) {
+        pthread_mutex_unlock(&receiver->mutex);
+        return;
+    }
+    receiver->terminate = 1;
+    pthread_cond_broadcast(&receiver->work_cond);
+    pthread_cond_broadcast(&receiver->ready_cond);
+    pthread_cond_broadcast(&receiver->free_cond);
+    pthread_mutex_unlock(&receiver->mutex);
+    pthread_join(receiver->receive_thread, NULL);
+    for (int i=0; i<receiver->config.nthreads; i++) {
+        pthread_join(receiver->decoders[i], NULL);
+    }
+    zmq_close(receiver->socket);
+}
+
+void receiver_close(Receiver* receiver)
+{
+    receiver_shutdown(receiver);
+    for (int i=0; i<receiver->config.depth; i++) {
+        ReceivedMessage* message = &receiver->messages[i];
+        if (message->state != MESSAGE_FREE) {
+            zmq_msg_close(&message->blob_msg);
+        }
+        free(message->text);
+        free(message->decoded);
+    }
+    free(receiver->messages);
+    free(receiver->decoders);
+    pthread_mutex_destroy(&receiver->mutex);
+    pthread_cond_destroy(&receiver->work_cond);
+    pthread_cond_destroy(&receiver->ready_cond);
+    pthread_cond_destroy(&receiver->free_cond);
+    zmq_ctx_term(receiver->context);
+}
+
+ReceivedMessage* receiver_next(Receiver* receiver, int timeout_ms)
+{
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&receiver->mutex);
+    ReceivedMessage* message = &receiver->messages[receiver->read_index % receiver->config.depth];
+    int timeout = 0;
+    while (message->state != MESSAGE_READY && !receiver->terminate && !timeout) {
+        if (timeout_ms >= 0) {
+            timeout = pthread_cond_timedwait(&receiver->ready_cond, &receiver->mutex,
+                                             &deadline) == ETIMEDOUT;
+        }
+        else {
+            pthread_cond_wait(&receiver->ready_cond, &receiver->mutex);
+        }
+    }
+    if (message->state == MESSAGE_READY) {
+        message->state = MESSAGE_HELD;
+        receiver->read_index++;
+    }
+    else {
+        message = NULL;
+    }
+    pthread_mutex_unlock(&receiver->mutex);
+    return message;
+}
+
+void receiver_release(Receiver* receiver, ReceivedMessage* message)
+{
+    zmq_msg_close(&message->blob_msg);
+    pthread_mutex_lock(&receiver->mutex);
+    message->state = MESSAGE_FREE;
+    // only the receive thread waits
+    pthread_cond_signal(&receiver->free_cond);
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+void receiver_stats(Receiver* receiver, ReceiverStats* stats)
+{
+    pthread_mutex_lock(&receiver->mutex);
+    *stats = receiver->stats;
+    pthread_mutex_unlock(&receiver->mutex);
+}
+
+Receiver* receiver_new(const char* endpoints, int depth, int nthreads, int rcvhwm)
+{
+    Receiver* receiver = malloc(sizeof(Receiver));
+    char* text = strdup(endpoints);
+    ReceiverConfig config;
+    memset(&config, 0, sizeof(config));
+    config.depth = depth;
+    config.nthreads = nthreads;
+    config.rcvhwm = rcvhwm;
+    char* rest = NULL;
+    for (char* endpoint = strtok_r(text, ",", &rest); endpoint && config.nendpoints < RECEIVER_MAX_ENDPOINTS;
+         endpoint = strtok_r(NULL, ",", &rest)) {
+        config.endpoints[config.nendpoints++] = endpoint;
+    }
+    if (config.nendpoints == 0 || depth < 1 || receiver_init(receiver, &config) != 0) {
+        free(text);
+        free(receiver);
+        return NULL;
+    }
+    receiver->endpoint_text = text;
+    return receiver;
+}
+
+void receiver_delete(Receiver* receiver)
+{
+    receiver_close(receiver);
+    free(receiver->endpoint_text);
+    free(receiver);
+}
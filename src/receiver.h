@@ -0,0 +1,134 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zmq.h>
+
+// Client side of the stream, built as libreceiver.so for pilatus/receiver.py.
+// Pulls from the streamer, splits batches into single images and decodes cbf and
+// bslz4 images on a pool of threads. Messages are handed out in the order they were
+// received and point into the zmq messages or the decode buffers of their slot, so
+// nothing is copied after zmq_msg_recv.
+
+#define RECEIVER_MAX_ENDPOINTS 16
+
+enum MessageType
+{
+    MESSAGE_HEADER,
+    MESSAGE_IMAGE,
+    MESSAGE_END,
+    // anything else the streamer may send, header and data as received
+    MESSAGE_OTHER
+};
+
+enum MessageState
+{
+    MESSAGE_FREE,
+    // received, waiting for a decoder
+    MESSAGE_PENDING,
+    MESSAGE_DECODING,
+    MESSAGE_READY,
+    // handed out until receiver_release
+    MESSAGE_HELD
+};
+
+typedef struct
+{
+    const char* endpoints[RECEIVER_MAX_ENDPOINTS];
+    int nendpoints;
+    // messages between the socket and the caller, the socket stops reading once all
+    // of them are held or waiting
+    int depth;
+    // decoder threads, with 0 compressed images are handed out as received
+    int nthreads;
+    // zmq receive high water mark in messages, 0 keeps the zmq default
+    int rcvhwm;
+} ReceiverConfig;
+
+// The members up to size are read by pilatus/receiver.py, keep them in sync
+typedef struct
+{
+    int type;
+    // number of series headers seen so far, so the first series is 1
+    int series;
+    // frame number, -1 if it isn't an image
+    int frame;
+    // height, width
+    int shape[2];
+    // decoding failed, data is the image as received
+    int error;
+    // of the data, compression is empty once the image is decoded
+    char dtype[8];
+    char compression[8];
+    // json text of the message or the binary image header, NUL terminated
+    const char* header;
+    size_t header_size;
+    const void* data;
+    size_t size;
+
+    int state;
+    zmq_msg_t blob_msg;
+    // header copy and decoded image, kept for the next message of the slot
+    char* text;
+    size_t text_capacity;
+    void* decoded;
+    size_t decoded_capacity;
+} ReceivedMessage;
+
+typedef struct
+{
+    uint64_t messages;
+    uint64_t images;
+    uint64_t bytes;
+    uint64_t decoded;
+    uint64_t errors;
+    // series headers and ends of all but one of the endpoints
+    uint64_t duplicates;
+} ReceiverStats;
+
+typedef struct
+{
+    ReceiverConfig config;
+    // copy of the endpoints given to receiver_new, config.endpoints points into it
+    char* endpoint_text;
+    void* context;
+    void* socket;
+    ReceivedMessage* messages;
+    // write_index: next slot to receive into, work_index: next slot for a decoder,
+    // read_index: next slot for the caller
+    int write_index;
+    int work_index;
+    int read_index;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t ready_cond;
+    pthread_cond_t free_cond;
+    pthread_t receive_thread;
+    pthread_t* decoders;
+    int terminate;
+    // series headers and ends received, every endpoint sends its own
+    int headers;
+    int ends;
+    ReceiverStats stats;
+} Receiver;
+
+// Connects to the endpoints and starts the threads, returns -1 if an endpoint is invalid
+int receiver_init(Receiver* receiver, const ReceiverConfig* config);
+// Stops the threads, the messages held by the caller stay valid until receiver_close
+void receiver_shutdown(Receiver* receiver);
+void receiver_close(Receiver* receiver);
+// Next message in order, NULL after timeout_ms or once the receiver is shut down.
+// A negative timeout waits forever. Only one thread may call it at a time.
+ReceivedMessage* receiver_next(Receiver* receiver, int timeout_ms);
+// Hands the slot back, a slot is reused in order so holding on to a message for long
+// stalls the receiver once it went round the ring
+void receiver_release(Receiver* receiver, ReceivedMessage* message);
+void receiver_stats(Receiver* receiver, ReceiverStats* stats);
+
+// For the ctypes bindings, which don't know the size of the structs
+Receiver* receiver_new(const char* endpoints, int depth, int nthreads, int rcvhwm);
+void receiver_delete(Receiver* receiver);
+
+#endif // RECEIVER_H
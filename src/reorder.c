@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include "reorder.h"
+#include "logger.h"
+
+int reorder_frame_number(const char* filename)
+{
+    const char* tmp = strrchr(filename, '_');
+    // if nimages=1 no frame number is appended to filename
+    if (tmp == NULL) {
+        return 0;
+    }
+    char* end;
+    long frame_number = strtol(tmp + 1, &end, 10);
+    if (!isdigit((unsigned char)tmp[1]) || frame_number > INT_MAX) {
+        return -1;
+    }
+    return frame_number;
+}
+
+void reorder_init(Reorder* reorder, const ReorderConfig* config)
+{
+    memset(reorder, 0, sizeof(Reorder));
+    reorder->config = *config;
+    reorder->slots = calloc(config->window, sizeof(ReorderSlot));
+    const int ready_size = 2 * config->window + 1;
+    reorder->ready_names = malloc(ready_size * sizeof(const char*));
+    reorder->ready_numbers = malloc(ready_size * sizeof(int));
+    reorder->ready_buffer = malloc(ready_size * sizeof(*reorder->ready_buffer));
+    reorder->expected = -1;
+}
+
+void reorder_close(Reorder* reorder)
+{
+    free(reorder->slots);
+    free(reorder->ready_names);
+    free(reorder->ready_numbers);
+    free(reorder->ready_buffer);
+}
+
+// Copies the name, the slot it came from may be reused before the file is queued
+static void release(Reorder* reorder, const char* filename, int frame_number)
+{
+    char* buffer = reorder->ready_buffer[reorder->ready_count];
+    snprintf(buffer, sizeof(*reorder->ready_buffer), "%s", filename);
+    reorder->ready_names[reorder->ready_count] = buffer;
+    reorder->ready_numbers[reorder->ready_count] = frame_number;
+    reorder->ready_count++;
+}
+
+static ReorderSlot* slot_of(Reorder* reorder, int frame_number)
+{
+    return &reorder->slots[frame_number % reorder->config.window];
+}
+
+// Releases the held frames that directly follow the ones already released
+static void release_held(Reorder* reorder)
+{
+    while (reorder->held > 0) {
+        ReorderSlot* slot = slot_of(reorder, reorder->next);
+        if (!slot->present) {
+            break;
+        }
+        release(reorder, slot->filename, reorder->next);
+        slot->present = 0;
+        reorder->held--;
+        reorder->next++;
+        reorder->gap_open = 0;
+    }
+}
+
+// Declares the missing frames from next on lost, up to the next held one or limit
+static void skip_gap(Reorder* reorder, int limit)
+{
+    const int first = reorder->next;
+    // nothing held, nothing to stop at
+    if (reorder->held == 0 && limit > reorder->next) {
+        reorder->next = limit;
+    }
+    while (reorder->next < limit && !slot_of(reorder, reorder->next)->present) {
+        reorder->next++;
+    }
+    const int n = reorder->next - first;
+    if (n == 0) {
+        return;
+    }
+    reorder->series_lost += n;
+    reorder->lost += n;
+    reorder->gaps++;
+    reorder->gap_open = 0;
+    if (n == 1) {
+        log_warning("Frame %d lost", first);
+    }
+    else {
+        log_warning("Frames %d-%d lost", first, reorder->next - 1);
+    }
+}
+
+int reorder_waiting(const Reorder* reorder)
+{
+    return reorder->active &&
+           (reorder->held > 0 ||
+            (reorder->finished && reorder->expected >= 0 && reorder->next < reorder->expected));
+}
+
+// Starts the timeout once a missing frame is really missed
+static void update_gap(Reorder* reorder, int64_t now)
+{
+    if (!reorder_waiting(reorder)) {
+        reorder->gap_open = 0;
+    }
+    else if (!reorder->gap_open) {
+        reorder->gap_open = 1;
+        reorder->gap_start = now;
+    }
+}
+
+void reorder_start(Reorder* reorder, int expected)
+{
+    reorder->active = 1;
+    reorder->next = 0;
+    reorder->held = 0;
+    reorder->expected = expected;
+    reorder->finished = 0;
+    reorder->gap_open = 0;
+    reorder->series_lost = 0;
+    for (int i=0; i<reorder->config.window; i++) {
+        reorder->slots[i].present = 0;
+    }
+}
+
+void reorder_expect(Reorder* reorder, int expected, int finished, int64_t now)
+{
+    if (!reorder->active) {
+        return;
+    }
+    if (expected >= 0) {
+        reorder->expected = expected;
+    }
+    if (finished) {
+        reorder->finished = 1;
+    }
+    update_gap(reorder, now);
+}
+
+int reorder_add(Reorder* reorder, int frame_number, const char* filename, int64_t now)
+{
+    if (!reorder->active) {
+        release(reorder, filename, frame_number);
+        return REORDER_ACCEPTED;
+    }
+    if (frame_number < reorder->next) {
+        reorder->late++;
+        log_warning("Frame %d arrived after it was declared lost", frame_number);
+        return REORDER_LATE;
+    }
+    // a stray file must not give up the frames still missing
+    if (reorder->expected >= 0 && frame_number >= reorder->expected) {
+        reorder->out_of_range++;
+        log_warning("Frame %d is beyond the %d frames of the series", frame_number,
+                    reorder->expected);
+        return REORDER_OUT_OF_RANGE;
+    }
+    const int window = reorder->config.window;
+    if (frame_number >= reorder->next + window) {
+        // the window is full, the oldest missing frames are given up
+        const int limit = frame_number - window + 1;
+        while (reorder->next < limit) {
+            release_held(reorder);
+            skip_gap(reorder, limit);
+        }
+    }
+    if (frame_number == reorder->next) {
+        release(reorder, filename, frame_number);
+        reorder->next++;
+        reorder->gap_open = 0;
+        release_held(reorder);
+    }
+    else {
+        ReorderSlot* slot = slot_of(reorder, frame_number);
+        if (slot->present) {
+            reorder->duplicates++;
+            // a repeated event of the held file, it is loaded with the frame
+            if (strcmp(slot->filename, filename) == 0) {
+                log_warning("Frame %d reported twice", frame_number);
+                return REORDER_ACCEPTED;
+            }
+            log_warning("Frame %d is already held, dropping %s", frame_number, filename);
+            return REORDER_DUPLICATE;
+        }
+        slot->present = 1;
+        snprintf(slot->filename, sizeof(slot->filename), "%s", filename);
+        reorder->held++;
+        reorder->reordered++;
+    }
+    update_gap(reorder, now);
+    return REORDER_ACCEPTED;
+}
+
+void reorder_poll(Reorder* reorder, int64_t now)
+{
+    if (!reorder_waiting(reorder) || !reorder->gap_open ||
+        now - reorder->gap_start < reorder->config.timeout_ms * 1000000LL) {
+        return;
+    }
+    skip_gap(reorder, reorder->held > 0 ? INT_MAX : reorder->expected);
+    release_held(reorder);
+    update_gap(reorder, now);
+}
+
+void reorder_flush(Reorder* reorder)
+{
+    if (!reorder->active) {
+        return;
+    }
+    while (reorder->held > 0) {
+        skip_gap(reorder, INT_MAX);
+        release_held(reorder);
+    }
+    if (reorder->expected >= 0) {
+        skip_gap(reorder, reorder->expected);
+    }
+    reorder->gap_open = 0;
+}
+
+int reorder_complete(Reorder* reorder)
+{
+    if (!reorder->active || reorder->expected < 0 || reorder->next < reorder->expected) {
+        return 0;
+    }
+    // frames beyond the expected ones aren't waited for
+    for (int i=0; reorder->held > 0; i++) {
+        ReorderSlot* slot = slot_of(reorder, reorder->next + i);
+        if (slot->present) {
+            release(reorder, slot->filename, reorder->next + i);
+            slot->present = 0;
+            reorder->held--;
+        }
+    }
+    reorder->active = 0;
+    reorder->gap_open = 0;
+    return 1;
+}
+
+void reorder_clear_ready(Reorder* reorder)
+{
+    reorder->ready_count = 0;
+}
+
+int reorder_format_stats(const Reorder* reorder, char* buffer, size_t size)
+{
+    return snprintf(buffer, size,
+                    "\"reorder\": {\"held\": %d,\"reordered\": %llu,\"lost\": %llu,"
+                    "\"gaps\": %llu,\"late\": %llu,\"duplicates\": %llu,"
+                    "\"out_of_range\": %llu}",
+                    reorder->held, (unsigned long long)reorder->reordered,
+                    (unsigned long long)reorder->lost, (unsigned long long)reorder->gaps,
+                    (unsigned long long)reorder->late,
+                    (unsigned long long)reorder->duplicates,
+                    (unsigned long long)reorder->out_of_range);
+}
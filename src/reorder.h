@@ -0,0 +1,103 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    // frames held back at most while an earlier one is missing
+    int window;
+    // milliseconds a missing frame is waited for, once a later one arrived or the
+    // acquisition finished, before it is declared lost
+    int timeout_ms;
+} ReorderConfig;
+
+typedef struct
+{
+    int present;
+    char filename[256];
+} ReorderSlot;
+
+enum ReorderResult
+{
+    REORDER_ACCEPTED,
+    // frame was already declared lost or sent, the file isn't used
+    REORDER_LATE,
+    // another file of a frame that is already held, e.g. a late one of the previous
+    // series, the file isn't used either
+    REORDER_DUPLICATE,
+    // frame number at or beyond the frames of the series, not used either
+    REORDER_OUT_OF_RANGE
+};
+
+// Puts the files of a series back into frame number order before they are queued,
+// so the frames go out in strict order. Frames after a missing one are held in a
+// window indexed by frame number until the gap is filled or times out. Only used
+// by the control loop.
+typedef struct
+{
+    ReorderConfig config;
+    ReorderSlot* slots;
+    // a series was started, otherwise files are passed through as they come
+    int active;
+    // next frame number to be released and the frames held after it
+    int next;
+    int held;
+    // frames of the series, -1 while unknown
+    int expected;
+    // camserver reported the end of the acquisition
+    int finished;
+    // when the wait for the next frame started counting as a gap
+    int gap_open;
+    int64_t gap_start;
+
+    // files released in order, handed to the pipeline with reorder_clear_ready
+    const char** ready_names;
+    int* ready_numbers;
+    char (*ready_buffer)[256];
+    int ready_count;
+
+    // counters of the current series and of all series
+    int series_lost;
+    uint64_t reordered;
+    uint64_t lost;
+    uint64_t gaps;
+    uint64_t late;
+    uint64_t duplicates;
+    uint64_t out_of_range;
+} Reorder;
+
+// Frame number at the end of a file name like scan_00012.tif, 0 without one and -1
+// if what follows the last _ isn't a number
+int reorder_frame_number(const char* filename);
+void reorder_init(Reorder* reorder, const ReorderConfig* config);
+void reorder_close(Reorder* reorder);
+// Starts a series of expected frames (-1 if unknown) numbered from 0. The previous
+// series has to be flushed and completed before.
+void reorder_start(Reorder* reorder, int expected);
+// Number of frames of the series, once known. finished is set when the camserver
+// reported the end of the acquisition, the frames still missing are then only
+// waited for until the timeout.
+void reorder_expect(Reorder* reorder, int expected, int finished, int64_t now);
+int reorder_add(Reorder* reorder, int frame_number, const char* filename, int64_t now);
+// Declares the frames lost that were waited for longer than the timeout
+void reorder_poll(Reorder* reorder, int64_t now);
+// Releases everything held and ends the series, e.g. before a new one starts
+void reorder_flush(Reorder* reorder);
+// 1 if a missing frame is waited for, then reorder_poll has to be called regularly
+int reorder_waiting(const Reorder* reorder);
+// Returns 1 once when every expected frame was released or declared lost, the series
+// is over then and later files are passed through
+int reorder_complete(Reorder* reorder);
+// The ready files have to be queued before the next add once more than window of them
+// piled up, at most 2 * window + 1 fit
+static inline int reorder_ready_full(const Reorder* reorder)
+{
+    return reorder->ready_count > reorder->config.window;
+}
+void reorder_clear_ready(Reorder* reorder);
+// "reorder" json member with the counters, returns the length like snprintf
+int reorder_format_stats(const Reorder* reorder, char* buffer, size_t size);
+
+#endif // REORDER_H
@@ -0,0 +1,570 @@
+// Stand-in for the Pilatus camserver and the DCU writing the frames, to test the
+// streamer without a detector. It listens for the streamer on the camserver port,
+// answers the text protocol and writes tif or cbf frames into the watched folder,
+// each one first under a hidden name and then renamed like the DCU does.
+//
+// The first pixels of every frame hold the time it was written, see consumer.c:
+//   pixel 0: seconds, pixel 1: microseconds (CLOCK_REALTIME), pixel 2: 0
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "tiff.h"
+#include "cbf.h"
+
+#define BUFFER_SIZE 1024
+#define TIF_HEADER_SIZE 4096
+// pixels at the start of the image that carry the timestamp
+#define STAMP_PIXELS 3
+// cbf byte offset escape to a 32 bit delta: 0x80, int16 -32768, int32
+#define CBF_ESCAPE_SIZE 7
+
+typedef struct
+{
+    const char* folder;
+    int width;
+    int height;
+    // defaults until the client sets them with nimages and expperiod
+    int nimages;
+    double period;
+    double exptime;
+    double energy;
+    char imgpath[256];
+    // write frames 2k+1 before 2k of every swap_every frames, 0 keeps the order
+    int swap_every;
+    // leave out every skip_every-th frame, 0 writes all of them
+    int skip_every;
+} Simulator;
+
+// One rendered frame, only the timestamp is patched before every write
+typedef struct
+{
+    char* data;
+    size_t size;
+    // offset of the first timestamp value in data
+    size_t stamp_offset;
+    int cbf;
+} FrameFile;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Counts like a real exposure, -1 in the gaps between the modules
+static void fill_image(int32_t* image, int width, int height)
+{
+    srand(1);
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            int32_t value = rand() % 20;
+            if (rand() % 1000 == 0) {
+                value = rand() % 1000000;
+            }
+            if (x % 494 >= 487 || y % 212 >= 195) {
+                value = -1;
+            }
+            image[y*width + x] = value;
+        }
+    }
+    for (int i=0; i<STAMP_PIXELS; i++) {
+        image[i] = 0;
+    }
+}
+
+static void render_tif(FrameFile* file, const int32_t* image, int width, int height)
+{
+    const uint32_t image_size = width * height * sizeof(int32_t);
+    file->size = TIF_HEADER_SIZE + image_size;
+    file->data = calloc(1, file->size);
+    TiffHeader header = {0x4949, 42, 8};
+    memcpy(file->data, &header, sizeof(header));
+    TifTag tags[] = {
+        {IMAGE_WIDTH, TIF_LONG, 1, width},
+        {IMAGE_HEIGHT, TIF_LONG, 1, height},
+        {BITS_PER_SAMPLE, TIF_SHORT, 1, 32},
+        {COMPRESSION, TIF_SHORT, 1, 1},
+        {STRIP_OFFSETS, TIF_LONG, 1, TIF_HEADER_SIZE},
+        {STRIP_BYTE_COUNTS, TIF_LONG, 1, image_size},
+        {SAMPLE_FORMAT, TIF_SHORT, 1, 2}
+    };
+    uint16_t count = sizeof(tags) / sizeof(TifTag);
+    memcpy(file->data + header.ifd_offset, &count, sizeof(count));
+    memcpy(file->data + header.ifd_offset + sizeof(count), tags, sizeof(tags));
+    memcpy(file->data + TIF_HEADER_SIZE, image, image_size);
+    file->stamp_offset = TIF_HEADER_SIZE;
+    file->cbf = 0;
+}
+
+// The timestamp pixels are always written as 32 bit deltas, so they can be changed
+// without compressing the image again. Pixel 2 is 0, so the deltas of the rest of
+// the image don't depend on the timestamp.
+static void render_cbf(FrameFile* file, const int32_t* image, int width, int height)
+{
+    const int nelements = width * height;
+    uint8_t* binary = malloc((size_t)nelements * 7);
+    uint8_t* p = binary;
+    for (int i=0; i<STAMP_PIXELS; i++) {
+        int16_t escape16 = -32768;
+        int32_t delta = 0;
+        *p++ = 0x80;
+        memcpy(p, &escape16, 2);
+        memcpy(p + 2, &delta, 4);
+        p += 6;
+    }
+    p += cbf_encode(image + STAMP_PIXELS, nelements - STAMP_PIXELS, p);
+    long binary_size = p - binary;
+
+    file->data = malloc(4096 + binary_size + 4096);
+    int length = sprintf(file->data,
+                         "###CBF: VERSION 1.5, CBFlib v0.7.8 - PILATUS detectors\r\n"
+                         "\r\n"
+                         "data_simulated\r\n"
+                         "\r\n"
+                         "_array_data.header_convention \"PILATUS_1.2\"\r\n"
+                         "_array_data.header_contents\r\n"
+                         ";\r\n"
+                         "# Detector: PILATUS simulator\r\n"
+                         "# Pixel_size 172e-6 m x 172e-6 m\r\n"
+                         ";\r\n"
+                         "\r\n"
+                         "_array_data.data\r\n"
+                         ";\r\n"
+                         "--CIF-BINARY-FORMAT-SECTION--\r\n"
+                         "Content-Type: application/octet-stream;\r\n"
+                         "     conversions=\"x-CBF_BYTE_OFFSET\"\r\n"
+                         "Content-Transfer-Encoding: BINARY\r\n"
+                         "X-Binary-Size: %ld\r\n"
+                         "X-Binary-ID: 1\r\n"
+                         "X-Binary-Element-Type: \"signed 32-bit integer\"\r\n"
+                         "X-Binary-Element-Byte-Order: LITTLE_ENDIAN\r\n"
+                         "X-Binary-Number-of-Elements: %d\r\n"
+                         "X-Binary-Size-Fastest-Dimension: %d\r\n"
+                         "X-Binary-Size-Second-Dimension: %d\r\n"
+                         "X-Binary-Size-Padding: 4095\r\n"
+                         "\r\n", binary_size, nelements, width, height);
+    const char marker[4] = {0x0c, 0x1a, 0x04, (char)0xd5};
+    memcpy(file->data + length, marker, 4);
+    length += 4;
+    file->stamp_offset = length + 3;
+    memcpy(file->data + length, binary, binary_size);
+    length += binary_size;
+    memset(file->data + length, 0, 4095);
+    length += 4095;
+    length += sprintf(file->data + length, "\r\n--CIF-BINARY-FORMAT-SECTION----\r\n;\r\n");
+    file->size = length;
+    file->cbf = 1;
+    free(binary);
+}
+
+static void stamp_frame(FrameFile* file)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int32_t stamp[STAMP_PIXELS] = {ts.tv_sec & 0x7fffffff, ts.tv_nsec / 1000, 0};
+    if (!file->cbf) {
+        memcpy(file->data + file->stamp_offset, stamp, sizeof(stamp));
+        return;
+    }
+    int32_t previous = 0;
+    for (int i=0; i<STAMP_PIXELS; i++) {
+        int32_t delta = (int32_t)((uint32_t)stamp[i] - (uint32_t)previous);
+        previous = stamp[i];
+        memcpy(file->data + file->stamp_offset + i*CBF_ESCAPE_SIZE, &delta, 4);
+    }
+}
+
+// Writes the file under a hidden name and renames it, the streamer only watches renames
+static int write_frame(const Simulator* sim, const FrameFile* file, const char* filename)
+{
+    char path[512];
+    char tmp_path[512];
+    snprintf(path, sizeof(path), "%s/%s", sim->folder, filename);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s", sim->folder, filename);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Could not open %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    size_t written = 0;
+    while (written < file->size) {
+        ssize_t nb = write(fd, file->data + written, file->size - written);
+        if (nb <= 0) {
+            printf("Could not write %s: %s\n", tmp_path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += nb;
+    }
+    close(fd);
+    if (rename(tmp_path, path) != 0) {
+        printf("Could not rename %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void reply(int sock, const char* msg)
+{
+    printf("Reply: %s\n", msg);
+    if (write(sock, msg, strlen(msg)) == -1) {
+        printf("Could not send reply: %s\n", strerror(errno));
+    }
+}
+
+// Returns 1 if the client asked to stop the exposure while the frames are written
+static int check_abort(int sock, const struct timespec* timeout)
+{
+    struct pollfd fd = {sock, POLLIN, 0};
+    if (ppoll(&fd, 1, timeout, NULL) <= 0) {
+        return 0;
+    }
+    char buffer[BUFFER_SIZE];
+    int nb = read(sock, buffer, BUFFER_SIZE - 1);
+    if (nb <= 0) {
+        return 1;
+    }
+    buffer[nb] = '\0';
+    printf("Request during exposure: %s\n", buffer);
+    return strstr(buffer, "camcmd k") != NULL || strcmp(buffer, "k") == 0;
+}
+
+// Writes the frames of one exposure at the exposure period
+static void expose(Simulator* sim, int sock, const char* cmd, const char* filename)
+{
+    const char* dot = strrchr(filename, '.');
+    int cbf = dot && strcmp(dot, ".cbf") == 0;
+    char base[256];
+    snprintf(base, sizeof(base), "%.*s", dot ? (int)(dot - filename) : (int)strlen(filename),
+             filename);
+
+    const int nelements = sim->width * sim->height;
+    int32_t* image = malloc(nelements * sizeof(int32_t));
+    fill_image(image, sim->width, sim->height);
+    FrameFile file;
+    if (cbf) {
+        render_cbf(&file, image, sim->width, sim->height);
+    }
+    else {
+        render_tif(&file, image, sim->width, sim->height);
+    }
+    free(image);
+
+    char msg[BUFFER_SIZE];
+    char date[64];
+    time_t t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+    snprintf(msg, sizeof(msg), "15 OK  Starting %f second background: %s\x18", sim->exptime, date);
+    reply(sock, msg);
+    printf("%s: %d frames of %dx%d every %f s\n", cmd, sim->nimages, sim->width, sim->height,
+           sim->period);
+
+    char name[300];
+    char last[300] = "";
+    int last_index = -1;
+    int aborted = 0;
+    int written = 0;
+    double max_lag = 0.0;
+    const double start = now();
+    for (int i=0; i<sim->nimages && !aborted; i++) {
+        double due = start + i * sim->period;
+        double wait = due - now();
+        if (wait > 0) {
+            struct timespec timeout = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+            aborted = check_abort(sock, &timeout);
+        }
+        else {
+            struct timespec timeout = {0, 0};
+            aborted = check_abort(sock, &timeout);
+            if (-wait > max_lag) {
+                max_lag = -wait;
+            }
+        }
+        if (aborted) {
+            break;
+        }
+        // frame written in this turn, the DCU doesn't always finish them in order
+        int index = i;
+        if (sim->swap_every > 0 && i % sim->swap_every < 2) {
+            if (i % sim->swap_every == 0 && i + 1 < sim->nimages && sim->swap_every > 1) {
+                index = i + 1;
+            }
+            else if (i % sim->swap_every == 1) {
+                index = i - 1;
+            }
+        }
+        // like the camserver a single image has no frame number
+        if (sim->nimages == 1) {
+            snprintf(name, sizeof(name), "%s", filename);
+        }
+        else {
+            snprintf(name, sizeof(name), "%s_%05d.%s", base, index, cbf ? "cbf" : "tif");
+        }
+        // the camserver reports the last frame of the exposure, also if it went missing
+        if (index > last_index) {
+            strcpy(last, name);
+            last_index = index;
+        }
+        if (sim->skip_every > 0 && index % sim->skip_every == sim->skip_every - 1) {
+            continue;
+        }
+        stamp_frame(&file);
+        if (write_frame(sim, &file, name) == 0) {
+            written++;
+        }
+    }
+    double elapsed = now() - start;
+    printf("Wrote %d frames in %.3f s, %.1f frames/s (target %.1f), %.3f ms behind at most\n",
+           written, elapsed, elapsed > 0 ? written / elapsed : 0.0,
+           sim->period > 0 ? 1.0 / sim->period : 0.0, max_lag * 1e3);
+
+    // also after an abort, the number of the last file tells the streamer how many frames
+    // the series has
+    if (written > 0) {
+        snprintf(msg, sizeof(msg), "7 OK %s/%s\x18", sim->imgpath, last);
+    }
+    else {
+        snprintf(msg, sizeof(msg), "7 ERR no frames written\x18");
+    }
+    reply(sock, msg);
+    free(file.data);
+}
+
+// Answers one camserver command, the replies follow the formats in pilatus/Pilatus.py
+static void handle_command(Simulator* sim, int sock, char* request)
+{
+    printf("Request: %s\n", request);
+    char cmd[64] = "";
+    char arg[256] = "";
+    int nargs = sscanf(request, "%63s %255s", cmd, arg);
+    char msg[BUFFER_SIZE];
+    if (nargs < 1) {
+        return;
+    }
+    if ((strcasecmp(cmd, "Exposure") == 0) ||
+        (strcasecmp(cmd, "ExtMtrigger") == 0) ||
+        (strcasecmp(cmd, "ExtEnable") == 0) ||
+        (strcasecmp(cmd, "Exttrigger") == 0)) {
+        expose(sim, sock, cmd, nargs == 2 ? arg : "image.tif");
+        return;
+    }
+    if (strcasecmp(cmd, "nimages") == 0) {
+        if (nargs == 2) {
+            sim->nimages = atoi(arg) > 0 ? atoi(arg) : 1;
+        }
+        snprintf(msg, sizeof(msg), "15 OK N images set to: %d\x18", sim->nimages);
+    }
+    else if (strcasecmp(cmd, "expperiod") == 0) {
+        if (nargs == 2) {
+            sim->period = atof(arg);
+        }
+        snprintf(msg, sizeof(msg), "15 OK Exposure period set to: %f sec\x18", sim->period);
+    }
+    else if (strcasecmp(cmd, "exptime") == 0) {
+        if (nargs == 2) {
+            sim->exptime = atof(arg);
+        }
+        snprintf(msg, sizeof(msg), "15 OK Exposure time set to: %f sec.\x18", sim->exptime);
+    }
+    else if (strcasecmp(cmd, "imgpath") == 0) {
+        if (nargs == 2) {
+            snprintf(sim->imgpath, sizeof(sim->imgpath), "%s", arg);
+        }
+        snprintf(msg, sizeof(msg), "10 OK %s\x18", sim->imgpath);
+    }
+    else if (strcasecmp(cmd, "setenergy") == 0) {
+        if (nargs == 2) {
+            sim->energy = atof(arg);
+        }
+        snprintf(msg, sizeof(msg), "15 OK Energy setting: %f eV\x18", sim->energy);
+    }
+    else {
+        snprintf(msg, sizeof(msg), "15 OK\x18");
+    }
+    reply(sock, msg);
+}
+
+static int start_server(const char* address, int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        printf("Could not create server socket\n");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(address);
+    server.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        printf("Error binding to %s:%d: %s\n", address, port, strerror(errno));
+        return -1;
+    }
+    listen(sock, 1);
+    return sock;
+}
+
+static void show_usage(const char* p)
+{
+  printf("\npilatus-simulator\n"
+         "\n"
+         "Usage: %s -f folder [-h]\n"
+         "    -f, --folder         The folder the streamer watches, the frames are written there\n"
+         "    -s, --size           The detector size. Either Pilatus100k, Pilatus1M, Pilatus2M\n"
+         "                         or WxH in pixels (default Pilatus100k)\n"
+         "    -n, --nimages        Number of frames per exposure until the client sets nimages\n"
+         "                         (default 100)\n"
+         "    -r, --rate           Frames per second until the client sets expperiod,\n"
+         "                         0 writes as fast as possible (default 100)\n"
+         "    -a, --address        Address to listen on for the streamer (default 127.0.0.1:41234)\n"
+         "        --swap-every     Write the second frame of every N before the first one, to\n"
+         "                         test the reordering of the streamer (default 0, in order)\n"
+         "        --skip-every     Leave out every Nth frame, to test the gap detection\n"
+         "                         (default 0, all frames)\n"
+         "    -h, --help           print this message and exit\n"
+         "\n"
+         "The file format follows the file name of the exposure command, tif or cbf.\n", p);
+}
+
+// options without a short form
+enum
+{
+    OPT_SWAP_EVERY = 256,
+    OPT_SKIP_EVERY
+};
+
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"folder", required_argument, NULL, 'f'},
+    {"size", required_argument, NULL, 's'},
+    {"nimages", required_argument, NULL, 'n'},
+    {"rate", required_argument, NULL, 'r'},
+    {"address", required_argument, NULL, 'a'},
+    {"swap-every", required_argument, NULL, OPT_SWAP_EVERY},
+    {"skip-every", required_argument, NULL, OPT_SKIP_EVERY},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char* argv[])
+{
+    Simulator sim;
+    sim.folder = NULL;
+    sim.width = 487;
+    sim.height = 195;
+    sim.nimages = 100;
+    sim.period = 0.01;
+    sim.exptime = 0.0;
+    sim.energy = 8041.0;
+    strcpy(sim.imgpath, "/ramdisk");
+    sim.swap_every = 0;
+    sim.skip_every = 0;
+    char address[64] = "127.0.0.1";
+    int port = 41234;
+
+    int c;
+    while((c = getopt_long(argc, argv, ":hf:s:n:r:a:", long_options, NULL)) != EOF) {
+        switch(c) {
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            case 'f':
+                sim.folder = optarg;
+                break;
+
+            case 's':
+                if (strcmp("Pilatus100k", optarg) == 0) {
+                    sim.width = 487;
+                    sim.height = 195;
+                }
+                else if (strcmp("Pilatus1M", optarg) == 0) {
+                    sim.width = 981;
+                    sim.height = 1043;
+                }
+                else if (strcmp("Pilatus2M", optarg) == 0) {
+                    sim.width = 1475;
+                    sim.height = 1679;
+                }
+                else if (sscanf(optarg, "%dx%d", &sim.width, &sim.height) != 2 ||
+                         sim.width * sim.height <= STAMP_PIXELS) {
+                    printf("Wrong detector size\n");
+                    return -1;
+                }
+                break;
+
+            case 'n':
+                sim.nimages = atoi(optarg);
+                if (sim.nimages < 1) {
+                    printf("Number of images has to be at least 1\n");
+                    return -1;
+                }
+                break;
+
+            case 'r': {
+                double rate = atof(optarg);
+                sim.period = rate > 0 ? 1.0 / rate : 0.0;
+                break;
+            }
+
+            case 'a':
+                if (sscanf(optarg, "%63[^:]:%d", address, &port) != 2) {
+                    printf("Address has to be host:port\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_SWAP_EVERY:
+                sim.swap_every = atoi(optarg);
+                break;
+
+            case OPT_SKIP_EVERY:
+                sim.skip_every = atoi(optarg);
+                break;
+        }
+    }
+    if (sim.folder == NULL) {
+        printf("Folder to write the frames to is empty. Abort!\n");
+        return -1;
+    }
+    sim.exptime = sim.period > 0.003 ? sim.period - 0.003 : sim.period;
+
+    int server_sock = start_server(address, port);
+    if (server_sock == -1) {
+        return -1;
+    }
+    printf("Waiting for the streamer on %s:%d\n", address, port);
+    char buffer[BUFFER_SIZE];
+    while (1) {
+        int sock = accept(server_sock, NULL, NULL);
+        if (sock == -1) {
+            printf("Error accepting connection\n");
+            continue;
+        }
+        printf("Streamer connected\n");
+        int nb;
+        while ((nb = read(sock, buffer, BUFFER_SIZE - 1)) > 0) {
+            buffer[nb] = '\0';
+            // the streamer terminates every command with a null byte
+            int i = 0;
+            while (i < nb) {
+                char* request = buffer + i;
+                i += strlen(request) + 1;
+                handle_command(&sim, sock, request);
+            }
+        }
+        printf("Streamer disconnected\n");
+        close(sock);
+    }
+    return 0;
+}
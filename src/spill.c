@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "spill.h"
+#include "stats.h"
+#include "logger.h"
+
+enum RecordType
+{
+    RECORD_FRAME = 1,
+    RECORD_MESSAGE,
+    // rest of the file is unused, the next record starts at the beginning
+    RECORD_WRAP
+};
+
+typedef struct
+{
+    uint32_t type;
+    int32_t endpoint;
+    uint32_t header_size;
+    uint32_t reserved;
+    uint64_t data_size;
+} RecordHeader;
+
+#define RECORD_ALIGN 8
+
+static size_t record_size(size_t header_size, size_t data_size)
+{
+    size_t size = sizeof(RecordHeader) + header_size + data_size;
+    return (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+int spill_init(Spill* spill, const SpillConfig* config)
+{
+    memset(spill, 0, sizeof(Spill));
+    spill->config = *config;
+    spill->size = config->size & ~(size_t)(RECORD_ALIGN - 1);
+    spill->fd = open(config->path, O_RDWR | O_CREAT, 0644);
+    if (spill->fd == -1) {
+        log_error("Could not open spill file %s: %s", config->path, strerror(errno));
+        return -1;
+    }
+    // allocated up front, so spilling never runs out of disk space halfway
+    int rc = posix_fallocate(spill->fd, 0, spill->size);
+    if (rc != 0) {
+        log_error("Could not allocate %zu bytes for spill file %s: %s", spill->size,
+                  config->path, strerror(rc));
+        close(spill->fd);
+        return -1;
+    }
+    spill->mem = mmap(NULL, spill->size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0);
+    if (spill->mem == MAP_FAILED) {
+        log_error("Could not map spill file %s: %s", config->path, strerror(errno));
+        close(spill->fd);
+        return -1;
+    }
+    madvise(spill->mem, spill->size, MADV_SEQUENTIAL);
+    atomic_init(&spill->records, 0);
+    atomic_init(&spill->used, 0);
+    spill->last_time = stats_now();
+    log_info("Spill file %s of %zu bytes", config->path, spill->size);
+    return 0;
+}
+
+void spill_close(Spill* spill)
+{
+    munmap(spill->mem, spill->size);
+    close(spill->fd);
+}
+
+int spill_append(Spill* spill, int endpoint, const void* header, size_t header_size,
+                 const void* data, size_t data_size)
+{
+    const size_t size = record_size(header_size, data_size);
+    if (spill_empty(spill)) {
+        spill->head = 0;
+        spill->tail = 0;
+    }
+    size_t start = spill->head;
+    size_t wasted = 0;
+    if (spill_empty(spill) || spill->head > spill->tail) {
+        // free space at the end, and at the beginning up to the oldest record
+        if (spill->head + size > spill->size) {
+            if (size > spill->tail) {
+                return -1;
+            }
+            if (spill->size - spill->head >= sizeof(RecordHeader)) {
+                RecordHeader* wrap = (RecordHeader*)(spill->mem + spill->head);
+                wrap->type = RECORD_WRAP;
+            }
+            wasted = spill->size - spill->head;
+            start = 0;
+        }
+    }
+    else if (spill->head + size > spill->tail) {
+        return -1;
+    }
+
+    RecordHeader* record = (RecordHeader*)(spill->mem + start);
+    record->type = data ? RECORD_FRAME : RECORD_MESSAGE;
+    record->endpoint = endpoint;
+    record->header_size = header_size;
+    record->reserved = 0;
+    record->data_size = data_size;
+    char* p = (char*)(record + 1);
+    memcpy(p, header, header_size);
+    if (data_size) {
+        memcpy(p + header_size, data, data_size);
+    }
+    spill->head = start + size;
+    atomic_fetch_add_explicit(&spill->used, size + wasted, memory_order_relaxed);
+    atomic_fetch_add_explicit(&spill->records, 1, memory_order_relaxed);
+    if (data) {
+        atomic_fetch_add_explicit(&spill->spilled, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+// Skips the unused end of the file if the next record starts at the beginning
+static void skip_wrap(Spill* spill)
+{
+    if (spill->size - spill->tail < sizeof(RecordHeader) ||
+        ((RecordHeader*)(spill->mem + spill->tail))->type == RECORD_WRAP) {
+        atomic_fetch_sub_explicit(&spill->used, spill->size - spill->tail, memory_order_relaxed);
+        spill->tail = 0;
+    }
+}
+
+int spill_peek(Spill* spill, SpillRecord* record)
+{
+    if (spill_empty(spill)) {
+        return 0;
+    }
+    skip_wrap(spill);
+    const RecordHeader* header = (const RecordHeader*)(spill->mem + spill->tail);
+    record->endpoint = header->endpoint;
+    record->header = (const char*)(header + 1);
+    record->header_size = header->header_size;
+    record->data = header->type == RECORD_FRAME ? record->header + header->header_size : NULL;
+    record->data_size = header->data_size;
+    return 1;
+}
+
+void spill_pop(Spill* spill)
+{
+    skip_wrap(spill);
+    const RecordHeader* header = (const RecordHeader*)(spill->mem + spill->tail);
+    const size_t size = record_size(header->header_size, header->data_size);
+    if (header->type == RECORD_FRAME) {
+        atomic_fetch_add_explicit(&spill->replayed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&spill->replayed_bytes, header->data_size, memory_order_relaxed);
+    }
+    spill->tail += size;
+    atomic_fetch_sub_explicit(&spill->used, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&spill->records, 1, memory_order_relaxed);
+}
+
+int spill_format_stats(Spill* spill, char* buffer, size_t size)
+{
+    const int64_t now = stats_now();
+    const uint64_t bytes = atomic_load(&spill->replayed_bytes);
+    const double elapsed = (now - spill->last_time) * 1e-9;
+    const double rate = elapsed > 0 ? (bytes - spill->last_replayed_bytes) / elapsed : 0.0;
+    spill->last_time = now;
+    spill->last_replayed_bytes = bytes;
+    return snprintf(buffer, size,
+                    "\"spill\": {\"capacity\": %zu,\"used\": %zu,\"records\": %d,"
+                    "\"spilled\": %llu,\"replayed\": %llu,\"full\": %llu,"
+                    "\"replay_bytes_per_second\": %.0f}",
+                    spill->size, atomic_load(&spill->used), atomic_load(&spill->records),
+                    (unsigned long long)atomic_load(&spill->spilled),
+                    (unsigned long long)atomic_load(&spill->replayed),
+                    (unsigned long long)atomic_load(&spill->full), rate);
+}
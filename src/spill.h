@@ -0,0 +1,72 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+typedef struct
+{
+    // ring file on a local disk, created if it doesn't exist
+    const char* path;
+    size_t size;
+    // milliseconds a frame may wait for the output before it is spilled
+    int deadline_ms;
+} SpillConfig;
+
+// A spilled frame or message, pointing into the mapped file
+typedef struct
+{
+    // -1 for messages that go to every endpoint
+    int endpoint;
+    const char* header;
+    size_t header_size;
+    const char* data;
+    size_t data_size;
+} SpillRecord;
+
+// Frames the output couldn't take in time, appended in order to a preallocated
+// and mapped ring file and replayed from there once the consumers caught up.
+// Only used by the sender thread, except for the counters. The file is scratch
+// space, its content doesn't survive a restart of the streamer.
+typedef struct
+{
+    SpillConfig config;
+    int fd;
+    char* mem;
+    size_t size;
+    // where the next record is written and where the oldest one starts
+    size_t head;
+    size_t tail;
+
+    // frames and messages in the file and the bytes they take
+    atomic_int records;
+    atomic_size_t used;
+    atomic_uint_fast64_t spilled;
+    atomic_uint_fast64_t replayed;
+    atomic_uint_fast64_t replayed_bytes;
+    // records that didn't fit and had to wait for the output
+    atomic_uint_fast64_t full;
+    // only used by the thread formatting the stats, for the replay rate
+    int64_t last_time;
+    uint64_t last_replayed_bytes;
+} Spill;
+
+// Returns -1 if the file can't be created, allocated or mapped
+int spill_init(Spill* spill, const SpillConfig* config);
+void spill_close(Spill* spill);
+static inline int spill_empty(Spill* spill)
+{
+    return atomic_load_explicit(&spill->records, memory_order_relaxed) == 0;
+}
+// Returns -1 if the record doesn't fit into the free part of the ring
+int spill_append(Spill* spill, int endpoint, const void* header, size_t header_size,
+                 const void* data, size_t data_size);
+// Oldest record, returns 0 if the spill is empty. It stays valid until spill_pop.
+int spill_peek(Spill* spill, SpillRecord* record);
+void spill_pop(Spill* spill);
+// "spill" json member with depth, counters and the replay rate since the last call,
+// returns the length like snprintf
+int spill_format_stats(Spill* spill, char* buffer, size_t size);
+
+#endif // SPILL_H
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include "stats.h"
+#include "logger.h"
+
+static const char* stage_names[STAGE_COUNT] = {
+    "queued",
+    "open",
+    "read",
+    "remove",
+    "process",
+    "order",
+    "send",
+    "total",
+    "free"
+};
+
+void stats_init(Stats* stats)
+{
+    memset(stats, 0, sizeof(Stats));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stats->start = stats_now();
+    stats->realtime_offset = ts.tv_sec * 1000000000LL + ts.tv_nsec - stats->start;
+    stats->last_time = stats->start;
+}
+
+void histogram_add(Histogram* histogram, int64_t ns)
+{
+    uint64_t us = ns > 0 ? ns / 1000 : 0;
+    // bit length, 0 for 0, 1 for 1, 2 for 2-3, ...
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_us, us, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+    while (us > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max_us, &max, us,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+uint64_t histogram_percentile(const Histogram* histogram, double q)
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count = 0;
+    // the buckets are read one by one while they may change, the sum of this copy is
+    // what the percentile refers to
+    for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+        buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        count += buckets[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = q * count;
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t max = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            uint64_t upper = i ? (1ULL << i) - 1 : 0;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+static void add_stage(Stats* stats, int stage, int64_t from, int64_t to)
+{
+    if (from && to) {
+        histogram_add(&stats->stages[stage], to - from);
+    }
+}
+
+void stats_add_frame(Stats* stats, const FrameTimes* times, int64_t send_ns)
+{
+    add_stage(stats, STAGE_QUEUED, times->event, times->load);
+    add_stage(stats, STAGE_OPEN, times->load, times->opened);
+    add_stage(stats, STAGE_READ, times->opened, times->read);
+    add_stage(stats, STAGE_REMOVE, times->read, times->removed);
+    add_stage(stats, STAGE_PROCESS, times->removed, times->processed);
+    add_stage(stats, STAGE_ORDER, times->processed, times->sent);
+    add_stage(stats, STAGE_TOTAL, times->event, times->sent);
+    histogram_add(&stats->stages[STAGE_SEND], send_ns);
+    if (send_ns > STATS_STALL_NS) {
+        atomic_fetch_add_explicit(&stats->send_stalls, 1, memory_order_relaxed);
+    }
+}
+
+int stats_format(Stats* stats, char* buffer, size_t size)
+{
+    const int64_t now = stats_now();
+    const uint64_t frames = atomic_load(&stats->frames);
+    const uint64_t bytes = atomic_load(&stats->bytes);
+    const double elapsed = (now - stats->last_time) * 1e-9;
+    const double frame_rate = elapsed > 0 ? (frames - stats->last_frames) / elapsed : 0.0;
+    const double byte_rate = elapsed > 0 ? (bytes - stats->last_bytes) / elapsed : 0.0;
+    stats->last_time = now;
+    stats->last_frames = frames;
+    stats->last_bytes = bytes;
+
+    int length = snprintf(buffer, size,
+                          "\"uptime\": %.3f,"
+                          "\"frames\": %llu,"
+                          "\"bytes\": %llu,"
+                          "\"messages\": %llu,"
+                          "\"errors\": %llu,"
+                          "\"send_stalls\": %llu,"
+                          "\"send_drops\": %llu,"
+                          "\"message_drops\": %llu,"
+                          "\"log_lines_lost\": %llu,"
+                          "\"frames_per_second\": %.1f,"
+                          "\"bytes_per_second\": %.0f,"
+                          "\"latency_us\": {",
+                          (now - stats->start) * 1e-9,
+                          (unsigned long long)frames, (unsigned long long)bytes,
+                          (unsigned long long)atomic_load(&stats->messages),
+                          (unsigned long long)atomic_load(&stats->errors),
+                          (unsigned long long)atomic_load(&stats->send_stalls),
+                          (unsigned long long)atomic_load(&stats->send_drops),
+                          (unsigned long long)atomic_load(&stats->message_drops),
+                          (unsigned long long)logger_dropped(),
+                          frame_rate, byte_rate);
+    for (int i=0; i<STAGE_COUNT && length < (int)size; i++) {
+        const Histogram* h = &stats->stages[i];
+        const uint64_t count = atomic_load(&h->count);
+        length += snprintf(buffer + length, size - length,
+                           "%s\"%s\": {\"count\": %llu,\"mean\": %.1f,"
+                           "\"p50\": %llu,\"p99\": %llu,\"max\": %llu}",
+                           i ? "," : "", stage_names[i], (unsigned long long)count,
+                           count ? (double)atomic_load(&h->sum_us) / count : 0.0,
+                           (unsigned long long)histogram_percentile(h, 0.5),
+                           (unsigned long long)histogram_percentile(h, 0.99),
+                           (unsigned long long)atomic_load(&h->max_us));
+    }
+    if (length < (int)size) {
+        length += snprintf(buffer + length, size - length, "}");
+    }
+    return length;
+}
@@ -0,0 +1,101 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// power of two buckets of microseconds, the last one also takes everything larger
+#define HISTOGRAM_BUCKETS 32
+// a send call taking longer than this counts as a stall of the send queue
+#define STATS_STALL_NS 1000000
+
+// Times a frame reached the stages of the pipeline, CLOCK_MONOTONIC in ns
+typedef struct
+{
+    // queued by the control loop after the inotify event
+    int64_t event;
+    // picked up by a reader
+    int64_t load;
+    int64_t opened;
+    int64_t read;
+    int64_t removed;
+    // parsed, decoded or compressed
+    int64_t processed;
+    // handed to zmq
+    int64_t sent;
+} FrameTimes;
+
+enum Stage
+{
+    // event -> load
+    STAGE_QUEUED,
+    // load -> opened
+    STAGE_OPEN,
+    // opened -> read
+    STAGE_READ,
+    // read -> removed
+    STAGE_REMOVE,
+    // removed -> processed
+    STAGE_PROCESS,
+    // processed -> sent, waiting for the frames before it and the send call
+    STAGE_ORDER,
+    // duration of the zmq send calls of a frame
+    STAGE_SEND,
+    // event -> sent
+    STAGE_TOTAL,
+    // sent -> buffer freed by zmq, includes the time the monitor copy holds on to
+    // the most recent frame
+    STAGE_FREE,
+    STAGE_COUNT
+};
+
+// Lock-free latency histogram, safe to update from any thread
+typedef struct
+{
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_us;
+    atomic_uint_fast64_t max_us;
+} Histogram;
+
+typedef struct
+{
+    Histogram stages[STAGE_COUNT];
+    atomic_uint_fast64_t frames;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t messages;
+    // frames that could not be loaded or parsed
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t send_stalls;
+    // frames and messages the send policy dropped because the output didn't take them
+    atomic_uint_fast64_t send_drops;
+    atomic_uint_fast64_t message_drops;
+    // CLOCK_REALTIME - CLOCK_MONOTONIC, to put wall clock times into the headers
+    int64_t realtime_offset;
+    int64_t start;
+    // only used by the thread formatting the stats, for the rates since the last call
+    int64_t last_time;
+    uint64_t last_frames;
+    uint64_t last_bytes;
+} Stats;
+
+static inline int64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_init(Stats* stats);
+void histogram_add(Histogram* histogram, int64_t ns);
+// Value below which the fraction q of the samples lie, rounded up to the bucket
+uint64_t histogram_percentile(const Histogram* histogram, double q);
+// Adds the latencies between the stages a frame went through
+void stats_add_frame(Stats* stats, const FrameTimes* times, int64_t send_ns);
+// Counters, rates and latency percentiles as json members, without the braces.
+// Returns the length like snprintf.
+int stats_format(Stats* stats, char* buffer, size_t size);
+
+#endif // STATS_H
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tiff.h"
+#include "logger.h"
 
 #ifndef NDEBUG
 #  define debug_print printf
@@ -8,62 +10,190 @@
 #  define debug_print(...)
 #endif
 
-void parse_tif(FILE* fp, TifInfo* info)
+static uint32_t tag_value(const TifTag* tag)
+{
+    // short values are left justified in the 4 bytes
+    if (tag->data_type == TIF_SHORT) {
+        return tag->data_offset & 0xffff;
+    }
+    return tag->data_offset;
+}
+
+// Element i of a SHORT or LONG array, which is stored in the tag itself if it fits
+static uint32_t tag_element(const char* data, const TifTag* tag, uint32_t i)
+{
+    const size_t type_size = tag->data_type == TIF_SHORT ? 2 : 4;
+    const char* array = (const char*)&tag->data_offset;
+    if (tag->data_count * type_size > 4) {
+        array = data + tag->data_offset;
+    }
+    if (type_size == 2) {
+        uint16_t value;
+        memcpy(&value, array + 2*i, 2);
+        return value;
+    }
+    uint32_t value;
+    memcpy(&value, array + 4*i, 4);
+    return value;
+}
+
+static int check_array(const TifTag* tag, size_t size)
+{
+    if (tag->data_type != TIF_SHORT && tag->data_type != TIF_LONG) {
+        return -1;
+    }
+    const size_t bytes = (size_t)tag->data_count * (tag->data_type == TIF_SHORT ? 2 : 4);
+    if (bytes > 4 && (size_t)tag->data_offset + bytes > size) {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_strips(const char* data, size_t size, TifInfo* info)
+{
+    if (info->offsets_tag.data_count == 0 ||
+        info->offsets_tag.data_count != info->counts_tag.data_count ||
+        check_array(&info->offsets_tag, size) != 0 ||
+        check_array(&info->counts_tag, size) != 0) {
+        log_error("Bad strip offsets or byte counts");
+        return -1;
+    }
+    info->nstrips = info->offsets_tag.data_count;
+    info->strip_offsets = tag_element(data, &info->offsets_tag, 0);
+    info->contiguous = 1;
+    size_t total = 0;
+    uint32_t next = info->strip_offsets;
+    for (uint32_t i=0; i<info->nstrips; i++) {
+        uint32_t offset = tag_element(data, &info->offsets_tag, i);
+        uint32_t count = tag_element(data, &info->counts_tag, i);
+        if ((size_t)offset + count > size) {
+            log_error("Image data exceeds file size");
+            return -1;
+        }
+        if (offset != next) {
+            info->contiguous = 0;
+        }
+        next = offset + count;
+        total += count;
+    }
+    info->strip_byte_counts = total;
+    return 0;
+}
+
+int parse_tif(const char* data, size_t size, TifInfo* info)
 {
     TiffHeader header;
-    if (fread(&header, sizeof(TiffHeader), 1, fp) != 1) {
-        printf("Problem reading header\n");
+    if (size < sizeof(TiffHeader)) {
+        log_error("Problem reading header");
+        return -1;
+    }
+    memcpy(&header, data, sizeof(TiffHeader));
+    if (memcmp(&header.identifier, "II", 2) != 0 || header.version != 42) {
+        log_error("Not a little endian tif file");
+        return -1;
     }
     debug_print("idf offset %d\n", header.ifd_offset);
     
-    fseek(fp, header.ifd_offset, SEEK_SET);
     uint16_t tag_count;
-    fread(&tag_count, sizeof(uint16_t), 1, fp);
+    if ((size_t)header.ifd_offset + sizeof(uint16_t) > size) {
+        log_error("Problem reading tag count");
+        return -1;
+    }
+    memcpy(&tag_count, data + header.ifd_offset, sizeof(uint16_t));
     debug_print("tag count %d\n", tag_count);
     
-    TifTag* tags = (TifTag*)malloc(tag_count*sizeof(TifTag));
-    fread(tags, sizeof(TifTag), tag_count, fp);
+    size_t tags_offset = header.ifd_offset + sizeof(uint16_t);
+    if (tags_offset + tag_count*sizeof(TifTag) > size) {
+        log_error("Problem reading tags");
+        return -1;
+    }
+    memset(info, 0, sizeof(TifInfo));
+    info->bits_per_sample = 1;
+    uint32_t compression = 1;
     for (int i=0; i<tag_count; i++) {
-        TifTag* tag = &tags[i];
+        TifTag tag;
+        memcpy(&tag, data + tags_offset + i*sizeof(TifTag), sizeof(TifTag));
         debug_print("tag id %d | data type %d | data count %d | value %d\n", 
-                    tag->tag_id, tag->data_type, tag->data_count, tag->data_offset);
-        switch(tag->tag_id) {
+                    tag.tag_id, tag.data_type, tag.data_count, tag.data_offset);
+        switch(tag.tag_id) {
             case IMAGE_WIDTH:
-                info->width = tag->data_offset;
+                info->width = tag_value(&tag);
                 break;
                 
             case IMAGE_HEIGHT:
-                info->height = tag->data_offset;
+                info->height = tag_value(&tag);
                 break;
                 
             case BITS_PER_SAMPLE:
-                info->bits_per_sample = tag->data_offset;
+                info->bits_per_sample = tag_value(&tag);
+                break;
+
+            case COMPRESSION:
+                compression = tag_value(&tag);
                 break;
                 
             case IMAGE_DESCRIPTION:
-                fseek(fp, tag->data_offset, SEEK_SET);
-                fread(info->description, tag->data_count, 1, fp);
+                if ((size_t)tag.data_offset + tag.data_count <= size) {
+                    size_t length = tag.data_count < sizeof(info->description) ?
+                                    tag.data_count : sizeof(info->description) - 1;
+                    memcpy(info->description, data + tag.data_offset, length);
+                    info->description[length] = '\0';
+                }
                 debug_print("### Image description: ###\n%s\n", info->description);
                 break;
                 
             case STRIP_OFFSETS:
-                info->strip_offsets = tag->data_offset;
+                info->offsets_tag = tag;
                 break;
                 
             case STRIP_BYTE_COUNTS:
-                info->strip_byte_counts = tag->data_offset;
+                info->counts_tag = tag;
+                break;
+
+            case SAMPLE_FORMAT:
+                info->sample_format = tag_value(&tag);
                 break;
         }
     }
-    free(tags);
+    if (compression != 1) {
+        log_error("Compressed tif files are not supported");
+        return -1;
+    }
+    if (info->bits_per_sample != 8 && info->bits_per_sample != 16 &&
+        info->bits_per_sample != 32) {
+        log_error("Unsupported bits per sample %d", info->bits_per_sample);
+        return -1;
+    }
+    if (parse_strips(data, size, info) != 0) {
+        return -1;
+    }
+    if ((size_t)info->width * info->height * (info->bits_per_sample / 8) != info->strip_byte_counts) {
+        log_error("Image size does not match the strips");
+        return -1;
+    }
+    return 0;
 }
 
-void read_tif_image(FILE* fp, const TifInfo* info, void* buffer)
+void tif_gather_strips(const char* data, const TifInfo* info, char* out)
 {
-    if (fseek(fp, info->strip_offsets, SEEK_SET) !=0) {
-        printf("fseek to image location failed!\n");
+    for (uint32_t i=0; i<info->nstrips; i++) {
+        uint32_t offset = tag_element(data, &info->offsets_tag, i);
+        uint32_t count = tag_element(data, &info->counts_tag, i);
+        memcpy(out, data + offset, count);
+        out += count;
     }
-    if (fread(buffer, info->strip_byte_counts, 1, fp) != 1) {
-        printf("Problem reading image data\n");
+}
+
+const char* tif_dtype(uint16_t bits_per_sample, uint16_t sample_format)
+{
+    // the tif default is unsigned, but pilatus 32 bit images are signed with -1 in the gaps
+    int is_signed = sample_format == 2 || (sample_format == 0 && bits_per_sample == 32);
+    switch (bits_per_sample) {
+        case 8:
+            return is_signed ? "int8" : "uint8";
+        case 16:
+            return is_signed ? "int16" : "uint16";
+        default:
+            return is_signed ? "int32" : "uint32";
     }
 }
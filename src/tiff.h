@@ -1,6 +1,7 @@
 #ifndef TIFF_H
 #define TIFF_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 // http://paulbourke.net/dataformats/tiff/tiff_summary.pdf
@@ -23,22 +24,59 @@ typedef struct
 typedef struct
 {
     uint16_t bits_per_sample;
+    // 1 unsigned, 2 signed integer, 3 float, 0 if the file has no sample format tag
+    uint16_t sample_format;
     uint32_t width;
     uint32_t height;
+    uint32_t nstrips;
+    // offset of the first strip and the size of all strips together
     uint32_t strip_offsets;
     uint32_t strip_byte_counts;
+    // the strips follow each other in the file, so the image can be used in place
+    int contiguous;
+    // needed to gather the strips if they are not contiguous
+    TifTag offsets_tag;
+    TifTag counts_tag;
     char description[2048];
 } TifInfo;
 
+// What is needed to read the image of a tif file without parsing it, valid for all
+// files of a series as long as they have the same size.
+typedef struct
+{
+    size_t file_size;
+    uint32_t width;
+    uint32_t height;
+    uint16_t bits_per_sample;
+    uint16_t sample_format;
+    uint32_t data_offset;
+    uint32_t data_size;
+} TifLayout;
+
 // Tif tag ids
 #define IMAGE_WIDTH 256
 #define IMAGE_HEIGHT 257
 #define BITS_PER_SAMPLE 258
+#define COMPRESSION 259
 #define IMAGE_DESCRIPTION 270
 #define STRIP_OFFSETS 273
 #define STRIP_BYTE_COUNTS 279
+#define SAMPLE_FORMAT 339
+
+// Tif data types
+#define TIF_SHORT 3
+#define TIF_LONG 4
+
+// Parses a tif file that was read into memory. Only little endian, uncompressed
+// images with 8, 16 or 32 bit integer pixels are supported.
+// Returns -1 if the file is malformed.
+int parse_tif(const char* data, size_t size, TifInfo* info);
+
+// Copies the strips of a parsed file in order into out, which needs room for
+// strip_byte_counts bytes.
+void tif_gather_strips(const char* data, const TifInfo* info, char* out);
 
-void parse_tif(FILE* fp, TifInfo* info);
-void read_tif_image(FILE* fp, const TifInfo* info, void* buffer);
+// Numpy style name of the pixel type, e.g. int32 or uint16
+const char* tif_dtype(uint16_t bits_per_sample, uint16_t sample_format);
 
 #endif // TIFF_H